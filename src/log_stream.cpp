@@ -1,7 +1,7 @@
 /**
  * swampex, a map processing library
  *
- * Authors: 
+ * Authors:
  *
  * Daniil Smelov <dn.smelov@gmail.com>
  *
@@ -22,31 +22,396 @@
  * Boston, MA  02110-1301, USA.
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <sys/time.h>
+#endif
 
 #include "log_stream.h"
+#include "ozf_atomic.h"
+
+/*--------------------------------------------------------------------------*/
+#define LOGSTREAM_SLOTS			4096	// power of two
+#define LOGSTREAM_SLOT_SIZE		240
+#define LOGSTREAM_BATCH_SIZE	65536
+#define LOGSTREAM_IDLE_MS		100
 
 /*--------------------------------------------------------------------------*/
 static FILE* logstream = NULL;
+static int logstream_threshold = LOGSTREAM_INFO;
+
+int logstream_active = -1;
+
+/*--------------------------------------------------------------------------*/
+static const char logstream_tags[] = "EWID";
+
+/*--------------------------------------------------------------------------*/
+static int logstream_format(char* dst, int size, int level,
+							const char* context, const char* fmt, va_list ap)
+{
+	int n = 0;
+
+	if (context)
+		n = snprintf(dst, size, "%c [%s] ", logstream_tags[level], context);
+	else
+		n = snprintf(dst, size, "%c ", logstream_tags[level]);
+
+	if (n < 0 || n >= size)
+		n = 0;
+
+	int m = vsnprintf(dst + n, size - n, fmt, ap);
+
+	if (m < 0)
+		m = 0;
+
+	n += m;
+
+	if (n >= size)
+	{
+		// truncated, keep the line terminated
+		n = size - 1;
+		dst[n - 1] = '\n';
+	}
+
+	return n;
+}
+
+#ifdef HAVE_PTHREAD_H
+
+/*--------------------------------------------------------------------------*/
+// Bounded multi-producer queue: producers claim a slot with a CAS on the
+// enqueue position and publish it through the slot sequence, the single
+// background writer drains published slots into large fwrite() batches.
+typedef struct
+{
+	unsigned long	seq;
+	int				length;
+	char			text[LOGSTREAM_SLOT_SIZE];
+} logstream_slot;
+
+/*--------------------------------------------------------------------------*/
+static logstream_slot	ring[LOGSTREAM_SLOTS];
+static unsigned long	enqueue_pos = 0;
+static unsigned long	dequeue_pos = 0;
+static unsigned long	dropped = 0;
+
+static pthread_mutex_t	writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t	writer_wake = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t	writer_done = PTHREAD_COND_INITIALIZER;
+static pthread_t		writer;
+static int				writer_running = 0;
+static int				writer_idle = 0;
+static int				writer_stop = 0;
+
+/*--------------------------------------------------------------------------*/
+static void logstream_ring_init(void)
+{
+	unsigned long i;
+
+	for (i = 0; i < LOGSTREAM_SLOTS; i++)
+		ring[i].seq = i;
+
+	enqueue_pos = 0;
+	dequeue_pos = 0;
+}
+
+/*--------------------------------------------------------------------------*/
+static int logstream_drain(FILE* f, char* batch)
+{
+	int n = 0, total = 0;
+
+	for (;;)
+	{
+		unsigned long pos = dequeue_pos;
+		logstream_slot* slot = &ring[pos & (LOGSTREAM_SLOTS - 1)];
+
+		if (OZF_ATOMIC_LOAD(&slot->seq, OZF_ACQUIRE) != pos + 1)
+			break;
+
+		if (n + slot->length > LOGSTREAM_BATCH_SIZE)
+		{
+			fwrite(batch, n, 1, f);
+			n = 0;
+		}
+
+		memcpy(batch + n, slot->text, slot->length);
+		n += slot->length;
+		total++;
+
+		OZF_ATOMIC_STORE(&slot->seq, pos + LOGSTREAM_SLOTS, OZF_RELEASE);
+		OZF_ATOMIC_STORE(&dequeue_pos, pos + 1, OZF_RELEASE);
+	}
+
+	unsigned long lost = OZF_ATOMIC_EXCHANGE(&dropped, 0, OZF_RELAXED);
+
+	if (lost)
+	{
+		if (n)
+			fwrite(batch, n, 1, f);
+
+		n = snprintf(batch, LOGSTREAM_BATCH_SIZE,
+			"W logstream: %lu messages dropped\n", lost);
+	}
+
+	if (n)
+	{
+		fwrite(batch, n, 1, f);
+		fflush(f);
+	}
+
+	return total;
+}
+
+/*--------------------------------------------------------------------------*/
+static void* logstream_writer(void*)
+{
+	char* batch = (char*)malloc(LOGSTREAM_BATCH_SIZE + 64);
+
+	pthread_mutex_lock(&writer_lock);
+
+	for (;;)
+	{
+		FILE* f = logstream;
+
+		pthread_mutex_unlock(&writer_lock);
+
+		if (f)
+			logstream_drain(f, batch);
+
+		pthread_mutex_lock(&writer_lock);
+
+		pthread_cond_broadcast(&writer_done);
+
+		if (writer_stop)
+			break;
+
+		// announce idleness before the last look at the queue, so a
+		// producer publishing in between is guaranteed to wake us up
+		OZF_ATOMIC_STORE(&writer_idle, 1, OZF_SEQ_CST);
+
+		if (OZF_ATOMIC_LOAD(&dequeue_pos, OZF_SEQ_CST) !=
+			OZF_ATOMIC_LOAD(&enqueue_pos, OZF_SEQ_CST))
+		{
+			OZF_ATOMIC_STORE(&writer_idle, 0, OZF_SEQ_CST);
+			continue;
+		}
+
+		struct timeval now;
+		struct timespec deadline;
+
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec;
+		deadline.tv_nsec = now.tv_usec * 1000 + LOGSTREAM_IDLE_MS * 1000000L;
+
+		if (deadline.tv_nsec >= 1000000000L)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		pthread_cond_timedwait(&writer_wake, &writer_lock, &deadline);
+		OZF_ATOMIC_STORE(&writer_idle, 0, OZF_SEQ_CST);
+	}
+
+	pthread_mutex_unlock(&writer_lock);
+
+	free(batch);
+
+	return NULL;
+}
+
+/*--------------------------------------------------------------------------*/
+static void logstream_stop(void)
+{
+	pthread_mutex_lock(&writer_lock);
+
+	if (!writer_running)
+	{
+		pthread_mutex_unlock(&writer_lock);
+		return;
+	}
+
+	writer_stop = 1;
+	pthread_cond_signal(&writer_wake);
+	pthread_mutex_unlock(&writer_lock);
+
+	pthread_join(writer, NULL);
+
+	writer_running = 0;
+	writer_stop = 0;
+}
 
 /*--------------------------------------------------------------------------*/
 void logstream_to(FILE* f)
 {
+	static int exit_hook = 0;
+
+	if (!f)
+	{
+		logstream_active = -1;
+		logstream_stop();
+		logstream = NULL;
+		return;
+	}
+
+	pthread_mutex_lock(&writer_lock);
+
 	logstream = f;
+	logstream_active = logstream_threshold;
+
+	if (!writer_running)
+	{
+		logstream_ring_init();
+
+		if (pthread_create(&writer, NULL, logstream_writer, NULL) == 0)
+			writer_running = 1;
+		else
+			logstream_active = -1;
+
+		if (!exit_hook)
+		{
+			atexit(logstream_stop);
+			exit_hook = 1;
+		}
+	}
+
+	pthread_mutex_unlock(&writer_lock);
 }
 
 /*--------------------------------------------------------------------------*/
-void logstream_write(const char *fmt, ...)
+void logstream_flush(void)
 {
-	if (logstream)
+	pthread_mutex_lock(&writer_lock);
+
+	while (writer_running &&
+		OZF_ATOMIC_LOAD(&dequeue_pos, OZF_ACQUIRE) !=
+		OZF_ATOMIC_LOAD(&enqueue_pos, OZF_ACQUIRE))
 	{
-        va_list ap;
+		pthread_cond_signal(&writer_wake);
+		pthread_cond_wait(&writer_done, &writer_lock);
+	}
 
-        va_start(ap, fmt);
+	pthread_mutex_unlock(&writer_lock);
+}
 
-        vfprintf(logstream, fmt, ap);
+/*--------------------------------------------------------------------------*/
+static void logstream_post(int level, const char* context,
+						   const char* fmt, va_list ap)
+{
+	unsigned long pos = OZF_ATOMIC_LOAD(&enqueue_pos, OZF_RELAXED);
+	logstream_slot* slot;
 
-        va_end(ap);
-		
-		fflush(logstream);
+	for (;;)
+	{
+		slot = &ring[pos & (LOGSTREAM_SLOTS - 1)];
+
+		long dif = (long)(OZF_ATOMIC_LOAD(&slot->seq, OZF_ACQUIRE) - pos);
+
+		if (dif == 0)
+		{
+			if (OZF_ATOMIC_CAS(&enqueue_pos, &pos, pos + 1,
+				OZF_RELAXED, OZF_RELAXED))
+				break;
+		}
+		else
+		if (dif < 0)
+		{
+			// writer is behind, never block the caller
+			OZF_ATOMIC_ADD_FETCH(&dropped, 1, OZF_RELAXED);
+			return;
+		}
+		else
+		{
+			pos = OZF_ATOMIC_LOAD(&enqueue_pos, OZF_RELAXED);
+		}
 	}
+
+	slot->length = logstream_format(slot->text, LOGSTREAM_SLOT_SIZE,
+									level, context, fmt, ap);
+
+	OZF_ATOMIC_STORE(&slot->seq, pos + 1, OZF_RELEASE);
+
+	// only the first producer after the writer went idle pays for a wakeup
+	if (OZF_ATOMIC_LOAD(&writer_idle, OZF_SEQ_CST) &&
+		OZF_ATOMIC_EXCHANGE(&writer_idle, 0, OZF_SEQ_CST))
+	{
+		pthread_mutex_lock(&writer_lock);
+		pthread_cond_signal(&writer_wake);
+		pthread_mutex_unlock(&writer_lock);
+	}
+}
+
+#else
+
+/*--------------------------------------------------------------------------*/
+void logstream_to(FILE* f)
+{
+	logstream = f;
+	logstream_active = f ? logstream_threshold : -1;
+}
+
+/*--------------------------------------------------------------------------*/
+void logstream_flush(void)
+{
+	if (logstream)
+		fflush(logstream);
+}
+
+/*--------------------------------------------------------------------------*/
+static void logstream_post(int level, const char* context,
+						   const char* fmt, va_list ap)
+{
+	char text[LOGSTREAM_SLOT_SIZE];
+	int n = logstream_format(text, sizeof(text), level, context, fmt, ap);
+
+	fwrite(text, n, 1, logstream);
+}
+
+#endif
+
+/*--------------------------------------------------------------------------*/
+void logstream_level(int level)
+{
+	if (level < LOGSTREAM_ERROR)
+		level = LOGSTREAM_ERROR;
+
+	if (level > LOGSTREAM_DEBUG)
+		level = LOGSTREAM_DEBUG;
+
+	logstream_threshold = level;
+
+	if (logstream)
+		logstream_active = level;
+}
+
+/*--------------------------------------------------------------------------*/
+void logstream_message(int level, const char* context, const char *fmt, ...)
+{
+	if (level > logstream_active)
+		return;
+
+	va_list ap;
+
+	va_start(ap, fmt);
+	logstream_post(level, context, fmt, ap);
+	va_end(ap);
+}
+
+/*--------------------------------------------------------------------------*/
+void logstream_write(const char *fmt, ...)
+{
+	if (LOGSTREAM_INFO > logstream_active)
+		return;
+
+	va_list ap;
+
+	va_start(ap, fmt);
+	logstream_post(LOGSTREAM_INFO, NULL, fmt, ap);
+	va_end(ap);
 }
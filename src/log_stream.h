@@ -1,7 +1,7 @@
 /**
  * swampex, a map processing library
  *
- * Authors: 
+ * Authors:
  *
  * Daniil Smelov <dn.smelov@gmail.com>
  *
@@ -30,7 +30,39 @@
 #include <stdarg.h>
 
 /*--------------------------------------------------------------------------*/
+#define LOGSTREAM_ERROR		0
+#define LOGSTREAM_WARNING	1
+#define LOGSTREAM_INFO		2
+#define LOGSTREAM_DEBUG		3
+
+// messages above this level are not compiled in at all
+#ifndef LOGSTREAM_MAX_LEVEL
+#define LOGSTREAM_MAX_LEVEL	LOGSTREAM_DEBUG
+#endif
+
+/*--------------------------------------------------------------------------*/
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// highest level currently written, -1 while no stream is attached
+extern int logstream_active;
+
 void logstream_to(FILE*);
+void logstream_level(int level);
+void logstream_flush(void);
 void logstream_write(const char *fmt, ...);
+void logstream_message(int level, const char* context, const char *fmt, ...);
+
+#ifdef __cplusplus
+};
+#endif
+
+/*--------------------------------------------------------------------------*/
+#define LOGSTREAM(level, context, ...) \
+	do { \
+		if ((level) <= LOGSTREAM_MAX_LEVEL && (level) <= logstream_active) \
+			logstream_message((level), (context), __VA_ARGS__); \
+	} while (0)
 
 #endif
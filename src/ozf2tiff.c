@@ -36,6 +36,8 @@
 #endif
 
 #include <stdio.h>
+#include <string.h>
+#include <strings.h>
 #include <sys/types.h>
 #ifdef HAVE_STDINT_H
 #include <stdint.h>
@@ -50,18 +52,25 @@
 #include <fcntl.h>
 #endif
 
-#include <zlib.h>
 #include <tiffio.h>
 
+#include "ozf_inflate.h"
+
 #define XTILESIZ 64
 #define YTILESIZ 64
 #define TILESIZ XTILESIZ*YTILESIZ
+#define UNIFORMSIZ 256	/* largest compressed single-colour tile looked for */
 
 unsigned char tilebuf[TILESIZ], obuf[TILESIZ];
-static z_stream zstream;
+static ozf_inflater *inflater;
+static int verify;
+static int sparse;
 
 static int decompress(unsigned char *buf, int len, unsigned char *outbuf,
 		int outbuf_len);
+static uint64_t unwrap(uint32_t offset, uint64_t before);
+static void findcopies(unsigned char *scn, uint64_t imgpos, uint32_t *offti,
+		long ntiles, long *first);
 static void *mapfile(const char *name, size_t * len, FILE ** stream);
 
 #pragma pack(1)
@@ -76,37 +85,70 @@ typedef struct {
 
 int main(int argc, char *argv[]) {
 
-	void *scn;
+	unsigned char *scn;
 
 	size_t binlen;
 	FILE *fpbin;
 	char *binnam;
 
-	int *dir;
-	int *ioff;
+	uint32_t *dir;
+	uint32_t *ioff;
+	uint64_t ioffpos, imgpos;
+	long nscales, iscale;
 
 	ozf2_imgEntry *curr_img;
 
 	TIFF *out;
 	int red, grn, blu;
 
+	if (argc == 4 && strcmp(argv[1], "-s") == 0) {
+		sparse = 1;
+		argv++;
+		argc--;
+	}
+
 	if (argc != 3) {
-		fprintf(stderr, "Usage: %s file.ozf2 file.tif\n", argv[0]);
+		fprintf(stderr, "Usage: %s [-s] file.ozf2 file.tif\n", argv[0]);
 		exit(1);
 	}
 
+	/* same settings as the GDAL driver */
+	char *envverify = getenv("OZF_INFLATE_VERIFY");
+	verify = !(envverify && (strcasecmp(envverify, "NO") == 0 || strcasecmp(
+			envverify, "OFF") == 0 || strcasecmp(envverify, "FALSE") == 0
+			|| strcmp(envverify, "0") == 0));
+
+	if (ozf_inflate_setup(getenv("OZF_INFLATE"), verify) != 0)
+		fprintf(stderr, "inflate backend %s is not available, using %s\n",
+				getenv("OZF_INFLATE") ? getenv("OZF_INFLATE") : "default",
+				ozf_inflate_backend());
+	inflater = ozf_inflater_create();
+
 	binnam = argv[1];
 
-	scn = (void *) mapfile(binnam, &binlen, &fpbin);
-	if (scn == NULL) {
+	scn = (unsigned char *) mapfile(binnam, &binlen, &fpbin);
+	if (scn == NULL || binlen < sizeof(uint32_t)) {
 		fprintf(stderr, "FATAL: can't open file=%s\n", binnam);
 		exit(1);
 	}
 
-	dir = (int *) ((off_t) scn + binlen - sizeof(int));
-	ioff = (int *) ((off_t) scn + (*dir));
+	/* offsets are 32 bit, they wrap around past 4 GB */
+	dir = (uint32_t *) (scn + binlen - sizeof(uint32_t));
+	ioffpos = unwrap(*dir, binlen - sizeof(uint32_t));
+	ioff = (uint32_t *) (scn + ioffpos);
 
-	curr_img = (ozf2_imgEntry *) ((off_t) scn + ioff[0]);
+	nscales = (long) ((binlen - sizeof(uint32_t) - ioffpos) / sizeof(uint32_t));
+	if (nscales < 1) {
+		fprintf(stderr, "FATAL: no scales in file=%s\n", binnam);
+		exit(1);
+	}
+
+	/* each scale header lies before the next one */
+	imgpos = ioffpos;
+	for (iscale = nscales - 1; iscale >= 0; iscale--)
+		imgpos = unwrap(ioff[iscale], imgpos);
+
+	curr_img = (ozf2_imgEntry *) (scn + imgpos);
 
 	int ipix, irow, icol, irowtile, icoltile;
 
@@ -125,10 +167,55 @@ int main(int argc, char *argv[]) {
 	TIFFSetField(out, TIFFTAG_TILEWIDTH, XTILESIZ);
 	TIFFSetField(out, TIFFTAG_TILELENGTH, YTILESIZ);
 
+	uint32_t *offti;
+	int itile;
+	offti = (uint32_t *) (scn + imgpos + sizeof(ozf2_imgEntry) - 4);
+
+	/* copies of a tile are decoded once, the blank margins and sea of a
+	 * sheet are mostly copies of one single-colour tile */
+	long ntiles = (long) curr_img->xtiles * curr_img->ytiles;
+	long *first = (long *) malloc((ntiles + 1) * sizeof(long));
+	long *copies = (long *) calloc(ntiles + 1, sizeof(long));
+	int *tilecolour = (int *) malloc((ntiles + 1) * sizeof(int));
+	unsigned char **shared = (unsigned char **) calloc(ntiles + 1,
+			sizeof(unsigned char *));
+	long uniform[256] = { 0 };
+	int background = -1;
+	long backgroundtile = -1;
+	int i;
+
+	findcopies(scn, imgpos, offti, ntiles, first);
+
+	for (itile = 0; itile < ntiles; itile++) {
+		int len = (int) (offti[itile + 1] - offti[itile]);
+
+		tilecolour[itile] = -1;
+
+		if (first[itile] != itile) {
+			tilecolour[itile] = tilecolour[first[itile]];
+			copies[first[itile]]++;
+		} else if (len <= UNIFORMSIZ && decompress(scn + unwrap(offti[itile],
+				imgpos), len, tilebuf, TILESIZ) == TILESIZ) {
+			for (ipix = 1; ipix < TILESIZ && tilebuf[ipix] == tilebuf[0]; ipix++)
+				;
+			if (ipix == TILESIZ)
+				tilecolour[itile] = tilebuf[0];
+		}
+
+		if (tilecolour[itile] >= 0)
+			uniform[tilecolour[itile]]++;
+	}
+
+	/* -s stores the tiles of the commonest single colour once, the others
+	 * point at that one */
+	for (i = 0; i < 256; i++)
+		if (sparse && uniform[i] > 0 && (background < 0 || uniform[i]
+				> uniform[background]))
+			background = i;
+
 	/* save the palette */
 
 	uint16_t redp[256], grnp[256], blup[256];
-	int i;
 
 #define SCALE(x) (((x)*((1L<<16)-1))/255)
 
@@ -147,34 +234,50 @@ int main(int argc, char *argv[]) {
 	TIFFSetField(out, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_PALETTE);
 	TIFFSetField(out, TIFFTAG_COMPRESSION, COMPRESSION_LZW);
 
-	int *offti, itile;
-	offti = (int *) ((off_t) scn + ioff[0] + sizeof(ozf2_imgEntry) - 4);
-
 	for (irowtile = 0; irowtile < curr_img->ytiles; irowtile++)
 		for (icoltile = 0; icoltile < curr_img->xtiles; icoltile++) {
 			unsigned char *compcoff;
 			int zres;
+			long src;
 
 			itile = irowtile * curr_img->xtiles + icoltile;
-			compcoff = (unsigned char *) ((off_t) scn + offti[itile]);
-
-			inflateInit(&zstream);
-			zres = decompress(compcoff, offti[itile + 1] - offti[itile],
-					tilebuf, TILESIZ);
-			inflateEnd(&zstream);
+			src = first[itile];
 
-			if (zres != TILESIZ) {
-				fprintf(stderr, "ozf2 compression bug: zres=%d != %d\n", zres,
-						TILESIZ);
-				exit(1);
-			}
+			if (tilecolour[itile] >= 0) {
+				if (tilecolour[itile] == background) {
+					if (backgroundtile >= 0)
+						continue;
+					backgroundtile = itile;
+				}
+				memset(obuf, tilecolour[itile], TILESIZ);
+			} else if (shared[src]) {
+				memcpy(obuf, shared[src], TILESIZ);
+			} else {
+				/* tiles lie before the header of their scale */
+				compcoff = scn + unwrap(offti[itile], imgpos);
+
+				zres = decompress(compcoff, (int) (offti[itile + 1]
+						- offti[itile]), tilebuf, TILESIZ);
+
+				if (zres != TILESIZ) {
+					fprintf(stderr, "ozf2 compression bug: zres=%d != %d\n",
+							zres, TILESIZ);
+					exit(1);
+				}
 
-			/* ozf2 tiles are mirrored */
-			for (irow = 0; irow < YTILESIZ; irow++)
-				for (icol = 0; icol < XTILESIZ; icol++) {
-					ipix = (YTILESIZ - 1 - irow) * XTILESIZ + icol;
-					obuf[irow * YTILESIZ + icol] = tilebuf[ipix];
+				/* ozf2 tiles are mirrored */
+				for (irow = 0; irow < YTILESIZ; irow++)
+					for (icol = 0; icol < XTILESIZ; icol++) {
+						ipix = (YTILESIZ - 1 - irow) * XTILESIZ + icol;
+						obuf[irow * YTILESIZ + icol] = tilebuf[ipix];
+					}
+
+				/* kept until the last copy is written */
+				if (copies[src] > 0) {
+					shared[src] = (unsigned char *) malloc(TILESIZ);
+					memcpy(shared[src], obuf, TILESIZ);
 				}
+			}
 
 			if (TIFFWriteTile(out, obuf, icoltile * XTILESIZ, irowtile
 					* YTILESIZ, 0, 0) < 0) {
@@ -182,32 +285,94 @@ int main(int argc, char *argv[]) {
 						irowtile, icoltile);
 				exit(1);
 			}
+
+			if (src != itile && --copies[src] == 0) {
+				free(shared[src]);
+				shared[src] = NULL;
+			}
 		}
 
+	/* the tiles span the image, tile numbers are the ozf2 ones; the tables
+	 * are written out by TIFFClose() */
+	if (backgroundtile >= 0) {
+		toff_t *offsets, *bytecounts;
+
+		if (TIFFGetField(out, TIFFTAG_TILEOFFSETS, &offsets) && TIFFGetField(
+				out, TIFFTAG_TILEBYTECOUNTS, &bytecounts)) {
+			for (itile = 0; itile < ntiles; itile++)
+				if (tilecolour[itile] == background) {
+					offsets[itile] = offsets[backgroundtile];
+					bytecounts[itile] = bytecounts[backgroundtile];
+				}
+		}
+	}
+
 	(void) TIFFClose(out);
+	ozf_inflater_destroy(inflater);
+	free(shared);
+	free(tilecolour);
+	free(copies);
+	free(first);
 
 	exit(0);
 }
 
 static int decompress(unsigned char *buf, int len, unsigned char *outbuf,
 		int outbuf_len) {
-	int err;
+	unsigned long outlen = outbuf_len;
 
-	zstream.next_in = buf;
-	zstream.avail_in = len;
+	if (len < 0 || ozf_inflate(inflater, verify, outbuf, &outlen, buf, len) != 0) {
+		fprintf(stderr, "decompression error %p(%d): %s\n", buf, len,
+				ozf_inflate_backend());
+		return -1;
+	}
+	return (int) outlen;
+}
 
-	zstream.next_out = outbuf;
-	zstream.avail_out = outbuf_len;
+static uint64_t unwrap(uint32_t offset, uint64_t before) {
+	if (before <= 0xffffffffULL)
+		return offset;
 
-	inflateReset(&zstream);
+	return before - (uint32_t) ((uint32_t) before - offset);
+}
 
-	err = inflate(&zstream, Z_FINISH);
-	if (err != Z_STREAM_END) {
-		fprintf(stderr, "decompression error %p(%d): %s\n", buf, len, zError(
-				err));
-		return -1;
+/* first[i] is the first tile with the same compressed data as tile i */
+static void findcopies(unsigned char *scn, uint64_t imgpos, uint32_t *offti,
+		long ntiles, long *first) {
+	long nslots, slot, i, k;
+	long *slots;
+
+	for (nslots = 1; nslots < 2 * ntiles; nslots <<= 1)
+		;
+
+	slots = (long *) malloc(nslots * sizeof(long));
+	for (slot = 0; slot < nslots; slot++)
+		slots[slot] = -1;
+
+	for (i = 0; i < ntiles; i++) {
+		unsigned char *data = scn + unwrap(offti[i], imgpos);
+		uint32_t len = offti[i + 1] - offti[i], j;
+		uint64_t h = 0xcbf29ce484222325ULL; /* FNV-1a */
+
+		for (j = 0; j < len; j++)
+			h = (h ^ data[j]) * 0x100000001b3ULL;
+
+		first[i] = i;
+
+		for (slot = (long) (h & (nslots - 1)); (k = slots[slot]) >= 0; slot
+				= (slot + 1) & (nslots - 1)) {
+			if (offti[k + 1] - offti[k] == len && memcmp(scn + unwrap(offti[k],
+					imgpos), data, len) == 0) {
+				first[i] = k;
+				break;
+			}
+		}
+
+		if (first[i] == i)
+			slots[slot] = i;
 	}
-	return zstream.total_out;
+
+	free(slots);
 }
 
 void *
@@ -235,12 +400,18 @@ mapfile(const char *name, size_t * len, FILE ** stream) {
 
 	fd = fileno(fp);
 	fstat(fd, &sbuf);
-	*len = sbuf.st_size;
+	*len = (size_t) sbuf.st_size;
+
+	if ((off_t) *len != sbuf.st_size) {
+		fprintf(stderr, "FATAL: file=%s too large to map\n", name);
+		exit(1);
+	}
 
 #ifdef HAVE_MMAP
 	ptr = mmap(NULL, *len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, (off_t) 0);
 	if (ptr == MAP_FAILED) {
-		fprintf(stderr, "FATAL: can't mmap file=%s len=%ld\n", name, *len);
+		fprintf(stderr, "FATAL: can't mmap file=%s len=%lu\n", name,
+				(unsigned long) *len);
 		exit(1);
 	}
 #endif
@@ -0,0 +1,433 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#if defined(HAVE_LIBURING_H) && defined(HAVE_LIBURING)
+#include <liburing.h>
+#define OZF_ASYNC_URING
+#endif
+
+#include "ozf_async.h"
+#include "ozf_pool.h"
+#include "ozf_stats.h"
+#include "ozf_trace.h"
+
+/*--------------------------------------------------------------------------*/
+#define OZF_ASYNC_DEFAULT_DEPTH		256
+#define OZF_ASYNC_DEFAULT_THREADS	4
+
+#define OZF_ASYNC_TILE_SIZE			(OZF_TILE_WIDTH * OZF_TILE_HEIGHT * 4)
+
+/*--------------------------------------------------------------------------*/
+typedef struct ozf_async_request
+{
+	ozf_async*					async;
+	ozf_stream*					s;
+	int							scale, x, y;
+	ozf_async_callback			callback;
+	void*						user;
+
+	ozf_offset					offset;
+	unsigned long				size;
+	unsigned char*				compressed;
+	int							fd;
+	int							status;
+
+	struct ozf_async_request*	next;
+} ozf_async_request;
+
+/*--------------------------------------------------------------------------*/
+struct ozf_async
+{
+	int					depth;
+	int					pending;		// submitted, not yet delivered
+	unsigned char*		tile;			// decode target, caller thread only
+
+#ifdef OZF_ASYNC_URING
+	int					uring;
+	int					unsubmitted;
+	struct io_uring		ring;
+#endif
+
+	ozf_pool*			pool;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		lock;
+	pthread_cond_t		done;
+#endif
+	ozf_async_request*	completed;		// filled by the pool workers, or
+	ozf_async_request*	completed_tail;	// by streams without a descriptor
+	int					ncompleted;
+};
+
+/*--------------------------------------------------------------------------*/
+static void ozf_async_free_request(ozf_async_request* r)
+{
+	free(r->compressed);
+	free(r);
+}
+
+/*--------------------------------------------------------------------------*/
+// decodes on the polling thread and hands the tile to the callback
+static void ozf_async_deliver(ozf_async* a, ozf_async_request* r)
+{
+	int status = r->status;
+
+	if (status == 0)
+		status = ozf_decode_tile(r->s, r->scale, r->x, r->y,
+								 r->compressed, r->size, a->tile);
+
+	r->callback(r->user, r->s, r->scale, r->x, r->y, status,
+				status == 0 ? a->tile : NULL);
+
+	ozf_async_free_request(r);
+
+	a->pending--;
+}
+
+/*--------------------------------------------------------------------------*/
+// pool workers call this under a->lock, io_uring has no workers to race
+static void ozf_async_complete(ozf_async* a, ozf_async_request* r)
+{
+	if (a->completed_tail)
+		a->completed_tail->next = r;
+	else
+		a->completed = r;
+
+	a->completed_tail = r;
+	a->ncompleted++;
+}
+
+/*--------------------------------------------------------------------------*/
+// thread pool backend: workers only read, decoding stays on the poller
+static void ozf_async_job(void* arg)
+{
+	ozf_async_request* r = (ozf_async_request*)arg;
+	ozf_async* a = r->async;
+
+	r->status = ozf_read_raw(r->s, r->offset, r->compressed, r->size);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&a->lock);
+#endif
+
+	ozf_async_complete(a, r);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_signal(&a->done);
+	pthread_mutex_unlock(&a->lock);
+#endif
+}
+
+/*--------------------------------------------------------------------------*/
+static int ozf_async_poll_pool(ozf_async* a, int min_complete)
+{
+	ozf_async_request* list;
+	int n = 0;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&a->lock);
+
+	while (a->ncompleted < min_complete)
+		pthread_cond_wait(&a->done, &a->lock);
+#endif
+
+	list = a->completed;
+	a->completed = NULL;
+	a->completed_tail = NULL;
+	a->ncompleted = 0;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&a->lock);
+#endif
+
+	while (list)
+	{
+		ozf_async_request* next = list->next;
+
+		ozf_async_deliver(a, list);
+		list = next;
+		n++;
+	}
+
+	return n;
+}
+
+#ifdef OZF_ASYNC_URING
+
+/*--------------------------------------------------------------------------*/
+static int ozf_async_submit_uring(ozf_async* a, ozf_async_request* r)
+{
+	// the descriptor stays pinned in the file pool until completion
+	r->fd = ozf_fd_acquire(r->s);
+
+	// stdio, mmap and VSI streams have none: read now, deliver on next poll
+	if (r->fd < 0)
+	{
+		r->status = ozf_read_raw(r->s, r->offset, r->compressed, r->size);
+		ozf_async_complete(a, r);
+
+		return 0;
+	}
+
+	struct io_uring_sqe* sqe = io_uring_get_sqe(&a->ring);
+
+	if (!sqe)
+	{
+		io_uring_submit(&a->ring);
+		a->unsubmitted = 0;
+
+		sqe = io_uring_get_sqe(&a->ring);
+	}
+
+	if (!sqe)
+	{
+		ozf_fd_release(r->s, r->fd);
+		return -1;
+	}
+
+	io_uring_prep_read(sqe, r->fd, r->compressed, r->size, r->offset);
+	io_uring_sqe_set_data(sqe, r);
+
+	a->unsubmitted++;
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+static int ozf_async_poll_uring(ozf_async* a, int min_complete)
+{
+	ozf_stats* stats = ozf_stats_local();
+	ozf_async_request* list = a->completed;
+	int n = 0;
+
+	a->completed = NULL;
+	a->completed_tail = NULL;
+	a->ncompleted = 0;
+
+	while (list)
+	{
+		ozf_async_request* next = list->next;
+
+		ozf_async_deliver(a, list);
+		list = next;
+		n++;
+	}
+
+	// submissions are batched until the caller is ready to wait
+	if (a->unsubmitted)
+	{
+		io_uring_submit(&a->ring);
+		a->unsubmitted = 0;
+	}
+
+	while (a->pending > 0)
+	{
+		struct io_uring_cqe* cqe;
+
+		int rc = n < min_complete ? io_uring_wait_cqe(&a->ring, &cqe)
+								  : io_uring_peek_cqe(&a->ring, &cqe);
+
+		if (rc != 0)
+			break;
+
+		ozf_async_request* r = (ozf_async_request*)io_uring_cqe_get_data(cqe);
+
+		r->status = cqe->res == (int)r->size ? 0 : -1;
+
+		io_uring_cqe_seen(&a->ring, cqe);
+
+		ozf_fd_release(r->s, r->fd);
+
+		OZF_STATS_ADD(stats, bytes_read, r->size);
+
+		ozf_async_deliver(a, r);
+		n++;
+	}
+
+	return n;
+}
+
+#endif
+
+/*--------------------------------------------------------------------------*/
+ozf_async* ozf_async_create(int depth, int threads)
+{
+	ozf_async* a = (ozf_async*)calloc(1, sizeof(ozf_async));
+
+	if (!a)
+		return NULL;
+
+	a->depth = depth > 0 ? depth : OZF_ASYNC_DEFAULT_DEPTH;
+	a->tile = (unsigned char*)malloc(OZF_ASYNC_TILE_SIZE);
+
+	if (!a->tile)
+	{
+		free(a);
+		return NULL;
+	}
+
+#ifdef OZF_ASYNC_URING
+	// io_uring_queue_init fails on kernels without io_uring, fall back
+	if (threads <= 0 && io_uring_queue_init(a->depth, &a->ring, 0) == 0)
+	{
+		a->uring = 1;
+		return a;
+	}
+#endif
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&a->lock, NULL);
+	pthread_cond_init(&a->done, NULL);
+#endif
+
+	a->pool = ozf_pool_create(threads > 0 ? threads : OZF_ASYNC_DEFAULT_THREADS);
+
+	if (!a->pool)
+	{
+		ozf_async_destroy(a);
+		return NULL;
+	}
+
+	return a;
+}
+
+/*--------------------------------------------------------------------------*/
+// in-flight requests are completed and delivered before returning
+void ozf_async_destroy(ozf_async* a)
+{
+	if (!a)
+		return;
+
+	while (a->pending > 0)
+		ozf_async_poll(a, a->pending);
+
+#ifdef OZF_ASYNC_URING
+	if (a->uring)
+		io_uring_queue_exit(&a->ring);
+	else
+#endif
+	{
+		ozf_pool_destroy(a->pool);
+
+#ifdef HAVE_PTHREAD_H
+		pthread_cond_destroy(&a->done);
+		pthread_mutex_destroy(&a->lock);
+#endif
+	}
+
+	free(a->tile);
+	free(a);
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_async_submit(ozf_async* a, ozf_stream* s, int scale, int x, int y,
+					 ozf_async_callback callback, void* user)
+{
+	if (a->pending >= a->depth)
+		return -1;
+
+	ozf_async_request* r = (ozf_async_request*)calloc(1, sizeof(ozf_async_request));
+
+	if (!r)
+		return -1;
+
+	r->async = a;
+	r->s = s;
+	r->scale = scale;
+	r->x = x;
+	r->y = y;
+	r->callback = callback;
+	r->user = user;
+
+	if (ozf_tile_location(s, scale, x, y, &r->offset, &r->size) != 0 ||
+		!(r->compressed = (unsigned char*)malloc(r->size)))
+	{
+		ozf_async_free_request(r);
+		return -1;
+	}
+
+	int rc;
+
+#ifdef OZF_ASYNC_URING
+	if (a->uring)
+		rc = ozf_async_submit_uring(a, r);
+	else
+#endif
+	rc = ozf_pool_push(a->pool, ozf_async_job, r);
+
+	if (rc != 0)
+	{
+		ozf_async_free_request(r);
+		return -1;
+	}
+
+	a->pending++;
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_async_poll(ozf_async* a, int min_complete)
+{
+	OZF_TRACE_SCOPE("ozf_async_poll");
+
+	if (min_complete > a->pending)
+		min_complete = a->pending;
+
+#ifdef OZF_ASYNC_URING
+	if (a->uring)
+		return ozf_async_poll_uring(a, min_complete);
+#endif
+
+	return ozf_async_poll_pool(a, min_complete);
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_async_pending(ozf_async* a)
+{
+	return a->pending;
+}
+
+/*--------------------------------------------------------------------------*/
+const char* ozf_async_backend(ozf_async* a)
+{
+#ifdef OZF_ASYNC_URING
+	if (a->uring)
+		return "io_uring";
+#else
+	(void)a;
+#endif
+
+	return "threads";
+}
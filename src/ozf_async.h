@@ -0,0 +1,70 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __OZF_ASYNC_INCLUDED
+#define __OZF_ASYNC_INCLUDED
+
+#include "ozf_decoder.h"
+
+/*--------------------------------------------------------------------------*/
+// Asynchronous tile fetch. Requests for any number of open streams are
+// queued with ozf_async_submit() and completed tiles are handed back from
+// ozf_async_poll(), always on the thread that polls. Reads go through
+// io_uring when built with liburing and the kernel supports it, otherwise
+// through a small pool of threads doing pread().
+//
+// An ozf_async context belongs to one thread; streams must stay open until
+// all of their requests have been delivered.
+typedef struct ozf_async ozf_async;
+
+// status is 0 and data holds a decoded RGBA tile, or status is -1;
+// data is owned by the context and only valid during the call
+typedef void (*ozf_async_callback)(void* user, ozf_stream* s, int scale,
+								   int x, int y, int status, unsigned char* data);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// depth bounds the requests in flight; threads > 0 forces the thread
+// pool with that many workers, 0 prefers io_uring
+ozf_async*	ozf_async_create(int depth, int threads);
+void		ozf_async_destroy(ozf_async* a);
+
+// 0 on success, -1 if the queue is full or the tile does not exist
+int			ozf_async_submit(ozf_async* a, ozf_stream* s, int scale, int x, int y,
+							 ozf_async_callback callback, void* user);
+
+// delivers completed requests, blocking until at least min_complete
+// (bounded by the pending count) are done; returns the number delivered
+int			ozf_async_poll(ozf_async* a, int min_complete);
+int			ozf_async_pending(ozf_async* a);
+
+const char*	ozf_async_backend(ozf_async* a);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,155 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+#ifndef __OZF_ATOMIC_INCLUDED
+#define __OZF_ATOMIC_INCLUDED
+
+/*--------------------------------------------------------------------------*/
+// Atomic operations and thread-local variables. configure checks for the
+// GCC builtins; without them every operation is done under one mutex, and
+// a build without threads (UNDER_CE, MSVC without config.h) uses plain
+// loads and stores.
+#if defined(HAVE_ATOMIC_BUILTINS)
+
+#define OZF_RELAXED		__ATOMIC_RELAXED
+#define OZF_ACQUIRE		__ATOMIC_ACQUIRE
+#define OZF_RELEASE		__ATOMIC_RELEASE
+#define OZF_ACQ_REL		__ATOMIC_ACQ_REL
+#define OZF_SEQ_CST		__ATOMIC_SEQ_CST
+
+#define OZF_ATOMIC_LOAD(p, order)				__atomic_load_n(p, order)
+#define OZF_ATOMIC_STORE(p, v, order)			__atomic_store_n(p, v, order)
+#define OZF_ATOMIC_EXCHANGE(p, v, order)		__atomic_exchange_n(p, v, order)
+#define OZF_ATOMIC_FETCH_ADD(p, n, order)		__atomic_fetch_add(p, n, order)
+#define OZF_ATOMIC_ADD_FETCH(p, n, order)		__atomic_add_fetch(p, n, order)
+
+// strong, the expected value is updated on failure
+#define OZF_ATOMIC_CAS(p, expected, v, success, failure) \
+	__atomic_compare_exchange_n(p, expected, v, 0, success, failure)
+
+#else
+
+#define OZF_RELAXED		0
+#define OZF_ACQUIRE		0
+#define OZF_RELEASE		0
+#define OZF_ACQ_REL		0
+#define OZF_SEQ_CST		0
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+
+// one lock shared by every module, an inline function has a single copy
+inline pthread_mutex_t* ozf_atomic_mutex(void)
+{
+	static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+	return &lock;
+}
+
+#define OZF_ATOMIC_LOCK()		pthread_mutex_lock(ozf_atomic_mutex())
+#define OZF_ATOMIC_UNLOCK()		pthread_mutex_unlock(ozf_atomic_mutex())
+#else
+#define OZF_ATOMIC_LOCK()
+#define OZF_ATOMIC_UNLOCK()
+#endif
+
+template <typename T> inline T ozf_atomic_load(T* p)
+{
+	OZF_ATOMIC_LOCK();
+	T v = *p;
+	OZF_ATOMIC_UNLOCK();
+
+	return v;
+}
+
+template <typename T, typename V> inline void ozf_atomic_store(T* p, V v)
+{
+	OZF_ATOMIC_LOCK();
+	*p = (T)v;
+	OZF_ATOMIC_UNLOCK();
+}
+
+template <typename T, typename V> inline T ozf_atomic_exchange(T* p, V v)
+{
+	OZF_ATOMIC_LOCK();
+	T old = *p;
+	*p = (T)v;
+	OZF_ATOMIC_UNLOCK();
+
+	return old;
+}
+
+template <typename T, typename N> inline T ozf_atomic_fetch_add(T* p, N n)
+{
+	OZF_ATOMIC_LOCK();
+	T old = *p;
+	*p = (T)(old + n);
+	OZF_ATOMIC_UNLOCK();
+
+	return old;
+}
+
+template <typename T, typename N> inline T ozf_atomic_add_fetch(T* p, N n)
+{
+	OZF_ATOMIC_LOCK();
+	T v = *p = (T)(*p + n);
+	OZF_ATOMIC_UNLOCK();
+
+	return v;
+}
+
+template <typename T, typename V> inline bool ozf_atomic_cas(T* p, T* expected, V v)
+{
+	OZF_ATOMIC_LOCK();
+	bool same = *p == *expected;
+
+	if (same)
+		*p = (T)v;
+	else
+		*expected = *p;
+
+	OZF_ATOMIC_UNLOCK();
+
+	return same;
+}
+
+#define OZF_ATOMIC_LOAD(p, order)				ozf_atomic_load(p)
+#define OZF_ATOMIC_STORE(p, v, order)			ozf_atomic_store(p, v)
+#define OZF_ATOMIC_EXCHANGE(p, v, order)		ozf_atomic_exchange(p, v)
+#define OZF_ATOMIC_FETCH_ADD(p, n, order)		ozf_atomic_fetch_add(p, n)
+#define OZF_ATOMIC_ADD_FETCH(p, n, order)		ozf_atomic_add_fetch(p, n)
+#define OZF_ATOMIC_CAS(p, expected, v, success, failure) \
+	ozf_atomic_cas(p, expected, v)
+
+#endif
+
+/*--------------------------------------------------------------------------*/
+// defined only where the compiler has thread-local variables, users fall
+// back to pthread keys
+#if defined(HAVE_TLS)
+#define OZF_THREAD_LOCAL		__thread
+#endif
+
+#endif
@@ -0,0 +1,275 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "ozf_cache.h"
+#include "ozf_stats.h"
+
+/*--------------------------------------------------------------------------*/
+#define OZF_CACHE_MIN_TILES		8
+#define OZF_CACHE_NONE			-1
+
+/*--------------------------------------------------------------------------*/
+typedef struct
+{
+	ozf_stream*		s;			// NULL while unused
+	int				scale, x, y;
+	int				chain;		// next entry in the hash bucket
+	int				prev, next;	// LRU list, most recent first
+	unsigned char*	indices;
+} ozf_cache_entry;
+
+/*--------------------------------------------------------------------------*/
+struct ozf_cache
+{
+	int					size;
+	int					buckets;	// power of two
+	int*				table;
+	ozf_cache_entry*	entries;
+	unsigned char*		data;
+	int					head, tail;
+};
+
+/*--------------------------------------------------------------------------*/
+static unsigned int ozf_cache_hash(ozf_cache* c, ozf_stream* s, int scale, int x, int y)
+{
+	unsigned long h = (unsigned long)s >> 4;
+
+	h = h * 31 + scale;
+	h = h * 0x9e3779b1UL + x;
+	h = h * 0x9e3779b1UL + y;
+	h ^= h >> 15;
+
+	return (unsigned int)h & (c->buckets - 1);
+}
+
+/*--------------------------------------------------------------------------*/
+static void ozf_cache_unlink(ozf_cache* c, int i)
+{
+	ozf_cache_entry* e = &c->entries[i];
+
+	if (e->prev != OZF_CACHE_NONE)
+		c->entries[e->prev].next = e->next;
+	else
+		c->head = e->next;
+
+	if (e->next != OZF_CACHE_NONE)
+		c->entries[e->next].prev = e->prev;
+	else
+		c->tail = e->prev;
+}
+
+/*--------------------------------------------------------------------------*/
+static void ozf_cache_push_front(ozf_cache* c, int i)
+{
+	ozf_cache_entry* e = &c->entries[i];
+
+	e->prev = OZF_CACHE_NONE;
+	e->next = c->head;
+
+	if (c->head != OZF_CACHE_NONE)
+		c->entries[c->head].prev = i;
+	else
+		c->tail = i;
+
+	c->head = i;
+}
+
+/*--------------------------------------------------------------------------*/
+static void ozf_cache_remove_key(ozf_cache* c, int i)
+{
+	ozf_cache_entry* e = &c->entries[i];
+
+	if (!e->s)
+		return;
+
+	int* link = &c->table[ozf_cache_hash(c, e->s, e->scale, e->x, e->y)];
+
+	while (*link != OZF_CACHE_NONE && *link != i)
+		link = &c->entries[*link].chain;
+
+	if (*link == i)
+		*link = e->chain;
+
+	e->s = NULL;
+}
+
+/*--------------------------------------------------------------------------*/
+ozf_cache* ozf_cache_create(int tiles)
+{
+	ozf_cache* c = (ozf_cache*)calloc(1, sizeof(ozf_cache));
+	int i;
+
+	if (!c)
+		return NULL;
+
+	if (tiles < OZF_CACHE_MIN_TILES)
+		tiles = OZF_CACHE_MIN_TILES;
+
+	c->size = tiles;
+
+	for (c->buckets = 1; c->buckets < tiles * 2; c->buckets <<= 1)
+		;
+
+	c->table = (int*)malloc(c->buckets * sizeof(int));
+	c->entries = (ozf_cache_entry*)calloc(tiles, sizeof(ozf_cache_entry));
+	c->data = (unsigned char*)malloc((long)tiles * OZF_TILE_WIDTH * OZF_TILE_HEIGHT);
+
+	if (!c->table || !c->entries || !c->data)
+	{
+		ozf_cache_destroy(c);
+		return NULL;
+	}
+
+	for (i = 0; i < c->buckets; i++)
+		c->table[i] = OZF_CACHE_NONE;
+
+	// every entry starts out unused on the LRU list
+	c->head = c->tail = OZF_CACHE_NONE;
+
+	for (i = 0; i < tiles; i++)
+	{
+		c->entries[i].indices = c->data + (long)i * OZF_TILE_WIDTH * OZF_TILE_HEIGHT;
+		c->entries[i].chain = OZF_CACHE_NONE;
+		ozf_cache_push_front(c, i);
+	}
+
+	return c;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_cache_destroy(ozf_cache* c)
+{
+	if (!c)
+		return;
+
+	free(c->data);
+	free(c->entries);
+	free(c->table);
+	free(c);
+}
+
+/*--------------------------------------------------------------------------*/
+// Copies of a tile share the entry of the first one, and tiles of a single
+// colour one entry per colour, keyed with x = -1 and y = the colour.
+const unsigned char* ozf_cache_get(ozf_cache* c, ozf_stream* s, int scale, int x, int y)
+{
+	ozf_stats* stats = ozf_stats_local();
+	int colour = ozf_tile_uniform(s, scale, x, y);
+	long first = ozf_tile_shared(s, scale, x, y);
+	int i;
+
+	if (colour >= 0)
+	{
+		x = -1;
+		y = colour;
+	}
+	else if (first >= 0)
+	{
+		x = (int)(first % ozf_num_tiles_per_x(s, scale));
+		y = (int)(first / ozf_num_tiles_per_x(s, scale));
+	}
+
+	unsigned int h = ozf_cache_hash(c, s, scale, x, y);
+
+	for (i = c->table[h]; i != OZF_CACHE_NONE; i = c->entries[i].chain)
+	{
+		ozf_cache_entry* e = &c->entries[i];
+
+		if (e->s == s && e->scale == scale && e->x == x && e->y == y)
+		{
+			if (c->head != i)
+			{
+				ozf_cache_unlink(c, i);
+				ozf_cache_push_front(c, i);
+			}
+
+			OZF_STATS_ADD(stats, cache_hits, 1);
+
+			return e->indices;
+		}
+	}
+
+	OZF_STATS_ADD(stats, cache_misses, 1);
+
+	// recycle the least recently used entry
+	i = c->tail;
+
+	ozf_cache_entry* e = &c->entries[i];
+
+	ozf_cache_remove_key(c, i);
+
+	if (colour >= 0)
+	{
+		memset(e->indices, colour, OZF_TILE_WIDTH * OZF_TILE_HEIGHT);
+		OZF_STATS_ADD(stats, tiles_skipped, 1);
+	}
+	else if (ozf_get_tile_indices(s, scale, x, y, e->indices) != 0)
+		return NULL;
+
+	e->s = s;
+	e->scale = scale;
+	e->x = x;
+	e->y = y;
+	e->chain = c->table[h];
+	c->table[h] = i;
+
+	ozf_cache_unlink(c, i);
+	ozf_cache_push_front(c, i);
+
+	return e->indices;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_cache_drop(ozf_cache* c, ozf_stream* s)
+{
+	int i;
+
+	for (i = 0; i < c->size; i++)
+	{
+		if (c->entries[i].s != s)
+			continue;
+
+		ozf_cache_remove_key(c, i);
+
+		// unused entries are recycled first
+		ozf_cache_unlink(c, i);
+
+		c->entries[i].prev = c->tail;
+		c->entries[i].next = OZF_CACHE_NONE;
+
+		if (c->tail != OZF_CACHE_NONE)
+			c->entries[c->tail].next = i;
+		else
+			c->head = i;
+
+		c->tail = i;
+	}
+}
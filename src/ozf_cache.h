@@ -0,0 +1,57 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __OZF_CACHE_INCLUDED
+#define __OZF_CACHE_INCLUDED
+
+#include "ozf_decoder.h"
+
+/*--------------------------------------------------------------------------*/
+// LRU cache of inflated tiles (palette indices, rows bottom-up) keyed by
+// stream, scale and tile position; copies of a tile and tiles of the same
+// single colour share one entry. A cache is not thread safe, use one per
+// rendering thread. Hits and misses go to the CACHE_HITS/CACHE_MISSES
+// decoder counters.
+typedef struct ozf_cache ozf_cache;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+ozf_cache*	ozf_cache_create(int tiles);
+void		ozf_cache_destroy(ozf_cache* c);
+
+// Returns the tile or NULL if it cannot be decoded. The pointer stays valid
+// until tiles - 1 further distinct tiles have been requested.
+const unsigned char*	ozf_cache_get(ozf_cache* c, ozf_stream* s, int scale,
+									  int x, int y);
+
+// forgets the tiles of a stream, call before closing it
+void		ozf_cache_drop(ozf_cache* c, ozf_stream* s);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
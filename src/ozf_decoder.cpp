@@ -22,10 +22,20 @@
  * Boston, MA  02110-1301, USA.
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <zlib.h>
 #include <string.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
 #include "ozf_decoder.h"
 
 #ifdef WIN32
@@ -33,6 +43,12 @@
 #endif
 
 #include "log_stream.h"
+#include "ozf_stats.h"
+#include "ozf_trace.h"
+#include "ozf_sidecar.h"
+#include "ozf_io.h"
+#include "ozf_inflate.h"
+#include "ozf_atomic.h"
 
 /*--------------------------------------------------------------------------*/
 #define OZFX3_KEY_MAX				256
@@ -48,8 +64,18 @@
 #define OZFX3_ZDATA_ENCRYPTION_LENGTH	16
 
 /*--------------------------------------------------------------------------*/
-#define	OZF_TILE_WIDTH				64
-#define	OZF_TILE_HEIGHT				64
+#define OZF_FIELD_SIZE				4		// integers in the file are 32 bit
+#define OZF_SCALE_HEADER_SIZE		(2 * 4 + 2 * 2 + 256 * 4)
+
+/*--------------------------------------------------------------------------*/
+#define OZF_COALESCE_GAP			16384		// read through holes up to
+#define OZF_COALESCE_MAX			(1 << 20)	// largest single read
+
+/*--------------------------------------------------------------------------*/
+#define OZF_SHARED_MAX_SIZE			256		// larger tiles are not compared
+
+/*--------------------------------------------------------------------------*/
+#define OZF_LOG(s, level, ...)		LOGSTREAM(level, (s)->name, __VA_ARGS__)
 
 /*--------------------------------------------------------------------------*/
 static unsigned char d0_key[] =
@@ -69,45 +95,44 @@ static unsigned char d1_key[] =
 };
 
 /*--------------------------------------------------------------------------*/
+// One tile with the adler32 checked whatever the setup, a wrong key must
+// not pass for a right one.
 int ozf_decompress_tile(Bytef *dest, uLongf* destLen, 
 						const Bytef *source, uLong sourceLen)
 {
-    z_stream stream;
-    int err;
+	unsigned long size = *destLen;
 
-    stream.next_in = (Bytef*)source;
-    stream.avail_in = (uInt)sourceLen;
-	
-    if ((uLong)stream.avail_in != sourceLen) 
-		return Z_BUF_ERROR;
+	if (ozf_inflate(NULL, 1, dest, &size, source, sourceLen) != 0)
+		return Z_DATA_ERROR;
 
-    stream.next_out = dest;
-    stream.avail_out = (uInt)*destLen;
-    
-	if ((uLong)stream.avail_out != *destLen) 
-		return Z_BUF_ERROR;
+	*destLen = size;
 
-    stream.zalloc = (alloc_func)0;
-    stream.zfree = (free_func)0;
+	return Z_OK;
+}
 
-    err = inflateInit(&stream);
-    
-	if (err != Z_OK) 
-		return err;
+/*--------------------------------------------------------------------------*/
+// Inflates on the reader's own decompressor, set up once instead of for
+// every tile. A reader shared by several threads lets one of them use it
+// and the others inflate on a private one. 0 on success.
+static int ozf_reader_inflate(ozf_stream* s, unsigned char* dest,
+							  unsigned long* dest_len,
+							  const unsigned char* source, unsigned long source_len)
+{
+	int verify = ozf_inflate_verify();
+	int err;
 
-    err = inflate(&stream, Z_FINISH);
+	if (OZF_ATOMIC_EXCHANGE(&s->inflate_busy, 1, OZF_ACQUIRE))
+		return ozf_inflate(NULL, verify, dest, dest_len, source, source_len);
 
-    if (err != Z_STREAM_END) 
-	{
-        inflateEnd(&stream);
-        return err == Z_OK ? Z_BUF_ERROR : err;
-    }
-    
-	*destLen = stream.total_out;
+	if (!s->inflate)
+		s->inflate = ozf_inflater_create();
 
-    err = inflateEnd(&stream);
-	
-    return err;
+	err = ozf_inflate((ozf_inflater*)s->inflate, verify, dest, dest_len,
+					  source, source_len);
+
+	OZF_ATOMIC_STORE(&s->inflate_busy, 0, OZF_RELEASE);
+
+	return err;
 }
 
 /*--------------------------------------------------------------------------*/
@@ -145,23 +170,88 @@ void ozf_decode1(unsigned char *s, long n, unsigned char initial)
 }
 
 /*--------------------------------------------------------------------------*/
-unsigned long ozf_calculate_key(FILE* fp)
+// a descriptor for callers doing their own I/O, -1 if the backend has none
+int ozf_fd_acquire(ozf_stream* s)
+{
+	if (!s->handle || !s->io->fd_acquire)
+		return -1;
+
+	return s->io->fd_acquire(s->handle);
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_fd_release(ozf_stream* s, int fd)
+{
+	if (fd >= 0 && s->io->fd_release)
+		s->io->fd_release(s->handle);
+}
+
+/*--------------------------------------------------------------------------*/
+// Positioned read, every backend allows several threads on one stream.
+static int ozf_read_at(ozf_stream* s, ozf_offset offset, void* data,
+					   unsigned long size, ozf_stats* stats)
+{
+	unsigned long long t0 = ozf_stats_clock(), t1;
+	int err = -1;
+
+	if (s->handle)
+		err = s->io->read(s->handle, offset, data, size);
+
+	t1 = ozf_stats_clock();
+	OZF_STATS_ADD(stats, ns_read, t1 - t0);
+	OZF_STATS_ADD(stats, bytes_read, size);
+	OZF_TRACE_SPAN("read", t0, t1, -1, -1, -1);
+
+	return err;
+}
+
+/*--------------------------------------------------------------------------*/
+// sequential reads of the headers, advances offset
+static int ozf_read_next(ozf_stream* s, ozf_offset* offset, void* data,
+						 unsigned long size)
+{
+	int err = ozf_read_at(s, *offset, data, size, ozf_stats_local());
+
+	*offset += size;
+
+	return err;
+}
+
+/*--------------------------------------------------------------------------*/
+// Offsets in the file are 32 bit and wrap around in maps over 4 GB. Data is
+// written front to back, so the true offset is the last one with the same
+// low 32 bits before an offset known to come later: the scales table comes
+// before the size, scale headers before the next one, tiles before the
+// header of their scale. Smaller files are taken as they are.
+static ozf_offset ozf_unwrap_offset(unsigned int value, ozf_offset before)
+{
+	if (before <= 0xffffffffULL)
+		return value;
+
+	return before - (unsigned int)((unsigned int)before - value);
+}
+
+/*--------------------------------------------------------------------------*/
+static ozf_offset ozf_tile_offset(ozf_stream* s, int scale,
+								  const unsigned int* table, long i)
+{
+	return ozf_unwrap_offset(table[i], s->images[scale].offset);
+}
+
+/*--------------------------------------------------------------------------*/
+unsigned long ozf_calculate_key(ozf_stream* s)
 {
 	unsigned long key = 0;
 	unsigned char initial = 0;
-	unsigned char keyblock[OZFX3_KEY_BLOCK_SIZE];
+	unsigned char keyblock[OZFX3_KEY_BLOCK_SIZE] = { 0 };
 	unsigned char bytes_per_info = 0;
+	ozf_stats* stats = ozf_stats_local();
 
-	fseek(fp, OZFX3_MAGIC_OFFSET_0, SEEK_SET);
-	fread(&bytes_per_info, 1, 1, fp);
-
-	unsigned long offset = OZFX3_MAGIC_OFFSET_2;
-	fseek(fp, offset, SEEK_SET);
-	fread(&initial, 1, 1, fp);
+	ozf_read_at(s, OZFX3_MAGIC_OFFSET_0, &bytes_per_info, 1, stats);
+	ozf_read_at(s, OZFX3_MAGIC_OFFSET_2, &initial, 1, stats);
 
-	offset = OZFX3_MAGIC_OFFSET_1 + bytes_per_info - OZFX3_MAGIC_BLOCKLENGTH_0;
-	fseek(fp, offset, SEEK_SET);
-	fread(keyblock, OZFX3_KEY_BLOCK_SIZE, 1, fp);
+	unsigned long offset = OZFX3_MAGIC_OFFSET_1 + bytes_per_info - OZFX3_MAGIC_BLOCKLENGTH_0;
+	ozf_read_at(s, offset, keyblock, OZFX3_KEY_BLOCK_SIZE, stats);
 
 	ozf_decode1(keyblock, OZFX3_KEY_BLOCK_SIZE, initial);
 
@@ -235,413 +325,1426 @@ long ozf_get_encyption_depth(void *data, long size, unsigned long key)
 }
 
 /*--------------------------------------------------------------------------*/
-void ozf_init_encrypted_stream(ozf_stream* stream)
+// the file stores BGRx entries
+static void ozf_palette_to_rgba(unsigned char* palette)
 {
-	ozf_stream* s = stream;
-	unsigned char bytes_per_infoblock;
-	unsigned long offset;
-	unsigned long scales_table_offset;
-	int i, j;
-	
-	logstream_write("ozf: processing encrypted stream\n");
+	int c;
 
-	fseek(s->file, OZFX3_MAGIC_OFFSET_0, SEEK_SET);
-	fread(&bytes_per_infoblock, 1, 1, s->file);
+	for (c = 0; c < 256; c++)
+	{
+		unsigned char b = palette[c*4 + 0];
 
-	logstream_write("ozf: bytes per info block: %d\n", bytes_per_infoblock);
+		palette[c*4 + 0] = palette[c*4 + 2];
+		palette[c*4 + 2] = b;
+		palette[c*4 + 3] = 255;
+	}
+}
 
-	offset =	OZFX3_MAGIC_OFFSET_1 + bytes_per_infoblock - 
-				OZFX3_MAGIC_BLOCKLENGTH_0 + sizeof(long);
+/*--------------------------------------------------------------------------*/
+// Scale headers and palettes, the tile tables are left to ozf_tiles_table().
+// The scales table offset is the last field of the file.
+static void ozf_init_scales(ozf_stream* s)
+{
+	unsigned int scales_table_offset = 0;
+	ozf_offset offset, table_offset;
+	int i;
 
-	s->ozf3 = (ozf3_header*)malloc(sizeof(ozf3_header));
-	
-	fseek(s->file, offset, SEEK_SET);
-	
-	fread(&s->ozf3->size, sizeof(long), 1, s->file);
-	fread(&s->ozf3->width, sizeof(long), 1, s->file);
-	fread(&s->ozf3->height, sizeof(long), 1, s->file);
-	fread(&s->ozf3->depth, sizeof(short), 1, s->file);
-	fread(&s->ozf3->bpp, sizeof(short), 1, s->file);
-	
-	ozf_decode1((unsigned char*)s->ozf3, sizeof(ozf3_header), s->key);
+	if (s->size < OZF_FIELD_SIZE)
+		return;
 
-	logstream_write("ozf: decoded ozf3 header: \n");
-	logstream_write("\tsize:\t%d\n", s->ozf3->size);
-	logstream_write("\twidth:\t%d\n", s->ozf3->width);
-	logstream_write("\theight:\t%d\n", s->ozf3->height);
-	logstream_write("\tdepth:\t%d\n", s->ozf3->depth);
-	logstream_write("\tbpp:\t%d\n", s->ozf3->bpp);
+	offset = s->size - OZF_FIELD_SIZE;
 
-	offset = s->size - sizeof(long);
-	
-	fseek(s->file, offset, SEEK_SET);
-	fread(&scales_table_offset, sizeof(long), 1, s->file);
-	
-	ozf_decode1((unsigned char*)&scales_table_offset, sizeof(long), s->key);
+	ozf_read_at(s, offset, &scales_table_offset, OZF_FIELD_SIZE, ozf_stats_local());
+
+	if (s->type == OZF_STREAM_ENCRYPTED)
+		ozf_decode1((unsigned char*)&scales_table_offset, OZF_FIELD_SIZE, s->key);
+
+	table_offset = ozf_unwrap_offset(scales_table_offset, offset);
 
-	logstream_write("ozf: scales table starts at: %d\n", scales_table_offset);
+	OZF_LOG(s, LOGSTREAM_DEBUG, "scales table starts at: %llu\n", table_offset);
+
+	if (table_offset > offset)
+	{
+		OZF_LOG(s, LOGSTREAM_ERROR, "scales table out of file\n");
+		return;
+	}
 
- 	s->scales = (s->size - scales_table_offset - sizeof(long)) / sizeof(long);
+ 	s->scales = (offset - table_offset) / OZF_FIELD_SIZE;
 
-	logstream_write("ozf: scales total: %d\n", s->scales);
+	OZF_LOG(s, LOGSTREAM_DEBUG, "scales total: %d\n", s->scales);
 
 	s->scales_table = 
-		(unsigned long*)malloc(s->scales * sizeof(unsigned long));
+		(unsigned int*)ozf_malloc(s->scales * sizeof(unsigned int));
 		
 	s->images = 
-		(ozf_image*)malloc(s->scales * sizeof(ozf_image));
+		(ozf_image*)ozf_malloc(s->scales * sizeof(ozf_image));
 
-	fseek(s->file, scales_table_offset, SEEK_SET);
-	fread(s->scales_table, s->scales * sizeof(long), 1, s->file);
-	
-	for (i = 0; i < s->scales; i++)
-	{
-		unsigned char* tile;
-	
-		ozf_decode1((unsigned char*)&s->scales_table[i], sizeof(long), s->key);
+	memset(s->images, 0, s->scales * sizeof(ozf_image));
 
-		logstream_write("ozf: scale %d header starts at: %d\n", i, s->scales_table[i]);
+	ozf_read_at(s, table_offset, s->scales_table,
+				s->scales * sizeof(unsigned int), ozf_stats_local());
 
-		fseek(s->file, s->scales_table[i], SEEK_SET);
-		
-		fread(&s->images[i].header.width, sizeof(long), 1, s->file);
-		fread(&s->images[i].header.height, sizeof(long), 1, s->file);
-		fread(&s->images[i].header.xtiles, sizeof(short), 1, s->file);
-		fread(&s->images[i].header.ytiles, sizeof(short), 1, s->file);
-		fread(s->images[i].header.palette, sizeof(long)*256, 1, s->file);
-		
-		ozf_decode1((unsigned char*)&s->images[i].header.width, sizeof(long), s->key);
-		ozf_decode1((unsigned char*)&s->images[i].header.height, sizeof(long), s->key);
-		ozf_decode1((unsigned char*)&s->images[i].header.xtiles, sizeof(short), s->key);
-		ozf_decode1((unsigned char*)&s->images[i].header.ytiles, sizeof(short), s->key);
+	// headers are unwrapped back to front, each lies before the next one
+	offset = table_offset;
 
-		logstream_write("ozf: \twidth:\t%d\n", s->images[i].header.width);
-		logstream_write("ozf: \theight:\t%d\n", s->images[i].header.height);
-		logstream_write("ozf: \ttiles per x:\t%d\n", s->images[i].header.xtiles);
-		logstream_write("ozf: \ttiles per y:\t%d\n", s->images[i].header.ytiles);
+	for (i = (int)s->scales - 1; i >= 0; i--)
+	{
+		if (s->type == OZF_STREAM_ENCRYPTED)
+			ozf_decode1((unsigned char*)&s->scales_table[i], OZF_FIELD_SIZE, s->key);
 
-		ozf_decode1((unsigned char*)s->images[i].header.palette, 1024, s->key);
+		offset = ozf_unwrap_offset(s->scales_table[i], offset);
+		s->images[i].offset = offset;
+	}
 	
-		s->images[i].tiles = s->images[i].header.xtiles * s->images[i].header.ytiles + 1;
-		
-		s->images[i].tiles_table = 
-			(unsigned long*)malloc(s->images[i].tiles * sizeof(long));
-		
-		fread(s->images[i].tiles_table, s->images[i].tiles * sizeof(long), 1, s->file);
+	for (i = 0; i < (int)s->scales; i++)
+	{
+		OZF_TRACE_SCOPE("ozf_init_scale", i);
+
+		ozf_image* image = &s->images[i];
+
+		OZF_LOG(s, LOGSTREAM_DEBUG, "scale %d header starts at: %llu\n", i, image->offset);
+
+		offset = image->offset;
 		
-		for (j = 0; j < s->images[i].tiles; j++)
+		ozf_read_next(s, &offset, &image->header.width, sizeof(int));
+		ozf_read_next(s, &offset, &image->header.height, sizeof(int));
+		ozf_read_next(s, &offset, &image->header.xtiles, sizeof(short));
+		ozf_read_next(s, &offset, &image->header.ytiles, sizeof(short));
+		ozf_read_next(s, &offset, image->header.palette, sizeof(image->header.palette));
+
+		if (s->type == OZF_STREAM_ENCRYPTED)
 		{
-			unsigned long* p = &s->images[i].tiles_table[j];
-			
-			ozf_decode1((unsigned char*)p, sizeof(long), s->key);
-			
+			ozf_decode1((unsigned char*)&image->header.width, sizeof(int), s->key);
+			ozf_decode1((unsigned char*)&image->header.height, sizeof(int), s->key);
+			ozf_decode1((unsigned char*)&image->header.xtiles, sizeof(short), s->key);
+			ozf_decode1((unsigned char*)&image->header.ytiles, sizeof(short), s->key);
+			ozf_decode1(image->header.palette, sizeof(image->header.palette), s->key);
 		}
-						
-		unsigned long tilesize =	s->images[i].tiles_table[1] - 
-									s->images[i].tiles_table[0];
 
-		tile = (unsigned char*)malloc(tilesize);
-		
-		fseek(s->file, s->images[i].tiles_table[0], SEEK_SET);
-		fread(tile, tilesize, 1, s->file);
-											
-		s->images[i].encryption_depth = 
-			ozf_get_encyption_depth(tile, tilesize, s->key);
-					
-		free(tile);									
+		ozf_palette_to_rgba(image->header.palette);
 
-		logstream_write("ozf: \tencryption depth:\t%d\n", s->images[i].encryption_depth);
-	}
+		OZF_LOG(s, LOGSTREAM_DEBUG, "\twidth:\t%d\n", image->header.width);
+		OZF_LOG(s, LOGSTREAM_DEBUG, "\theight:\t%d\n", image->header.height);
+		OZF_LOG(s, LOGSTREAM_DEBUG, "\ttiles per x:\t%d\n", image->header.xtiles);
+		OZF_LOG(s, LOGSTREAM_DEBUG, "\ttiles per y:\t%d\n", image->header.ytiles);
 
+		if (image->header.xtiles < 0 || image->header.ytiles < 0)
+			image->header.xtiles = image->header.ytiles = 0;
+	
+		image->tiles = image->header.xtiles * image->header.ytiles + 1;
+		image->encryption_depth = -1;
+	}
 }
 
 /*--------------------------------------------------------------------------*/
-void ozf_init_raw_stream(ozf_stream* stream)
+void ozf_init_encrypted_stream(ozf_stream* stream)
 {
 	ozf_stream* s = stream;
+	unsigned char bytes_per_infoblock = 0;
+	ozf_offset offset;
+	
+	OZF_LOG(s, LOGSTREAM_DEBUG, "processing encrypted stream\n");
+
+	ozf_read_at(s, OZFX3_MAGIC_OFFSET_0, &bytes_per_infoblock, 1, ozf_stats_local());
 
-	unsigned long offset;
-	unsigned long scales_table_offset;
-	int i, j;
+	OZF_LOG(s, LOGSTREAM_DEBUG, "bytes per info block: %d\n", bytes_per_infoblock);
+
+	offset =	OZFX3_MAGIC_OFFSET_1 + bytes_per_infoblock - 
+				OZFX3_MAGIC_BLOCKLENGTH_0 + OZF_FIELD_SIZE;
+
+	s->ozf3 = (ozf3_header*)ozf_malloc(sizeof(ozf3_header));
+	memset(s->ozf3, 0, sizeof(ozf3_header));
+	
+	ozf_read_next(s, &offset, &s->ozf3->size, sizeof(int));
+	ozf_read_next(s, &offset, &s->ozf3->width, sizeof(int));
+	ozf_read_next(s, &offset, &s->ozf3->height, sizeof(int));
+	ozf_read_next(s, &offset, &s->ozf3->depth, sizeof(short));
+	ozf_read_next(s, &offset, &s->ozf3->bpp, sizeof(short));
 	
-	logstream_write("ozf: processing raw stream\n");
+	ozf_decode1((unsigned char*)s->ozf3, sizeof(ozf3_header), s->key);
+
+	OZF_LOG(s, LOGSTREAM_DEBUG, "decoded ozf3 header: \n");
+	OZF_LOG(s, LOGSTREAM_DEBUG, "\tsize:\t%d\n", s->ozf3->size);
+	OZF_LOG(s, LOGSTREAM_DEBUG, "\twidth:\t%d\n", s->ozf3->width);
+	OZF_LOG(s, LOGSTREAM_DEBUG, "\theight:\t%d\n", s->ozf3->height);
+	OZF_LOG(s, LOGSTREAM_DEBUG, "\tdepth:\t%d\n", s->ozf3->depth);
+	OZF_LOG(s, LOGSTREAM_DEBUG, "\tbpp:\t%d\n", s->ozf3->bpp);
 
-	offset = 0;
+	ozf_init_scales(s);
+}
 
-	s->ozf2 = (ozf2_header*)malloc(sizeof(ozf2_header));
+/*--------------------------------------------------------------------------*/
+void ozf_init_raw_stream(ozf_stream* stream)
+{
+	ozf_stream* s = stream;
+	ozf_offset offset = 0;
 	
-	fseek(s->file, offset, SEEK_SET);
+	OZF_LOG(s, LOGSTREAM_DEBUG, "processing raw stream\n");
+
+	s->ozf2 = (ozf2_header*)ozf_malloc(sizeof(ozf2_header));
+	memset(s->ozf2, 0, sizeof(ozf2_header));
 	
-	fread(&s->ozf2->magic, sizeof(short), 1, s->file); 
-	fread(&s->ozf2->dummy1, sizeof(long), 1, s->file);
-	fread(&s->ozf2->dummy2, sizeof(long), 1, s->file);
-	fread(&s->ozf2->dummy3, sizeof(long), 1, s->file);
-	fread(&s->ozf2->dummy4, sizeof(long), 1, s->file);
+	ozf_read_next(s, &offset, &s->ozf2->magic, sizeof(short)); 
+	ozf_read_next(s, &offset, &s->ozf2->dummy1, sizeof(int));
+	ozf_read_next(s, &offset, &s->ozf2->dummy2, sizeof(int));
+	ozf_read_next(s, &offset, &s->ozf2->dummy3, sizeof(int));
+	ozf_read_next(s, &offset, &s->ozf2->dummy4, sizeof(int));
 
-	fread(&s->ozf2->width, sizeof(long), 1, s->file);
-	fread(&s->ozf2->height, sizeof(long), 1, s->file);
+	ozf_read_next(s, &offset, &s->ozf2->width, sizeof(int));
+	ozf_read_next(s, &offset, &s->ozf2->height, sizeof(int));
 
-	fread(&s->ozf2->depth, sizeof(short), 1, s->file);
-	fread(&s->ozf2->bpp, sizeof(short), 1, s->file);
+	ozf_read_next(s, &offset, &s->ozf2->depth, sizeof(short));
+	ozf_read_next(s, &offset, &s->ozf2->bpp, sizeof(short));
 
-	fread(&s->ozf2->dummy5, sizeof(long), 1, s->file);
+	ozf_read_next(s, &offset, &s->ozf2->dummy5, sizeof(int));
 
-	fread(&s->ozf2->memsiz, sizeof(long), 1, s->file); 
+	ozf_read_next(s, &offset, &s->ozf2->memsiz, sizeof(int)); 
 
-	fread(&s->ozf2->dummy6, sizeof(long), 1, s->file); 
-	fread(&s->ozf2->dummy7, sizeof(long), 1, s->file); 
-	fread(&s->ozf2->dummy8, sizeof(long), 1, s->file); 
-	fread(&s->ozf2->version, sizeof(long), 1, s->file); 
+	ozf_read_next(s, &offset, &s->ozf2->dummy6, sizeof(int)); 
+	ozf_read_next(s, &offset, &s->ozf2->dummy7, sizeof(int)); 
+	ozf_read_next(s, &offset, &s->ozf2->dummy8, sizeof(int)); 
+	ozf_read_next(s, &offset, &s->ozf2->version, sizeof(int)); 
 	
-	logstream_write("ozf: decoded ozf2 header: \n");
-	logstream_write("\twidth:\t%d\n", s->ozf2->width);
-	logstream_write("\theight:\t%d\n", s->ozf2->height);
-	logstream_write("\tdepth:\t%d\n", s->ozf2->depth);
-	logstream_write("\tbpp:\t%d\n", s->ozf2->bpp);
+	OZF_LOG(s, LOGSTREAM_DEBUG, "decoded ozf2 header: \n");
+	OZF_LOG(s, LOGSTREAM_DEBUG, "\twidth:\t%d\n", s->ozf2->width);
+	OZF_LOG(s, LOGSTREAM_DEBUG, "\theight:\t%d\n", s->ozf2->height);
+	OZF_LOG(s, LOGSTREAM_DEBUG, "\tdepth:\t%d\n", s->ozf2->depth);
+	OZF_LOG(s, LOGSTREAM_DEBUG, "\tbpp:\t%d\n", s->ozf2->bpp);
 
-	offset = s->size - sizeof(long);
-	
-	fseek(s->file, offset, SEEK_SET);
-	fread(&scales_table_offset, sizeof(long), 1, s->file);
-	
-	logstream_write("ozf: scales table starts at: %d\n", scales_table_offset);
+	ozf_init_scales(s);
+}
+
+/*--------------------------------------------------------------------------*/
+// reads, and for encrypted streams decodes, the tile table of a scale and
+// finds its encryption depth, nothing of the stream is changed
+static unsigned int* ozf_load_tiles_table(ozf_stream* s, int scale, int* depth)
+{
+	ozf_image* image = &s->images[scale];
+	ozf_offset offset = image->offset + OZF_SCALE_HEADER_SIZE;
+	unsigned long size = image->tiles * sizeof(unsigned int);
+	unsigned long j;
 
- 	s->scales = (s->size - scales_table_offset - sizeof(long)) / sizeof(long);
+	OZF_TRACE_SCOPE("ozf_load_tiles_table", scale);
 
-	logstream_write("ozf: scales total: %d\n", s->scales);
+	if (offset + size > s->size)
+	{
+		OZF_LOG(s, LOGSTREAM_ERROR, "scale %d tile table out of file\n", scale);
+		return NULL;
+	}
 
-	s->scales_table = 
-		(unsigned long*)malloc(s->scales * sizeof(unsigned long));
-		
-	s->images = 
-		(ozf_image*)malloc(s->scales * sizeof(ozf_image));
+	unsigned int* table = (unsigned int*)ozf_malloc(size);
 
-	fseek(s->file, scales_table_offset, SEEK_SET);
-	fread(s->scales_table, s->scales * sizeof(long), 1, s->file);
-	
-	for (i = 0; i < s->scales; i++)
+	if (ozf_read_at(s, offset, table, size, ozf_stats_local()) != 0)
 	{
-		unsigned char* tile;
-	
-		logstream_write("ozf: scale %d header starts at: %d\n", i, s->scales_table[i]);
+		ozf_free(table);
+		return NULL;
+	}
 
-		fseek(s->file, s->scales_table[i], SEEK_SET);
-		
-		fread(&s->images[i].header.width, sizeof(long), 1, s->file);
-		fread(&s->images[i].header.height, sizeof(long), 1, s->file);
-		fread(&s->images[i].header.xtiles, sizeof(short), 1, s->file);
-		fread(&s->images[i].header.ytiles, sizeof(short), 1, s->file);
-		fread(s->images[i].header.palette, sizeof(long)*256, 1, s->file);
-
-		logstream_write("ozf: \twidth:\t%d\n", s->images[i].header.width);
-		logstream_write("ozf: \theight:\t%d\n", s->images[i].header.height);
-		logstream_write("ozf: \ttiles per x:\t%d\n", s->images[i].header.xtiles);
-		logstream_write("ozf: \ttiles per y:\t%d\n", s->images[i].header.ytiles);
-	
-		s->images[i].tiles = s->images[i].header.xtiles * s->images[i].header.ytiles + 1;
-		
-		s->images[i].tiles_table = 
-			(unsigned long*)malloc(s->images[i].tiles * sizeof(long));
-		
-		fread(s->images[i].tiles_table, s->images[i].tiles * sizeof(long), 1, s->file);
-		
+	if (s->type == OZF_STREAM_ENCRYPTED)
+	{
+		for (j = 0; j < image->tiles; j++)
+			ozf_decode1((unsigned char*)&table[j], sizeof(unsigned int), s->key);
+
+		unsigned long tilesize = image->tiles > 1 ? (unsigned int)(table[1] - table[0]) : 0;
+
+		if (tilesize > 0 && tilesize <= OZF_COALESCE_MAX)
+		{
+			unsigned char* tile = (unsigned char*)malloc(tilesize);
+
+			if (ozf_read_at(s, ozf_unwrap_offset(table[0], image->offset),
+							tile, tilesize, ozf_stats_local()) == 0)
+				*depth = ozf_get_encyption_depth(tile, tilesize, s->key);
+
+			free(tile);
+		}
+
+		OZF_LOG(s, LOGSTREAM_DEBUG, "scale %d encryption depth:\t%d\n", scale, *depth);
 	}
-}
 
+	return table;
+}
 
-// data shout be preallocated, 64 * 64 * sizeof(RGBA)
 /*--------------------------------------------------------------------------*/
-void ozf_get_tile(ozf_stream* stream, int scale, int x, int y, unsigned char* data)
+// Tile tables are read when a scale is first used, a map that is open but
+// only ever shown at one zoom level does not hold the others. Nothing is
+// locked: threads first using a scale at the same time each read it, one
+// table is published and the others are freed. NULL if the table cannot
+// be read.
+const unsigned int* ozf_tiles_table(ozf_stream* s, int scale)
 {
-	ozf_stream* s = stream;
+	ozf_image* image = &s->images[scale];
+	unsigned int* table = OZF_ATOMIC_LOAD(&image->tiles_table, OZF_ACQUIRE);
+	unsigned int* other = NULL;
+	int depth = -1;
 
-	long j;
-	
-	if (scale > s->scales - 1)
-		return;
-	
-	if (x > s->images[scale].header.xtiles - 1)
-		return;
+	if (table)
+		return table;
 
-	if (y > s->images[scale].header.ytiles - 1)
-		return;
-		
-	if (x < 0)
-		return;
+	table = ozf_load_tiles_table(s, scale, &depth);
 
-	if (y < 0)
-		return;
-		
-	
-	long i = y * s->images[scale].header.xtiles + x;
-		
-	unsigned long tilesize =	s->images[scale].tiles_table[i+1] - 
-								s->images[scale].tiles_table[i];
+	if (!table)
+		return NULL;
 
-	unsigned char* tile = (unsigned char*)alloca(tilesize);
-		
-	fseek(s->file, s->images[scale].tiles_table[i], SEEK_SET);
-	fread(tile, tilesize, 1, s->file);
+	// the same for every thread, visible before the table is
+	OZF_ATOMIC_STORE(&image->encryption_depth, depth, OZF_RELAXED);
+
+	if (!OZF_ATOMIC_CAS(&image->tiles_table, &other, table, OZF_ACQ_REL, OZF_ACQUIRE))
+	{
+		ozf_free(table);
+		table = other;
+	}
+
+	return table;
+}
+
+/*--------------------------------------------------------------------------*/
+static int ozf_tile_valid(ozf_stream* s, int scale, int x, int y)
+{
+	if (scale < 0 || scale >= (int)s->scales)
+		return 0;
 	
+	if (x < 0 || x > s->images[scale].header.xtiles - 1)
+		return 0;
+
+	if (y < 0 || y > s->images[scale].header.ytiles - 1)
+		return 0;
+
+	return ozf_tiles_table(s, scale) != NULL;
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_read_raw(ozf_stream* s, ozf_offset offset, void* data, unsigned long size)
+{
+	return ozf_read_at(s, offset, data, size, ozf_stats_local());
+}
+
+/*--------------------------------------------------------------------------*/
+// Decrypts and inflates one tile into 64x64 palette indices, rows stay
+// bottom-up as stored. The compressed data is left untouched.
+static int ozf_inflate_tile(ozf_stream* s, int scale, int x, int y,
+							const unsigned char* data, unsigned long size,
+							unsigned char* indices, ozf_stats* stats)
+{
+	unsigned long long t0 = ozf_stats_clock(), t1;
+	unsigned char* tile = (unsigned char*)data;
+	unsigned char scratch[8192];
+
 	if (s->type == OZF_STREAM_ENCRYPTED)
 	{
-		if (s->images[scale].encryption_depth == -1)
-			ozf_decode1(tile, tilesize, s->key);
+		tile = size <= sizeof(scratch) ? scratch : (unsigned char*)malloc(size);
+		memcpy(tile, data, size);
+
+		int depth = OZF_ATOMIC_LOAD(&s->images[scale].encryption_depth, OZF_RELAXED);
+
+		if (depth == -1 || (unsigned long)depth > size)
+			ozf_decode1(tile, size, s->key);
 		else
-			ozf_decode1(tile, s->images[scale].encryption_depth, s->key);
+			ozf_decode1(tile, depth, s->key);
+
+		t1 = ozf_stats_clock();
+		OZF_STATS_ADD(stats, ns_decrypt, t1 - t0);
+		OZF_TRACE_SPAN("decrypt", t0, t1, scale, x, y);
+		t0 = t1;
 	}
-	
-	if (!(tile[0] == 0x78 && tile[1] == 0xda))  // zlib signature
+
+	int err = -1;
+
+	if (size > 2 && tile[0] == 0x78 && tile[1] == 0xda)  // zlib signature
 	{
-		logstream_write("ozf: zlib signature verification failed\n");
-		return;
+		unsigned long decompressed_size = OZF_TILE_WIDTH * OZF_TILE_HEIGHT;
+
+		err = ozf_reader_inflate(s, indices, &decompressed_size, tile, size);
 	}
-		
-	unsigned long	decompressed_size = OZF_TILE_WIDTH * OZF_TILE_HEIGHT;
-	unsigned char*	decompressed = (unsigned char*)alloca(decompressed_size);
-		
-	long n = ozf_decompress_tile((Bytef*)decompressed, (uLongf*)&decompressed_size,
-			(const Bytef*)tile, (uLong)tilesize);
-								
-	unsigned char*	foo = data;
-	unsigned char*	palette = (unsigned char*)s->images[scale].header.palette;
+	else
+	{
+		OZF_LOG(s, LOGSTREAM_ERROR, "zlib signature verification failed\n");
+	}
+
+	if (tile != data && tile != scratch)
+		free(tile);
+
+	t1 = ozf_stats_clock();
+	OZF_STATS_ADD(stats, ns_inflate, t1 - t0);
+	OZF_TRACE_SPAN("inflate", t0, t1, scale, x, y);
+
+	if (err != 0)
+		return -1;
+
+	OZF_STATS_ADD(stats, tiles_decoded, 1);
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+// palette lookup and the vertical flip, the palette is kept as RGBA
+static void ozf_expand_tile(ozf_stream* s, int scale, int x, int y,
+							const unsigned char* indices, unsigned char* data,
+							ozf_stats* stats)
+{
+	unsigned long long t0 = ozf_stats_clock(), t1;
+	const unsigned char* palette = s->images[scale].header.palette;
+	long j;
 	
 	for(j = 0; j < OZF_TILE_WIDTH * OZF_TILE_HEIGHT; j++)
 	{
-		unsigned char c = decompressed[j];
+		unsigned char c = indices[j];
 		
 		// flipping image vertical
 		int tile_y = (OZF_TILE_WIDTH - 1) - (j / OZF_TILE_WIDTH);
 		int tile_x = j % OZF_TILE_WIDTH;
 		int tile_z = tile_y * OZF_TILE_WIDTH + tile_x;
 				
-		unsigned char r = palette[c*4 + 2];
-		unsigned char g = palette[c*4 + 1];
-		unsigned char b = palette[c*4 + 0];
-		unsigned char a = 255;
-		
-		// applying bgr -> rgba
-		data[tile_z * 4 + 0] = r; // r
-		data[tile_z * 4 + 1] = g; // g
-		data[tile_z * 4 + 2] = b; // b
-		data[tile_z * 4 + 3] = a; // a
+		memcpy(data + tile_z * 4, palette + c * 4, 4);
 	}
-}
 
-/*--------------------------------------------------------------------------*/
-int	ozf_num_scales(ozf_stream* stream)
-{
-	return stream->scales - 1;
+	t1 = ozf_stats_clock();
+	OZF_STATS_ADD(stats, ns_expand, t1 - t0);
+	OZF_TRACE_SPAN("expand", t0, t1, scale, x, y);
 }
 
 /*--------------------------------------------------------------------------*/
-int	ozf_num_tiles_per_x(ozf_stream* stream, int scale)
+typedef struct
 {
-	return stream->images[scale].header.xtiles;
-}
+	ozf_offset		offset;
+	ozf_offset		end;
+	long			index;
+} ozf_tile_ref;
 
 /*--------------------------------------------------------------------------*/
-int	ozf_num_tiles_per_y(ozf_stream* stream, int scale)
+static int ozf_tile_ref_compare(const void* a, const void* b)
 {
-	return stream->images[scale].header.ytiles;
-}
+	const ozf_tile_ref* ra = (const ozf_tile_ref*)a;
+	const ozf_tile_ref* rb = (const ozf_tile_ref*)b;
 
+	if (ra->offset != rb->offset)
+		return ra->offset < rb->offset ? -1 : 1;
+
+	return ra->index < rb->index ? -1 : (ra->index > rb->index);
+}
 
 /*--------------------------------------------------------------------------*/
-int	ozf_scale_dx(ozf_stream* stream, int scale)
+typedef struct
 {
-	return stream->images[scale].header.width;
-}
+	unsigned long long	hash;
+	unsigned long		data;	// into the scan buffer
+	unsigned long		size;
+	long				index;
+} ozf_tile_key;
 
 /*--------------------------------------------------------------------------*/
-int	ozf_scale_dy(ozf_stream* stream, int scale)
+static int ozf_tile_key_compare(const void* a, const void* b)
 {
-	return stream->images[scale].header.height;
+	const ozf_tile_key* ka = (const ozf_tile_key*)a;
+	const ozf_tile_key* kb = (const ozf_tile_key*)b;
+
+	if (ka->hash != kb->hash)
+		return ka->hash < kb->hash ? -1 : 1;
+
+	if (ka->size != kb->size)
+		return ka->size < kb->size ? -1 : 1;
+
+	return ka->index < kb->index ? -1 : (ka->index > kb->index);
 }
 
 /*--------------------------------------------------------------------------*/
-ozf_stream* ozf_open(char* path)
+// Blank margins and sea are stored as many copies of one small compressed
+// tile. Tiles up to OZF_SHARED_MAX_SIZE are read and hashed, equal ones
+// point to the first of them, and one of each is inflated to find those of
+// a single colour. Larger tiles keep their own index.
+static unsigned int* ozf_scan_tiles(ozf_stream* s, int scale, const unsigned int* table)
 {
-	ozf_stream* s = NULL;
-	
-	FILE* f = fopen(path, "rb");
-	
-	logstream_write("ozf: opening %s\n", path);
-	
-	if (f)
-	{
-		logstream_write("ozf: %s opened\n", path);
-	
-		s = (ozf_stream*)malloc(sizeof(ozf_stream));
-		memset(s, 0, sizeof(ozf_stream));
-		
-		s->file = f;
-		s->type = OZF_STREAM_DEFAULT;
-		fseek(f, 0, SEEK_END);
-		s->size = ftell(f);
-		
-		logstream_write("ozf: stream size: %d bytes\n", s->size);
-		
-		// need to find more convenient way		
-		if (strstr(path, ".ozfx3"))
-		{
-			logstream_write("ozf: %s is an encrypted stream\n", path);
-		
-			s->type = OZF_STREAM_ENCRYPTED;
-			s->key	= ozf_calculate_key(s->file);
-			
-			logstream_write("ozf: stream key = %08x\n", s->key);
+	ozf_image* image = &s->images[scale];
+	long count = (long)image->tiles - 1;
+	long k, m, j, n = 0, keys = 0;
 
-			ozf_init_encrypted_stream(s);			
-		}
-		else
-		if (strstr(path, ".ozf2"))
-		{
-			logstream_write("ozf: %s is raw stream\n", path);
-			ozf_init_raw_stream(s);			
-		}
-	}
-	else
+	OZF_TRACE_SCOPE("ozf_scan_tiles", scale);
+
+	unsigned int* info = (unsigned int*)ozf_malloc((count + 1) * sizeof(unsigned int));
+
+	for (k = 0; k < count; k++)
+		info[k] = (unsigned int)k;
+
+	ozf_tile_ref* refs = (ozf_tile_ref*)malloc((count + 1) * sizeof(ozf_tile_ref));
+
+	for (k = 0; k < count; k++)
 	{
-		logstream_write("ozf: %s open fails\n", path);
+		unsigned long size = (unsigned int)(table[k+1] - table[k]);
+
+		if (size <= 2 || size > OZF_SHARED_MAX_SIZE)
+			continue;
+
+		refs[n].index = k;
+		refs[n].offset = ozf_tile_offset(s, scale, table, k);
+		refs[n].end = refs[n].offset + size;
+		n++;
 	}
-	
-	return s;
-}
 
-/*--------------------------------------------------------------------------*/
-void	ozf_close(ozf_stream* stream)
-{
-	ozf_stream* s = stream;
+	qsort(refs, n, sizeof(ozf_tile_ref), ozf_tile_ref_compare);
 
-	if (s)
+	ozf_stats* stats = ozf_stats_local();
+
+	ozf_tile_key*	key = (ozf_tile_key*)malloc((n + 1) * sizeof(ozf_tile_key));
+	unsigned char*	data = (unsigned char*)malloc(n * OZF_SHARED_MAX_SIZE + 1);
+	unsigned long	used = 0;
+	unsigned char	buffer[OZF_SHARED_MAX_SIZE * 64];
+	unsigned char	indices[OZF_TILE_WIDTH * OZF_TILE_HEIGHT];
+
+	// neighbours are read together, through holes no larger than a tile
+	for (k = 0; k < n; k = m)
 	{
-		if (s->file)
+		ozf_offset start = refs[k].offset;
+		ozf_offset end = refs[k].end;
+
+		for (m = k + 1; m < n; m++)
 		{
-			fclose(s->file);
-		}
+			if (refs[m].offset > end + OZF_SHARED_MAX_SIZE ||
+				refs[m].end - start > sizeof(buffer))
+				break;
 
-		if (s->ozf2)
-			free(s->ozf2);
+			if (refs[m].end > end)
+				end = refs[m].end;
+		}
 
-		if (s->ozf3)
-			free(s->ozf3);
+		if (ozf_read_at(s, start, buffer, end - start, stats) != 0)
+			continue;
 
-		if (s->scales_table)
-			free(s->scales_table);
-			
-		if (s->images)
+		for (j = k; j < m; j++)
 		{
-			int i;
-			
-			for (i = 0; i < s->scales; i++)
+			unsigned long size = refs[j].end - refs[j].offset;
+			const unsigned char* p = buffer + (refs[j].offset - start);
+			unsigned long long h = 0xcbf29ce484222325ULL;	// FNV-1a
+			unsigned long i;
+
+			for (i = 0; i < size; i++)
+				h = (h ^ p[i]) * 0x100000001b3ULL;
+
+			memcpy(data + used, p, size);
+
+			key[keys].hash = h;
+			key[keys].data = used;
+			key[keys].size = size;
+			key[keys].index = refs[j].index;
+			keys++;
+
+			used += size;
+		}
+	}
+
+	qsort(key, keys, sizeof(ozf_tile_key), ozf_tile_key_compare);
+
+	// the first of equal tiles is the smallest index, compared byte by byte
+	for (k = 0; k < keys; k = m)
+	{
+		ozf_tile_key* first = &key[k];
+		int colour = -1;
+
+		for (m = k + 1; m < keys; m++)
+		{
+			if (key[m].hash != first->hash || key[m].size != first->size)
+				break;
+		}
+
+		int x = first->index % image->header.xtiles;
+		int y = first->index / image->header.xtiles;
+
+		if (ozf_inflate_tile(s, scale, x, y, data + first->data, first->size,
+							 indices, stats) == 0)
+		{
+			for (j = 1; j < OZF_TILE_WIDTH * OZF_TILE_HEIGHT; j++)
+				if (indices[j] != indices[0])
+					break;
+
+			if (j == OZF_TILE_WIDTH * OZF_TILE_HEIGHT)
+				colour = indices[0];
+		}
+
+		for (j = k; j < m; j++)
+		{
+			if (j > k && memcmp(data + key[j].data, data + first->data, first->size) != 0)
+				continue;
+
+			info[key[j].index] = colour >= 0 ?
+				OZF_TILE_UNIFORM | colour : (unsigned int)first->index;
+		}
+	}
+
+	free(data);
+	free(key);
+	free(refs);
+
+	return info;
+}
+
+/*--------------------------------------------------------------------------*/
+// Made when first asked for like the tile table, and saved in the sidecar.
+// The scan reads every small tile of the scale, so it runs unlocked into a
+// private array and a thread losing the race to publish drops its own.
+// NULL if the tile table cannot be read.
+const unsigned int* ozf_tiles_info(ozf_stream* s, int scale)
+{
+	ozf_image* image = &s->images[scale];
+	unsigned int* info = OZF_ATOMIC_LOAD(&image->tiles_info, OZF_ACQUIRE);
+	unsigned int* other = NULL;
+
+	if (info)
+		return info;
+
+	const unsigned int* table = ozf_tiles_table(s, scale);
+
+	if (!table)
+		return NULL;
+
+	info = ozf_scan_tiles(s, scale, table);
+
+	if (!OZF_ATOMIC_CAS(&image->tiles_info, &other, info, OZF_ACQ_REL, OZF_ACQUIRE))
+	{
+		ozf_free(info);
+		info = other;
+	}
+
+	return info;
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_tile_uniform(ozf_stream* s, int scale, int x, int y)
+{
+	if (!ozf_tile_valid(s, scale, x, y))
+		return -1;
+
+	const unsigned int* info = ozf_tiles_info(s, scale);
+	unsigned int i = info[y * s->images[scale].header.xtiles + x];
+
+	return i & OZF_TILE_UNIFORM ? (int)(i & 0xff) : -1;
+}
+
+/*--------------------------------------------------------------------------*/
+long ozf_tile_shared(ozf_stream* s, int scale, int x, int y)
+{
+	if (!ozf_tile_valid(s, scale, x, y))
+		return -1;
+
+	const unsigned int* info = ozf_tiles_info(s, scale);
+	long index = (long)y * s->images[scale].header.xtiles + x;
+
+	return info[index] & OZF_TILE_UNIFORM ? index : (long)info[index];
+}
+
+// data shout be preallocated, 64 * 64 * sizeof(RGBA)
+/*--------------------------------------------------------------------------*/
+void ozf_get_tile(ozf_stream* stream, int scale, int x, int y, unsigned char* data)
+{
+	ozf_stream* s = stream;
+
+	OZF_TRACE_SCOPE("ozf_get_tile", scale, x, y);
+
+	if (!ozf_tile_valid(s, scale, x, y))
+		return;
+	
+	unsigned char indices[OZF_TILE_WIDTH * OZF_TILE_HEIGHT];
+
+	if (ozf_get_tile_indices(s, scale, x, y, indices) != 0)
+		return;
+
+	ozf_expand_tile(s, scale, x, y, indices, data, ozf_stats_local());
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_tile_location(ozf_stream* s, int scale, int x, int y,
+					  ozf_offset* offset, unsigned long* size)
+{
+	if (!ozf_tile_valid(s, scale, x, y))
+		return -1;
+
+	const unsigned int* table = ozf_tiles_table(s, scale);
+	long i = y * s->images[scale].header.xtiles + x;
+
+	*offset = ozf_tile_offset(s, scale, table, i);
+	*size = (unsigned int)(table[i+1] - table[i]);
+
+	if (*size == 0 || *size > OZF_COALESCE_MAX)
+		return -1;
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+// inflated palette indices of a tile, rows bottom-up as stored in the file
+int ozf_get_tile_indices(ozf_stream* s, int scale, int x, int y, unsigned char* indices)
+{
+	ozf_offset offset;
+	unsigned long size;
+	ozf_stats* stats = ozf_stats_local();
+	int colour = ozf_tile_uniform(s, scale, x, y);
+
+	if (colour >= 0)
+	{
+		memset(indices, colour, OZF_TILE_WIDTH * OZF_TILE_HEIGHT);
+		OZF_STATS_ADD(stats, tiles_skipped, 1);
+
+		return 0;
+	}
+
+	if (ozf_tile_location(s, scale, x, y, &offset, &size) != 0)
+		return -1;
+
+	// tiles compress to a few kilobytes, worker thread stacks are small
+	unsigned char scratch[8192];
+	unsigned char* tile = size <= sizeof(scratch) ? scratch : (unsigned char*)malloc(size);
+	int err = -1;
+
+	if (ozf_read_at(s, offset, tile, size, stats) == 0)
+		err = ozf_inflate_tile(s, scale, x, y, tile, size, indices, stats);
+
+	if (tile != scratch)
+		free(tile);
+
+	return err;
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_decode_tile(ozf_stream* s, int scale, int x, int y,
+					const unsigned char* compressed, unsigned long size,
+					unsigned char* data)
+{
+	unsigned char indices[OZF_TILE_WIDTH * OZF_TILE_HEIGHT];
+	ozf_stats* stats = ozf_stats_local();
+
+	if (!ozf_tile_valid(s, scale, x, y))
+		return -1;
+
+	if (ozf_inflate_tile(s, scale, x, y, compressed, size, indices, stats) != 0)
+		return -1;
+
+	ozf_expand_tile(s, scale, x, y, indices, data, stats);
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+// receives inflated palette indices, rows stored bottom-up as in the file
+typedef void (*ozf_index_callback)(void* user, int scale, int x, int y,
+								   const unsigned char* indices);
+
+/*--------------------------------------------------------------------------*/
+// Tiles of the rectangle are visited in file order. Neighbouring tiles are
+// fetched with one read as long as the hole between them stays below
+// OZF_COALESCE_GAP and the read below OZF_COALESCE_MAX. Single-colour tiles
+// are not read at all, and copies of a tile are read and inflated once.
+static int ozf_inflate_tiles(ozf_stream* s, int scale, int x, int y, int nx, int ny,
+							 ozf_index_callback callback, void* user)
+{
+	if (scale < 0 || scale >= (int)s->scales)
+		return -1;
+
+	ozf_image* image = &s->images[scale];
+
+	int x0 = x < 0 ? 0 : x;
+	int y0 = y < 0 ? 0 : y;
+	int x1 = x + nx > image->header.xtiles ? image->header.xtiles : x + nx;
+	int y1 = y + ny > image->header.ytiles ? image->header.ytiles : y + ny;
+
+	if (x1 <= x0 || y1 <= y0)
+		return 0;
+
+	const unsigned int* table = ozf_tiles_table(s, scale);
+	const unsigned int* info = ozf_tiles_info(s, scale);
+
+	if (!table || !info)
+		return -1;
+
+	long count = 0;
+	long k, m, j;
+	int tx, ty;
+
+	ozf_stats* stats = ozf_stats_local();
+
+	unsigned char*	buffer = NULL;
+	unsigned long	capacity = 0;
+	unsigned char	indices[OZF_TILE_WIDTH * OZF_TILE_HEIGHT];
+	int				delivered = 0;
+
+	ozf_tile_ref* refs = (ozf_tile_ref*)malloc((long)(x1 - x0) * (y1 - y0) * sizeof(ozf_tile_ref));
+
+	for (ty = y0; ty < y1; ty++)
+	{
+		for (tx = x0; tx < x1; tx++)
+		{
+			long index = (long)ty * image->header.xtiles + tx;
+
+			if (info[index] & OZF_TILE_UNIFORM)
 			{
-				free(s->images[i].tiles_table);
+				memset(indices, info[index] & 0xff, sizeof(indices));
+				OZF_STATS_ADD(stats, tiles_skipped, 1);
+
+				callback(user, scale, tx, ty, indices);
+				delivered++;
+				continue;
 			}
-			
-			free(s->images);
+
+			// copies are read at the place of the first one, next to it
+			refs[count].index = index;
+			refs[count].offset = ozf_tile_offset(s, scale, table, info[index]);
+			refs[count].end = ozf_tile_offset(s, scale, table, info[index] + 1);
+			count++;
+		}
+	}
+
+	qsort(refs, count, sizeof(ozf_tile_ref), ozf_tile_ref_compare);
+
+	long inflated = -1;		// first tile of what indices holds
+
+	for (k = 0; k < count; k = m)
+	{
+		ozf_offset start = refs[k].offset;
+		ozf_offset end = refs[k].end;
+
+		for (m = k + 1; m < count; m++)
+		{
+			ozf_offset next = refs[m].offset;
+			ozf_offset next_end = refs[m].end;
+
+			if (next > end + OZF_COALESCE_GAP)
+				break;
+
+			if ((next_end > end ? next_end : end) - start > OZF_COALESCE_MAX)
+				break;
+
+			if (next_end > end)
+				end = next_end;
+		}
+
+		if (end <= start || end - start > OZF_COALESCE_MAX)
+			continue;
+
+		if (end - start > capacity)
+		{
+			capacity = end - start;
+			buffer = (unsigned char*)realloc(buffer, capacity);
+		}
+
+		if (ozf_read_at(s, start, buffer, end - start, stats) != 0)
+			continue;
+
+		for (j = k; j < m; j++)
+		{
+			long index = refs[j].index;
+
+			if (refs[j].end <= refs[j].offset || refs[j].end > end)
+				continue;
+
+			unsigned long tilesize = refs[j].end - refs[j].offset;
+
+			tx = index % image->header.xtiles;
+			ty = index / image->header.xtiles;
+
+			if (inflated == (long)info[index])
+			{
+				OZF_STATS_ADD(stats, tiles_skipped, 1);
+			}
+			else
+			{
+				inflated = -1;
+
+				if (ozf_inflate_tile(s, scale, tx, ty, buffer + (refs[j].offset - start),
+									 tilesize, indices, stats) != 0)
+					continue;
+
+				inflated = info[index];
+			}
+
+			callback(user, scale, tx, ty, indices);
+			delivered++;
+		}
+	}
+
+	free(buffer);
+	free(refs);
+
+	return delivered;
+}
+
+/*--------------------------------------------------------------------------*/
+typedef struct
+{
+	ozf_stream*			s;
+	ozf_stats*			stats;
+	ozf_tile_callback	callback;
+	void*				user;
+	unsigned char		rgba[OZF_TILE_WIDTH * OZF_TILE_HEIGHT * 4];
+} ozf_expand_context;
+
+/*--------------------------------------------------------------------------*/
+static void ozf_expand_callback(void* user, int scale, int x, int y,
+								const unsigned char* indices)
+{
+	ozf_expand_context* c = (ozf_expand_context*)user;
+
+	ozf_expand_tile(c->s, scale, x, y, indices, c->rgba, c->stats);
+
+	c->callback(c->user, scale, x, y, c->rgba);
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_get_tiles(ozf_stream* s, int scale, int x, int y, int nx, int ny,
+				  ozf_tile_callback callback, void* user)
+{
+	OZF_TRACE_SCOPE("ozf_get_tiles", scale, x, y);
+
+	ozf_expand_context* c = (ozf_expand_context*)malloc(sizeof(ozf_expand_context));
+
+	c->s = s;
+	c->stats = ozf_stats_local();
+	c->callback = callback;
+	c->user = user;
+
+	int n = ozf_inflate_tiles(s, scale, x, y, nx, ny, ozf_expand_callback, c);
+
+	free(c);
+
+	return n;
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_format_bpp(int format)
+{
+	switch (format)
+	{
+		case OZF_FORMAT_RGBA:	return 4;
+		case OZF_FORMAT_RGB:	return 3;
+		case OZF_FORMAT_INDEX:	return 1;
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+// palette of a scale as 256 RGBA entries
+int ozf_get_palette(ozf_stream* s, int scale, unsigned char* rgba)
+{
+	if (scale < 0 || scale >= (int)s->scales)
+		return -1;
+
+	memcpy(rgba, s->images[scale].header.palette, 256 * 4);
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+typedef struct
+{
+	ozf_stream*		s;
+	ozf_stats*		stats;
+	int				format;
+	int				bpp;
+	unsigned char*	buffer;
+	long			stride;
+	int				x, y;				// buffer origin in image pixels
+	int				x0, y0, x1, y1;		// window clipped to the image
+	int				tiles;
+	unsigned char	lut[256 * 4];
+} ozf_region;
+
+/*--------------------------------------------------------------------------*/
+// writes the visible part of a tile straight into the caller's buffer,
+// the vertical flip is folded into the source row index
+static void ozf_region_callback(void* user, int scale, int tx, int ty,
+								const unsigned char* indices)
+{
+	ozf_region* r = (ozf_region*)user;
+	unsigned long long t0 = ozf_stats_clock(), t1;
+
+	int ox = tx * OZF_TILE_WIDTH;
+	int oy = ty * OZF_TILE_HEIGHT;
+
+	int c0 = (r->x0 > ox ? r->x0 : ox) - ox;
+	int c1 = (r->x1 < ox + OZF_TILE_WIDTH ? r->x1 : ox + OZF_TILE_WIDTH) - ox;
+	int r0 = (r->y0 > oy ? r->y0 : oy) - oy;
+	int r1 = (r->y1 < oy + OZF_TILE_HEIGHT ? r->y1 : oy + OZF_TILE_HEIGHT) - oy;
+	int row, i, n = c1 - c0;
+
+	for (row = r0; row < r1; row++)
+	{
+		const unsigned char* src = indices + (OZF_TILE_HEIGHT - 1 - row) * OZF_TILE_WIDTH + c0;
+		unsigned char* dst = r->buffer + (long)(oy + row - r->y) * r->stride
+										+ (long)(ox + c0 - r->x) * r->bpp;
+
+		switch (r->format)
+		{
+			case OZF_FORMAT_INDEX:
+				memcpy(dst, src, n);
+				break;
+
+			case OZF_FORMAT_RGB:
+				for (i = 0; i < n; i++, dst += 3)
+				{
+					const unsigned char* p = r->lut + src[i] * 4;
+
+					dst[0] = p[0];
+					dst[1] = p[1];
+					dst[2] = p[2];
+				}
+				break;
+
+			default:
+				for (i = 0; i < n; i++, dst += 4)
+					memcpy(dst, r->lut + src[i] * 4, 4);
+				break;
+		}
+	}
+
+	r->tiles++;
+
+	t1 = ozf_stats_clock();
+	OZF_STATS_ADD(r->stats, ns_expand, t1 - t0);
+	OZF_TRACE_SPAN("expand", t0, t1, scale, tx, ty);
+}
+
+/*--------------------------------------------------------------------------*/
+// Reads the w x h window at (x, y) of a scale into buffer, stride bytes
+// apart (0 for packed rows). Pixels outside the image are zeroed. Returns
+// 0, or -1 on bad arguments or when some tile could not be decoded.
+int ozf_read_region(ozf_stream* s, int scale, int x, int y, int w, int h,
+					int format, unsigned char* buffer, long stride)
+{
+	OZF_TRACE_SCOPE("ozf_read_region", scale, x, y);
+
+	int bpp = ozf_format_bpp(format);
+
+	if (scale < 0 || scale >= (int)s->scales || w <= 0 || h <= 0 || !bpp)
+		return -1;
+
+	if (stride == 0)
+		stride = (long)w * bpp;
+
+	ozf_image* image = &s->images[scale];
+	ozf_region* r = (ozf_region*)malloc(sizeof(ozf_region));
+
+	r->s = s;
+	r->stats = ozf_stats_local();
+	r->format = format;
+	r->bpp = bpp;
+	r->buffer = buffer;
+	r->stride = stride;
+	r->x = x;
+	r->y = y;
+	r->x0 = x < 0 ? 0 : x;
+	r->y0 = y < 0 ? 0 : y;
+	r->x1 = x + w > image->header.width ? image->header.width : x + w;
+	r->y1 = y + h > image->header.height ? image->header.height : y + h;
+	r->tiles = 0;
+
+	ozf_get_palette(s, scale, r->lut);
+
+	// clear whatever the image does not cover
+	int row, expected = 0;
+
+	for (row = 0; row < h; row++)
+	{
+		unsigned char* dst = buffer + (long)row * stride;
+
+		if (y + row < r->y0 || y + row >= r->y1 || r->x1 <= r->x0)
+		{
+			memset(dst, 0, (long)w * bpp);
+			continue;
 		}
+
+		if (r->x0 > x)
+			memset(dst, 0, (long)(r->x0 - x) * bpp);
+
+		if (r->x1 < x + w)
+			memset(dst + (long)(r->x1 - x) * bpp, 0, (long)(x + w - r->x1) * bpp);
+	}
+
+	if (r->x1 > r->x0 && r->y1 > r->y0)
+	{
+		int tx0 = r->x0 / OZF_TILE_WIDTH, tx1 = (r->x1 - 1) / OZF_TILE_WIDTH + 1;
+		int ty0 = r->y0 / OZF_TILE_HEIGHT, ty1 = (r->y1 - 1) / OZF_TILE_HEIGHT + 1;
+
+		expected = (tx1 - tx0) * (ty1 - ty0);
+
+		ozf_inflate_tiles(s, scale, tx0, ty0, tx1 - tx0, ty1 - ty0,
+						  ozf_region_callback, r);
+	}
+
+	int rc = r->tiles == expected ? 0 : -1;
+
+	free(r);
+
+	return rc;
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_foreach_tile(ozf_stream* s, int scale, ozf_tile_callback callback, void* user)
+{
+	if (scale < 0 || scale >= (int)s->scales)
+		return -1;
+
+	return ozf_get_tiles(s, scale, 0, 0, s->images[scale].header.xtiles,
+						 s->images[scale].header.ytiles, callback, user);
+}
+
+/*--------------------------------------------------------------------------*/
+int	ozf_num_scales(ozf_stream* stream)
+{
+	return stream->scales - 1;
+}
+
+/*--------------------------------------------------------------------------*/
+int	ozf_num_tiles_per_x(ozf_stream* stream, int scale)
+{
+	return stream->images[scale].header.xtiles;
+}
+
+/*--------------------------------------------------------------------------*/
+int	ozf_num_tiles_per_y(ozf_stream* stream, int scale)
+{
+	return stream->images[scale].header.ytiles;
+}
+
+
+/*--------------------------------------------------------------------------*/
+int	ozf_scale_dx(ozf_stream* stream, int scale)
+{
+	return stream->images[scale].header.width;
+}
+
+/*--------------------------------------------------------------------------*/
+int	ozf_scale_dy(ozf_stream* stream, int scale)
+{
+	return stream->images[scale].header.height;
+}
+
+/*--------------------------------------------------------------------------*/
+// Headers, palettes and tile tables are parsed once per file and shared by
+// every stream opened on it. The index is never modified after it is
+// published, readers only add their own file handle and inflate context.
+struct ozf_index
+{
+	ozf_stream			meta;		// file is NULL, path and tables owned here
+	long				mtime;
+	int					refs;
+	struct ozf_index*	next;
+};
+
+static ozf_index*		index_list = NULL;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	index_lock = PTHREAD_MUTEX_INITIALIZER;
+#define OZF_INDEX_LOCK()	pthread_mutex_lock(&index_lock)
+#define OZF_INDEX_UNLOCK()	pthread_mutex_unlock(&index_lock)
+#else
+#define OZF_INDEX_LOCK()
+#define OZF_INDEX_UNLOCK()
+#endif
+
+/*--------------------------------------------------------------------------*/
+// parses through handle, which is left to the first reader
+static ozf_index* ozf_index_create(char* path, const ozf_io* io, void* handle,
+								   ozf_offset size, long mtime)
+{
+	ozf_index* index = (ozf_index*)ozf_malloc(sizeof(ozf_index));
+	ozf_stream* s = &index->meta;
+
+	OZF_TRACE_SCOPE("ozf_index_create");
+
+	memset(index, 0, sizeof(ozf_index));
+
+	index->mtime = mtime;
+	index->refs = 1;
+
+	s->path = (char*)ozf_malloc(strlen(path) + 1);
+	strcpy(s->path, path);
+
+	s->name = strrchr(s->path, '/');
+	s->name = s->name ? s->name + 1 : s->path;
+
+	s->io = io;
+	s->handle = handle;
+	s->type = OZF_STREAM_DEFAULT;
+	s->size = size;
+	
+	OZF_LOG(s, LOGSTREAM_DEBUG, "stream size: %llu bytes\n", s->size);
+	
+	// need to find more convenient way		
+	if (strstr(path, ".ozfx3"))
+	{
+		OZF_LOG(s, LOGSTREAM_DEBUG, "%s is an encrypted stream\n", path);
+	
+		s->type = OZF_STREAM_ENCRYPTED;
+
+		if (ozf_sidecar_load(s) != 0)
+		{
+			s->key	= ozf_calculate_key(s);
+		
+			OZF_LOG(s, LOGSTREAM_DEBUG, "stream key = %08x\n", s->key);
+
+			ozf_init_encrypted_stream(s);
+		}
+	}
+	else
+	if (strstr(path, ".ozf2"))
+	{
+		OZF_LOG(s, LOGSTREAM_DEBUG, "%s is raw stream\n", path);
+
+		if (ozf_sidecar_load(s) != 0)
+		{
+			ozf_init_raw_stream(s);
+		}
+	}
+
+	s->handle = NULL;
+
+	return index;
+}
+
+/*--------------------------------------------------------------------------*/
+static void ozf_index_free(ozf_index* index)
+{
+	ozf_stream* s = &index->meta;
+
+	if (s->path)
+		ozf_free(s->path);
+
+	if (s->ozf2)
+		ozf_free(s->ozf2);
+
+	if (s->ozf3)
+		ozf_free(s->ozf3);
+
+	// tables loaded from a sidecar point into its mapping
+	if (s->scales_table && !s->sidecar)
+		ozf_free(s->scales_table);
+		
+	if (s->images)
+	{
+		int i;
+		
+		for (i = 0; i < (int)s->scales; i++)
+		{
+			if (!ozf_sidecar_owns(s, s->images[i].tiles_table))
+				ozf_free(s->images[i].tiles_table);
+
+			if (!ozf_sidecar_owns(s, s->images[i].tiles_info))
+				ozf_free(s->images[i].tiles_info);
+		}
+		
+		ozf_free(s->images);
+	}
+
+	ozf_sidecar_release(s);
+
+	// left over from scanning the tiles
+	ozf_inflater_destroy((ozf_inflater*)s->inflate);
+	
+	ozf_free(index);
+}
+
+/*--------------------------------------------------------------------------*/
+// An index still in use is shared if the file did not change since it was
+// parsed; a rewritten file gets a new one while the old readers finish.
+static ozf_index* ozf_index_lookup(const char* path, const ozf_io* io,
+								   ozf_offset size, long mtime)
+{
+	ozf_index* index;
+
+	for (index = index_list; index; index = index->next)
+	{
+		if (index->meta.size == size && index->mtime == mtime &&
+			index->meta.io == io &&
+			strcmp(index->meta.path, path) == 0)
+		{
+			index->refs++;
+			return index;
+		}
+	}
+
+	return NULL;
+}
+
+/*--------------------------------------------------------------------------*/
+static ozf_stream* ozf_reader_create(ozf_index* index, void* handle)
+{
+	ozf_stream* s = (ozf_stream*)ozf_malloc(sizeof(ozf_stream));
+
+	// metadata members alias the index and must not be freed by the reader
+	memcpy(s, &index->meta, sizeof(ozf_stream));
+
+	s->handle = handle;
+	s->index = index;
+	s->inflate = NULL;
+	s->inflate_busy = 0;
+
+	return s;
+}
+
+/*--------------------------------------------------------------------------*/
+ozf_stream* ozf_open(char* path)
+{
+	return ozf_open_io(path, NULL);
+}
+
+/*--------------------------------------------------------------------------*/
+ozf_stream* ozf_open_io(char* path, const ozf_io* io)
+{
+	ozf_index* index;
+	ozf_index* other;
+
+	ozf_offset size = 0;
+	long mtime = 0;
+
+	OZF_TRACE_SCOPE("ozf_open");
+
+	if (!io)
+		io = ozf_io_default();
+	
+	LOGSTREAM(LOGSTREAM_DEBUG, "ozf", "opening %s (%s)\n", path, io->name);
+
+	void* handle = io->open(path, &size, &mtime);
+	
+	if (!handle)
+	{
+		LOGSTREAM(LOGSTREAM_WARNING, "ozf", "%s open fails\n", path);
+		return NULL;
+	}
+
+	OZF_INDEX_LOCK();
+	index = ozf_index_lookup(path, io, size, mtime);
+	OZF_INDEX_UNLOCK();
+
+	if (index)
+	{
+		LOGSTREAM(LOGSTREAM_DEBUG, "ozf", "%s shares an open index\n", path);
+
+		return ozf_reader_create(index, handle);
+	}
+
+	// parsed outside the lock, opening other files does not wait for it
+	index = ozf_index_create(path, io, handle, size, mtime);
+
+	LOGSTREAM(LOGSTREAM_DEBUG, "ozf", "%s opened\n", path);
+
+	if (!index->meta.ozf2 && !index->meta.ozf3)
+		return ozf_reader_create(index, handle);
+
+	OZF_INDEX_LOCK();
+
+	other = ozf_index_lookup(path, io, size, mtime);
+
+	if (!other)
+	{
+		index->next = index_list;
+		index_list = index;
+	}
+
+	OZF_INDEX_UNLOCK();
+
+	// another thread parsed the same file meanwhile
+	if (other)
+	{
+		ozf_index_free(index);
+		index = other;
+	}
+
+	return ozf_reader_create(index, handle);
+}
+
+/*--------------------------------------------------------------------------*/
+ozf_index* ozf_index_open(char* path)
+{
+	ozf_stream* s = ozf_open(path);
+
+	if (!s)
+		return NULL;
+
+	ozf_index* index = ozf_index_ref(s->index);
+
+	ozf_close(s);
+
+	return index;
+}
+
+/*--------------------------------------------------------------------------*/
+ozf_index* ozf_index_ref(ozf_index* index)
+{
+	OZF_INDEX_LOCK();
+	index->refs++;
+	OZF_INDEX_UNLOCK();
+
+	return index;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_index_release(ozf_index* index)
+{
+	ozf_index** p;
+
+	if (!index)
+		return;
+
+	OZF_INDEX_LOCK();
+
+	if (--index->refs > 0)
+	{
+		OZF_INDEX_UNLOCK();
+		return;
+	}
+
+	for (p = &index_list; *p; p = &(*p)->next)
+	{
+		if (*p == index)
+		{
+			*p = index->next;
+			break;
+		}
+	}
+
+	OZF_INDEX_UNLOCK();
+
+	// saved now rather than when parsed, with the scales actually used
+	ozf_sidecar_save(&index->meta, index->mtime);
+
+	ozf_index_free(index);
+}
+
+/*--------------------------------------------------------------------------*/
+ozf_index* ozf_stream_index(ozf_stream* s)
+{
+	return s->index;
+}
+
+/*--------------------------------------------------------------------------*/
+ozf_stream* ozf_reader_open(ozf_index* index)
+{
+	ozf_offset size;
+	long mtime;
+
+	void* handle = index->meta.io->open(index->meta.path, &size, &mtime);
+
+	if (!handle)
+	{
+		LOGSTREAM(LOGSTREAM_WARNING, "ozf", "%s open fails\n", index->meta.path);
+		return NULL;
+	}
+
+	return ozf_reader_create(ozf_index_ref(index), handle);
+}
+
+/*--------------------------------------------------------------------------*/
+void	ozf_close(ozf_stream* stream)
+{
+	ozf_stream* s = stream;
+
+	if (s)
+	{
+		if (s->handle)
+			s->io->close(s->handle);
+
+		ozf_inflater_destroy((ozf_inflater*)s->inflate);
+
+		ozf_index_release(s->index);
 		
-		free(s);
+		ozf_free(s);
 	}
 }
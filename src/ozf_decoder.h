@@ -32,51 +32,67 @@
 #endif
 #include <stdio.h>
 
+#include "ozf_io.h"
+
 #define	OZF_STREAM_DEFAULT		0
 #define OZF_STREAM_ENCRYPTED	1
 
+#define	OZF_TILE_WIDTH			64
+#define	OZF_TILE_HEIGHT			64
+
+// pixel formats of ozf_read_region
+#define OZF_FORMAT_RGBA			0
+#define OZF_FORMAT_RGB			1
+#define OZF_FORMAT_INDEX		2	// palette indices, see ozf_get_palette
+
+// ozf_tiles_info() entries are y * xtiles + x of the first tile with the
+// same compressed data, or OZF_TILE_UNIFORM | palette index for a tile of
+// a single colour
+#define OZF_TILE_UNIFORM		0x80000000
+
 /*--------------------------------------------------------------------------*/
+// integers are stored as in the file, 32 bit whatever the size of long
 typedef struct
 {
-	long width;
-	long height;
+	int width;
+	int height;
 	short xtiles;
 	short ytiles;
 
-	long palette[256];
+	unsigned char palette[256 * 4];	// RGBA, the file has BGRx
  } ozf_image_header;
 
 /*--------------------------------------------------------------------------*/
 typedef struct
 {
 	short magic;
-	long dummy1;
-	long dummy2;
-	long dummy3;
-	long dummy4;
+	int dummy1;
+	int dummy2;
+	int dummy3;
+	int dummy4;
 
-	long width;
-	long height;
+	int width;
+	int height;
 
 	short depth;
 	short bpp;
 
-	long dummy5;
+	int dummy5;
 
-	long memsiz;
+	int memsiz;
 
-	long dummy6;
-	long dummy7;
-	long dummy8;
-	long version;
+	int dummy6;
+	int dummy7;
+	int dummy8;
+	int version;
  } ozf2_header;
 
 /*--------------------------------------------------------------------------*/
 typedef struct
 {
-	long size;
-	long width;
-	long height;
+	int size;
+	int width;
+	int height;
 	short depth;
 	short bpp;
 } ozf3_header;
@@ -86,30 +102,53 @@ typedef struct
 {
 	ozf_image_header	header;
 	
-	unsigned long		tiles;
-	unsigned long*		tiles_table;
+	ozf_offset			offset;			// of the header, see ozf_unwrap_offset()
+	unsigned int		tiles;
+	unsigned int*		tiles_table;	// NULL until read by ozf_tiles_table()
+	unsigned int*		tiles_info;		// NULL until made by ozf_tiles_info()
 	
-	long				encryption_depth;
+	int					encryption_depth;
 	
 } ozf_image;
 
 /*--------------------------------------------------------------------------*/
+// parsed metadata of one file, shared by all streams open on it
+typedef struct ozf_index ozf_index;
+
+/*--------------------------------------------------------------------------*/
+// A stream is a reader on a shared index: the metadata members below alias
+// the index and are read only, the file and inflate context are its own.
 typedef struct 
 {
-	FILE*				file;
+	const ozf_io*		io;
+	void*				handle;
+	char*				path;
+	const char*			name;	// log context
 	int					type;
 	unsigned long		key;
-	unsigned long		size;
+	ozf_offset			size;
 
 	unsigned long		scales;
-	unsigned long*		scales_table;
+	unsigned int*		scales_table;
 	ozf_image*			images;
 	
 	ozf2_header*		ozf2;
 	ozf3_header*		ozf3;
+
+	void*				sidecar;	// mapped .ozfidx the tables point into
+	unsigned long		sidecar_size;
+
+	ozf_index*			index;
+	void*				inflate;	// ozf_inflater reused between tiles
+	int					inflate_busy;
 	
 } ozf_stream;
 
+/*--------------------------------------------------------------------------*/
+// receives a decoded 64x64 RGBA tile, data is only valid during the call
+typedef void (*ozf_tile_callback)(void* user, int scale, int x, int y,
+								  unsigned char* data);
+
 /*--------------------------------------------------------------------------*/
 
 #ifdef __cplusplus
@@ -117,7 +156,37 @@ extern "C" {
 #endif
 
 ozf_stream*		ozf_open(char* path);
+ozf_stream*		ozf_open_io(char* path, const ozf_io* io);	// NULL io: default
 void		ozf_get_tile(ozf_stream* s, int scale, int x, int y, unsigned char* data);
+int			ozf_get_tiles(ozf_stream* s, int scale, int x, int y, int nx, int ny,
+						  ozf_tile_callback callback, void* user);
+int			ozf_foreach_tile(ozf_stream* s, int scale,
+							 ozf_tile_callback callback, void* user);
+int			ozf_read_region(ozf_stream* s, int scale, int x, int y, int w, int h,
+							int format, unsigned char* buffer, long stride);
+int			ozf_get_tile_indices(ozf_stream* s, int scale, int x, int y,
+								 unsigned char* indices);
+int			ozf_format_bpp(int format);
+int			ozf_get_palette(ozf_stream* s, int scale, unsigned char* rgba);
+
+// known from the index without decoding: the palette index of a single-
+// colour tile, else -1; y * xtiles + x of the first tile with the same
+// compressed data, the tile's own if there is none or it is single-colour
+int			ozf_tile_uniform(ozf_stream* s, int scale, int x, int y);
+long		ozf_tile_shared(ozf_stream* s, int scale, int x, int y);
+
+// building blocks for callers doing their own I/O
+int			ozf_tile_location(ozf_stream* s, int scale, int x, int y,
+							  ozf_offset* offset, unsigned long* size);
+int			ozf_decode_tile(ozf_stream* s, int scale, int x, int y,
+							const unsigned char* compressed, unsigned long size,
+							unsigned char* data);
+const unsigned int*	ozf_tiles_table(ozf_stream* s, int scale);
+const unsigned int*	ozf_tiles_info(ozf_stream* s, int scale);
+int			ozf_read_raw(ozf_stream* s, ozf_offset offset, void* data,
+						 unsigned long size);
+int			ozf_fd_acquire(ozf_stream* s);
+void		ozf_fd_release(ozf_stream* s, int fd);
 int			ozf_num_scales(ozf_stream* s);
 int			ozf_num_tiles_per_x(ozf_stream*, int scale);
 int			ozf_num_tiles_per_y(ozf_stream*, int scale);
@@ -125,6 +194,14 @@ int			ozf_scale_dx(ozf_stream*, int scale);
 int			ozf_scale_dy(ozf_stream*, int scale);
 void		ozf_close(ozf_stream*);
 
+// ozf_open() shares the index of a file that is already open; these give
+// explicit control, e.g. one reader per thread on an index kept around
+ozf_index*	ozf_index_open(char* path);
+ozf_index*	ozf_index_ref(ozf_index* index);
+void		ozf_index_release(ozf_index* index);
+ozf_index*	ozf_stream_index(ozf_stream* s);
+ozf_stream*	ozf_reader_open(ozf_index* index);
+
 #ifdef __cplusplus
 };
 #endif
@@ -4,20 +4,48 @@
  *  Created on: Dec 12, 2010
  *      Author: geom
  */
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <gdal.h>
 #include <gdal_priv.h>
+#include <cpl_vsi.h>
+#include <cpl_multiproc.h>
 #include "ozf_decoder.h"
+#include "ozf_stats.h"
+#include "log_stream.h"
+#include "ozf_trace.h"
+#include "ozf_sidecar.h"
+#include "ozf_files.h"
+#include "ozf_inflate.h"
 
 class OZFRasterBand;
+class OZFMaskBand;
 
 class CPL_DLL OZFDataset: public GDALDataset {
 	friend class OZFRasterBand;
+	friend class OZFMaskBand;
 private:
 	ozf_stream* source;
+	char** papszStats;
+
+	int nNodataIndex;
+	OZFMaskBand *poMaskBand;
+
+#if GDAL_VERSION_NUM >= 2020000
+	int GetDataCoverageStatus(int nXOff, int nYOff, int nXSize, int nYSize,
+			int nMaskFlagStop, double *pdfDataPct);
+#endif
 
 public:
+	OZFDataset();
 	virtual ~OZFDataset();
 
+	virtual char **GetMetadata(const char * pszDomain = "");
+	virtual const char *GetMetadataItem(const char * pszName,
+			const char * pszDomain = "");
+
 	static GDALDataset *Open(GDALOpenInfo *);
 };
 
@@ -26,15 +54,136 @@ public:
 	OZFRasterBand(OZFDataset *, int);
 	virtual CPLErr IReadBlock(int, int, void *);
 	virtual GDALColorInterp GetColorInterpretation();
+	virtual GDALRasterBand *GetMaskBand();
+	virtual int GetMaskFlags();
+
+#if GDAL_VERSION_NUM >= 2020000
+protected:
+	virtual int IGetDataCoverageStatus(int nXOff, int nYOff, int nXSize,
+			int nYSize, int nMaskFlagStop, double *pdfDataPct);
+#endif
 };
 
+// -------------------------------------------------------------------- //
+//      Mask shared by the bands when OZF_NODATA_INDEX is set: 0 where  //
+//      the palette index is that one, 255 elsewhere.                   //
+// -------------------------------------------------------------------- //
+class CPL_DLL OZFMaskBand: public GDALRasterBand {
+public:
+	OZFMaskBand(OZFDataset *);
+	virtual CPLErr IReadBlock(int, int, void *);
+
+#if GDAL_VERSION_NUM >= 2020000
+protected:
+	virtual int IGetDataCoverageStatus(int nXOff, int nYOff, int nXSize,
+			int nYSize, int nMaskFlagStop, double *pdfDataPct);
+#endif
+};
+
+OZFDataset::OZFDataset() {
+	source = NULL;
+	papszStats = NULL;
+	nNodataIndex = -1;
+	poMaskBand = NULL;
+}
+
 OZFDataset::~OZFDataset() {
 	FlushCache();
+	delete poMaskBand;
 	if (source) {
 		ozf_close(source);
 	}
+	CSLDestroy(papszStats);
+}
+
+// -------------------------------------------------------------------- //
+//      Decoder counters are published in the "OZF_STATS" domain and    //
+//      are sampled again on every request.                             //
+// -------------------------------------------------------------------- //
+char **OZFDataset::GetMetadata(const char * pszDomain) {
+	if (pszDomain == NULL || !EQUAL(pszDomain, "OZF_STATS"))
+		return GDALDataset::GetMetadata(pszDomain);
+
+	ozf_stats stats;
+	ozf_stats_get(&stats);
+
+	CSLDestroy(papszStats);
+	papszStats = NULL;
+
+	for (int i = 0; i < OZF_STATS_FIELDS; i++) {
+		papszStats = CSLSetNameValue(papszStats, ozf_stats_name(i),
+				CPLSPrintf(CPL_FRMT_GIB, (GIntBig) ozf_stats_value(&stats, i)));
+	}
+
+	return papszStats;
 }
 
+const char *OZFDataset::GetMetadataItem(const char * pszName,
+		const char * pszDomain) {
+	if (pszDomain == NULL || !EQUAL(pszDomain, "OZF_STATS"))
+		return GDALDataset::GetMetadataItem(pszName, pszDomain);
+
+	return CSLFetchNameValue(GetMetadata(pszDomain), pszName);
+}
+
+/************************************************************************/
+/*                            VSI file access                           */
+/*                                                                      */
+/*      Maps under /vsi (zip archives, memory, subfiles, ...) are read  */
+/*      through GDAL's virtual files; plain paths keep the decoder's    */
+/*      pooled descriptors, sidecar indexes and io_uring reads.         */
+/************************************************************************/
+
+typedef struct {
+	FILE *fp;
+	void *hMutex;
+} OZFVSIHandle;
+
+static void *OZFVSIOpen(const char *pszPath, ozf_offset *pnSize,
+		long *pnMTime) {
+	VSIStatBufL sStat;
+
+	if (VSIStatL(pszPath, &sStat) != 0)
+		return NULL;
+
+	FILE *fp = VSIFOpenL(pszPath, "rb");
+	if (fp == NULL)
+		return NULL;
+
+	OZFVSIHandle *psHandle = (OZFVSIHandle *) CPLCalloc(1, sizeof(OZFVSIHandle));
+	psHandle->fp = fp;
+
+	*pnSize = (ozf_offset) sStat.st_size;
+	*pnMTime = (long) sStat.st_mtime;
+
+	return psHandle;
+}
+
+// virtual handles keep a file position, seek and read go together
+static int OZFVSIRead(void *hHandle, ozf_offset nOffset, void *pData,
+		unsigned long nSize) {
+	OZFVSIHandle *psHandle = (OZFVSIHandle *) hHandle;
+
+	CPLMutexHolderD(&psHandle->hMutex);
+
+	if (VSIFSeekL(psHandle->fp, (vsi_l_offset) nOffset, SEEK_SET) != 0)
+		return -1;
+
+	return VSIFReadL(pData, 1, nSize, psHandle->fp) == nSize ? 0 : -1;
+}
+
+static void OZFVSIClose(void *hHandle) {
+	OZFVSIHandle *psHandle = (OZFVSIHandle *) hHandle;
+
+	VSIFCloseL(psHandle->fp);
+	if (psHandle->hMutex)
+		CPLDestroyMutex(psHandle->hMutex);
+	CPLFree(psHandle);
+}
+
+static const ozf_io sOZFVSIIO = { "vsi", OZFVSIOpen, OZFVSIRead, OZFVSIClose,
+		NULL, NULL };
+
 GDALDataset* OZFDataset::Open(GDALOpenInfo * poOpenInfo) {
 	// -------------------------------------------------------------------- //
 	//      Confirm the requested access is supported.                      //
@@ -52,8 +201,14 @@ GDALDataset* OZFDataset::Open(GDALOpenInfo * poOpenInfo) {
 
 	poDS = new OZFDataset();
 
-	poDS->source = ozf_open(poOpenInfo->pszFilename);
-	if (poDS->source->ozf2) {
+	const ozf_io *psIO = EQUALN(poOpenInfo->pszFilename, "/vsi", 4) ? &sOZFVSIIO
+			: NULL;
+
+	poDS->source = ozf_open_io(poOpenInfo->pszFilename, psIO);
+	if (poDS->source == NULL) {
+		delete poDS;
+		return NULL;
+	} else if (poDS->source->ozf2) {
 		poDS->nRasterXSize = poDS->source->ozf2->width;
 		poDS->nRasterYSize = poDS->source->ozf2->height;
 	} else if (poDS->source->ozf3) {
@@ -72,6 +227,41 @@ GDALDataset* OZFDataset::Open(GDALOpenInfo * poOpenInfo) {
 	poDS->SetBand(2, new OZFRasterBand(poDS, 2));
 	poDS->SetBand(3, new OZFRasterBand(poDS, 3));
 
+	// -------------------------------------------------------------------- //
+	//      OZF_NODATA_INDEX is a palette index taken as no data, e.g. the  //
+	//      white of the sheet margins. It gives the bands a mask and lets  //
+	//      their data coverage report tiles of that colour as empty.       //
+	// -------------------------------------------------------------------- //
+	const char *pszNodata = CPLGetConfigOption("OZF_NODATA_INDEX", NULL);
+
+	if (pszNodata != NULL && *pszNodata != '\0') {
+		int nIndex = atoi(pszNodata);
+
+		if (nIndex < 0 || nIndex > 255) {
+			CPLError(CE_Warning, CPLE_IllegalArg,
+					"OZF_NODATA_INDEX=%s is not a palette index, ignored.",
+					pszNodata);
+		} else {
+			poDS->nNodataIndex = nIndex;
+			poDS->poMaskBand = new OZFMaskBand(poDS);
+		}
+	}
+
+	// -------------------------------------------------------------------- //
+	//      Zoom levels stored in the file, in the "OZF" domain.            //
+	// -------------------------------------------------------------------- //
+	int nScales = ozf_num_scales(poDS->source);
+	CPLString osValue;
+
+	poDS->SetMetadataItem("SCALES", osValue.Printf("%d", nScales), "OZF");
+	for (int i = 0; i < nScales; i++) {
+		CPLString osName;
+		osName.Printf("SCALE_%d", i);
+		osValue.Printf("%dx%d", ozf_scale_dx(poDS->source, i),
+				ozf_scale_dy(poDS->source, i));
+		poDS->SetMetadataItem(osName, osValue, "OZF");
+	}
+
 	// -------------------------------------------------------------------- //
 	//      Initialize default overviews.                                   //
 	// -------------------------------------------------------------------- //
@@ -93,20 +283,60 @@ CPLErr OZFRasterBand::IReadBlock(int nBlockXOff, int nBlockYOff, void * pImage)
 
 	OZFDataset *poDS = (OZFDataset *) this->poDS;
 
-	unsigned char* buffer = (unsigned char*) VSIMalloc(64 * 64 * 4
-			* sizeof(unsigned char));
+	// level 0 is the full resolution image the raster size comes from
+	int scale = 0;
 
-	int scale = ozf_num_scales(poDS->source) - 1;
+	OZF_TRACE_SCOPE("OZFRasterBand::IReadBlock", scale, nBlockXOff, nBlockYOff);
 
-	ozf_get_tile(poDS->source, scale, nBlockXOff, nBlockYOff, buffer);
+	// -------------------------------------------------------------------- //
+	//      Read palette indices straight into the block and map them to   //
+	//      this band in place; edge blocks come back cropped and zeroed.  //
+	// -------------------------------------------------------------------- //
+	GByte *pabyBlock = (GByte *) pImage;
+	GByte abyPalette[256 * 4];
 
-	for (int i = 0; i < 64 * 64; i++) {
-		((GByte*) pImage)[i] = buffer[i * 4 + this->nBand];
+	if (ozf_read_region(poDS->source, scale, nBlockXOff * nBlockXSize,
+			nBlockYOff * nBlockYSize, nBlockXSize, nBlockYSize,
+			OZF_FORMAT_INDEX, pabyBlock, nBlockXSize) != 0
+			|| ozf_get_palette(poDS->source, scale, abyPalette) != 0) {
+		CPLError(CE_Failure, CPLE_FileIO,
+				"Failed to read OZF block %d,%d.", nBlockXOff, nBlockYOff);
+		return CE_Failure;
+	}
+
+	for (int i = 0; i < nBlockXSize * nBlockYSize; i++) {
+		pabyBlock[i] = abyPalette[pabyBlock[i] * 4 + nBand - 1];
 	}
 
 	return CE_None;
 }
 
+GDALRasterBand *OZFRasterBand::GetMaskBand() {
+	OZFDataset *poGDS = (OZFDataset *) poDS;
+
+	if (poGDS->poMaskBand == NULL)
+		return GDALRasterBand::GetMaskBand();
+
+	return poGDS->poMaskBand;
+}
+
+int OZFRasterBand::GetMaskFlags() {
+	OZFDataset *poGDS = (OZFDataset *) poDS;
+
+	if (poGDS->poMaskBand == NULL)
+		return GDALRasterBand::GetMaskFlags();
+
+	return GMF_PER_DATASET;
+}
+
+#if GDAL_VERSION_NUM >= 2020000
+int OZFRasterBand::IGetDataCoverageStatus(int nXOff, int nYOff, int nXSize,
+		int nYSize, int nMaskFlagStop, double *pdfDataPct) {
+	return ((OZFDataset *) poDS)->GetDataCoverageStatus(nXOff, nYOff, nXSize,
+			nYSize, nMaskFlagStop, pdfDataPct);
+}
+#endif
+
 GDALColorInterp OZFRasterBand::GetColorInterpretation() {
 	switch (this->nBand) {
 	case 1:
@@ -120,6 +350,179 @@ GDALColorInterp OZFRasterBand::GetColorInterpretation() {
 	}
 }
 
+OZFMaskBand::OZFMaskBand(OZFDataset *poDS) {
+	this->poDS = poDS;
+	this->nBand = 0;
+
+	nRasterXSize = poDS->GetRasterXSize();
+	nRasterYSize = poDS->GetRasterYSize();
+
+	eDataType = GDT_Byte;
+
+	nBlockXSize = OZF_TILE_WIDTH;
+	nBlockYSize = OZF_TILE_HEIGHT;
+}
+
+CPLErr OZFMaskBand::IReadBlock(int nBlockXOff, int nBlockYOff, void * pImage) {
+	OZFDataset *poGDS = (OZFDataset *) poDS;
+	GByte *pabyBlock = (GByte *) pImage;
+
+	// blocks are tiles, single-colour ones are known from the index
+	int nIndex = ozf_tile_uniform(poGDS->source, 0, nBlockXOff, nBlockYOff);
+
+	if (nIndex >= 0) {
+		memset(pabyBlock, nIndex == poGDS->nNodataIndex ? 0 : 255,
+				nBlockXSize * nBlockYSize);
+		return CE_None;
+	}
+
+	if (ozf_read_region(poGDS->source, 0, nBlockXOff * nBlockXSize,
+			nBlockYOff * nBlockYSize, nBlockXSize, nBlockYSize,
+			OZF_FORMAT_INDEX, pabyBlock, nBlockXSize) != 0) {
+		CPLError(CE_Failure, CPLE_FileIO,
+				"Failed to read OZF mask block %d,%d.", nBlockXOff, nBlockYOff);
+		return CE_Failure;
+	}
+
+	for (int i = 0; i < nBlockXSize * nBlockYSize; i++) {
+		pabyBlock[i] = pabyBlock[i] == poGDS->nNodataIndex ? 0 : 255;
+	}
+
+	return CE_None;
+}
+
+#if GDAL_VERSION_NUM >= 2020000
+int OZFMaskBand::IGetDataCoverageStatus(int nXOff, int nYOff, int nXSize,
+		int nYSize, int nMaskFlagStop, double *pdfDataPct) {
+	return ((OZFDataset *) poDS)->GetDataCoverageStatus(nXOff, nYOff, nXSize,
+			nYSize, nMaskFlagStop, pdfDataPct);
+}
+
+// -------------------------------------------------------------------- //
+//      Data coverage from the tile infos of the full resolution level: //
+//      tiles of the OZF_NODATA_INDEX colour are empty, any other tile  //
+//      counts as data. No tile is read or decoded.                     //
+// -------------------------------------------------------------------- //
+int OZFDataset::GetDataCoverageStatus(int nXOff, int nYOff, int nXSize,
+		int nYSize, int nMaskFlagStop, double *pdfDataPct) {
+	int nStatus = 0;
+	double dfDataPixels = 0.0;
+
+	int nTileX0 = nXOff / OZF_TILE_WIDTH;
+	int nTileY0 = nYOff / OZF_TILE_HEIGHT;
+	int nTileX1 = (nXOff + nXSize - 1) / OZF_TILE_WIDTH;
+	int nTileY1 = (nYOff + nYSize - 1) / OZF_TILE_HEIGHT;
+
+	for (int y = nTileY0; y <= nTileY1; y++) {
+		for (int x = nTileX0; x <= nTileX1; x++) {
+			if (nNodataIndex >= 0
+					&& ozf_tile_uniform(source, 0, x, y) == nNodataIndex) {
+				nStatus |= GDAL_DATA_COVERAGE_STATUS_EMPTY;
+			} else {
+				int nX0 = MAX(nXOff, x * OZF_TILE_WIDTH);
+				int nX1 = MIN(nXOff + nXSize, (x + 1) * OZF_TILE_WIDTH);
+				int nY0 = MAX(nYOff, y * OZF_TILE_HEIGHT);
+				int nY1 = MIN(nYOff + nYSize, (y + 1) * OZF_TILE_HEIGHT);
+
+				nStatus |= GDAL_DATA_COVERAGE_STATUS_DATA;
+				dfDataPixels += (double) (nX1 - nX0) * (nY1 - nY0);
+			}
+
+			// the percentage is only known once every tile was looked at
+			if (nStatus & nMaskFlagStop) {
+				if (pdfDataPct != NULL)
+					*pdfDataPct = -1.0;
+				return nStatus;
+			}
+		}
+	}
+
+	if (pdfDataPct != NULL)
+		*pdfDataPct = 100.0 * dfDataPixels / ((double) nXSize * nYSize);
+
+	return nStatus;
+}
+#endif
+
+// -------------------------------------------------------------------- //
+//      Decoder logging is off unless OZF_LOG names a file (or stderr). //
+//      OZF_LOG_LEVEL is one of ERROR, WARNING, INFO (default), DEBUG.  //
+// -------------------------------------------------------------------- //
+static void OZFSetupLogging() {
+	const char *pszLog = CPLGetConfigOption("OZF_LOG", NULL);
+	const char *pszLevel = CPLGetConfigOption("OZF_LOG_LEVEL", "INFO");
+
+	if (pszLog == NULL || *pszLog == '\0')
+		return;
+
+	FILE *fp;
+	if (EQUAL(pszLog, "stderr"))
+		fp = stderr;
+	else if (EQUAL(pszLog, "stdout"))
+		fp = stdout;
+	else
+		fp = fopen(pszLog, "a");
+
+	if (fp == NULL) {
+		CPLError(CE_Warning, CPLE_OpenFailed,
+				"Cannot open OZF_LOG file \"%s\".", pszLog);
+		return;
+	}
+
+	if (EQUAL(pszLevel, "ERROR"))
+		logstream_level(LOGSTREAM_ERROR);
+	else if (EQUAL(pszLevel, "WARNING"))
+		logstream_level(LOGSTREAM_WARNING);
+	else if (EQUAL(pszLevel, "DEBUG"))
+		logstream_level(LOGSTREAM_DEBUG);
+	else
+		logstream_level(LOGSTREAM_INFO);
+
+	logstream_to(fp);
+}
+
+// -------------------------------------------------------------------- //
+//      Sidecar indexes (.ozfidx) are on unless OZF_INDEX_CACHE is NO;  //
+//      YES keeps them in the user cache directory, BESIDE next to the  //
+//      maps where writable, any other value names the cache directory. //
+// -------------------------------------------------------------------- //
+static void OZFSetupSidecars() {
+	const char *pszCache = CPLGetConfigOption("OZF_INDEX_CACHE", "YES");
+
+	if (!CSLTestBoolean(pszCache))
+		ozf_sidecar_setup(OZF_SIDECAR_OFF, NULL);
+	else if (EQUAL(pszCache, "YES") || EQUAL(pszCache, "ON")
+			|| EQUAL(pszCache, "TRUE") || EQUAL(pszCache, "1"))
+		ozf_sidecar_setup(OZF_SIDECAR_ON, NULL);
+	else if (EQUAL(pszCache, "BESIDE"))
+		ozf_sidecar_setup(OZF_SIDECAR_BESIDE, NULL);
+	else
+		ozf_sidecar_setup(OZF_SIDECAR_ON, pszCache);
+}
+
+// -------------------------------------------------------------------- //
+//      OZF_MAX_OPEN_FILES bounds the descriptors held by open maps,    //
+//      idle ones are closed and reopened when they are read again.     //
+// -------------------------------------------------------------------- //
+static void OZFSetupFiles() {
+	ozf_files_setup(atoi(CPLGetConfigOption("OZF_MAX_OPEN_FILES", "0")));
+}
+
+// -------------------------------------------------------------------- //
+//      OZF_INFLATE picks the inflate backend: zlib, zlib-ng or         //
+//      libdeflate, the build default otherwise. OZF_INFLATE_VERIFY=NO  //
+//      skips the adler32 check of every tile.                          //
+// -------------------------------------------------------------------- //
+static void OZFSetupInflate() {
+	const char *pszBackend = CPLGetConfigOption("OZF_INFLATE", NULL);
+	int bVerify = CSLTestBoolean(CPLGetConfigOption("OZF_INFLATE_VERIFY", "YES"));
+
+	if (ozf_inflate_setup(pszBackend, bVerify) != 0)
+		CPLError(CE_Warning, CPLE_NotSupported,
+				"OZF_INFLATE=%s is not available in this build, using %s.",
+				pszBackend ? pszBackend : "default", ozf_inflate_backend());
+}
+
 extern "C" CPL_DLL void GDALRegister_OZF() {
 
 	GDALDriver *poDriver;
@@ -136,5 +539,16 @@ extern "C" CPL_DLL void GDALRegister_OZF() {
 		poDriver->pfnOpen = OZFDataset::Open;
 
 		GetGDALDriverManager()->RegisterDriver(poDriver);
+
+		OZFSetupLogging();
+		OZFSetupSidecars();
+		OZFSetupFiles();
+		OZFSetupInflate();
+
+#ifdef OZF_TRACE
+		const char *pszTrace = CPLGetConfigOption("OZF_TRACE_FILE", NULL);
+		if (pszTrace != NULL && !ozf_trace_enabled)
+			ozf_trace_start(pszTrace);
+#endif
 	}
 }
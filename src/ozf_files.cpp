@@ -0,0 +1,329 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "ozf_files.h"
+#include "log_stream.h"
+
+#if defined(HAVE_UNISTD_H) && defined(HAVE_FCNTL_H) && defined(HAVE_SYS_STAT_H)
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#ifndef O_CLOEXEC
+#define O_CLOEXEC	0
+#endif
+
+/*--------------------------------------------------------------------------*/
+struct ozf_file_slot
+{
+	char*					path;
+	ozf_offset				size;	// of the file the index was made from
+	long					mtime;
+	int						fd;		// -1 while closed
+	int						pins;
+
+	// most recently used first, only slots holding a descriptor
+	struct ozf_file_slot*	prev;
+	struct ozf_file_slot*	next;
+};
+
+/*--------------------------------------------------------------------------*/
+static ozf_file_slot*	files_head = NULL;
+static ozf_file_slot*	files_tail = NULL;
+static int				files_open = 0;
+static int				files_max = OZF_FILES_DEFAULT_MAX;
+
+#ifdef HAVE_PTHREAD_H
+static pthread_mutex_t	files_lock = PTHREAD_MUTEX_INITIALIZER;
+#define OZF_FILES_LOCK()	pthread_mutex_lock(&files_lock)
+#define OZF_FILES_UNLOCK()	pthread_mutex_unlock(&files_lock)
+#else
+#define OZF_FILES_LOCK()
+#define OZF_FILES_UNLOCK()
+#endif
+
+/*--------------------------------------------------------------------------*/
+static void ozf_files_unlink(ozf_file_slot* slot)
+{
+	if (slot->prev)
+		slot->prev->next = slot->next;
+	else
+		files_head = slot->next;
+
+	if (slot->next)
+		slot->next->prev = slot->prev;
+	else
+		files_tail = slot->prev;
+
+	slot->prev = slot->next = NULL;
+}
+
+/*--------------------------------------------------------------------------*/
+static void ozf_files_push(ozf_file_slot* slot)
+{
+	slot->prev = NULL;
+	slot->next = files_head;
+
+	if (files_head)
+		files_head->prev = slot;
+	else
+		files_tail = slot;
+
+	files_head = slot;
+}
+
+/*--------------------------------------------------------------------------*/
+// closes the least recently used descriptor nobody holds, 0 if there was one
+static int ozf_files_evict(void)
+{
+	ozf_file_slot* slot;
+
+	for (slot = files_tail; slot; slot = slot->prev)
+	{
+		if (slot->pins == 0)
+		{
+			ozf_files_unlink(slot);
+			close(slot->fd);
+
+			slot->fd = -1;
+			files_open--;
+
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_files_setup(int max_open)
+{
+	OZF_FILES_LOCK();
+
+	files_max = max_open > 0 ? max_open : OZF_FILES_DEFAULT_MAX;
+
+	while (files_open > files_max && ozf_files_evict() == 0)
+		;
+
+	OZF_FILES_UNLOCK();
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_files_open_count(void)
+{
+	OZF_FILES_LOCK();
+
+	int n = files_open;
+
+	OZF_FILES_UNLOCK();
+
+	return n;
+}
+
+/*--------------------------------------------------------------------------*/
+ozf_file_slot* ozf_file_slot_create(const char* path, ozf_offset size, long mtime)
+{
+	ozf_file_slot* slot = (ozf_file_slot*)calloc(1, sizeof(ozf_file_slot));
+
+	slot->path = strdup(path);
+	slot->size = size;
+	slot->mtime = mtime;
+	slot->fd = -1;
+
+	return slot;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_file_slot_destroy(ozf_file_slot* slot)
+{
+	if (!slot)
+		return;
+
+	OZF_FILES_LOCK();
+
+	if (slot->fd >= 0)
+	{
+		ozf_files_unlink(slot);
+		close(slot->fd);
+		files_open--;
+	}
+
+	OZF_FILES_UNLOCK();
+
+	free(slot->path);
+	free(slot);
+}
+
+/*--------------------------------------------------------------------------*/
+// A descriptor closed by the pool is opened again by path, where another
+// file may have been put since: offsets of the index would then be read
+// from the wrong data.
+static int ozf_file_open(ozf_file_slot* slot)
+{
+	struct stat st;
+	int fd = open(slot->path, O_RDONLY | O_CLOEXEC);
+
+	// the process limit is lower than ours, make room and try again
+	while (fd < 0 && (errno == EMFILE || errno == ENFILE))
+	{
+		OZF_FILES_LOCK();
+		int evicted = ozf_files_evict() == 0;
+		OZF_FILES_UNLOCK();
+
+		if (!evicted)
+			break;
+
+		fd = open(slot->path, O_RDONLY | O_CLOEXEC);
+	}
+
+	if (fd < 0)
+	{
+		LOGSTREAM(LOGSTREAM_WARNING, "ozf", "%s open fails\n", slot->path);
+		return -1;
+	}
+
+	if (fstat(fd, &st) != 0 || (ozf_offset)st.st_size != slot->size ||
+		(long)st.st_mtime != slot->mtime)
+	{
+		LOGSTREAM(LOGSTREAM_WARNING, "ozf", "%s changed since it was opened\n",
+				  slot->path);
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*--------------------------------------------------------------------------*/
+// Files are opened outside the lock. Two threads reopening the same slot
+// both open it, the one coming second closes its descriptor again.
+int ozf_file_acquire(ozf_file_slot* slot)
+{
+	int fd, spare = -1;
+
+	OZF_FILES_LOCK();
+
+	if (slot->fd < 0)
+	{
+		OZF_FILES_UNLOCK();
+
+		fd = ozf_file_open(slot);
+
+		if (fd < 0)
+			return -1;
+
+		OZF_FILES_LOCK();
+
+		if (slot->fd < 0)
+		{
+			// pinned descriptors may push the pool over its limit for a while
+			while (files_open >= files_max && ozf_files_evict() == 0)
+				;
+
+			slot->fd = fd;
+			files_open++;
+		}
+		else
+		{
+			ozf_files_unlink(slot);
+			spare = fd;
+		}
+	}
+	else
+	{
+		ozf_files_unlink(slot);
+	}
+
+	ozf_files_push(slot);
+	slot->pins++;
+
+	fd = slot->fd;
+
+	OZF_FILES_UNLOCK();
+
+	if (spare >= 0)
+		close(spare);
+
+	return fd;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_file_release(ozf_file_slot* slot)
+{
+	OZF_FILES_LOCK();
+
+	slot->pins--;
+
+	// over the limit because of pinned descriptors, close an idle one now
+	if (files_open > files_max && slot->pins == 0)
+		ozf_files_evict();
+
+	OZF_FILES_UNLOCK();
+}
+
+#else
+
+/*--------------------------------------------------------------------------*/
+// no positioned reads, streams keep a stdio file of their own instead
+void ozf_files_setup(int max_open)
+{
+}
+
+int ozf_files_open_count(void)
+{
+	return 0;
+}
+
+ozf_file_slot* ozf_file_slot_create(const char* path, ozf_offset size, long mtime)
+{
+	return NULL;
+}
+
+void ozf_file_slot_destroy(ozf_file_slot* slot)
+{
+}
+
+int ozf_file_acquire(ozf_file_slot* slot)
+{
+	return -1;
+}
+
+void ozf_file_release(ozf_file_slot* slot)
+{
+}
+
+#endif
@@ -0,0 +1,60 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __OZF_FILES_INCLUDED
+#define __OZF_FILES_INCLUDED
+
+#include "ozf_io.h"
+
+/*--------------------------------------------------------------------------*/
+// Bounded pool of read-only file descriptors. Every stream owns a slot
+// naming its file; the descriptor is opened on first use and may be closed
+// again, least recently used first, while nobody holds it, so the number
+// of open streams is not limited by the descriptor limit.
+typedef struct ozf_file_slot ozf_file_slot;
+
+#define OZF_FILES_DEFAULT_MAX	256
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// limit on descriptors held by the pool, 0 restores the default
+void			ozf_files_setup(int max_open);
+int				ozf_files_open_count(void);
+
+// size and mtime of the file as parsed, a reopened file must still match
+ozf_file_slot*	ozf_file_slot_create(const char* path, ozf_offset size, long mtime);
+void			ozf_file_slot_destroy(ozf_file_slot* slot);
+
+// descriptor stays open until the matching release, -1 on failure or if
+// the file changed
+int				ozf_file_acquire(ozf_file_slot* slot);
+void			ozf_file_release(ozf_file_slot* slot);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,336 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include "log_stream.h"
+#include "ozf_inflate.h"
+
+#if defined(HAVE_LIBDEFLATE_H) && defined(HAVE_LIBDEFLATE)
+#define OZF_INFLATE_HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
+
+#if defined(HAVE_ZLIB_NG_H) && defined(HAVE_LIBZ_NG)
+#define OZF_INFLATE_HAVE_ZLIB_NG
+#endif
+
+/*--------------------------------------------------------------------------*/
+// configure --with-inflate, otherwise the fastest one built in
+#ifndef OZF_INFLATE_DEFAULT
+#if defined(OZF_INFLATE_HAVE_LIBDEFLATE)
+#define OZF_INFLATE_DEFAULT		OZF_INFLATE_LIBDEFLATE
+#elif defined(OZF_INFLATE_HAVE_ZLIB_NG)
+#define OZF_INFLATE_DEFAULT		OZF_INFLATE_ZLIB_NG
+#else
+#define OZF_INFLATE_DEFAULT		OZF_INFLATE_ZLIB
+#endif
+#endif
+
+#define OZF_INFLATE_BACKENDS	3
+
+/*--------------------------------------------------------------------------*/
+struct ozf_inflater
+{
+	int		backend;
+	int		raw;		// context inflates deflate data without the zlib frame
+	void*	context;	// z_stream, zng_stream or libdeflate_decompressor
+};
+
+/*--------------------------------------------------------------------------*/
+static const char*	inflate_names[OZF_INFLATE_BACKENDS] =
+{
+	"zlib", "zlib-ng", "libdeflate"
+};
+
+static int			inflate_backend = OZF_INFLATE_ZLIB;	// until ozf_inflate_setup()
+static int			inflate_verify = 1;
+
+/*--------------------------------------------------------------------------*/
+static int ozf_inflate_built_in(int backend)
+{
+	switch (backend)
+	{
+		case OZF_INFLATE_ZLIB:			return 1;
+#ifdef OZF_INFLATE_HAVE_ZLIB_NG
+		case OZF_INFLATE_ZLIB_NG:		return 1;
+#endif
+#ifdef OZF_INFLATE_HAVE_LIBDEFLATE
+		case OZF_INFLATE_LIBDEFLATE:	return 1;
+#endif
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_inflate_setup(const char* backend, int verify)
+{
+	int i = OZF_INFLATE_DEFAULT;
+
+	inflate_verify = verify;
+
+	if (backend && *backend)
+	{
+		for (i = 0; i < OZF_INFLATE_BACKENDS; i++)
+			if (strcmp(backend, inflate_names[i]) == 0)
+				break;
+	}
+
+	if (i >= OZF_INFLATE_BACKENDS || !ozf_inflate_built_in(i))
+	{
+		LOGSTREAM(LOGSTREAM_WARNING, "inflate", "%s is not built in, using zlib\n",
+				  backend && *backend ? backend : inflate_names[OZF_INFLATE_DEFAULT]);
+
+		inflate_backend = OZF_INFLATE_ZLIB;
+
+		return -1;
+	}
+
+	inflate_backend = i;
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+const char* ozf_inflate_backend(void)
+{
+	return inflate_names[inflate_backend];
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_inflate_verify(void)
+{
+	return inflate_verify;
+}
+
+/*--------------------------------------------------------------------------*/
+// zlib
+/*--------------------------------------------------------------------------*/
+static void* ozf_inflate_zlib_create(int raw)
+{
+	z_stream* stream = (z_stream*)calloc(1, sizeof(z_stream));
+
+	if ((raw ? inflateInit2(stream, -MAX_WBITS) : inflateInit(stream)) != Z_OK)
+	{
+		free(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+static void ozf_inflate_zlib_destroy(void* context)
+{
+	inflateEnd((z_stream*)context);
+	free(context);
+}
+
+static int ozf_inflate_zlib(void* context, unsigned char* dest,
+							unsigned long* dest_len,
+							const unsigned char* source, unsigned long source_len)
+{
+	z_stream* stream = (z_stream*)context;
+
+	inflateReset(stream);
+
+	stream->next_in = (Bytef*)source;
+	stream->avail_in = (uInt)source_len;
+	stream->next_out = dest;
+	stream->avail_out = (uInt)*dest_len;
+
+	if (inflate(stream, Z_FINISH) != Z_STREAM_END)
+		return -1;
+
+	*dest_len = stream->total_out;
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+// libdeflate, a tile in one call
+/*--------------------------------------------------------------------------*/
+#ifdef OZF_INFLATE_HAVE_LIBDEFLATE
+
+static int ozf_inflate_libdeflate(void* context, int raw, unsigned char* dest,
+								  unsigned long* dest_len,
+								  const unsigned char* source,
+								  unsigned long source_len)
+{
+	struct libdeflate_decompressor* d = (struct libdeflate_decompressor*)context;
+	enum libdeflate_result result;
+	size_t inflated = 0;
+
+	if (raw)
+		result = libdeflate_deflate_decompress(d, source, source_len,
+											   dest, *dest_len, &inflated);
+	else
+		result = libdeflate_zlib_decompress(d, source, source_len,
+											dest, *dest_len, &inflated);
+
+	if (result != LIBDEFLATE_SUCCESS)
+		return -1;
+
+	*dest_len = inflated;
+
+	return 0;
+}
+
+#endif
+
+/*--------------------------------------------------------------------------*/
+static void ozf_inflater_release(ozf_inflater* z)
+{
+	if (!z->context)
+		return;
+
+	switch (z->backend)
+	{
+#ifdef OZF_INFLATE_HAVE_LIBDEFLATE
+		case OZF_INFLATE_LIBDEFLATE:
+			libdeflate_free_decompressor((struct libdeflate_decompressor*)z->context);
+			break;
+#endif
+		case OZF_INFLATE_ZLIB_NG:
+			ozf_inflate_ng_destroy(z->context);
+			break;
+		default:
+			ozf_inflate_zlib_destroy(z->context);
+			break;
+	}
+
+	z->context = NULL;
+}
+
+/*--------------------------------------------------------------------------*/
+// context for raw or framed data, set up again when that changes
+static void* ozf_inflater_context(ozf_inflater* z, int raw)
+{
+	if (z->context && z->raw == raw)
+		return z->context;
+
+	ozf_inflater_release(z);
+
+	switch (z->backend)
+	{
+#ifdef OZF_INFLATE_HAVE_LIBDEFLATE
+		case OZF_INFLATE_LIBDEFLATE:
+			z->context = libdeflate_alloc_decompressor();
+			break;
+#endif
+		case OZF_INFLATE_ZLIB_NG:
+			z->context = ozf_inflate_ng_create(raw);
+			break;
+		default:
+			z->context = ozf_inflate_zlib_create(raw);
+			break;
+	}
+
+	z->raw = raw;
+
+	return z->context;
+}
+
+/*--------------------------------------------------------------------------*/
+ozf_inflater* ozf_inflater_create(void)
+{
+	ozf_inflater* z = (ozf_inflater*)calloc(1, sizeof(ozf_inflater));
+
+	z->backend = inflate_backend;
+
+	return z;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_inflater_destroy(ozf_inflater* z)
+{
+	if (!z)
+		return;
+
+	ozf_inflater_release(z);
+	free(z);
+}
+
+/*--------------------------------------------------------------------------*/
+// The zlib header is checked here. Without verify the deflate data behind
+// it is inflated raw, which skips the adler32 of the inflated tile.
+int ozf_inflate(ozf_inflater* z, int verify, unsigned char* dest,
+				unsigned long* dest_len,
+				const unsigned char* source, unsigned long source_len)
+{
+	ozf_inflater once;
+	int raw = !verify;
+	int err = -1;
+
+	if (source_len < 2 || (source[0] & 0x0f) != Z_DEFLATED ||
+		(source[1] & 0x20) || ((source[0] << 8) | source[1]) % 31 != 0)
+		return -1;
+
+	if (!z)
+	{
+		memset(&once, 0, sizeof(once));
+		once.backend = inflate_backend;
+		z = &once;
+	}
+
+	if (raw)
+	{
+		source += 2;
+		source_len -= 2;
+	}
+
+	void* context = ozf_inflater_context(z, raw);
+
+	if (context)
+	{
+		switch (z->backend)
+		{
+#ifdef OZF_INFLATE_HAVE_LIBDEFLATE
+			case OZF_INFLATE_LIBDEFLATE:
+				err = ozf_inflate_libdeflate(context, raw, dest, dest_len,
+											 source, source_len);
+				break;
+#endif
+			case OZF_INFLATE_ZLIB_NG:
+				err = ozf_inflate_ng(context, dest, dest_len, source, source_len);
+				break;
+			default:
+				err = ozf_inflate_zlib(context, dest, dest_len, source, source_len);
+				break;
+		}
+	}
+
+	if (z == &once)
+		ozf_inflater_release(&once);
+
+	return err;
+}
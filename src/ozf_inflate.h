@@ -0,0 +1,71 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __OZF_INFLATE_INCLUDED
+#define __OZF_INFLATE_INCLUDED
+
+/*--------------------------------------------------------------------------*/
+// Inflate backends. Tiles always inflate to 64x64 bytes in one call, which
+// suits whole-buffer decompressors better than streaming zlib. The ones
+// built in depend on the libraries found by configure, zlib always is.
+#define OZF_INFLATE_ZLIB		0
+#define OZF_INFLATE_ZLIB_NG		1
+#define OZF_INFLATE_LIBDEFLATE	2
+
+// decompressor reused between tiles, used by one thread at a time
+typedef struct ozf_inflater ozf_inflater;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Backend by name ("zlib", "zlib-ng", "libdeflate"), NULL for the build
+// default. Returns -1 and falls back to zlib if it is not built in.
+// Without verify the adler32 trailer of the tiles is not checked.
+int				ozf_inflate_setup(const char* backend, int verify);
+const char*		ozf_inflate_backend(void);
+int				ozf_inflate_verify(void);
+
+ozf_inflater*	ozf_inflater_create(void);
+void			ozf_inflater_destroy(ozf_inflater* z);
+
+// Inflates a zlib stream into at most *dest_len bytes, sets *dest_len to
+// the size inflated. z may be NULL for a single tile. 0 on success.
+int				ozf_inflate(ozf_inflater* z, int verify,
+							unsigned char* dest, unsigned long* dest_len,
+							const unsigned char* source, unsigned long source_len);
+
+// zlib-ng backend, apart because its header does not mix with zlib.h
+void*			ozf_inflate_ng_create(int raw);
+void			ozf_inflate_ng_destroy(void* context);
+int				ozf_inflate_ng(void* context, unsigned char* dest,
+							   unsigned long* dest_len,
+							   const unsigned char* source,
+							   unsigned long source_len);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,97 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#include "ozf_inflate.h"
+
+#if defined(HAVE_ZLIB_NG_H) && defined(HAVE_LIBZ_NG)
+
+#include <zlib-ng.h>
+
+/*--------------------------------------------------------------------------*/
+void* ozf_inflate_ng_create(int raw)
+{
+	zng_stream* stream = (zng_stream*)calloc(1, sizeof(zng_stream));
+
+	if ((raw ? zng_inflateInit2(stream, -MAX_WBITS) : zng_inflateInit(stream)) != Z_OK)
+	{
+		free(stream);
+		return NULL;
+	}
+
+	return stream;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_inflate_ng_destroy(void* context)
+{
+	zng_inflateEnd((zng_stream*)context);
+	free(context);
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_inflate_ng(void* context, unsigned char* dest, unsigned long* dest_len,
+				   const unsigned char* source, unsigned long source_len)
+{
+	zng_stream* stream = (zng_stream*)context;
+
+	zng_inflateReset(stream);
+
+	stream->next_in = source;
+	stream->avail_in = (uint32_t)source_len;
+	stream->next_out = dest;
+	stream->avail_out = (uint32_t)*dest_len;
+
+	if (zng_inflate(stream, Z_FINISH) != Z_STREAM_END)
+		return -1;
+
+	*dest_len = (unsigned long)stream->total_out;
+
+	return 0;
+}
+
+#else
+
+/*--------------------------------------------------------------------------*/
+void* ozf_inflate_ng_create(int raw)
+{
+	return NULL;
+}
+
+void ozf_inflate_ng_destroy(void* context)
+{
+}
+
+int ozf_inflate_ng(void* context, unsigned char* dest, unsigned long* dest_len,
+				   const unsigned char* source, unsigned long source_len)
+{
+	return -1;
+}
+
+#endif
@@ -0,0 +1,327 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "ozf_io.h"
+#include "ozf_files.h"
+
+#if defined(HAVE_UNISTD_H) && defined(HAVE_SYS_STAT_H) && defined(HAVE_FCNTL_H)
+#define OZF_IO_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+#endif
+
+/*--------------------------------------------------------------------------*/
+static int ozf_io_stat(const char* path, ozf_offset* size, long* mtime)
+{
+#ifdef OZF_IO_POSIX
+	struct stat st;
+
+	if (stat(path, &st) != 0 || !S_ISREG(st.st_mode))
+		return -1;
+
+	*size = st.st_size;
+	*mtime = (long)st.st_mtime;
+#else
+	FILE* f = fopen(path, "rb");
+
+	if (!f)
+		return -1;
+
+#ifdef HAVE_FSEEKO
+	fseeko(f, 0, SEEK_END);
+
+	*size = ftello(f);
+#else
+	fseek(f, 0, SEEK_END);
+
+	*size = ftell(f);
+#endif
+	*mtime = 0;
+
+	fclose(f);
+#endif
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+// pooled descriptors
+/*--------------------------------------------------------------------------*/
+#ifdef OZF_IO_POSIX
+
+static void* ozf_files_open(const char* path, ozf_offset* size, long* mtime)
+{
+	if (ozf_io_stat(path, size, mtime) != 0)
+		return NULL;
+
+	return ozf_file_slot_create(path, *size, *mtime);
+}
+
+static int ozf_files_read(void* handle, ozf_offset offset, void* data,
+						  unsigned long size)
+{
+	int fd = ozf_file_acquire((ozf_file_slot*)handle);
+
+	if (fd < 0)
+		return -1;
+
+	int ok = pread(fd, data, size, (off_t)offset) == (ssize_t)size;
+
+	ozf_file_release((ozf_file_slot*)handle);
+
+	return ok ? 0 : -1;
+}
+
+static void ozf_files_close(void* handle)
+{
+	ozf_file_slot_destroy((ozf_file_slot*)handle);
+}
+
+static int ozf_files_fd_acquire(void* handle)
+{
+	return ozf_file_acquire((ozf_file_slot*)handle);
+}
+
+static void ozf_files_fd_release(void* handle)
+{
+	ozf_file_release((ozf_file_slot*)handle);
+}
+
+const ozf_io ozf_io_files =
+{
+	"files",
+	ozf_files_open, ozf_files_read, ozf_files_close,
+	ozf_files_fd_acquire, ozf_files_fd_release
+};
+
+#else
+
+static void* ozf_files_open(const char* path, ozf_offset* size, long* mtime)
+{
+	return NULL;
+}
+
+const ozf_io ozf_io_files = { "files", ozf_files_open, NULL, NULL, NULL, NULL };
+
+#endif
+
+/*--------------------------------------------------------------------------*/
+// stdio
+/*--------------------------------------------------------------------------*/
+typedef struct
+{
+	FILE*				file;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		lock;
+#endif
+} ozf_stdio_handle;
+
+static void* ozf_stdio_open(const char* path, ozf_offset* size, long* mtime)
+{
+	if (ozf_io_stat(path, size, mtime) != 0)
+		return NULL;
+
+	FILE* f = fopen(path, "rb");
+
+	if (!f)
+		return NULL;
+
+	ozf_stdio_handle* h = (ozf_stdio_handle*)malloc(sizeof(ozf_stdio_handle));
+
+	h->file = f;
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&h->lock, NULL);
+#endif
+
+	return h;
+}
+
+// seek and read must not interleave with another thread's
+static int ozf_stdio_read(void* handle, ozf_offset offset, void* data,
+						  unsigned long size)
+{
+	ozf_stdio_handle* h = (ozf_stdio_handle*)handle;
+	int ok;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&h->lock);
+#endif
+
+#ifdef HAVE_FSEEKO
+	ok = fseeko(h->file, (off_t)offset, SEEK_SET) == 0 &&
+#else
+	ok = offset <= LONG_MAX && fseek(h->file, (long)offset, SEEK_SET) == 0 &&
+#endif
+		 fread(data, size, 1, h->file) == 1;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_unlock(&h->lock);
+#endif
+
+	return ok ? 0 : -1;
+}
+
+static void ozf_stdio_close(void* handle)
+{
+	ozf_stdio_handle* h = (ozf_stdio_handle*)handle;
+
+	fclose(h->file);
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_destroy(&h->lock);
+#endif
+	free(h);
+}
+
+const ozf_io ozf_io_stdio =
+{
+	"stdio",
+	ozf_stdio_open, ozf_stdio_read, ozf_stdio_close,
+	NULL, NULL
+};
+
+/*--------------------------------------------------------------------------*/
+// mmap
+/*--------------------------------------------------------------------------*/
+#if defined(OZF_IO_POSIX) && defined(HAVE_SYS_MMAN_H)
+
+typedef struct
+{
+	unsigned char*		data;
+	size_t				size;
+} ozf_mmap_handle;
+
+static void* ozf_mmap_open(const char* path, ozf_offset* size, long* mtime)
+{
+	struct stat st;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		close(fd);
+		return NULL;
+	}
+
+	// a file larger than the address space cannot be mapped
+	if ((ozf_offset)st.st_size != (size_t)st.st_size)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	ozf_mmap_handle* h = (ozf_mmap_handle*)calloc(1, sizeof(ozf_mmap_handle));
+
+	h->size = st.st_size;
+
+	if (h->size)
+	{
+		void* p = mmap(NULL, h->size, PROT_READ, MAP_SHARED, fd, 0);
+
+		if (p == MAP_FAILED)
+		{
+			close(fd);
+			free(h);
+			return NULL;
+		}
+
+		h->data = (unsigned char*)p;
+	}
+
+	// the mapping stays valid without the descriptor
+	close(fd);
+
+	*size = h->size;
+	*mtime = (long)st.st_mtime;
+
+	return h;
+}
+
+static int ozf_mmap_read(void* handle, ozf_offset offset, void* data,
+						 unsigned long size)
+{
+	ozf_mmap_handle* h = (ozf_mmap_handle*)handle;
+
+	if (offset > h->size || size > h->size - offset)
+		return -1;
+
+	memcpy(data, h->data + offset, size);
+
+	return 0;
+}
+
+static void ozf_mmap_close(void* handle)
+{
+	ozf_mmap_handle* h = (ozf_mmap_handle*)handle;
+
+	if (h->data)
+		munmap(h->data, h->size);
+
+	free(h);
+}
+
+const ozf_io ozf_io_mmap =
+{
+	"mmap",
+	ozf_mmap_open, ozf_mmap_read, ozf_mmap_close,
+	NULL, NULL
+};
+
+#else
+
+static void* ozf_mmap_open(const char* path, ozf_offset* size, long* mtime)
+{
+	return NULL;
+}
+
+const ozf_io ozf_io_mmap = { "mmap", ozf_mmap_open, NULL, NULL, NULL, NULL };
+
+#endif
+
+/*--------------------------------------------------------------------------*/
+const ozf_io* ozf_io_default(void)
+{
+#ifdef OZF_IO_POSIX
+	return &ozf_io_files;
+#else
+	return &ozf_io_stdio;
+#endif
+}
@@ -0,0 +1,66 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __OZF_IO_INCLUDED
+#define __OZF_IO_INCLUDED
+
+/*--------------------------------------------------------------------------*/
+// file offsets and sizes, 64 bit so that maps over 4 GB can be read
+typedef unsigned long long	ozf_offset;
+
+/*--------------------------------------------------------------------------*/
+// Where the decoder reads a file from. open() returns a handle, or NULL if
+// the file cannot be read, along with the size and modification time the
+// shared index is keyed on. read() may be called from several threads on
+// one handle and returns 0 only if all size bytes were read.
+typedef struct
+{
+	const char*	name;
+
+	void*		(*open)(const char* path, ozf_offset* size, long* mtime);
+	int			(*read)(void* handle, ozf_offset offset, void* data,
+						unsigned long size);
+	void		(*close)(void* handle);
+
+	// optional: a descriptor for io_uring, held until released
+	int			(*fd_acquire)(void* handle);
+	void		(*fd_release)(void* handle);
+} ozf_io;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern const ozf_io	ozf_io_files;	// pread() on descriptors of the file pool
+extern const ozf_io	ozf_io_stdio;	// one stdio file per stream, reads serialised
+extern const ozf_io	ozf_io_mmap;	// the whole file mapped, reads are copies
+
+// ozf_io_files where there is pread(), ozf_io_stdio otherwise
+const ozf_io*	ozf_io_default(void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,214 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "ozf_pool.h"
+
+/*--------------------------------------------------------------------------*/
+#define OZF_POOL_MAX_THREADS	64
+
+/*--------------------------------------------------------------------------*/
+typedef struct ozf_pool_item
+{
+	ozf_pool_job			job;
+	void*					arg;
+	struct ozf_pool_item*	next;
+} ozf_pool_item;
+
+#ifdef HAVE_PTHREAD_H
+
+/*--------------------------------------------------------------------------*/
+struct ozf_pool
+{
+	pthread_mutex_t	lock;
+	pthread_cond_t	wake;
+	pthread_t		workers[OZF_POOL_MAX_THREADS];
+	int				threads;
+	int				stop;
+	ozf_pool_item*	head;
+	ozf_pool_item*	tail;
+};
+
+/*--------------------------------------------------------------------------*/
+static void* ozf_pool_worker(void* p)
+{
+	ozf_pool* pool = (ozf_pool*)p;
+
+	pthread_mutex_lock(&pool->lock);
+
+	for (;;)
+	{
+		while (!pool->head && !pool->stop)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+
+		ozf_pool_item* item = pool->head;
+
+		// queued jobs are still run on shutdown
+		if (!item)
+			break;
+
+		pool->head = item->next;
+
+		if (!pool->head)
+			pool->tail = NULL;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		item->job(item->arg);
+		free(item);
+
+		pthread_mutex_lock(&pool->lock);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+/*--------------------------------------------------------------------------*/
+ozf_pool* ozf_pool_create(int threads)
+{
+	ozf_pool* pool = (ozf_pool*)calloc(1, sizeof(ozf_pool));
+
+	if (!pool)
+		return NULL;
+
+	if (threads < 1)
+		threads = 1;
+
+	if (threads > OZF_POOL_MAX_THREADS)
+		threads = OZF_POOL_MAX_THREADS;
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+
+	for (pool->threads = 0; pool->threads < threads; pool->threads++)
+	{
+		if (pthread_create(&pool->workers[pool->threads], NULL,
+			ozf_pool_worker, pool) != 0)
+			break;
+	}
+
+	if (pool->threads == 0)
+	{
+		ozf_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_pool_push(ozf_pool* pool, ozf_pool_job job, void* arg)
+{
+	ozf_pool_item* item = (ozf_pool_item*)malloc(sizeof(ozf_pool_item));
+
+	if (!item)
+		return -1;
+
+	item->job = job;
+	item->arg = arg;
+	item->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->tail)
+		pool->tail->next = item;
+	else
+		pool->head = item;
+
+	pool->tail = item;
+
+	pthread_cond_signal(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_pool_destroy(ozf_pool* pool)
+{
+	int i;
+
+	if (!pool)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->threads; i++)
+		pthread_join(pool->workers[i], NULL);
+
+	pthread_cond_destroy(&pool->wake);
+	pthread_mutex_destroy(&pool->lock);
+
+	free(pool);
+}
+
+#else
+
+/*--------------------------------------------------------------------------*/
+struct ozf_pool
+{
+	int				threads;
+};
+
+/*--------------------------------------------------------------------------*/
+ozf_pool* ozf_pool_create(int threads)
+{
+	return (ozf_pool*)calloc(1, sizeof(ozf_pool));
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_pool_push(ozf_pool* pool, ozf_pool_job job, void* arg)
+{
+	job(arg);
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_pool_destroy(ozf_pool* pool)
+{
+	free(pool);
+}
+
+#endif
+
+/*--------------------------------------------------------------------------*/
+int ozf_pool_threads(ozf_pool* pool)
+{
+	return pool->threads;
+}
@@ -0,0 +1,48 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __OZF_POOL_INCLUDED
+#define __OZF_POOL_INCLUDED
+
+/*--------------------------------------------------------------------------*/
+// Minimal fixed-size worker pool. Jobs run in submission order on any free
+// worker; without pthreads ozf_pool_push() runs the job in the caller.
+typedef struct ozf_pool ozf_pool;
+
+typedef void (*ozf_pool_job)(void* arg);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+ozf_pool*	ozf_pool_create(int threads);
+int			ozf_pool_push(ozf_pool* pool, ozf_pool_job job, void* arg);
+int			ozf_pool_threads(ozf_pool* pool);
+void		ozf_pool_destroy(ozf_pool* pool);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,556 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "ozf_resample.h"
+#include "ozf_stats.h"
+#include "ozf_trace.h"
+
+/*--------------------------------------------------------------------------*/
+// per output column (or row) sampling positions, relative to the fetched
+// source rectangle
+typedef struct
+{
+	int		a, b;		// nearest: a; box: [a, b); bilinear: a, b
+	int		weight;		// bilinear weight of b, 0..256
+	int		valid;		// sample centre lies inside the image
+} ozf_sample;
+
+/*--------------------------------------------------------------------------*/
+static void ozf_sample_axis(ozf_sample* t, int n, double start, double step,
+							int size, int origin, int extent, int filter)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+	{
+		double centre = start + (i + 0.5) * step;
+		ozf_sample* p = &t[i];
+
+		p->valid = centre >= 0 && centre < size;
+		p->weight = 0;
+
+		if (filter == OZF_FILTER_BOX)
+		{
+			p->a = (int)floor(start + i * step);
+			p->b = (int)floor(start + (i + 1) * step);
+
+			if (p->b <= p->a)
+				p->b = p->a + 1;
+		}
+		else
+		if (filter == OZF_FILTER_BILINEAR)
+		{
+			double f = centre - 0.5;
+
+			if (f < 0)
+				f = 0;
+
+			if (f > size - 1)
+				f = size - 1;
+
+			p->a = (int)f;
+			p->b = p->a + 1 < size ? p->a + 1 : p->a;
+			p->weight = (int)((f - p->a) * 256);
+		}
+		else
+		{
+			p->a = (int)floor(centre);
+			p->b = p->a + 1;
+		}
+
+		// keep everything inside the fetched rectangle
+		p->a -= origin;
+		p->b -= origin;
+
+		if (p->a < 0)
+			p->a = 0;
+
+		if (p->a > extent - 1)
+			p->a = extent - 1;
+
+		if (p->b <= p->a && filter == OZF_FILTER_BOX)
+			p->b = p->a + 1;
+
+		if (p->b > extent)
+			p->b = filter == OZF_FILTER_BOX ? extent : extent - 1;
+
+		if (p->b < 0)
+			p->b = 0;
+	}
+}
+
+/*--------------------------------------------------------------------------*/
+static void ozf_put_pixel(unsigned char* dst, const unsigned char* rgba, int bpp)
+{
+	dst[0] = rgba[0];
+	dst[1] = rgba[1];
+	dst[2] = rgba[2];
+
+	if (bpp == 4)
+		dst[3] = rgba[3];
+}
+
+/*--------------------------------------------------------------------------*/
+static void ozf_resample_nearest(const unsigned char* src, int rw,
+								 const ozf_sample* xs, const ozf_sample* ys,
+								 int out_w, int out_h, int format,
+								 const unsigned char* palette,
+								 unsigned char* buffer, long stride)
+{
+	int bpp = ozf_format_bpp(format);
+	int i, j;
+
+	for (j = 0; j < out_h; j++)
+	{
+		const unsigned char* row = src + (long)ys[j].a * rw;
+		unsigned char* dst = buffer + (long)j * stride;
+
+		if (!ys[j].valid)
+		{
+			memset(dst, 0, (long)out_w * bpp);
+			continue;
+		}
+
+		if (format == OZF_FORMAT_INDEX)
+		{
+			for (i = 0; i < out_w; i++)
+				dst[i] = xs[i].valid ? row[xs[i].a] : 0;
+		}
+		else
+		{
+			for (i = 0; i < out_w; i++, dst += bpp)
+			{
+				if (xs[i].valid)
+					ozf_put_pixel(dst, palette + row[xs[i].a] * 4, bpp);
+				else
+					memset(dst, 0, bpp);
+			}
+		}
+	}
+}
+
+/*--------------------------------------------------------------------------*/
+// area average; output rows never share source rows, so every source pixel
+// is summed exactly once when downsampling
+static void ozf_resample_box(const unsigned char* src, int rw,
+							 const ozf_sample* xs, const ozf_sample* ys,
+							 int out_w, int out_h, int bpp,
+							 unsigned char* buffer, long stride)
+{
+	unsigned int* acc = (unsigned int*)malloc((long)out_w * 4 * sizeof(unsigned int));
+	unsigned char pixel[4];
+	int i, j, k, xx, yy;
+
+	for (j = 0; j < out_h; j++)
+	{
+		unsigned char* dst = buffer + (long)j * stride;
+
+		if (!ys[j].valid)
+		{
+			memset(dst, 0, (long)out_w * bpp);
+			continue;
+		}
+
+		memset(acc, 0, (long)out_w * 4 * sizeof(unsigned int));
+
+		for (yy = ys[j].a; yy < ys[j].b; yy++)
+		{
+			const unsigned char* row = src + (long)yy * rw * 4;
+
+			for (i = 0; i < out_w; i++)
+			{
+				unsigned int* a = acc + i * 4;
+
+				for (xx = xs[i].a; xx < xs[i].b; xx++)
+				{
+					for (k = 0; k < 4; k++)
+						a[k] += row[xx * 4 + k];
+				}
+			}
+		}
+
+		for (i = 0; i < out_w; i++, dst += bpp)
+		{
+			unsigned int n = (xs[i].b - xs[i].a) * (ys[j].b - ys[j].a);
+
+			if (!xs[i].valid || n == 0)
+			{
+				memset(dst, 0, bpp);
+				continue;
+			}
+
+			for (k = 0; k < 4; k++)
+				pixel[k] = (acc[i * 4 + k] + n / 2) / n;
+
+			ozf_put_pixel(dst, pixel, bpp);
+		}
+	}
+
+	free(acc);
+}
+
+/*--------------------------------------------------------------------------*/
+// 8 bit fixed point weights, horizontal then vertical
+static void ozf_resample_bilinear(const unsigned char* src, int rw,
+								  const ozf_sample* xs, const ozf_sample* ys,
+								  int out_w, int out_h, int bpp,
+								  unsigned char* buffer, long stride)
+{
+	unsigned char pixel[4];
+	int i, j, k;
+
+	for (j = 0; j < out_h; j++)
+	{
+		const unsigned char* r0 = src + (long)ys[j].a * rw * 4;
+		const unsigned char* r1 = src + (long)ys[j].b * rw * 4;
+		unsigned int wy = ys[j].weight;
+		unsigned char* dst = buffer + (long)j * stride;
+
+		if (!ys[j].valid)
+		{
+			memset(dst, 0, (long)out_w * bpp);
+			continue;
+		}
+
+		for (i = 0; i < out_w; i++, dst += bpp)
+		{
+			const unsigned char* p00 = r0 + xs[i].a * 4;
+			const unsigned char* p01 = r0 + xs[i].b * 4;
+			const unsigned char* p10 = r1 + xs[i].a * 4;
+			const unsigned char* p11 = r1 + xs[i].b * 4;
+			unsigned int wx = xs[i].weight;
+
+			if (!xs[i].valid)
+			{
+				memset(dst, 0, bpp);
+				continue;
+			}
+
+			for (k = 0; k < 4; k++)
+			{
+				unsigned int top = p00[k] * (256 - wx) + p01[k] * wx;
+				unsigned int bottom = p10[k] * (256 - wx) + p11[k] * wx;
+
+				pixel[k] = (top * (256 - wy) + bottom * wy + 32768) >> 16;
+			}
+
+			ozf_put_pixel(dst, pixel, bpp);
+		}
+	}
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_pick_scale(ozf_stream* s, double w, double h, int out_w, int out_h)
+{
+	int scales = ozf_num_scales(s);
+	double w0 = ozf_scale_dx(s, 0);
+	double h0 = ozf_scale_dy(s, 0);
+	int best = 0, i;
+
+	if (w0 <= 0 || h0 <= 0)
+		return 0;
+
+	for (i = 1; i < scales; i++)
+	{
+		int lw = ozf_scale_dx(s, i);
+		int lh = ozf_scale_dy(s, i);
+
+		// half a pixel of slack for the rounding of odd level sizes
+		if (w * lw / w0 + 0.5 >= out_w && h * lh / h0 + 0.5 >= out_h &&
+			lw < ozf_scale_dx(s, best))
+			best = i;
+	}
+
+	return best;
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_read_scaled(ozf_stream* s, double x, double y, double w, double h,
+					int out_w, int out_h, int format, int filter,
+					unsigned char* buffer, long stride)
+{
+	if (out_w <= 0 || out_h <= 0 || w <= 0 || h <= 0)
+		return -1;
+
+	return ozf_read_scaled_level(s, ozf_pick_scale(s, w, h, out_w, out_h),
+								 x, y, w, h, out_w, out_h, format, filter,
+								 buffer, stride);
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_read_scaled_level(ozf_stream* s, int scale,
+						  double x, double y, double w, double h,
+						  int out_w, int out_h, int format, int filter,
+						  unsigned char* buffer, long stride)
+{
+	int bpp = ozf_format_bpp(format);
+
+	if (out_w <= 0 || out_h <= 0 || w <= 0 || h <= 0 || !bpp)
+		return -1;
+
+	if (scale < 0 || scale > ozf_num_scales(s) || ozf_scale_dx(s, 0) <= 0 ||
+		ozf_scale_dy(s, 0) <= 0)
+		return -1;
+
+	if (stride == 0)
+		stride = (long)out_w * bpp;
+
+	if (format == OZF_FORMAT_INDEX)
+		filter = OZF_FILTER_NEAREST;
+
+	OZF_TRACE_SCOPE("ozf_read_scaled", scale);
+
+	int lw = ozf_scale_dx(s, scale);
+	int lh = ozf_scale_dy(s, scale);
+
+	// window in level pixels
+	double kx = (double)lw / ozf_scale_dx(s, 0);
+	double ky = (double)lh / ozf_scale_dy(s, 0);
+	double sx = x * kx, sw = w * kx;
+	double sy = y * ky, sh = h * ky;
+
+	// fetched source rectangle, one pixel of margin for the bilinear taps
+	int rx0 = (int)floor(sx) - 1, rx1 = (int)ceil(sx + sw) + 1;
+	int ry0 = (int)floor(sy) - 1, ry1 = (int)ceil(sy + sh) + 1;
+
+	if (rx0 < 0) rx0 = 0;
+	if (ry0 < 0) ry0 = 0;
+	if (rx1 > lw) rx1 = lw;
+	if (ry1 > lh) ry1 = lh;
+
+	if (rx1 <= rx0 || ry1 <= ry0)
+	{
+		int j;
+
+		for (j = 0; j < out_h; j++)
+			memset(buffer + (long)j * stride, 0, (long)out_w * bpp);
+
+		return scale;
+	}
+
+	int rw = rx1 - rx0, rh = ry1 - ry0;
+	int src_format = filter == OZF_FILTER_NEAREST ? OZF_FORMAT_INDEX : OZF_FORMAT_RGBA;
+
+	unsigned char* src = (unsigned char*)malloc((long)rw * rh * ozf_format_bpp(src_format));
+	ozf_sample* xs = (ozf_sample*)malloc(out_w * sizeof(ozf_sample));
+	ozf_sample* ys = (ozf_sample*)malloc(out_h * sizeof(ozf_sample));
+	unsigned char palette[256 * 4];
+
+	int rc = ozf_read_region(s, scale, rx0, ry0, rw, rh, src_format, src, 0);
+
+	if (rc == 0)
+	{
+		ozf_get_palette(s, scale, palette);
+
+		ozf_sample_axis(xs, out_w, sx, sw / out_w, lw, rx0, rw, filter);
+		ozf_sample_axis(ys, out_h, sy, sh / out_h, lh, ry0, rh, filter);
+
+		unsigned long long t0 = ozf_stats_clock(), t1;
+
+		switch (filter)
+		{
+			case OZF_FILTER_BOX:
+				ozf_resample_box(src, rw, xs, ys, out_w, out_h, bpp, buffer, stride);
+				break;
+
+			case OZF_FILTER_BILINEAR:
+				ozf_resample_bilinear(src, rw, xs, ys, out_w, out_h, bpp, buffer, stride);
+				break;
+
+			default:
+				ozf_resample_nearest(src, rw, xs, ys, out_w, out_h, format,
+									 palette, buffer, stride);
+				break;
+		}
+
+		t1 = ozf_stats_clock();
+		OZF_STATS_ADD(ozf_stats_local(), ns_expand, t1 - t0);
+		OZF_TRACE_SPAN("resample", t0, t1, scale, -1, -1);
+	}
+
+	free(ys);
+	free(xs);
+	free(src);
+
+	return rc == 0 ? scale : -1;
+}
+
+/*--------------------------------------------------------------------------*/
+typedef struct
+{
+	ozf_stream*				s;
+	ozf_cache*				cache;
+	int						scale;
+	int						tx, ty;		// tile of the last lookup
+	const unsigned char*	tile;
+} ozf_affine_source;
+
+/*--------------------------------------------------------------------------*/
+// palette index at a level pixel inside the image, -1 for a broken tile;
+// the memo holds only the pointer of the latest cache lookup, which the
+// cache guarantees to be valid
+static int ozf_affine_index(ozf_affine_source* src, int x, int y)
+{
+	int tx = x / OZF_TILE_WIDTH;
+	int ty = y / OZF_TILE_HEIGHT;
+
+	if (tx != src->tx || ty != src->ty)
+	{
+		src->tile = ozf_cache_get(src->cache, src->s, src->scale, tx, ty);
+		src->tx = tx;
+		src->ty = ty;
+	}
+
+	if (!src->tile)
+		return -1;
+
+	return src->tile[(OZF_TILE_HEIGHT - 1 - y % OZF_TILE_HEIGHT) * OZF_TILE_WIDTH
+					 + x % OZF_TILE_WIDTH];
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_read_affine(ozf_stream* s, ozf_cache* cache, const ozf_viewport* vp,
+					int out_w, int out_h, int format, int filter,
+					unsigned char* buffer, long stride)
+{
+	int bpp = ozf_format_bpp(format);
+
+	if (out_w <= 0 || out_h <= 0 || vp->scale <= 0 || !bpp || !cache)
+		return -1;
+
+	if (ozf_scale_dx(s, 0) <= 0 || ozf_scale_dy(s, 0) <= 0)
+		return -1;
+
+	if (stride == 0)
+		stride = (long)out_w * bpp;
+
+	if (format == OZF_FORMAT_INDEX)
+		filter = OZF_FILTER_NEAREST;
+
+	int scale = ozf_pick_scale(s, vp->scale * out_w, vp->scale * out_h, out_w, out_h);
+
+	OZF_TRACE_SCOPE("ozf_read_affine", scale);
+
+	unsigned long long t0 = ozf_stats_clock(), t1;
+
+	int lw = ozf_scale_dx(s, scale);
+	int lh = ozf_scale_dy(s, scale);
+
+	// output pixel steps in level pixels
+	double kx = (double)lw / ozf_scale_dx(s, 0);
+	double ky = (double)lh / ozf_scale_dy(s, 0);
+	double ax = vp->scale * cos(vp->rotation), ay = vp->scale * sin(vp->rotation);
+
+	ozf_affine_source src = { s, cache, scale, -1, -1, NULL };
+	unsigned char palette[256 * 4];
+	unsigned char pixel[4];
+	int i, j, k;
+
+	ozf_get_palette(s, scale, palette);
+
+	for (j = 0; j < out_h; j++)
+	{
+		unsigned char* dst = buffer + (long)j * stride;
+		double dy = j + 0.5 - out_h / 2.0;
+		double dx = 0.5 - out_w / 2.0;
+
+		double X0 = vp->cx + dx * ax - dy * ay;
+		double Y0 = vp->cy + dx * ay + dy * ax;
+
+		for (i = 0; i < out_w; i++, dst += bpp)
+		{
+			double lx = (X0 + i * ax) * kx;
+			double ly = (Y0 + i * ay) * ky;
+
+			if (lx < 0 || ly < 0 || lx >= lw || ly >= lh)
+			{
+				memset(dst, 0, bpp);
+				continue;
+			}
+
+			if (filter == OZF_FILTER_NEAREST)
+			{
+				int c = ozf_affine_index(&src, (int)lx, (int)ly);
+
+				if (c < 0)
+					memset(dst, 0, bpp);
+				else
+				if (format == OZF_FORMAT_INDEX)
+					dst[0] = c;
+				else
+					ozf_put_pixel(dst, palette + c * 4, bpp);
+
+				continue;
+			}
+
+			double fx = lx - 0.5, fy = ly - 0.5;
+
+			if (fx < 0) fx = 0;
+			if (fy < 0) fy = 0;
+			if (fx > lw - 1) fx = lw - 1;
+			if (fy > lh - 1) fy = lh - 1;
+
+			int x0 = (int)fx, y0 = (int)fy;
+			int x1 = x0 + 1 < lw ? x0 + 1 : x0;
+			int y1 = y0 + 1 < lh ? y0 + 1 : y0;
+			unsigned int wx = (unsigned int)((fx - x0) * 256);
+			unsigned int wy = (unsigned int)((fy - y0) * 256);
+
+			int c00 = ozf_affine_index(&src, x0, y0);
+			int c01 = ozf_affine_index(&src, x1, y0);
+			int c10 = ozf_affine_index(&src, x0, y1);
+			int c11 = ozf_affine_index(&src, x1, y1);
+
+			if (c00 < 0 || c01 < 0 || c10 < 0 || c11 < 0)
+			{
+				memset(dst, 0, bpp);
+				continue;
+			}
+
+			for (k = 0; k < 4; k++)
+			{
+				unsigned int top = palette[c00 * 4 + k] * (256 - wx) + palette[c01 * 4 + k] * wx;
+				unsigned int bottom = palette[c10 * 4 + k] * (256 - wx) + palette[c11 * 4 + k] * wx;
+
+				pixel[k] = (top * (256 - wy) + bottom * wy + 32768) >> 16;
+			}
+
+			ozf_put_pixel(dst, pixel, bpp);
+		}
+	}
+
+	t1 = ozf_stats_clock();
+	OZF_STATS_ADD(ozf_stats_local(), ns_expand, t1 - t0);
+	OZF_TRACE_SPAN("resample", t0, t1, scale, -1, -1);
+
+	return scale;
+}
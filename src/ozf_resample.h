@@ -0,0 +1,82 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __OZF_RESAMPLE_INCLUDED
+#define __OZF_RESAMPLE_INCLUDED
+
+#include "ozf_decoder.h"
+#include "ozf_cache.h"
+
+/*--------------------------------------------------------------------------*/
+#define OZF_FILTER_NEAREST		0
+#define OZF_FILTER_BOX			1
+#define OZF_FILTER_BILINEAR		2
+
+/*--------------------------------------------------------------------------*/
+// Screen placement for ozf_read_affine. The output centre shows (cx, cy)
+// in level 0 pixels, one output pixel covers scale level 0 pixels, and
+// the screen axes are turned clockwise over the map by rotation radians,
+// so a heading of h gives a heading-up display with rotation = h.
+typedef struct
+{
+	double	cx, cy;
+	double	rotation;
+	double	scale;
+} ozf_viewport;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// smallest embedded level that still has at least out_w x out_h pixels
+// for a w x h window given in level 0 pixels
+int			ozf_pick_scale(ozf_stream* s, double w, double h, int out_w, int out_h);
+
+// Renders the window (x, y, w, h), in level 0 pixels, to out_w x out_h
+// pixels of format, decoding only the tiles of the picked level that the
+// window touches. OZF_FORMAT_INDEX output is always nearest-neighbour.
+// Output pixels outside the image are zeroed. Returns the level used, or
+// -1 on bad arguments or read errors.
+int			ozf_read_scaled(ozf_stream* s, double x, double y, double w, double h,
+							int out_w, int out_h, int format, int filter,
+							unsigned char* buffer, long stride);
+
+// same with the level chosen by the caller
+int			ozf_read_scaled_level(ozf_stream* s, int scale,
+								  double x, double y, double w, double h,
+								  int out_w, int out_h, int format, int filter,
+								  unsigned char* buffer, long stride);
+
+// Fills out_w x out_h pixels by sampling the tiles of the level picked
+// for vp->scale directly through cache, nearest or bilinear (box falls
+// back to bilinear). Returns the level used, or -1 on bad arguments.
+int			ozf_read_affine(ozf_stream* s, ozf_cache* cache, const ozf_viewport* vp,
+							int out_w, int out_h, int format, int filter,
+							unsigned char* buffer, long stride);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
@@ -0,0 +1,593 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "ozf_sidecar.h"
+#include "ozf_stats.h"
+#include "ozf_trace.h"
+#include "log_stream.h"
+
+#if defined(HAVE_UNISTD_H) && defined(HAVE_SYS_STAT_H)
+
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#endif
+
+/*--------------------------------------------------------------------------*/
+#define OZF_SIDECAR_MAGIC		"OZFIDX\r\n"
+#define OZF_SIDECAR_VERSION		5
+#define OZF_SIDECAR_BYTE_ORDER	0x01020304
+#define OZF_SIDECAR_EXTENSION	".ozfidx"
+
+#define OZF_SIDECAR_ALIGN(n)	(((n) + 7) & ~(unsigned long)7)
+
+#define OZF_SIDECAR_TABLE		1	// the scale has its tile table saved
+#define OZF_SIDECAR_INFO		2	// and its tile infos
+
+#define OZF_LOG(s, level, ...)		LOGSTREAM(level, (s)->name, __VA_ARGS__)
+
+/*--------------------------------------------------------------------------*/
+// Native layout, readable only by a build with the same byte order: this
+// header, the ozf2 or ozf3 header, the scales table, one
+// ozf_sidecar_scale per scale, the tile tables and the tile infos (one
+// entry less than the table) of the scales that have them, each part 8
+// aligned.
+typedef struct
+{
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	byte_order;
+	uint32_t	entry_size;	// of the table entries
+	uint32_t	type;
+	uint64_t	file_size;
+	int64_t		file_mtime;
+	uint64_t	key;
+	uint64_t	scales;
+	uint64_t	size;		// of the sidecar, catches truncated files
+} ozf_sidecar_header;
+
+typedef struct
+{
+	uint64_t			offset;		// of the header, unwrapped
+	ozf_image_header	header;
+	unsigned int		tiles;
+	int					encryption_depth;
+	uint32_t			parts;		// OZF_SIDECAR_TABLE, OZF_SIDECAR_INFO
+} ozf_sidecar_scale;
+
+/*--------------------------------------------------------------------------*/
+static int		sidecar_mode = OZF_SIDECAR_ON;
+static char*	sidecar_dir = NULL;
+
+/*--------------------------------------------------------------------------*/
+void ozf_sidecar_setup(int mode, const char* cache_dir)
+{
+	sidecar_mode = mode;
+
+	free(sidecar_dir);
+	sidecar_dir = cache_dir && *cache_dir ? strdup(cache_dir) : NULL;
+}
+
+/*--------------------------------------------------------------------------*/
+// <map>.ozfidx
+static char* ozf_sidecar_beside(ozf_stream* s)
+{
+	char* path = (char*)malloc(strlen(s->path) + sizeof(OZF_SIDECAR_EXTENSION));
+
+	strcpy(path, s->path);
+	strcat(path, OZF_SIDECAR_EXTENSION);
+
+	return path;
+}
+
+/*--------------------------------------------------------------------------*/
+// <cache dir>/<hash of the absolute map path>.ozfidx, the directory is
+// created first if create is set
+static char* ozf_sidecar_cached(ozf_stream* s, int create)
+{
+	char dir[4096];
+	const char* env;
+
+	if (sidecar_dir)
+		snprintf(dir, sizeof(dir), "%s", sidecar_dir);
+	else if ((env = getenv("XDG_CACHE_HOME")) && *env)
+		snprintf(dir, sizeof(dir), "%s/ozitools", env);
+	else if ((env = getenv("HOME")) && *env)
+		snprintf(dir, sizeof(dir), "%s/.cache/ozitools", env);
+	else
+		return NULL;
+
+	if (create)
+	{
+		char* p;
+
+		for (p = strchr(dir + 1, '/'); p; p = strchr(p + 1, '/'))
+		{
+			*p = '\0';
+			mkdir(dir, 0755);
+			*p = '/';
+		}
+
+		mkdir(dir, 0755);
+	}
+
+	char* real = realpath(s->path, NULL);
+	const char* key = real ? real : s->path;
+
+	// FNV-1a
+	unsigned long long h = 0xcbf29ce484222325ULL;
+
+	for (; *key; key++)
+		h = (h ^ (unsigned char)*key) * 0x100000001b3ULL;
+
+	free(real);
+
+	char* path = (char*)malloc(strlen(dir) + 32);
+
+	sprintf(path, "%s/%016llx%s", dir, h, OZF_SIDECAR_EXTENSION);
+
+	return path;
+}
+
+/*--------------------------------------------------------------------------*/
+static void* ozf_sidecar_map(const char* path, unsigned long* size)
+{
+	struct stat st;
+	void* data = NULL;
+	int fd = open(path, O_RDONLY);
+
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(ozf_sidecar_header))
+	{
+		*size = (unsigned long)st.st_size;
+
+#ifdef HAVE_SYS_MMAN_H
+		data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+		if (data == MAP_FAILED)
+			data = NULL;
+#else
+		data = malloc(*size);
+
+		if (data && pread(fd, data, *size, 0) != (ssize_t)*size)
+		{
+			free(data);
+			data = NULL;
+		}
+#endif
+	}
+
+	close(fd);
+
+	return data;
+}
+
+/*--------------------------------------------------------------------------*/
+static void ozf_sidecar_unmap(void* data, unsigned long size)
+{
+#ifdef HAVE_SYS_MMAN_H
+	munmap(data, size);
+#else
+	free(data);
+#endif
+}
+
+/*--------------------------------------------------------------------------*/
+// Checks the sidecar against the stream and everything it points to
+// against the file size, then sets the stream up from it.
+static int ozf_sidecar_apply(ozf_stream* s, unsigned char* data,
+							 unsigned long size, const struct stat* st)
+{
+	const ozf_sidecar_header* h = (const ozf_sidecar_header*)data;
+	unsigned long offset, i, j, head_size;
+
+	if (memcmp(h->magic, OZF_SIDECAR_MAGIC, sizeof(h->magic)) != 0 ||
+		h->version != OZF_SIDECAR_VERSION ||
+		h->byte_order != OZF_SIDECAR_BYTE_ORDER ||
+		h->entry_size != sizeof(unsigned int) ||
+		h->type != (uint32_t)s->type ||
+		h->file_size != (uint64_t)s->size ||
+		h->file_mtime != (int64_t)st->st_mtime ||
+		h->size != (uint64_t)size ||
+		h->scales == 0 || h->scales > size / sizeof(ozf_sidecar_scale))
+		return -1;
+
+	head_size = s->type == OZF_STREAM_ENCRYPTED ?
+		sizeof(ozf3_header) : sizeof(ozf2_header);
+
+	offset = OZF_SIDECAR_ALIGN(sizeof(ozf_sidecar_header));
+	unsigned long head_offset = offset;
+	offset += OZF_SIDECAR_ALIGN(head_size);
+	unsigned long scales_offset = offset;
+	offset += OZF_SIDECAR_ALIGN(h->scales * sizeof(unsigned int));
+	const ozf_sidecar_scale* scales = (const ozf_sidecar_scale*)(data + offset);
+	offset += h->scales * sizeof(ozf_sidecar_scale);
+
+	if (offset > size)
+		return -1;
+
+	unsigned long tables = offset;
+
+	for (i = 0; i < h->scales; i++)
+	{
+		const ozf_sidecar_scale* sc = &scales[i];
+		unsigned int* table = (unsigned int*)(data + offset);
+
+		// the depth was found in the first tile, no tile is larger than the file
+		ozf_offset tile_size = s->size;
+
+		if (sc->tiles != (unsigned int)(sc->header.xtiles * sc->header.ytiles + 1) ||
+			sc->offset > (uint64_t)s->size)
+			return -1;
+
+		if (sc->parts & OZF_SIDECAR_TABLE)
+		{
+			if (sc->tiles > (size - offset) / sizeof(unsigned int))
+				return -1;
+
+			for (j = 0; j < sc->tiles; j++)
+				if (table[j] > s->size)
+					return -1;
+
+			tile_size = sc->tiles > 1 && table[1] > table[0] ? table[1] - table[0] : 0;
+			offset += sc->tiles * sizeof(unsigned int);
+		}
+
+		if (sc->encryption_depth != -1 &&
+			(sc->encryption_depth < 4 || (ozf_offset)sc->encryption_depth > tile_size))
+			return -1;
+	}
+
+	unsigned long infos = offset;
+
+	for (i = 0; i < h->scales; i++)
+	{
+		const ozf_sidecar_scale* sc = &scales[i];
+		unsigned int* info = (unsigned int*)(data + offset);
+
+		if (!(sc->parts & OZF_SIDECAR_INFO))
+			continue;
+
+		if (sc->tiles - 1 > (size - offset) / sizeof(unsigned int))
+			return -1;
+
+		// copies point back to the first one
+		for (j = 0; j < sc->tiles - 1; j++)
+			if (info[j] & OZF_TILE_UNIFORM ? info[j] > (OZF_TILE_UNIFORM | 0xff) : info[j] > j)
+				return -1;
+
+		offset += (sc->tiles - 1) * sizeof(unsigned int);
+	}
+
+	if (offset != size)
+		return -1;
+
+	// ------------------------------------------------------------------------
+	s->key = (unsigned long)h->key;
+	s->scales = (unsigned long)h->scales;
+	s->scales_table = (unsigned int*)(data + scales_offset);
+	s->images = (ozf_image*)ozf_malloc(s->scales * sizeof(ozf_image));
+
+	if (s->type == OZF_STREAM_ENCRYPTED)
+	{
+		s->ozf3 = (ozf3_header*)ozf_malloc(sizeof(ozf3_header));
+		memcpy(s->ozf3, data + head_offset, sizeof(ozf3_header));
+	}
+	else
+	{
+		s->ozf2 = (ozf2_header*)ozf_malloc(sizeof(ozf2_header));
+		memcpy(s->ozf2, data + head_offset, sizeof(ozf2_header));
+	}
+
+	offset = tables;
+
+	for (i = 0; i < s->scales; i++)
+	{
+		s->images[i].offset = scales[i].offset;
+		s->images[i].header = scales[i].header;
+		s->images[i].tiles = scales[i].tiles;
+		s->images[i].encryption_depth = scales[i].encryption_depth;
+		s->images[i].tiles_table = NULL;
+		s->images[i].tiles_info = NULL;
+
+		// scales not used before are read when first used, as without a sidecar
+		if (scales[i].parts & OZF_SIDECAR_TABLE)
+		{
+			s->images[i].tiles_table = (unsigned int*)(data + offset);
+			offset += scales[i].tiles * sizeof(unsigned int);
+		}
+
+		if (scales[i].parts & OZF_SIDECAR_INFO)
+		{
+			s->images[i].tiles_info = (unsigned int*)(data + infos);
+			infos += (scales[i].tiles - 1) * sizeof(unsigned int);
+		}
+	}
+
+	s->sidecar = data;
+	s->sidecar_size = size;
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_sidecar_load(ozf_stream* s)
+{
+	struct stat st;
+	char* paths[2];
+	int i, result = -1;
+
+	if (sidecar_mode == OZF_SIDECAR_OFF || stat(s->path, &st) != 0)
+		return -1;
+
+	OZF_TRACE_SCOPE("ozf_sidecar_load");
+
+	// where ozf_sidecar_save() writes first
+	int beside = sidecar_mode == OZF_SIDECAR_BESIDE;
+
+	paths[!beside] = ozf_sidecar_beside(s);
+	paths[beside] = ozf_sidecar_cached(s, 0);
+
+	for (i = 0; i < 2 && result != 0; i++)
+	{
+		unsigned long size = 0;
+		void* data;
+
+		if (!paths[i] || !(data = ozf_sidecar_map(paths[i], &size)))
+			continue;
+
+		result = ozf_sidecar_apply(s, (unsigned char*)data, size, &st);
+
+		if (result == 0)
+			OZF_LOG(s, LOGSTREAM_DEBUG, "index loaded from %s\n", paths[i]);
+		else
+			ozf_sidecar_unmap(data, size);
+	}
+
+	free(paths[0]);
+	free(paths[1]);
+
+	return result;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_sidecar_release(ozf_stream* s)
+{
+	if (s->sidecar)
+		ozf_sidecar_unmap(s->sidecar, s->sidecar_size);
+
+	s->sidecar = NULL;
+	s->sidecar_size = 0;
+}
+
+/*--------------------------------------------------------------------------*/
+int ozf_sidecar_owns(ozf_stream* s, const void* p)
+{
+	const unsigned char* data = (const unsigned char*)s->sidecar;
+
+	return data && (const unsigned char*)p >= data &&
+		(const unsigned char*)p < data + s->sidecar_size;
+}
+
+/*--------------------------------------------------------------------------*/
+static int ozf_sidecar_write(ozf_stream* s, const char* path,
+							 const ozf_sidecar_header* h)
+{
+	static const unsigned char zero[8] = { 0 };
+	char* tmp = (char*)malloc(strlen(path) + 32);
+	unsigned long i, head_size;
+	int ok;
+
+	// written aside and renamed, concurrent readers never see half a file
+	sprintf(tmp, "%s.%ld.tmp", path, (long)getpid());
+
+	FILE* f = fopen(tmp, "wb");
+
+	if (!f)
+	{
+		free(tmp);
+		return -1;
+	}
+
+	head_size = s->type == OZF_STREAM_ENCRYPTED ?
+		sizeof(ozf3_header) : sizeof(ozf2_header);
+
+	ok = fwrite(h, sizeof(*h), 1, f) == 1;
+	ok = ok && fwrite(zero, OZF_SIDECAR_ALIGN(sizeof(*h)) - sizeof(*h), 1, f) <= 1;
+	ok = ok && fwrite(s->type == OZF_STREAM_ENCRYPTED ? (void*)s->ozf3 : (void*)s->ozf2,
+					  head_size, 1, f) == 1;
+	ok = ok && fwrite(zero, OZF_SIDECAR_ALIGN(head_size) - head_size, 1, f) <= 1;
+	ok = ok && fwrite(s->scales_table, sizeof(unsigned int) * s->scales, 1, f) == 1;
+	ok = ok && fwrite(zero, OZF_SIDECAR_ALIGN(sizeof(unsigned int) * s->scales) -
+					  sizeof(unsigned int) * s->scales, 1, f) <= 1;
+
+	for (i = 0; ok && i < s->scales; i++)
+	{
+		ozf_sidecar_scale sc;
+
+		memset(&sc, 0, sizeof(sc));
+		sc.offset = s->images[i].offset;
+		sc.header = s->images[i].header;
+		sc.tiles = s->images[i].tiles;
+		sc.encryption_depth = s->images[i].encryption_depth;
+
+		if (s->images[i].tiles_table)
+			sc.parts |= OZF_SIDECAR_TABLE;
+
+		if (s->images[i].tiles_info)
+			sc.parts |= OZF_SIDECAR_INFO;
+
+		ok = fwrite(&sc, sizeof(sc), 1, f) == 1;
+	}
+
+	for (i = 0; ok && i < s->scales; i++)
+		if (s->images[i].tiles_table)
+			ok = fwrite(s->images[i].tiles_table,
+						sizeof(unsigned int) * s->images[i].tiles, 1, f) == 1;
+
+	for (i = 0; ok && i < s->scales; i++)
+		if (s->images[i].tiles_info)
+			ok = fwrite(s->images[i].tiles_info,
+						sizeof(unsigned int) * (s->images[i].tiles - 1), 1, f) <= 1;
+
+	if (fclose(f) != 0)
+		ok = 0;
+
+	ok = ok && rename(tmp, path) == 0;
+
+	if (!ok)
+		unlink(tmp);
+
+	free(tmp);
+
+	return ok ? 0 : -1;
+}
+
+/*--------------------------------------------------------------------------*/
+// Only what was loaded is saved, no table is read for the sidecar. A
+// sidecar already in use is rewritten if scales were used it lacks.
+int ozf_sidecar_save(ozf_stream* s, long mtime)
+{
+	ozf_sidecar_header h;
+	struct stat st;
+	unsigned long i, size, head_size;
+	int changed = !s->sidecar;
+
+	if (sidecar_mode == OZF_SIDECAR_OFF || !s->scales ||
+		!s->images || !(s->ozf2 || s->ozf3))
+		return -1;
+
+	for (i = 0; i < s->scales && !changed; i++)
+	{
+		ozf_image* image = &s->images[i];
+
+		if ((image->tiles_table && !ozf_sidecar_owns(s, image->tiles_table)) ||
+			(image->tiles_info && !ozf_sidecar_owns(s, image->tiles_info)))
+			changed = 1;
+	}
+
+	if (!changed)
+		return 0;
+
+	// the file must still be the one that was parsed
+	if (stat(s->path, &st) != 0 || (ozf_offset)st.st_size != s->size ||
+		(long)st.st_mtime != mtime)
+		return -1;
+
+	OZF_TRACE_SCOPE("ozf_sidecar_save");
+
+	head_size = s->type == OZF_STREAM_ENCRYPTED ?
+		sizeof(ozf3_header) : sizeof(ozf2_header);
+
+	size =	OZF_SIDECAR_ALIGN(sizeof(h)) + OZF_SIDECAR_ALIGN(head_size) +
+			OZF_SIDECAR_ALIGN(sizeof(unsigned int) * s->scales) +
+			sizeof(ozf_sidecar_scale) * s->scales;
+
+	for (i = 0; i < s->scales; i++)
+	{
+		if (s->images[i].tiles_table)
+			size += sizeof(unsigned int) * s->images[i].tiles;
+
+		if (s->images[i].tiles_info)
+			size += sizeof(unsigned int) * (s->images[i].tiles - 1);
+	}
+
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, OZF_SIDECAR_MAGIC, sizeof(h.magic));
+	h.version		= OZF_SIDECAR_VERSION;
+	h.byte_order	= OZF_SIDECAR_BYTE_ORDER;
+	h.entry_size	= sizeof(unsigned int);
+	h.type			= s->type;
+	h.file_size		= s->size;
+	h.file_mtime	= st.st_mtime;
+	h.key			= s->key;
+	h.scales		= s->scales;
+	h.size			= size;
+
+	// beside the map only if asked to, the map directory may be shared
+	char* path = NULL;
+	int result = -1;
+
+	if (sidecar_mode == OZF_SIDECAR_BESIDE)
+	{
+		path = ozf_sidecar_beside(s);
+		result = ozf_sidecar_write(s, path, &h);
+	}
+
+	if (result != 0)
+	{
+		free(path);
+		path = ozf_sidecar_cached(s, 1);
+		result = path ? ozf_sidecar_write(s, path, &h) : -1;
+	}
+
+	if (result == 0)
+		OZF_LOG(s, LOGSTREAM_DEBUG, "index saved to %s\n", path);
+
+	free(path);
+
+	return result;
+}
+
+#else
+
+/*--------------------------------------------------------------------------*/
+void ozf_sidecar_setup(int mode, const char* cache_dir)
+{
+}
+
+int ozf_sidecar_load(ozf_stream* s)
+{
+	return -1;
+}
+
+int ozf_sidecar_save(ozf_stream* s, long mtime)
+{
+	return -1;
+}
+
+void ozf_sidecar_release(ozf_stream* s)
+{
+}
+
+int ozf_sidecar_owns(ozf_stream* s, const void* p)
+{
+	return 0;
+}
+
+#endif
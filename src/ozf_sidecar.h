@@ -0,0 +1,61 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+
+#ifndef __OZF_SIDECAR_INCLUDED
+#define __OZF_SIDECAR_INCLUDED
+
+#include "ozf_decoder.h"
+
+/*--------------------------------------------------------------------------*/
+// Parsed headers, palettes, tile tables, tile infos and encryption depths
+// of a stream are saved to the cache directory, or with OZF_SIDECAR_BESIDE
+// to <file>.ozfidx unless the map directory is not writable, and mapped on
+// the next ozf_open() of the same file instead of being read and decrypted
+// again. Both places are looked up on open. A sidecar is only used
+// if the file size and modification time it was made for still match. It
+// is written when the last reader of the file closes it, with the tables of
+// the scales used so far.
+#define OZF_SIDECAR_OFF			0
+#define OZF_SIDECAR_ON			1
+#define OZF_SIDECAR_BESIDE		2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// cache_dir NULL means $XDG_CACHE_HOME/ozitools or ~/.cache/ozitools
+void		ozf_sidecar_setup(int mode, const char* cache_dir);
+
+// decoder internals, 0 on success
+int			ozf_sidecar_load(ozf_stream* s);
+int			ozf_sidecar_save(ozf_stream* s, long mtime);
+void		ozf_sidecar_release(ozf_stream* s);
+int			ozf_sidecar_owns(ozf_stream* s, const void* p);	// points into the mapping
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
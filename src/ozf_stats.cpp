@@ -0,0 +1,336 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "ozf_stats.h"
+
+/*--------------------------------------------------------------------------*/
+// Only the owning thread writes stats. A reset does not touch them, it
+// records them as the base the readers subtract.
+typedef struct ozf_stats_block
+{
+	ozf_stats				stats;
+	ozf_stats				base;	// at the last reset, under stats_lock
+	struct ozf_stats_block*	next;
+} ozf_stats_block;
+
+/*--------------------------------------------------------------------------*/
+static const char* stats_names[OZF_STATS_FIELDS] =
+{
+	"BYTES_READ",
+	"TILES_DECODED",
+	"TILES_SKIPPED",
+	"NS_READ",
+	"NS_DECRYPT",
+	"NS_INFLATE",
+	"NS_EXPAND",
+	"CACHE_HITS",
+	"CACHE_MISSES",
+	"BYTES_ALLOCATED"
+};
+
+#ifdef HAVE_PTHREAD_H
+
+/*--------------------------------------------------------------------------*/
+static pthread_mutex_t	stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t	stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	stats_key;
+
+static ozf_stats_block*	stats_blocks = NULL;	// live threads
+static ozf_stats		stats_retired;			// sum of finished threads
+
+#ifdef OZF_THREAD_LOCAL
+static OZF_THREAD_LOCAL ozf_stats_block* stats_tls = NULL;
+#define OZF_STATS_TLS()			stats_tls
+#define OZF_STATS_TLS_SET(b)	(stats_tls = (b))
+#else
+#define OZF_STATS_TLS() \
+	(pthread_once(&stats_once, ozf_stats_init), \
+	 (ozf_stats_block*)pthread_getspecific(stats_key))
+#define OZF_STATS_TLS_SET(b)
+#endif
+
+/*--------------------------------------------------------------------------*/
+#define OZF_STATS_DELTA(b, field) \
+	(OZF_ATOMIC_LOAD(&(b)->stats.field, OZF_RELAXED) - (b)->base.field)
+
+static void ozf_stats_accumulate(ozf_stats* dst, const ozf_stats_block* src)
+{
+	dst->bytes_read		+= OZF_STATS_DELTA(src, bytes_read);
+	dst->tiles_decoded	+= OZF_STATS_DELTA(src, tiles_decoded);
+	dst->tiles_skipped	+= OZF_STATS_DELTA(src, tiles_skipped);
+	dst->ns_read		+= OZF_STATS_DELTA(src, ns_read);
+	dst->ns_decrypt		+= OZF_STATS_DELTA(src, ns_decrypt);
+	dst->ns_inflate		+= OZF_STATS_DELTA(src, ns_inflate);
+	dst->ns_expand		+= OZF_STATS_DELTA(src, ns_expand);
+	dst->cache_hits		+= OZF_STATS_DELTA(src, cache_hits);
+	dst->cache_misses	+= OZF_STATS_DELTA(src, cache_misses);
+	dst->bytes_allocated += OZF_STATS_DELTA(src, bytes_allocated);
+}
+
+/*--------------------------------------------------------------------------*/
+static void ozf_stats_retire(void* p)
+{
+	ozf_stats_block* block = (ozf_stats_block*)p;
+	ozf_stats_block** link;
+
+	pthread_mutex_lock(&stats_lock);
+
+	for (link = &stats_blocks; *link; link = &(*link)->next)
+	{
+		if (*link == block)
+		{
+			*link = block->next;
+			break;
+		}
+	}
+
+	ozf_stats_accumulate(&stats_retired, block);
+
+	pthread_mutex_unlock(&stats_lock);
+
+	// a later destructor freeing decoder memory makes a new block
+	OZF_STATS_TLS_SET(NULL);
+
+	free(block);
+}
+
+/*--------------------------------------------------------------------------*/
+static void ozf_stats_init(void)
+{
+	pthread_key_create(&stats_key, ozf_stats_retire);
+}
+
+/*--------------------------------------------------------------------------*/
+static ozf_stats_block* ozf_stats_block_local(void)
+{
+	ozf_stats_block* block = OZF_STATS_TLS();
+
+	if (!block)
+	{
+		block = (ozf_stats_block*)calloc(1, sizeof(ozf_stats_block));
+
+		pthread_once(&stats_once, ozf_stats_init);
+
+		pthread_mutex_lock(&stats_lock);
+		block->next = stats_blocks;
+		stats_blocks = block;
+		pthread_mutex_unlock(&stats_lock);
+
+		pthread_setspecific(stats_key, block);
+
+		OZF_STATS_TLS_SET(block);
+	}
+
+	return block;
+}
+
+/*--------------------------------------------------------------------------*/
+ozf_stats* ozf_stats_local(void)
+{
+	return &ozf_stats_block_local()->stats;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_stats_get(ozf_stats* stats)
+{
+	ozf_stats_block* block;
+
+	pthread_mutex_lock(&stats_lock);
+
+	*stats = stats_retired;
+
+	for (block = stats_blocks; block; block = block->next)
+		ozf_stats_accumulate(stats, block);
+
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_stats_get_thread(ozf_stats* stats)
+{
+	ozf_stats_block* block = ozf_stats_block_local();
+
+	memset(stats, 0, sizeof(ozf_stats));
+
+	pthread_mutex_lock(&stats_lock);
+	ozf_stats_accumulate(stats, block);
+	pthread_mutex_unlock(&stats_lock);
+}
+
+/*--------------------------------------------------------------------------*/
+// live allocation size is not a counter and survives the reset
+void ozf_stats_reset(void)
+{
+	ozf_stats_block* block;
+
+	pthread_mutex_lock(&stats_lock);
+
+	long long allocated = stats_retired.bytes_allocated;
+	memset(&stats_retired, 0, sizeof(ozf_stats));
+	stats_retired.bytes_allocated = allocated;
+
+	for (block = stats_blocks; block; block = block->next)
+	{
+		ozf_stats now;
+
+		memset(&now, 0, sizeof(now));
+		ozf_stats_accumulate(&now, block);
+
+		now.bytes_allocated = 0;
+
+		block->base.bytes_read		+= now.bytes_read;
+		block->base.tiles_decoded	+= now.tiles_decoded;
+		block->base.tiles_skipped	+= now.tiles_skipped;
+		block->base.ns_read			+= now.ns_read;
+		block->base.ns_decrypt		+= now.ns_decrypt;
+		block->base.ns_inflate		+= now.ns_inflate;
+		block->base.ns_expand		+= now.ns_expand;
+		block->base.cache_hits		+= now.cache_hits;
+		block->base.cache_misses	+= now.cache_misses;
+	}
+
+	pthread_mutex_unlock(&stats_lock);
+}
+
+#else
+
+/*--------------------------------------------------------------------------*/
+static ozf_stats stats_global;
+
+/*--------------------------------------------------------------------------*/
+ozf_stats* ozf_stats_local(void)
+{
+	return &stats_global;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_stats_get(ozf_stats* stats)
+{
+	*stats = stats_global;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_stats_get_thread(ozf_stats* stats)
+{
+	*stats = stats_global;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_stats_reset(void)
+{
+	long long allocated = stats_global.bytes_allocated;
+	memset(&stats_global, 0, sizeof(ozf_stats));
+	stats_global.bytes_allocated = allocated;
+}
+
+#endif
+
+/*--------------------------------------------------------------------------*/
+const char* ozf_stats_name(int field)
+{
+	if (field < 0 || field >= OZF_STATS_FIELDS)
+		return NULL;
+
+	return stats_names[field];
+}
+
+/*--------------------------------------------------------------------------*/
+long long ozf_stats_value(const ozf_stats* stats, int field)
+{
+	switch (field)
+	{
+		case 0:	return stats->bytes_read;
+		case 1:	return stats->tiles_decoded;
+		case 2:	return stats->tiles_skipped;
+		case 3:	return stats->ns_read;
+		case 4:	return stats->ns_decrypt;
+		case 5:	return stats->ns_inflate;
+		case 6:	return stats->ns_expand;
+		case 7:	return stats->cache_hits;
+		case 8:	return stats->cache_misses;
+		case 9:	return stats->bytes_allocated;
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+unsigned long long ozf_stats_clock(void)
+{
+#ifdef CLOCK_MONOTONIC
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#else
+	return (unsigned long long)clock() * (1000000000ULL / CLOCKS_PER_SEC);
+#endif
+}
+
+/*--------------------------------------------------------------------------*/
+// allocations are prefixed with their size, so ozf_free can account them
+#define OZF_ALLOC_PREFIX	16
+
+/*--------------------------------------------------------------------------*/
+void* ozf_malloc(size_t size)
+{
+	unsigned char* p = (unsigned char*)malloc(size + OZF_ALLOC_PREFIX);
+
+	if (!p)
+		return NULL;
+
+	*(size_t*)p = size;
+
+	OZF_STATS_ADD(ozf_stats_local(), bytes_allocated, (long long)size);
+
+	return p + OZF_ALLOC_PREFIX;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_free(void* ptr)
+{
+	if (ptr)
+	{
+		unsigned char* p = (unsigned char*)ptr - OZF_ALLOC_PREFIX;
+
+		OZF_STATS_ADD(ozf_stats_local(), bytes_allocated, -(long long)*(size_t*)p);
+
+		free(p);
+	}
+}
@@ -0,0 +1,85 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __OZF_STATS_INCLUDED
+#define __OZF_STATS_INCLUDED
+
+#include <stddef.h>
+
+#include "ozf_atomic.h"
+
+/*--------------------------------------------------------------------------*/
+// Decoder counters. Every thread updates its own block without locking,
+// readers sum all blocks (including the ones of already finished threads).
+typedef struct
+{
+	unsigned long long	bytes_read;
+	unsigned long long	tiles_decoded;
+	unsigned long long	tiles_skipped;	// uniform or shared, not inflated
+
+	unsigned long long	ns_read;
+	unsigned long long	ns_decrypt;
+	unsigned long long	ns_inflate;
+	unsigned long long	ns_expand;
+
+	unsigned long long	cache_hits;
+	unsigned long long	cache_misses;
+
+	long long			bytes_allocated;
+} ozf_stats;
+
+#define OZF_STATS_FIELDS	10
+
+/*--------------------------------------------------------------------------*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+void		ozf_stats_get(ozf_stats* stats);
+void		ozf_stats_get_thread(ozf_stats* stats);
+void		ozf_stats_reset(void);
+const char*	ozf_stats_name(int field);
+long long	ozf_stats_value(const ozf_stats* stats, int field);
+
+/*--------------------------------------------------------------------------*/
+// decoder internals
+ozf_stats*			ozf_stats_local(void);
+unsigned long long	ozf_stats_clock(void);
+
+void*		ozf_malloc(size_t size);
+void		ozf_free(void* p);
+
+#ifdef __cplusplus
+};
+#endif
+
+/*--------------------------------------------------------------------------*/
+// single writer per block, so a relaxed load/store pair is enough
+#define OZF_STATS_ADD(st, field, n) \
+	OZF_ATOMIC_STORE(&(st)->field, \
+		OZF_ATOMIC_LOAD(&(st)->field, OZF_RELAXED) + (n), \
+		OZF_RELAXED)
+
+#endif
@@ -0,0 +1,369 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+/*--------------------------------------------------------------------------*/
+// make check: ozf2 files larger than 4 GB. The header sits at the start of
+// a sparse file, the tiles and tables are written past a hole, once with
+// the tile data straddling the 4 GB mark and once well above it. Exits 77
+// (skipped) where the file system cannot hold such files sparsely.
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "ozf_decoder.h"
+#include "ozf_sidecar.h"
+
+#define TEST_PATH		"ozf_test_large.ozf2"
+#define TEST_SKIP		77
+
+#define TEST_WIDTH		128
+#define TEST_HEIGHT		128
+#define TEST_SCALES		3
+#define TEST_TILE		64
+#define TEST_MAX_TILES	4
+
+/*--------------------------------------------------------------------------*/
+typedef struct
+{
+	unsigned char*		data;
+	unsigned long		size;
+	unsigned long		allocated;
+	unsigned long long	base;		// file offset of data[0]
+} test_buffer;
+
+typedef struct
+{
+	int					xtiles;
+	int					ytiles;
+	unsigned long long	tiles[TEST_MAX_TILES];
+} test_scale;
+
+/*--------------------------------------------------------------------------*/
+static void test_put(test_buffer* b, const void* data, unsigned long size)
+{
+	if (b->size + size > b->allocated)
+	{
+		b->allocated = (b->size + size) * 2;
+		b->data = (unsigned char*)realloc(b->data, b->allocated);
+	}
+
+	memcpy(b->data + b->size, data, size);
+	b->size += size;
+}
+
+static void test_put_int(test_buffer* b, uint32_t v)
+{
+	test_put(b, &v, sizeof(v));
+}
+
+static void test_put_short(test_buffer* b, uint16_t v)
+{
+	test_put(b, &v, sizeof(v));
+}
+
+// the file keeps the low 32 bits of every offset
+static uint32_t test_position(const test_buffer* b)
+{
+	return (uint32_t)(b->base + b->size);
+}
+
+/*--------------------------------------------------------------------------*/
+static int test_pixel(int scale, int x, int y)
+{
+	return (x * 3 + y * 5 + scale * 7) & 0xff;
+}
+
+/*--------------------------------------------------------------------------*/
+// tile rows are stored bottom up
+static void test_put_tile(test_buffer* b, int scale, int tx, int ty)
+{
+	unsigned char raw[TEST_TILE * TEST_TILE];
+	unsigned char packed[TEST_TILE * TEST_TILE * 2];
+	uLongf size = sizeof(packed);
+	int i;
+
+	for (i = 0; i < TEST_TILE * TEST_TILE; i++)
+	{
+		int x = tx * TEST_TILE + i % TEST_TILE;
+		int y = ty * TEST_TILE + TEST_TILE - 1 - i / TEST_TILE;
+
+		raw[i] = test_pixel(scale, x, y);
+	}
+
+	compress2(packed, &size, raw, sizeof(raw), 9);
+	test_put(b, packed, size);
+}
+
+/*--------------------------------------------------------------------------*/
+static void test_header(test_buffer* b)
+{
+	int i;
+
+	test_put_short(b, 0x7778);
+
+	for (i = 0; i < 4; i++)
+		test_put_int(b, 0);
+
+	test_put_int(b, TEST_WIDTH);
+	test_put_int(b, TEST_HEIGHT);
+	test_put_short(b, 1);
+	test_put_short(b, 8);
+
+	for (i = 0; i < 6; i++)
+		test_put_int(b, 0);
+}
+
+/*--------------------------------------------------------------------------*/
+// tiles of a scale, its header and tile table, and last the scales table
+static void test_body(test_buffer* b, test_scale* scales)
+{
+	uint32_t headers[TEST_SCALES];
+	int scale, i;
+
+	for (scale = 0; scale < TEST_SCALES; scale++)
+	{
+		test_scale* sc = &scales[scale];
+		int w = TEST_WIDTH >> scale, h = TEST_HEIGHT >> scale;
+		uint32_t table[TEST_MAX_TILES + 1];
+
+		sc->xtiles = (w + TEST_TILE - 1) / TEST_TILE;
+		sc->ytiles = (h + TEST_TILE - 1) / TEST_TILE;
+
+		for (i = 0; i < sc->xtiles * sc->ytiles; i++)
+		{
+			sc->tiles[i] = b->base + b->size;
+			table[i] = test_position(b);
+			test_put_tile(b, scale, i % sc->xtiles, i / sc->xtiles);
+		}
+
+		table[i] = test_position(b);
+
+		headers[scale] = test_position(b);
+
+		test_put_int(b, w);
+		test_put_int(b, h);
+		test_put_short(b, sc->xtiles);
+		test_put_short(b, sc->ytiles);
+
+		for (i = 0; i < 256; i++)
+			test_put_int(b, i | (255 - i) << 8 | (i ^ 0x55) << 16);
+
+		test_put(b, table, (sc->xtiles * sc->ytiles + 1) * sizeof(uint32_t));
+	}
+
+	uint32_t table_offset = test_position(b);
+
+	test_put(b, headers, sizeof(headers));
+	test_put_int(b, table_offset);
+}
+
+/*--------------------------------------------------------------------------*/
+static int test_write(int fd, const test_buffer* b)
+{
+	unsigned long done = 0;
+
+	while (done < b->size)
+	{
+		ssize_t n = pwrite(fd, b->data + done, b->size - done, b->base + done);
+
+		if (n <= 0)
+			return -1;
+
+		done += n;
+	}
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+// 0 written, TEST_SKIP no sparse file of that size here, -1 failed
+static int test_create(unsigned long long base, test_scale* scales)
+{
+	test_buffer header, body;
+	struct stat st;
+	int fd, result = -1;
+
+	memset(&header, 0, sizeof(header));
+	memset(&body, 0, sizeof(body));
+
+	body.base = base;
+
+	test_header(&header);
+	test_body(&body, scales);
+
+	fd = open(TEST_PATH, O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+	if (fd < 0)
+	{
+		perror(TEST_PATH);
+		goto done;
+	}
+
+	if (ftruncate(fd, body.base + body.size) != 0)
+	{
+		fprintf(stderr, "no %llu byte file here: %s\n",
+				body.base + body.size, strerror(errno));
+		result = TEST_SKIP;
+		goto done;
+	}
+
+	if (test_write(fd, &header) != 0 || test_write(fd, &body) != 0 || fstat(fd, &st) != 0)
+	{
+		perror(TEST_PATH);
+		goto done;
+	}
+
+	if ((unsigned long long)st.st_blocks * 512 > 0x10000000ULL)
+	{
+		fprintf(stderr, "file system does not keep holes\n");
+		result = TEST_SKIP;
+		goto done;
+	}
+
+	result = 0;
+
+done:
+	if (fd >= 0)
+		close(fd);
+
+	free(header.data);
+	free(body.data);
+
+	return result;
+}
+
+/*--------------------------------------------------------------------------*/
+static int test_check(const test_scale* scales)
+{
+	ozf_stream* s = ozf_open((char*)TEST_PATH);
+	unsigned char indices[TEST_TILE * TEST_TILE];
+	int scale, tx, ty, i, errors = 0;
+
+	if (!s)
+	{
+		fprintf(stderr, "cannot open %s\n", TEST_PATH);
+		return 1;
+	}
+
+	// the last scale is the thumbnail, not counted
+	if (ozf_num_scales(s) != TEST_SCALES - 1)
+	{
+		fprintf(stderr, "%d scales, expected %d\n", ozf_num_scales(s), TEST_SCALES - 1);
+		ozf_close(s);
+		return 1;
+	}
+
+	for (scale = 0; scale < TEST_SCALES - 1; scale++)
+	{
+		const test_scale* sc = &scales[scale];
+
+		for (ty = 0; ty < sc->ytiles; ty++)
+		for (tx = 0; tx < sc->xtiles; tx++)
+		{
+			ozf_offset offset = 0;
+			unsigned long size = 0;
+
+			if (ozf_tile_location(s, scale, tx, ty, &offset, &size) != 0 ||
+				offset != sc->tiles[ty * sc->xtiles + tx])
+			{
+				fprintf(stderr, "scale %d tile %d,%d at %llu, expected %llu\n",
+						scale, tx, ty, (unsigned long long)offset,
+						sc->tiles[ty * sc->xtiles + tx]);
+				errors++;
+				continue;
+			}
+
+			if (ozf_get_tile_indices(s, scale, tx, ty, indices) != 0)
+			{
+				fprintf(stderr, "scale %d tile %d,%d not decoded\n", scale, tx, ty);
+				errors++;
+				continue;
+			}
+
+			// indices keep the stored row order
+			for (i = 0; i < TEST_TILE * TEST_TILE; i++)
+			{
+				int x = tx * TEST_TILE + i % TEST_TILE;
+				int y = ty * TEST_TILE + TEST_TILE - 1 - i / TEST_TILE;
+
+				if (indices[i] != test_pixel(scale, x, y))
+				{
+					fprintf(stderr, "scale %d tile %d,%d wrong pixel %d,%d\n",
+							scale, tx, ty, x, y);
+					errors++;
+					break;
+				}
+			}
+		}
+	}
+
+	ozf_close(s);
+
+	return errors ? 1 : 0;
+}
+
+/*--------------------------------------------------------------------------*/
+int main(void)
+{
+	// the first tile below 4 GB and the rest above; all of it above
+	static const unsigned long long bases[] = { 0xffffff00ULL, 0x140000000ULL };
+	unsigned int i;
+	int result = 0;
+
+	if (sizeof(off_t) < 8)
+	{
+		fprintf(stderr, "no large file support\n");
+		return TEST_SKIP;
+	}
+
+	ozf_sidecar_setup(OZF_SIDECAR_OFF, NULL);
+
+	for (i = 0; i < sizeof(bases) / sizeof(bases[0]) && !result; i++)
+	{
+		test_scale scales[TEST_SCALES];
+
+		memset(scales, 0, sizeof(scales));
+
+		result = test_create(bases[i], scales);
+
+		if (result == 0)
+			result = test_check(scales);
+	}
+
+	unlink(TEST_PATH);
+
+	return result < 0 ? 1 : result;
+}
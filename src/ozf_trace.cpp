@@ -0,0 +1,201 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include "ozf_trace.h"
+#include "ozf_atomic.h"
+
+#ifdef OZF_TRACE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*--------------------------------------------------------------------------*/
+typedef struct
+{
+	const char*			name;	// written last, NULL while incomplete
+	unsigned long long	begin;
+	unsigned long long	end;
+	int					tid;
+	int					scale;
+	int					x;
+	int					y;
+} ozf_trace_event;
+
+/*--------------------------------------------------------------------------*/
+// The event buffer is a fixed array, so tracing costs one atomic increment
+// per span and never allocates. Spans past the end are counted and dropped.
+static ozf_trace_event	trace_events[OZF_TRACE_MAX_EVENTS];
+static unsigned long	trace_next = 0;
+static unsigned long	trace_dropped = 0;
+static int				trace_tids = 0;
+static char*			trace_path = NULL;
+
+#ifdef OZF_THREAD_LOCAL
+static OZF_THREAD_LOCAL int	trace_tid = 0;
+#else
+static int				trace_tid = 1;	// all threads show on one row
+#endif
+
+int ozf_trace_enabled = 0;
+
+/*--------------------------------------------------------------------------*/
+// same time base as ozf_stats_clock(), the decoder mixes both
+unsigned long long ozf_trace_clock(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_trace_complete(const char* name, unsigned long long begin,
+						unsigned long long end, int scale, int x, int y)
+{
+	if (!ozf_trace_enabled)
+		return;
+
+	unsigned long i = OZF_ATOMIC_FETCH_ADD(&trace_next, 1, OZF_RELAXED);
+
+	if (i >= OZF_TRACE_MAX_EVENTS)
+	{
+		OZF_ATOMIC_ADD_FETCH(&trace_dropped, 1, OZF_RELAXED);
+		return;
+	}
+
+	if (!trace_tid)
+		trace_tid = OZF_ATOMIC_ADD_FETCH(&trace_tids, 1, OZF_RELAXED);
+
+	ozf_trace_event* e = &trace_events[i];
+
+	e->begin	= begin;
+	e->end		= end;
+	e->tid		= trace_tid;
+	e->scale	= scale;
+	e->x		= x;
+	e->y		= y;
+
+	OZF_ATOMIC_STORE(&e->name, name, OZF_RELEASE);
+}
+
+/*--------------------------------------------------------------------------*/
+// Several copies of this module (one per driver) may append to one file,
+// which the JSON array format allows as long as nobody closes the array.
+int ozf_trace_start(const char* path)
+{
+	static int exit_hook = 0;
+
+	FILE* f = fopen(path, "w");
+
+	if (!f)
+		return -1;
+
+	fputs("[\n", f);
+	fclose(f);
+
+	free(trace_path);
+	trace_path = strdup(path);
+
+	OZF_ATOMIC_STORE(&trace_next, 0, OZF_RELAXED);
+	OZF_ATOMIC_STORE(&trace_dropped, 0, OZF_RELAXED);
+
+	if (!exit_hook)
+	{
+		atexit(ozf_trace_stop);
+		exit_hook = 1;
+	}
+
+	OZF_ATOMIC_STORE(&ozf_trace_enabled, 1, OZF_RELEASE);
+
+	return 0;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_trace_stop(void)
+{
+	unsigned long i, n;
+
+	if (!ozf_trace_enabled || !trace_path)
+		return;
+
+	OZF_ATOMIC_STORE(&ozf_trace_enabled, 0, OZF_RELEASE);
+
+	FILE* f = fopen(trace_path, "a");
+
+	if (!f)
+		return;
+
+	int pid = (int)getpid();
+
+	n = OZF_ATOMIC_LOAD(&trace_next, OZF_ACQUIRE);
+
+	if (n > OZF_TRACE_MAX_EVENTS)
+		n = OZF_TRACE_MAX_EVENTS;
+
+	for (i = 0; i < n; i++)
+	{
+		ozf_trace_event* e = &trace_events[i];
+		const char* name = OZF_ATOMIC_LOAD(&e->name, OZF_ACQUIRE);
+
+		if (!name)
+			continue;
+
+		fprintf(f, "{\"name\":\"%s\",\"cat\":\"ozf\",\"ph\":\"X\","
+			"\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+			name, pid, e->tid, e->begin / 1000.0, (e->end - e->begin) / 1000.0);
+
+		if (e->scale >= 0)
+		{
+			if (e->x >= 0)
+				fprintf(f, ",\"args\":{\"scale\":%d,\"x\":%d,\"y\":%d}",
+					e->scale, e->x, e->y);
+			else
+				fprintf(f, ",\"args\":{\"scale\":%d}", e->scale);
+		}
+
+		fputs("},\n", f);
+
+		e->name = NULL;
+	}
+
+	if (trace_dropped)
+		fprintf(f, "{\"name\":\"dropped\",\"cat\":\"ozf\",\"ph\":\"i\","
+			"\"pid\":%d,\"tid\":0,\"ts\":0,\"s\":\"g\","
+			"\"args\":{\"events\":%lu}},\n", pid, trace_dropped);
+
+	fclose(f);
+
+	trace_next = 0;
+	trace_dropped = 0;
+}
+
+#endif
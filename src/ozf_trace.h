@@ -0,0 +1,95 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __OZF_TRACE_INCLUDED
+#define __OZF_TRACE_INCLUDED
+
+/*--------------------------------------------------------------------------*/
+// Trace-event spans in Chrome JSON array format (loads in Perfetto and
+// chrome://tracing). Built only with OZF_TRACE defined, see --enable-trace;
+// otherwise every macro below expands to nothing.
+#ifdef OZF_TRACE
+
+#define OZF_TRACE_MAX_EVENTS	65536
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern int ozf_trace_enabled;
+
+int			ozf_trace_start(const char* path);
+void		ozf_trace_stop(void);
+
+unsigned long long	ozf_trace_clock(void);
+void		ozf_trace_complete(const char* name, unsigned long long begin,
+							   unsigned long long end, int scale, int x, int y);
+
+#ifdef __cplusplus
+};
+
+/*--------------------------------------------------------------------------*/
+struct ozf_trace_scope
+{
+	const char*			name;
+	unsigned long long	begin;
+	int					scale, x, y;
+
+	ozf_trace_scope(const char* n, int sc = -1, int tx = -1, int ty = -1)
+		: name(n), begin(0), scale(sc), x(tx), y(ty)
+	{
+		if (ozf_trace_enabled)
+			begin = ozf_trace_clock();
+	}
+
+	~ozf_trace_scope()
+	{
+		if (begin)
+			ozf_trace_complete(name, begin, ozf_trace_clock(), scale, x, y);
+	}
+};
+
+#define OZF_TRACE_CONCAT_(a, b)	a##b
+#define OZF_TRACE_CONCAT(a, b)	OZF_TRACE_CONCAT_(a, b)
+
+#define OZF_TRACE_SCOPE(...) \
+	ozf_trace_scope OZF_TRACE_CONCAT(ozf_trace_scope_, __LINE__)(__VA_ARGS__)
+
+#endif
+
+// span with timestamps the caller has already taken
+#define OZF_TRACE_SPAN(name, begin, end, scale, x, y) \
+	do { \
+		if (ozf_trace_enabled) \
+			ozf_trace_complete((name), (begin), (end), (scale), (x), (y)); \
+	} while (0)
+
+#else
+
+#define OZF_TRACE_SCOPE(...)
+#define OZF_TRACE_SPAN(name, begin, end, scale, x, y)
+
+#endif
+
+#endif
@@ -0,0 +1,345 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#include "ozf_view.h"
+#include "ozf_pool.h"
+#include "ozf_resample.h"
+#include "ozf_trace.h"
+#include "ozf_atomic.h"
+
+/*--------------------------------------------------------------------------*/
+#define OZF_VIEW_STRIP			64		// output rows per refinement job
+#define OZF_VIEW_DEFAULT_THREADS	2
+
+#ifdef HAVE_PTHREAD_H
+#define OZF_VIEW_LOCK(v)		pthread_mutex_lock(&(v)->lock)
+#define OZF_VIEW_UNLOCK(v)		pthread_mutex_unlock(&(v)->lock)
+#else
+#define OZF_VIEW_LOCK(v)
+#define OZF_VIEW_UNLOCK(v)
+#endif
+
+/*--------------------------------------------------------------------------*/
+typedef struct
+{
+	double				x, y, w, h;
+	int					out_w, out_h;
+	unsigned char*		buffer;
+	long				stride;
+	ozf_view_callback	callback;
+	void*				user;
+} ozf_view_request;
+
+/*--------------------------------------------------------------------------*/
+struct ozf_view
+{
+	ozf_stream*			s;
+	ozf_pool*			pool;
+	int					filter;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_t		lock;
+	pthread_cond_t		idle;
+#endif
+	unsigned int		generation;
+	ozf_view_request	request;
+	unsigned char*		row_level;	// finest level written per output row
+	int					outstanding;	// jobs left in the current generation
+	int					delivering;		// callbacks running
+};
+
+/*--------------------------------------------------------------------------*/
+typedef struct
+{
+	ozf_view*			v;
+	unsigned int		generation;
+	int					scale;
+	int					y0, y1;		// output rows
+	ozf_view_request	request;
+} ozf_view_job;
+
+/*--------------------------------------------------------------------------*/
+static void ozf_view_finish_job(ozf_view* v, ozf_view_job* job, int rows)
+{
+	ozf_view_request* r = &job->request;
+	int final = 0;
+
+	OZF_VIEW_LOCK(v);
+
+	if (job->generation != v->generation)
+	{
+		OZF_VIEW_UNLOCK(v);
+		return;
+	}
+
+	final = --v->outstanding == 0;
+	v->delivering++;
+
+	OZF_VIEW_UNLOCK(v);
+
+	if (r->callback && (rows || final))
+		r->callback(r->user, job->generation, job->scale, job->y0,
+					job->y1 - job->y0, final);
+
+	// ozf_view_wait() returns only after the final callback is done
+	OZF_VIEW_LOCK(v);
+
+	v->delivering--;
+
+#ifdef HAVE_PTHREAD_H
+	if (v->outstanding == 0 && v->delivering == 0)
+		pthread_cond_broadcast(&v->idle);
+#endif
+
+	OZF_VIEW_UNLOCK(v);
+}
+
+/*--------------------------------------------------------------------------*/
+static void ozf_view_run(void* arg)
+{
+	ozf_view_job* job = (ozf_view_job*)arg;
+	ozf_view* v = job->v;
+	ozf_view_request* r = &job->request;
+	int rows = 0;
+
+	// stale work is dropped before doing anything expensive
+	if (job->generation != OZF_ATOMIC_LOAD(&v->generation, OZF_ACQUIRE))
+	{
+		free(job);
+		return;
+	}
+
+	OZF_TRACE_SCOPE("ozf_view_run", job->scale, 0, job->y0);
+
+	int n = job->y1 - job->y0;
+	long line = (long)r->out_w * 4;
+	unsigned char* strip = (unsigned char*)malloc(line * n);
+
+	double step = r->h / r->out_h;
+
+	int rc = ozf_read_scaled_level(v->s, job->scale, r->x, r->y + job->y0 * step,
+								   r->w, n * step, r->out_w, n,
+								   OZF_FORMAT_RGBA, v->filter, strip, line);
+
+	OZF_VIEW_LOCK(v);
+
+	// the buffer may already belong to another request, check under the lock
+	if (rc >= 0 && job->generation == v->generation)
+	{
+		int j;
+
+		for (j = 0; j < n; j++)
+		{
+			int row = job->y0 + j;
+
+			if (v->row_level[row] <= job->scale)
+				continue;
+
+			memcpy(r->buffer + (long)row * r->stride, strip + j * line, line);
+			v->row_level[row] = job->scale;
+			rows++;
+		}
+	}
+
+	OZF_VIEW_UNLOCK(v);
+
+	free(strip);
+
+	ozf_view_finish_job(v, job, rows);
+
+	free(job);
+}
+
+/*--------------------------------------------------------------------------*/
+static void ozf_view_push(ozf_view* v, unsigned int generation, int scale,
+						  int y0, int y1)
+{
+	ozf_view_job* job = (ozf_view_job*)malloc(sizeof(ozf_view_job));
+
+	job->v = v;
+	job->generation = generation;
+	job->scale = scale;
+	job->y0 = y0;
+	job->y1 = y1;
+	job->request = v->request;
+
+	if (ozf_pool_push(v->pool, ozf_view_run, job) != 0)
+	{
+		ozf_view_finish_job(v, job, 0);
+		free(job);
+	}
+}
+
+/*--------------------------------------------------------------------------*/
+ozf_view* ozf_view_create(ozf_stream* s, int threads, int filter)
+{
+	ozf_view* v = (ozf_view*)calloc(1, sizeof(ozf_view));
+
+	if (!v)
+		return NULL;
+
+	v->s = s;
+	v->filter = filter;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_init(&v->lock, NULL);
+	pthread_cond_init(&v->idle, NULL);
+#endif
+
+	v->pool = ozf_pool_create(threads > 0 ? threads : OZF_VIEW_DEFAULT_THREADS);
+
+	if (!v->pool)
+	{
+		ozf_view_destroy(v);
+		return NULL;
+	}
+
+	return v;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_view_destroy(ozf_view* v)
+{
+	if (!v)
+		return;
+
+	ozf_view_cancel(v);
+
+	// queued jobs see the new generation and return at once
+	ozf_pool_destroy(v->pool);
+
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_destroy(&v->idle);
+	pthread_mutex_destroy(&v->lock);
+#endif
+
+	free(v->row_level);
+	free(v);
+}
+
+/*--------------------------------------------------------------------------*/
+unsigned int ozf_view_render(ozf_view* v, double x, double y, double w, double h,
+							 int out_w, int out_h, unsigned char* buffer, long stride,
+							 ozf_view_callback callback, void* user)
+{
+	int coarse = ozf_num_scales(v->s) - 1;
+	int fine, scale, k;
+
+	if (out_w <= 0 || out_h <= 0 || w <= 0 || h <= 0)
+	{
+		ozf_view_cancel(v);
+		return v->generation;
+	}
+
+	fine = ozf_pick_scale(v->s, w, h, out_w, out_h);
+
+	if (coarse < fine)
+		coarse = fine;
+
+	int strips = (out_h + OZF_VIEW_STRIP - 1) / OZF_VIEW_STRIP;
+
+	OZF_VIEW_LOCK(v);
+
+	unsigned int generation = OZF_ATOMIC_ADD_FETCH(&v->generation, 1, OZF_RELEASE);
+
+	v->request.x = x;
+	v->request.y = y;
+	v->request.w = w;
+	v->request.h = h;
+	v->request.out_w = out_w;
+	v->request.out_h = out_h;
+	v->request.buffer = buffer;
+	v->request.stride = stride ? stride : (long)out_w * 4;
+	v->request.callback = callback;
+	v->request.user = user;
+
+	free(v->row_level);
+	v->row_level = (unsigned char*)malloc(out_h);
+	memset(v->row_level, 0xff, out_h);
+
+	// one job for the coarse preview, then strips of every finer level
+	v->outstanding = 1 + (coarse - fine) * strips;
+
+	OZF_VIEW_UNLOCK(v);
+
+	// the preview is the first job in the queue, time to first pixel is
+	// one small decode regardless of the map size
+	ozf_view_push(v, generation, coarse, 0, out_h);
+
+	for (scale = coarse - 1; scale >= fine; scale--)
+	{
+		// strips nearest to the centre of the viewport go first
+		int centre = strips / 2;
+
+		for (k = 0; k < strips; k++)
+		{
+			int i = k & 1 ? centre - (k + 1) / 2 : centre + k / 2;
+			int y1 = (i + 1) * OZF_VIEW_STRIP;
+
+			ozf_view_push(v, generation, scale, i * OZF_VIEW_STRIP,
+						  y1 < out_h ? y1 : out_h);
+		}
+	}
+
+	return generation;
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_view_cancel(ozf_view* v)
+{
+	OZF_VIEW_LOCK(v);
+
+	OZF_ATOMIC_ADD_FETCH(&v->generation, 1, OZF_RELEASE);
+	v->outstanding = 0;
+
+#ifdef HAVE_PTHREAD_H
+	pthread_cond_broadcast(&v->idle);
+#endif
+
+	OZF_VIEW_UNLOCK(v);
+}
+
+/*--------------------------------------------------------------------------*/
+void ozf_view_wait(ozf_view* v)
+{
+#ifdef HAVE_PTHREAD_H
+	pthread_mutex_lock(&v->lock);
+
+	while (v->outstanding > 0 || v->delivering > 0)
+		pthread_cond_wait(&v->idle, &v->lock);
+
+	pthread_mutex_unlock(&v->lock);
+#endif
+}
@@ -0,0 +1,66 @@
+/**
+ * swampex, a map processing library
+ *
+ * Authors:
+ *
+ * Daniil Smelov <dn.smelov@gmail.com>
+ *
+ * Copyright (C) 2006-2009 Daniil Smelov, Slava Baryshnikov
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * version 2 as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ * Boston, MA  02110-1301, USA.
+ */
+
+#ifndef __OZF_VIEW_INCLUDED
+#define __OZF_VIEW_INCLUDED
+
+#include "ozf_decoder.h"
+
+/*--------------------------------------------------------------------------*/
+// Progressive viewport renderer. ozf_view_render() returns at once; worker
+// threads first fill the whole viewport from the smallest embedded level,
+// then refine it level by level in strips, from the centre outwards, down
+// to the level ozf_pick_scale() chooses. A new render or ozf_view_cancel()
+// makes all queued work of the previous request a no-op.
+typedef struct ozf_view ozf_view;
+
+// Called on a worker thread after output rows [y, y + h) were updated from
+// level scale. final is set on the last update of the request. Updates of
+// a stale generation are never delivered, but one may race with the call
+// that superseded it, so compare generations if that matters.
+typedef void (*ozf_view_callback)(void* user, unsigned int generation, int scale,
+								  int y, int h, int final);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+ozf_view*		ozf_view_create(ozf_stream* s, int threads, int filter);
+void			ozf_view_destroy(ozf_view* v);
+
+// renders the level 0 window (x, y, w, h) into an out_w x out_h RGBA
+// buffer, which must stay valid until the next render, cancel or destroy
+unsigned int	ozf_view_render(ozf_view* v, double x, double y, double w, double h,
+								int out_w, int out_h, unsigned char* buffer, long stride,
+								ozf_view_callback callback, void* user);
+void			ozf_view_cancel(ozf_view* v);
+
+// blocks until the current request is complete or cancelled
+void			ozf_view_wait(ozf_view* v);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
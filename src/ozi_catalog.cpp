@@ -0,0 +1,812 @@
+/*
+ * ozi_catalog.cpp
+ *
+ *  On-disk catalog of .map sheets. The builder scans directories with a
+ *  pool of threads and records what coverage queries need; the catalog
+ *  is then loaded in one read and queried through its stored R-tree
+ *  without touching a .map file. Updates re-read only changed sheets.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <gdal_priv.h>
+#include <cpl_conv.h>
+#include <cpl_string.h>
+#include <cpl_multiproc.h>
+
+#include "ozi_driver.h"
+
+#define OZI_CATALOG_MAGIC "OZICAT\r\n"
+#define OZI_CATALOG_VERSION 1
+#define OZI_CATALOG_BYTE_ORDER 0x01020304
+#define OZI_CATALOG_MAX_DEPTH 32
+#define OZI_CATALOG_MAX_THREADS 64
+
+// metres per degree of latitude, close enough for pixel sizes
+#define OZI_METRES_PER_DEGREE 111319.49
+
+// -------------------------------------------------------------------- //
+//      File layout, native byte order, every section 8 byte aligned    //
+//      up to the items:                                                //
+//                                                                      //
+//      header, OziBox[nSheets] extents, OziCatalogRecord[nSheets],     //
+//      OziRTreeNode[nNodes], int[nSheets] tree items,                  //
+//      int[2 * nScales] scale sizes, nStrings bytes of strings.        //
+//                                                                      //
+//      Records are sorted by .map path, for updates.                   //
+// -------------------------------------------------------------------- //
+typedef struct {
+	char achMagic[8];
+	GUInt32 nByteOrder;
+	GUInt32 nVersion;
+	GUInt32 nSheets;
+	GUInt32 nNodes;
+	GUInt32 nScales;
+	GUInt32 nStrings;
+} OziCatalogHeader;
+
+typedef struct {
+	GIntBig nMapMTime;
+	GIntBig nMapSize;
+	GIntBig nImageMTime;
+	GIntBig nImageSize;
+	double dfPixelSize;
+	GInt32 nXSize;
+	GInt32 nYSize;
+	GUInt32 nMapFile;           // string offsets
+	GUInt32 nImageFile;
+	GUInt32 nWKT;
+	GUInt32 nFirstScale;
+	GUInt32 nScales;
+	GUInt32 nReserved;
+} OziCatalogRecord;
+
+struct OziCatalog {
+	GByte *pabyData;
+	const OziCatalogHeader *psHeader;
+	const OziBox *pasExtents;
+	const OziCatalogRecord *pasRecords;
+	const int *panScales;
+	const char *pachStrings;
+	OziRTree sTree;
+};
+
+// -------------------------------------------------------------------- //
+//      One .map file being (re)indexed.                                //
+// -------------------------------------------------------------------- //
+typedef struct {
+	char *pszMapFile;
+	int bOK;
+
+	OziBox sExtent;
+	OziCatalogRecord sRecord;   // string and scale members unused
+	char *pszImageFile;
+	char *pszWKT;
+	int nScales;
+	int *panScales;
+} OziCatalogJob;
+
+typedef struct {
+	OziCatalog *psOld;
+	OziCatalogJob *pasJobs;
+	int nJobs;
+	int iNext;
+	void *hMutex;
+	int nReused;
+} OziCatalogBuilder;
+
+static const char *OziCatalogString(const OziCatalog *psCatalog,
+		GUInt32 nOffset) {
+	return psCatalog->pachStrings + nOffset;
+}
+
+/************************************************************************/
+/*                          OziCatalogCollect()                         */
+/*                                                                      */
+/*      .map files of a directory tree, or the file itself.             */
+/************************************************************************/
+
+static char **OziCatalogCollect(const char *pszPath, char **papszMaps,
+		int nDepth) {
+	VSIStatBufL sStat;
+
+	if (VSIStatL(pszPath, &sStat) != 0)
+		return papszMaps;
+
+	if (!VSI_ISDIR(sStat.st_mode)) {
+		if (EQUAL(CPLGetExtension(pszPath), "map"))
+			papszMaps = CSLAddString(papszMaps, pszPath);
+		return papszMaps;
+	}
+
+	if (nDepth >= OZI_CATALOG_MAX_DEPTH)
+		return papszMaps;
+
+	char **papszFiles = VSIReadDir(pszPath);
+	for (int i = 0; papszFiles && papszFiles[i]; i++) {
+		if (EQUAL(papszFiles[i], ".") || EQUAL(papszFiles[i], ".."))
+			continue;
+		papszMaps = OziCatalogCollect(CPLFormFilename(pszPath, papszFiles[i],
+				NULL), papszMaps, nDepth + 1);
+	}
+	CSLDestroy(papszFiles);
+
+	return papszMaps;
+}
+
+static int OziCompareString(const void *a, const void *b) {
+	return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/************************************************************************/
+/*                          OziCatalogFind()                            */
+/************************************************************************/
+
+static int OziCatalogFind(const OziCatalog *psCatalog, const char *pszMapFile) {
+	int nLow = 0, nHigh = (int) psCatalog->psHeader->nSheets - 1;
+
+	while (nLow <= nHigh) {
+		int nMid = (nLow + nHigh) / 2;
+		int nCmp = strcmp(pszMapFile, OziCatalogString(psCatalog,
+				psCatalog->pasRecords[nMid].nMapFile));
+		if (nCmp == 0)
+			return nMid;
+		if (nCmp < 0)
+			nHigh = nMid - 1;
+		else
+			nLow = nMid + 1;
+	}
+
+	return -1;
+}
+
+/************************************************************************/
+/*                           OziCatalogReuse()                          */
+/*                                                                      */
+/*      Takes the old entry over if neither the .map nor its image has  */
+/*      changed since.                                                  */
+/************************************************************************/
+
+static int OziCatalogReuse(const OziCatalog *psOld, OziCatalogJob *psJob,
+		const VSIStatBufL *psMapStat) {
+	int iOld = psOld ? OziCatalogFind(psOld, psJob->pszMapFile) : -1;
+	if (iOld < 0)
+		return FALSE;
+
+	const OziCatalogRecord *psRecord = psOld->pasRecords + iOld;
+	if (psRecord->nMapMTime != (GIntBig) psMapStat->st_mtime
+			|| psRecord->nMapSize != (GIntBig) psMapStat->st_size)
+		return FALSE;
+
+	const char *pszImage = OziCatalogString(psOld, psRecord->nImageFile);
+	VSIStatBufL sStat;
+	if (VSIStatL(pszImage, &sStat) != 0 || psRecord->nImageMTime
+			!= (GIntBig) sStat.st_mtime || psRecord->nImageSize
+			!= (GIntBig) sStat.st_size)
+		return FALSE;
+
+	psJob->sExtent = psOld->pasExtents[iOld];
+	psJob->sRecord = *psRecord;
+	psJob->pszImageFile = CPLStrdup(pszImage);
+	psJob->pszWKT = CPLStrdup(OziCatalogString(psOld, psRecord->nWKT));
+	psJob->nScales = (int) psRecord->nScales;
+	if (psJob->nScales > 0) {
+		psJob->panScales = (int *) CPLMalloc(sizeof(int) * 2 * psJob->nScales);
+		memcpy(psJob->panScales, psOld->panScales + 2 * psRecord->nFirstScale,
+				sizeof(int) * 2 * psJob->nScales);
+	}
+
+	return TRUE;
+}
+
+/************************************************************************/
+/*                           OziCatalogScan()                           */
+/*                                                                      */
+/*      Extent of the border polygon, or else of the image, in WGS84;   */
+/*      edges are densified since they curve in lon/lat.                */
+/************************************************************************/
+
+static int OziCatalogScan(OziCatalogJob *psJob, const VSIStatBufL *psMapStat) {
+	OziMapInfo *psMap = OziMapLoad(psJob->pszMapFile);
+	if (psMap == NULL)
+		return FALSE;
+
+	const OziSRS *psSRS = NULL;
+	char *pszWKT = NULL;
+	double adfTransform[6];
+	int nGCPCount = 0;
+	GDAL_GCP *pasGCPs = NULL;
+
+	CPLPushErrorHandler(CPLQuietErrorHandler);
+	CPLErr eErr = OziMapGeoreference(psJob->pszMapFile, psMap, adfTransform,
+			&psSRS, &pszWKT, &nGCPCount, &pasGCPs);
+	CPLPopErrorHandler();
+
+	int bOK = eErr == CE_None && psSRS != NULL;
+	if (bOK && nGCPCount > 0)
+		bOK = GDALGCPsToGeoTransform(nGCPCount, pasGCPs, adfTransform, TRUE);
+	GDALDeinitGCPs(nGCPCount, pasGCPs);
+	CPLFree(pasGCPs);
+
+	// -------------------------------------------------------------------- //
+	//      Image size and zoom levels, the image header is read either     //
+	//      way since its time goes into the catalog.                       //
+	// -------------------------------------------------------------------- //
+	char *pszImage = bOK ? OziResolveImagePath(psJob->pszMapFile,
+			psMap->pszImage) : NULL;
+	VSIStatBufL sImageStat;
+	int nXSize = psMap->nImageWidth, nYSize = psMap->nImageHeight;
+
+	bOK = pszImage != NULL && VSIStatL(pszImage, &sImageStat) == 0;
+	if (bOK) {
+		GDALDataset *poImage = OziPoolAcquire(pszImage);
+		if (poImage != NULL) {
+			if (nXSize <= 0 || nYSize <= 0) {
+				nXSize = poImage->GetRasterXSize();
+				nYSize = poImage->GetRasterYSize();
+			}
+			const char *pszScales = poImage->GetMetadataItem("SCALES", "OZF");
+			psJob->nScales = pszScales ? MAX(0, atoi(pszScales)) : 0;
+			if (psJob->nScales > 0)
+				psJob->panScales = (int *) CPLCalloc(sizeof(int),
+						2 * psJob->nScales);
+			for (int i = 0; i < psJob->nScales; i++) {
+				const char *pszSize = poImage->GetMetadataItem(CPLSPrintf(
+						"SCALE_%d", i), "OZF");
+				if (pszSize != NULL)
+					sscanf(pszSize, "%dx%d", psJob->panScales + 2 * i,
+							psJob->panScales + 2 * i + 1);
+			}
+			OziPoolRelease(poImage);
+		}
+	}
+	bOK = bOK && nXSize > 0 && nYSize > 0;
+
+	// -------------------------------------------------------------------- //
+	//      Outline in pixel/line.                                          //
+	// -------------------------------------------------------------------- //
+	int nVertices = 4;
+	double adfCorners[8] = { 0.0, 0.0, (double) nXSize, 0.0, (double) nXSize,
+			(double) nYSize, 0.0, (double) nYSize };
+	const double *padfOutline = adfCorners;
+
+	if (psMap->nBorderXY >= 3) {
+		nVertices = psMap->nBorderXY;
+		padfOutline = psMap->padfBorderXY;
+	}
+
+	const int nSteps = 8;
+	int nPoints = nVertices * nSteps + 3;
+	double *padfX = (double *) CPLMalloc(sizeof(double) * nPoints);
+	double *padfY = (double *) CPLMalloc(sizeof(double) * nPoints);
+	int *pabSuccess = (int *) CPLMalloc(sizeof(int) * nPoints);
+
+	for (int i = 0; i < nVertices; i++) {
+		const double *p0 = padfOutline + i * 2;
+		const double *p1 = padfOutline + ((i + 1) % nVertices) * 2;
+		for (int k = 0; k < nSteps; k++) {
+			padfX[i * nSteps + k] = p0[0] + (p1[0] - p0[0]) * k / nSteps;
+			padfY[i * nSteps + k] = p0[1] + (p1[1] - p0[1]) * k / nSteps;
+		}
+	}
+
+	// centre pixel and its neighbours, for the pixel size
+	int iCentre = nVertices * nSteps;
+	padfX[iCentre] = padfX[iCentre + 2] = nXSize / 2.0;
+	padfY[iCentre] = padfY[iCentre + 1] = nYSize / 2.0;
+	padfX[iCentre + 1] = nXSize / 2.0 + 1.0;
+	padfY[iCentre + 2] = nYSize / 2.0 + 1.0;
+
+	// -------------------------------------------------------------------- //
+	//      To WGS84.                                                       //
+	// -------------------------------------------------------------------- //
+	if (bOK) {
+		for (int i = 0; i < nPoints; i++) {
+			double dfPixel = padfX[i], dfLine = padfY[i];
+			padfX[i] = adfTransform[0] + dfPixel * adfTransform[1] + dfLine
+					* adfTransform[2];
+			padfY[i] = adfTransform[3] + dfPixel * adfTransform[4] + dfLine
+					* adfTransform[5];
+		}
+		OziSRSTransform(psSRS, OZI_SRS_TARGET_TO_WGS84, nPoints, padfX, padfY,
+				pabSuccess);
+	}
+
+	int nValid = 0;
+	for (int i = 0; bOK && i < iCentre; i++) {
+		if (!pabSuccess[i])
+			continue;
+		if (nValid++ == 0) {
+			psJob->sExtent.dfMinX = psJob->sExtent.dfMaxX = padfX[i];
+			psJob->sExtent.dfMinY = psJob->sExtent.dfMaxY = padfY[i];
+		} else {
+			psJob->sExtent.dfMinX = MIN(psJob->sExtent.dfMinX, padfX[i]);
+			psJob->sExtent.dfMaxX = MAX(psJob->sExtent.dfMaxX, padfX[i]);
+			psJob->sExtent.dfMinY = MIN(psJob->sExtent.dfMinY, padfY[i]);
+			psJob->sExtent.dfMaxY = MAX(psJob->sExtent.dfMaxY, padfY[i]);
+		}
+	}
+	bOK = bOK && nValid >= 3;
+
+	// -------------------------------------------------------------------- //
+	//      Pixel size, MM1B as written or else measured at the centre.     //
+	// -------------------------------------------------------------------- //
+	double dfPixelSize = psMap->dfMetersPerPixel;
+	if (bOK && dfPixelSize <= 0.0 && pabSuccess[iCentre]
+			&& pabSuccess[iCentre + 1] && pabSuccess[iCentre + 2]) {
+		double dfCos = cos(padfY[iCentre] * M_PI / 180.0);
+		double dfDX = hypot((padfX[iCentre + 1] - padfX[iCentre]) * dfCos,
+				padfY[iCentre + 1] - padfY[iCentre]);
+		double dfDY = hypot((padfX[iCentre + 2] - padfX[iCentre]) * dfCos,
+				padfY[iCentre + 2] - padfY[iCentre]);
+		dfPixelSize = (dfDX + dfDY) / 2.0 * OZI_METRES_PER_DEGREE;
+	}
+
+	if (bOK) {
+		OziCatalogRecord *psRecord = &psJob->sRecord;
+		psRecord->nMapMTime = (GIntBig) psMapStat->st_mtime;
+		psRecord->nMapSize = (GIntBig) psMapStat->st_size;
+		psRecord->nImageMTime = (GIntBig) sImageStat.st_mtime;
+		psRecord->nImageSize = (GIntBig) sImageStat.st_size;
+		psRecord->dfPixelSize = dfPixelSize;
+		psRecord->nXSize = nXSize;
+		psRecord->nYSize = nYSize;
+
+		psJob->pszImageFile = pszImage;
+		psJob->pszWKT = pszWKT;
+		pszImage = NULL;
+		pszWKT = NULL;
+	}
+
+	CPLFree(padfX);
+	CPLFree(padfY);
+	CPLFree(pabSuccess);
+	CPLFree(pszImage);
+	CPLFree(pszWKT);
+	OziMapFree(psMap);
+
+	return bOK;
+}
+
+/************************************************************************/
+/*                          OziCatalogWorker()                          */
+/************************************************************************/
+
+static void OziCatalogWorker(void *pData) {
+	OziCatalogBuilder *psBuilder = (OziCatalogBuilder *) pData;
+
+	for (;;) {
+		int iJob, bReused = FALSE;
+		{
+			CPLMutexHolderD(&psBuilder->hMutex);
+			iJob = psBuilder->iNext++;
+		}
+		if (iJob >= psBuilder->nJobs)
+			break;
+
+		OziCatalogJob *psJob = psBuilder->pasJobs + iJob;
+		VSIStatBufL sStat;
+
+		if (VSIStatL(psJob->pszMapFile, &sStat) != 0)
+			continue;
+
+		bReused = OziCatalogReuse(psBuilder->psOld, psJob, &sStat);
+		psJob->bOK = bReused || OziCatalogScan(psJob, &sStat);
+
+		if (bReused) {
+			CPLMutexHolderD(&psBuilder->hMutex);
+			psBuilder->nReused++;
+		} else if (!psJob->bOK) {
+			CPLDebug("OZI", "Catalog skips \"%s\", no usable georeferencing.",
+					psJob->pszMapFile);
+		}
+	}
+}
+
+/************************************************************************/
+/*                          OziCatalogWrite()                           */
+/************************************************************************/
+
+static int OziCatalogWrite(const char *pszCatalog, OziCatalogJob *pasJobs,
+		int nJobs) {
+	OziCatalogHeader sHeader;
+	int nSheets = 0, nScales = 0;
+
+	for (int i = 0; i < nJobs; i++) {
+		if (pasJobs[i].bOK) {
+			nSheets++;
+			nScales += pasJobs[i].nScales;
+		}
+	}
+
+	OziBox *pasExtents = (OziBox *) CPLMalloc(sizeof(OziBox) * MAX(nSheets, 1));
+	OziCatalogRecord *pasRecords = (OziCatalogRecord *) CPLCalloc(
+			sizeof(OziCatalogRecord), MAX(nSheets, 1));
+	int *panScales = (int *) CPLMalloc(sizeof(int) * 2 * MAX(nScales, 1));
+
+	// -------------------------------------------------------------------- //
+	//      Records and strings; sheets mostly share a few SRS, so WKT      //
+	//      strings are stored once.                                        //
+	// -------------------------------------------------------------------- //
+	CPLString osStrings;
+	char **papszWKT = NULL;
+	int *panWKTOffsets = NULL;
+	int iSheet = 0, iScale = 0;
+
+	for (int i = 0; i < nJobs; i++) {
+		OziCatalogJob *psJob = pasJobs + i;
+		if (!psJob->bOK)
+			continue;
+
+		OziCatalogRecord *psRecord = pasRecords + iSheet;
+		*psRecord = psJob->sRecord;
+		pasExtents[iSheet] = psJob->sExtent;
+
+		psRecord->nMapFile = (GUInt32) osStrings.size();
+		osStrings.append(psJob->pszMapFile, strlen(psJob->pszMapFile) + 1);
+		psRecord->nImageFile = (GUInt32) osStrings.size();
+		osStrings.append(psJob->pszImageFile, strlen(psJob->pszImageFile) + 1);
+
+		int iWKT = CSLFindString(papszWKT, psJob->pszWKT);
+		if (iWKT < 0) {
+			iWKT = CSLCount(papszWKT);
+			papszWKT = CSLAddString(papszWKT, psJob->pszWKT);
+			panWKTOffsets = (int *) CPLRealloc(panWKTOffsets, sizeof(int)
+					* (iWKT + 1));
+			panWKTOffsets[iWKT] = (int) osStrings.size();
+			osStrings.append(psJob->pszWKT, strlen(psJob->pszWKT) + 1);
+		}
+		psRecord->nWKT = (GUInt32) panWKTOffsets[iWKT];
+
+		psRecord->nFirstScale = (GUInt32) iScale;
+		psRecord->nScales = (GUInt32) psJob->nScales;
+		psRecord->nReserved = 0;
+		if (psJob->nScales > 0)
+			memcpy(panScales + 2 * iScale, psJob->panScales, sizeof(int) * 2
+					* psJob->nScales);
+		iScale += psJob->nScales;
+		iSheet++;
+	}
+	CSLDestroy(papszWKT);
+	CPLFree(panWKTOffsets);
+
+	OziRTree sTree;
+	OziRTreeBuild(&sTree, pasExtents, nSheets);
+
+	memset(&sHeader, 0, sizeof(sHeader));
+	memcpy(sHeader.achMagic, OZI_CATALOG_MAGIC, sizeof(sHeader.achMagic));
+	sHeader.nByteOrder = OZI_CATALOG_BYTE_ORDER;
+	sHeader.nVersion = OZI_CATALOG_VERSION;
+	sHeader.nSheets = (GUInt32) nSheets;
+	sHeader.nNodes = (GUInt32) sTree.nNodes;
+	sHeader.nScales = (GUInt32) nScales;
+	sHeader.nStrings = (GUInt32) osStrings.size();
+
+	// -------------------------------------------------------------------- //
+	//      Written aside and renamed, readers never see half a catalog.    //
+	// -------------------------------------------------------------------- //
+	CPLString osTemp = CPLString(pszCatalog) + ".tmp";
+	FILE *fp = VSIFOpenL(osTemp, "wb");
+	int bOK = fp != NULL;
+
+	if (bOK) {
+		bOK = VSIFWriteL(&sHeader, sizeof(sHeader), 1, fp) == 1;
+		if (bOK && nSheets > 0)
+			bOK = VSIFWriteL(pasExtents, sizeof(OziBox), nSheets, fp)
+					== (size_t) nSheets && VSIFWriteL(pasRecords,
+					sizeof(OziCatalogRecord), nSheets, fp) == (size_t) nSheets
+					&& VSIFWriteL(sTree.pasNodes, sizeof(OziRTreeNode),
+							sTree.nNodes, fp) == (size_t) sTree.nNodes
+					&& VSIFWriteL(sTree.panItems, sizeof(int), nSheets, fp)
+							== (size_t) nSheets;
+		if (bOK && nScales > 0)
+			bOK = VSIFWriteL(panScales, sizeof(int) * 2, nScales, fp)
+					== (size_t) nScales;
+		if (bOK && !osStrings.empty())
+			bOK = VSIFWriteL(osStrings.data(), osStrings.size(), 1, fp) == 1;
+		if (VSIFCloseL(fp) != 0)
+			bOK = FALSE;
+
+		if (bOK)
+			bOK = VSIRename(osTemp, pszCatalog) == 0;
+		if (!bOK)
+			VSIUnlink(osTemp);
+	}
+
+	if (!bOK)
+		CPLError(CE_Failure, CPLE_FileIO,
+				"OziCatalogUpdate(): cannot write catalog \"%s\".", pszCatalog);
+
+	OziRTreeFree(&sTree);
+	CPLFree(pasExtents);
+	CPLFree(pasRecords);
+	CPLFree(panScales);
+
+	return bOK;
+}
+
+/************************************************************************/
+/*                          OziCatalogUpdate()                          */
+/*                                                                      */
+/*      Indexes the .map files under papszSources, directories or       */
+/*      single files, into pszCatalog. An existing catalog is reused    */
+/*      for sheets whose files have not changed; sheets that are gone   */
+/*      are dropped. nThreads <= 0 uses OZI_CATALOG_THREADS, or one     */
+/*      per CPU. Returns the number of sheets, or -1.                   */
+/************************************************************************/
+
+int OziCatalogUpdate(const char *pszCatalog, char **papszSources,
+		int nThreads) {
+	char **papszMaps = NULL;
+
+	for (int i = 0; papszSources && papszSources[i]; i++)
+		papszMaps = OziCatalogCollect(papszSources[i], papszMaps, 0);
+
+	int nMaps = CSLCount(papszMaps);
+	if (nMaps > 0)
+		qsort(papszMaps, nMaps, sizeof(char *), OziCompareString);
+
+	// same file reached through overlapping sources
+	int nUnique = 0;
+	for (int i = 0; i < nMaps; i++) {
+		if (nUnique > 0 && strcmp(papszMaps[i], papszMaps[nUnique - 1]) == 0)
+			CPLFree(papszMaps[i]);
+		else
+			papszMaps[nUnique++] = papszMaps[i];
+	}
+	nMaps = nUnique;
+	if (papszMaps)
+		papszMaps[nMaps] = NULL;
+
+	OziCatalogBuilder sBuilder;
+	memset(&sBuilder, 0, sizeof(sBuilder));
+
+	VSIStatBufL sStat;
+	if (VSIStatL(pszCatalog, &sStat) == 0) {
+		CPLPushErrorHandler(CPLQuietErrorHandler);
+		sBuilder.psOld = OziCatalogOpen(pszCatalog);
+		CPLPopErrorHandler();
+	}
+
+	sBuilder.nJobs = nMaps;
+	sBuilder.pasJobs = (OziCatalogJob *) CPLCalloc(sizeof(OziCatalogJob),
+			MAX(nMaps, 1));
+	for (int i = 0; i < nMaps; i++)
+		sBuilder.pasJobs[i].pszMapFile = papszMaps[i];
+
+	// -------------------------------------------------------------------- //
+	//      Scan; the .map and image reads are what takes time.             //
+	// -------------------------------------------------------------------- //
+	if (nThreads <= 0)
+		nThreads = atoi(CPLGetConfigOption("OZI_CATALOG_THREADS", "0"));
+
+	if (nThreads <= 0)
+		nThreads = CPLGetNumCPUs();
+	nThreads = MAX(1, MIN(MIN(nThreads, OZI_CATALOG_MAX_THREADS), nMaps));
+
+	// the calling thread is one of the workers; GDAL built without
+	// threads starts none of the others
+	CPLJoinableThread *ahThreads[OZI_CATALOG_MAX_THREADS];
+	int nStarted = 0;
+
+	for (int i = 1; i < nThreads; i++) {
+		ahThreads[nStarted] = CPLCreateJoinableThread(OziCatalogWorker,
+				&sBuilder);
+		if (ahThreads[nStarted] != NULL)
+			nStarted++;
+	}
+	OziCatalogWorker(&sBuilder);
+	for (int i = 0; i < nStarted; i++)
+		CPLJoinThread(ahThreads[i]);
+	nThreads = nStarted + 1;
+
+	int nSheets = 0;
+	for (int i = 0; i < nMaps; i++)
+		nSheets += sBuilder.pasJobs[i].bOK;
+
+	CPLDebug("OZI", "Catalog \"%s\": %d sheets, %d unchanged, %d threads.",
+			pszCatalog, nSheets, sBuilder.nReused, nThreads);
+
+	int bOK = OziCatalogWrite(pszCatalog, sBuilder.pasJobs, nMaps);
+
+	for (int i = 0; i < nMaps; i++) {
+		CPLFree(sBuilder.pasJobs[i].pszImageFile);
+		CPLFree(sBuilder.pasJobs[i].pszWKT);
+		CPLFree(sBuilder.pasJobs[i].panScales);
+	}
+	CPLFree(sBuilder.pasJobs);
+	if (sBuilder.hMutex)
+		CPLDestroyMutex(sBuilder.hMutex);
+	if (sBuilder.psOld)
+		OziCatalogClose(sBuilder.psOld);
+	CSLDestroy(papszMaps);
+
+	return bOK ? nSheets : -1;
+}
+
+/************************************************************************/
+/*                           OziCatalogOpen()                           */
+/*                                                                      */
+/*      Reads the whole catalog and checks every offset in it once, so  */
+/*      queries can trust the arrays.                                   */
+/************************************************************************/
+
+OziCatalog *OziCatalogOpen(const char *pszCatalog) {
+	FILE *fp = VSIFOpenL(pszCatalog, "rb");
+	if (fp == NULL) {
+		CPLError(CE_Failure, CPLE_OpenFailed,
+				"OziCatalogOpen(): cannot open \"%s\".", pszCatalog);
+		return NULL;
+	}
+
+	VSIFSeekL(fp, 0, SEEK_END);
+	vsi_l_offset nSize = VSIFTellL(fp);
+	VSIFSeekL(fp, 0, SEEK_SET);
+
+	GByte *pabyData = NULL;
+	if (nSize >= sizeof(OziCatalogHeader) && nSize < 0x7fffffff) {
+		pabyData = (GByte *) VSIMalloc((size_t) nSize);
+		if (pabyData && VSIFReadL(pabyData, (size_t) nSize, 1, fp) != 1) {
+			VSIFree(pabyData);
+			pabyData = NULL;
+		}
+	}
+	VSIFCloseL(fp);
+
+	const OziCatalogHeader *psHeader = (const OziCatalogHeader *) pabyData;
+	if (psHeader == NULL || memcmp(psHeader->achMagic, OZI_CATALOG_MAGIC,
+			sizeof(psHeader->achMagic)) != 0 || psHeader->nByteOrder
+			!= OZI_CATALOG_BYTE_ORDER || psHeader->nVersion
+			!= OZI_CATALOG_VERSION) {
+		CPLError(CE_Failure, CPLE_OpenFailed,
+				"OziCatalogOpen(): \"%s\" is not a catalog of this version"
+				" or byte order.", pszCatalog);
+		VSIFree(pabyData);
+		return NULL;
+	}
+
+	// -------------------------------------------------------------------- //
+	//      Sections.                                                       //
+	// -------------------------------------------------------------------- //
+	GUIntBig nSheets = psHeader->nSheets, nNodes = psHeader->nNodes;
+	GUIntBig nScales = psHeader->nScales, nStrings = psHeader->nStrings;
+	GUIntBig nOffset = sizeof(OziCatalogHeader);
+	GUIntBig nRecords = nOffset + nSheets * sizeof(OziBox);
+	GUIntBig nNodeOffset = nRecords + nSheets * sizeof(OziCatalogRecord);
+	GUIntBig nItems = nNodeOffset + nNodes * sizeof(OziRTreeNode);
+	GUIntBig nScaleOffset = nItems + nSheets * sizeof(int);
+	GUIntBig nStringOffset = nScaleOffset + nScales * 2 * sizeof(int);
+
+	OziCatalog *psCatalog = (OziCatalog *) CPLCalloc(1, sizeof(OziCatalog));
+	psCatalog->pabyData = pabyData;
+	psCatalog->psHeader = psHeader;
+	psCatalog->pasExtents = (const OziBox *) (pabyData + nOffset);
+	psCatalog->pasRecords = (const OziCatalogRecord *) (pabyData + nRecords);
+	psCatalog->panScales = (const int *) (pabyData + nScaleOffset);
+	psCatalog->pachStrings = (const char *) (pabyData + nStringOffset);
+	psCatalog->sTree.nNodes = (int) nNodes;
+	psCatalog->sTree.pasNodes = (OziRTreeNode *) (pabyData + nNodeOffset);
+	psCatalog->sTree.panItems = (int *) (pabyData + nItems);
+	psCatalog->sTree.pasBoxes = psCatalog->pasExtents;
+
+	int bOK = nStringOffset + nStrings == nSize && (nStrings == 0
+			|| psCatalog->pachStrings[nStrings - 1] == '\0') && (nSheets == 0)
+			== (nNodes == 0);
+
+	for (GUIntBig i = 0; bOK && i < nSheets; i++) {
+		const OziCatalogRecord *psRecord = psCatalog->pasRecords + i;
+		bOK = psRecord->nMapFile < nStrings && psRecord->nImageFile < nStrings
+				&& psRecord->nWKT < nStrings && (GUIntBig) psRecord->nFirstScale
+				+ psRecord->nScales <= nScales && psCatalog->sTree.panItems[i]
+				>= 0 && (GUIntBig) psCatalog->sTree.panItems[i] < nSheets;
+	}
+	for (GUIntBig i = 0; bOK && i < nNodes; i++) {
+		const OziRTreeNode *psNode = psCatalog->sTree.pasNodes + i;
+		GUIntBig nLimit = psNode->bLeaf ? nSheets : i;
+		bOK = psNode->iFirst >= 0 && psNode->nCount > 0
+				&& (GUIntBig) psNode->iFirst + psNode->nCount <= nLimit;
+	}
+
+	if (!bOK) {
+		CPLError(CE_Failure, CPLE_FileIO,
+				"OziCatalogOpen(): \"%s\" is corrupt.", pszCatalog);
+		OziCatalogClose(psCatalog);
+		return NULL;
+	}
+
+	return psCatalog;
+}
+
+void OziCatalogClose(OziCatalog *psCatalog) {
+	if (psCatalog == NULL)
+		return;
+	VSIFree(psCatalog->pabyData);
+	CPLFree(psCatalog);
+}
+
+int OziCatalogSheetCount(const OziCatalog *psCatalog) {
+	return (int) psCatalog->psHeader->nSheets;
+}
+
+int OziCatalogGetSheet(const OziCatalog *psCatalog, int iSheet,
+		OziCatalogSheet *psSheet) {
+	if (iSheet < 0 || iSheet >= OziCatalogSheetCount(psCatalog))
+		return FALSE;
+
+	const OziCatalogRecord *psRecord = psCatalog->pasRecords + iSheet;
+	const OziBox *psExtent = psCatalog->pasExtents + iSheet;
+
+	psSheet->pszMapFile = OziCatalogString(psCatalog, psRecord->nMapFile);
+	psSheet->pszImageFile = OziCatalogString(psCatalog, psRecord->nImageFile);
+	psSheet->pszWKT = OziCatalogString(psCatalog, psRecord->nWKT);
+	psSheet->dfMinLon = psExtent->dfMinX;
+	psSheet->dfMinLat = psExtent->dfMinY;
+	psSheet->dfMaxLon = psExtent->dfMaxX;
+	psSheet->dfMaxLat = psExtent->dfMaxY;
+	psSheet->dfPixelSize = psRecord->dfPixelSize;
+	psSheet->nXSize = psRecord->nXSize;
+	psSheet->nYSize = psRecord->nYSize;
+	psSheet->nScales = (int) psRecord->nScales;
+	psSheet->panScaleSizes = psCatalog->panScales + 2 * psRecord->nFirstScale;
+	psSheet->nMapMTime = psRecord->nMapMTime;
+	psSheet->nImageMTime = psRecord->nImageMTime;
+
+	return TRUE;
+}
+
+/************************************************************************/
+/*                          OziCatalogQuery()                           */
+/*                                                                      */
+/*      Sheets overlapping the lon/lat box whose pixel size is within   */
+/*      the range, a bound of 0 is open. Returns the number of sheets,  */
+/*      of which at most nMaxSheets are stored, in no specific order.   */
+/************************************************************************/
+
+typedef struct {
+	const OziCatalog *psCatalog;
+	double dfMinPixelSize;
+	double dfMaxPixelSize;
+} OziCatalogFilter;
+
+static int OziCatalogAccept(int iSheet, void *pUserData) {
+	const OziCatalogFilter *psFilter = (const OziCatalogFilter *) pUserData;
+	double dfPixelSize = psFilter->psCatalog->pasRecords[iSheet].dfPixelSize;
+
+	return (psFilter->dfMinPixelSize <= 0.0 || dfPixelSize
+			>= psFilter->dfMinPixelSize) && (psFilter->dfMaxPixelSize <= 0.0
+			|| dfPixelSize <= psFilter->dfMaxPixelSize);
+}
+
+int OziCatalogQuery(const OziCatalog *psCatalog, double dfMinLon,
+		double dfMinLat, double dfMaxLon, double dfMaxLat,
+		double dfMinPixelSize, double dfMaxPixelSize, int *panSheets,
+		int nMaxSheets) {
+	OziBox sBox;
+	sBox.dfMinX = dfMinLon;
+	sBox.dfMinY = dfMinLat;
+	sBox.dfMaxX = dfMaxLon;
+	sBox.dfMaxY = dfMaxLat;
+
+	OziCatalogFilter sFilter;
+	sFilter.psCatalog = psCatalog;
+	sFilter.dfMinPixelSize = dfMinPixelSize;
+	sFilter.dfMaxPixelSize = dfMaxPixelSize;
+
+	int bFilter = dfMinPixelSize > 0.0 || dfMaxPixelSize > 0.0;
+
+	return OziRTreeQuery(&psCatalog->sTree, &sBox, bFilter ? OziCatalogAccept
+			: NULL, &sFilter, panSheets, nMaxSheets);
+}
+
+// a point on a sheet edge is not on the sheet
+int OziCatalogQueryPoint(const OziCatalog *psCatalog, double dfLon,
+		double dfLat, double dfMinPixelSize, double dfMaxPixelSize,
+		int *panSheets, int nMaxSheets) {
+	return OziCatalogQuery(psCatalog, dfLon, dfLat, dfLon, dfLat,
+			dfMinPixelSize, dfMaxPixelSize, panSheets, nMaxSheets);
+}
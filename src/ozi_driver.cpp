@@ -5,11 +5,20 @@
  *      Author: geom
  */
 
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
 #include <gdal.h>
 #include <gdal_priv.h>
 #include <gdal_proxy.h>
+#include <gdalwarper.h>
 #include <ogr_spatialref.h>
 #include <cpl_string.h>
+#include <cpl_multiproc.h>
+
+#include "ozi_driver.h"
+#include "ozf_trace.h"
 
 /*
  * OGR stuff.
@@ -274,8 +283,8 @@ static const OZIDatums
 
 						{ NULL, 0, NULL } };
 
-int CPL_STDCALL ImportFromOzi(OGRSpatialReference *pSRS, char *pszDatum,
-		char *pszProj, char *pszProjParms, int* targetEPSG) {
+int CPL_STDCALL ImportFromOzi(OGRSpatialReference *pSRS, const char *pszDatum,
+		const char *pszProj, const char *pszProjParms, int* targetEPSG) {
 
 	pSRS->Clear();
 
@@ -308,8 +317,6 @@ int CPL_STDCALL ImportFromOzi(OGRSpatialReference *pSRS, char *pszDatum,
 				goto not_enough_data;
 			}
 			pSRS->CopyGeogCSFrom(&oGCS);
-			char* twkt;
-			oGCS.exportToWkt(&twkt);
 			if (paoDatum->nEPSGCode > 0) {
 				*targetEPSG = paoDatum->nEPSGCode;
 			}
@@ -423,158 +430,96 @@ int CPL_STDCALL ImportFromOzi(OGRSpatialReference *pSRS, char *pszDatum,
 
 }
 
-#define MAX_GCP 30
-
-static CPLErr GDALOpenOziMapFile(const char *pszFilename, char ***papszLines) {
-
-	int nLines = 0;
-
-	VALIDATE_POINTER1( pszFilename, "GDALOpenOziMapFile", CE_Failure );
-
-	*papszLines = CSLLoad2(pszFilename, 1000, 200, NULL);
-
-	if (!*papszLines)
-		return CE_Failure;
-
-	nLines = CSLCount(*papszLines);
-	int iLine = 0;
-	for (iLine = 0; iLine < nLines; iLine++) {
-		CPLDebug("OZI", (*papszLines)[iLine]);
-	}
-	// Check the OziExplorer Map file signature
-	if (nLines < 5
-			|| !EQUALN((*papszLines)[0], "OziExplorer Map Data File Version ", 34)) {
-		CSLDestroy(*papszLines);
-		CPLError(
-				CE_Failure,
-				CPLE_AppDefined,
-				"GDALOpenOziMapFile(): file \"%s\" is not in OziExplorer Map format.",
-				pszFilename);
-		return CE_Failure;
-	}
-
-	return CE_None;
-}
+/************************************************************************/
+/*                         OziMapGeoreference()                         */
+/*                                                                      */
+/*      Builds the SRS, geotransform or GCPs of a parsed .map file.     */
+/*      Calibration points are preferred; when they do not fit an       */
+/*      affine transform the MMPXY/MMPLL border corners are tried       */
+/*      before falling back to GCPs.                                    */
+/************************************************************************/
 
-static CPLErr GDALParseOziMapParams(const char *pszFilename, char **papszLines,
-		double *padfGeoTransform, char **ppszWKT, int *pnGCPCount,
-		GDAL_GCP **ppasGCPs)
+CPLErr OziMapGeoreference(const char *pszFilename, OziMapInfo *psMap,
+		double *padfGeoTransform, const OziSRS **ppsSRS, char **ppszWKT,
+		int *pnGCPCount, GDAL_GCP **ppasGCPs)
 
 {
-	char **papszTok = NULL;
-	int iLine, nLines = 0;
-	int nCoordinateCount = 0;
-	GDAL_GCP asGCPs[MAX_GCP];
-
-	VALIDATE_POINTER1( padfGeoTransform, "GDALLoadOziMapFile", CE_Failure );
-	VALIDATE_POINTER1( pnGCPCount, "GDALLoadOziMapFile", CE_Failure );
-	VALIDATE_POINTER1( ppasGCPs, "GDALLoadOziMapFile", CE_Failure );
-
-	nLines = CSLCount(papszLines);
+	VALIDATE_POINTER1( padfGeoTransform, "OziMapGeoreference", CE_Failure );
+	VALIDATE_POINTER1( pnGCPCount, "OziMapGeoreference", CE_Failure );
+	VALIDATE_POINTER1( ppasGCPs, "OziMapGeoreference", CE_Failure );
 
-	OGRSpatialReference oSRS, *poTargetSRS = NULL, *poLatLong = NULL;
-	OGRCoordinateTransformation *poTransform = NULL, *poPTransform = NULL;
-	char *pszProj = NULL, *pszProjParms = NULL;
+	// shared by every sheet with the same datum and projection
+	const OziSRS *psSRS = OziSRSAcquire(psMap->pszDatum, psMap->pszProjection,
+			psMap->pszProjectionSetup);
 
-	for (iLine = 8; iLine < nLines; iLine++) {
-		if (EQUALN(papszLines[iLine], "Map Projection", 14)) {
-			pszProj = papszLines[iLine];
-			continue;
-		}
-
-		if (EQUALN(papszLines[iLine], "Projection Setup", 16)) {
-			pszProjParms = papszLines[iLine];
-			continue;
-		}
-	}
-
-	int targetEPSG;
-
-	if (papszLines[4][0] != '\0' && pszProj && pszProjParms && ImportFromOzi(
-			&oSRS, papszLines[4], pszProj, pszProjParms, &targetEPSG)
-			== OGRERR_NONE) {
-
-		OGRSpatialReference tSRS;
-		tSRS.importFromEPSG(targetEPSG);
-
-		poTargetSRS = oSRS.Clone();
-		poTargetSRS->CopyGeogCSFrom(&tSRS);
-
-		if (ppszWKT != NULL)
-			poTargetSRS->exportToWkt(ppszWKT);
-
-		poLatLong = oSRS.CloneGeogCS();
-		poTransform = OGRCreateCoordinateTransformation(poLatLong, poTargetSRS);
-		poPTransform = OGRCreateCoordinateTransformation(&oSRS, poTargetSRS);
-	} else {
+	if (psSRS == NULL) {
 		CPLError(
 				CE_Failure,
 				CPLE_AppDefined,
-				"GDALLoadOziMapFile(): file \"%s\" is not georeferenced correctly.",
+				"OziMapGeoreference(): file \"%s\" is not georeferenced correctly.",
 				pszFilename);
 		return CE_Failure;
 	}
 
-	// Iterate all lines in the TAB-file
-	for (iLine = 5; iLine < nLines; iLine++) {
-		CSLDestroy(papszTok);
-		papszTok = CSLTokenizeString2(papszLines[iLine], ",",
-				CSLT_ALLOWEMPTYTOKENS | CSLT_STRIPLEADSPACES
-						| CSLT_STRIPENDSPACES);
-
-		if (CSLCount(papszTok) < 12)
-			continue;
+	if (ppsSRS != NULL)
+		*ppsSRS = psSRS;
+	if (ppszWKT != NULL)
+		*ppszWKT = CPLStrdup(OziSRSGetWKT(psSRS));
 
-		if (CSLCount(papszTok) >= 12 && EQUALN(papszTok[0], "Point", 5)
-				&& nCoordinateCount < MAX_GCP) {
-			if (!EQUAL(papszTok[3], "")) {
-				double dfLon, dfLat;
+	// -------------------------------------------------------------------- //
+	//      Calibration points, there is no limit on their number.          //
+	// -------------------------------------------------------------------- //
+	int nCoordinateCount = psMap->nPoints;
+	GDAL_GCP *pasGCPs = (GDAL_GCP *) CPLCalloc(sizeof(GDAL_GCP),
+			MAX(nCoordinateCount, 1));
 
-				GDALInitGCPs(1, asGCPs + nCoordinateCount);
+	GDALInitGCPs(nCoordinateCount, pasGCPs);
 
-				// Set pixel/line part
-				asGCPs[nCoordinateCount].dfGCPPixel = CPLAtofM(papszTok[2]);
-				asGCPs[nCoordinateCount].dfGCPLine = CPLAtofM(papszTok[3]);
+	for (int i = 0; i < nCoordinateCount; i++) {
+		double dfLon = psMap->pasPoints[i].dfLon;
+		double dfLat = psMap->pasPoints[i].dfLat;
+		int bSuccess;
 
-				if (!EQUAL(papszTok[6], "") && !EQUAL(papszTok[7], "")
-						&& !EQUAL(papszTok[9], "") && !EQUAL(papszTok[10], "")) {
+		OziSRSTransform(psSRS, OZI_SRS_MAP_TO_TARGET, 1, &dfLon, &dfLat,
+				&bSuccess);
 
-					// Set geographical coordinates of the pixels
-					dfLon = CPLAtofM(papszTok[9]) + CPLAtofM(papszTok[10])
-							/ 60.0;
-					dfLat = CPLAtofM(papszTok[6]) + CPLAtofM(papszTok[7])
-							/ 60.0;
-					if (EQUAL(papszTok[11], "W"))
-						dfLon = -dfLon;
-					if (EQUAL(papszTok[8], "S"))
-						dfLat = -dfLat;
-
-					if (poTransform)
-						poTransform->Transform(1, &dfLon, &dfLat);
-
-					asGCPs[nCoordinateCount].dfGCPX = dfLon;
-					asGCPs[nCoordinateCount].dfGCPY = dfLat;
+		pasGCPs[i].dfGCPPixel = psMap->pasPoints[i].dfPixel;
+		pasGCPs[i].dfGCPLine = psMap->pasPoints[i].dfLine;
+		pasGCPs[i].dfGCPX = dfLon;
+		pasGCPs[i].dfGCPY = dfLat;
+	}
 
-					nCoordinateCount++;
-				}
-			}
+	// -------------------------------------------------------------------- //
+	//      Border corners, used when the points alone do not give a       //
+	//      geotransform.                                                   //
+	// -------------------------------------------------------------------- //
+	int nCornerCount = MIN(psMap->nBorderXY, psMap->nBorderLL);
+	GDAL_GCP *pasCorners = NULL;
+
+	if (nCornerCount >= 3) {
+		pasCorners = (GDAL_GCP *) CPLCalloc(sizeof(GDAL_GCP), nCornerCount);
+		GDALInitGCPs(nCornerCount, pasCorners);
+
+		for (int i = 0; i < nCornerCount; i++) {
+			double dfLon = psMap->padfBorderLL[i * 2];
+			double dfLat = psMap->padfBorderLL[i * 2 + 1];
+			int bSuccess;
+
+			OziSRSTransform(psSRS, OZI_SRS_MAP_TO_TARGET, 1, &dfLon, &dfLat,
+					&bSuccess);
+
+			pasCorners[i].dfGCPPixel = psMap->padfBorderXY[i * 2];
+			pasCorners[i].dfGCPLine = psMap->padfBorderXY[i * 2 + 1];
+			pasCorners[i].dfGCPX = dfLon;
+			pasCorners[i].dfGCPY = dfLat;
 		}
 	}
 
-	if (poTransform)
-		delete poTransform;
-	if (poPTransform)
-		delete poPTransform;
-	if (poLatLong)
-		delete poLatLong;
-	if (poTargetSRS)
-		delete poTargetSRS;
-
-	CSLDestroy(papszTok);
-
-	if (nCoordinateCount == 0) {
-		CPLDebug("GDAL", "GDALLoadOziMapFile(\"%s\") did not get any GCPs.",
+	if (nCoordinateCount == 0 && pasCorners == NULL) {
+		CPLDebug("GDAL", "OziMapGeoreference(\"%s\") did not get any GCPs.",
 				pszFilename);
+		GDALDeinitGCPs(nCoordinateCount, pasGCPs);
+		CPLFree(pasGCPs);
 		return CE_Failure;
 	}
 
@@ -582,41 +527,68 @@ static CPLErr GDALParseOziMapParams(const char *pszFilename, char **papszLines,
 	/*      Try to convert the GCPs into a geotransform definition, if      */
 	/*      possible.  Otherwise we will need to use them as GCPs.          */
 	/* -------------------------------------------------------------------- */
-	if (!GDALGCPsToGeoTransform(nCoordinateCount, asGCPs, padfGeoTransform,
-			FALSE)) {
-		if (pnGCPCount && ppasGCPs) {
-			CPLDebug("GDAL",
-					"GDALLoadOziMapFile(%s) found file, wasn't able to derive a\n"
-						"first order geotransform.  Using points as GCPs.",
-					pszFilename);
-
-			*ppasGCPs = (GDAL_GCP *) CPLCalloc(sizeof(GDAL_GCP),
-					nCoordinateCount);
-			memcpy(*ppasGCPs, asGCPs, sizeof(GDAL_GCP) * nCoordinateCount);
-			*pnGCPCount = nCoordinateCount;
-		}
+	if (nCoordinateCount > 0 && GDALGCPsToGeoTransform(nCoordinateCount,
+			pasGCPs, padfGeoTransform, FALSE)) {
+		GDALDeinitGCPs(nCoordinateCount, pasGCPs);
+		CPLFree(pasGCPs);
+	} else if (pasCorners != NULL && GDALGCPsToGeoTransform(nCornerCount,
+			pasCorners, padfGeoTransform, FALSE)) {
+		CPLDebug("GDAL", "OziMapGeoreference(%s) derived the geotransform"
+			" from the MMPXY/MMPLL corners.", pszFilename);
+		GDALDeinitGCPs(nCoordinateCount, pasGCPs);
+		CPLFree(pasGCPs);
 	} else {
-		GDALDeinitGCPs(nCoordinateCount, asGCPs);
+		CPLDebug("GDAL",
+				"OziMapGeoreference(%s) found file, wasn't able to derive a\n"
+					"first order geotransform.  Using points as GCPs.",
+				pszFilename);
+
+		if (nCoordinateCount == 0) {
+			CPLFree(pasGCPs);
+			pasGCPs = pasCorners;
+			nCoordinateCount = nCornerCount;
+			pasCorners = NULL;
+		}
+
+		*ppasGCPs = pasGCPs;
+		*pnGCPCount = nCoordinateCount;
+	}
+
+	if (pasCorners) {
+		GDALDeinitGCPs(nCornerCount, pasCorners);
+		CPLFree(pasCorners);
 	}
 
 	return CE_None;
 }
 
-#undef MAX_GCP
-
 /*
  * OZI Driver stuff
  *
  *
  *
  */
+class OziRasterBand;
+class OziMaskBand;
+
 class CPL_DLL OziDataset: public GDALProxyDataset {
+	friend class OziRasterBand;
+	friend class OziMaskBand;
 private:
 	GDALDataset *poUnderlyingDS;
+	OziMapInfo *psMap;
 	char *pszProjectionRef;
+	const OziSRS *psSRS;
 	double adfGeoTransform[6];
 	int nGCPCount;
 	GDAL_GCP *pasGCPList;
+	OziMaskBand *poMaskBand;
+	char **papszOziMetadata;
+	char **papszMergedMetadata;
+	OziTransformer *psTransformer;
+	void *hTransformerMutex;
+
+	void InitBands();
 protected:
 	virtual GDALDataset *RefUnderlyingDataset();
 	virtual void UnrefUnderlyingDataset(GDALDataset* poUnderlyingDataset);
@@ -624,6 +596,10 @@ public:
 	OziDataset(GDALDataset *poDS);
 	virtual ~OziDataset();
 
+	virtual char **GetMetadata(const char * pszDomain = "");
+	virtual const char *GetMetadataItem(const char * pszName,
+			const char * pszDomain = "");
+
 	virtual const char *GetProjectionRef(void);
 	virtual CPLErr SetProjection(const char *);
 
@@ -636,15 +612,52 @@ public:
 	virtual CPLErr SetGCPs(int nGCPCount, const GDAL_GCP *pasGCPList,
 			const char *pszGCPProjection);
 
+	OziTransformer *GetTransformer();
+
 	static GDALDataset *Open(GDALOpenInfo *);
 	static int Identify(GDALOpenInfo *);
 };
 
+/*
+ * Bands forward to the image, but report the map border as their mask.
+ */
+class CPL_DLL OziRasterBand: public GDALProxyRasterBand {
+private:
+	GDALRasterBand *poUnderlyingBand;
+protected:
+	virtual GDALRasterBand *RefUnderlyingRasterBand();
+public:
+	OziRasterBand(OziDataset *, int, GDALRasterBand *);
+
+	virtual GDALRasterBand *GetMaskBand();
+	virtual int GetMaskFlags();
+#if GDAL_VERSION_NUM >= 2020000
+	virtual int IGetDataCoverageStatus(int nXOff, int nYOff, int nXSize,
+			int nYSize, int nMaskFlagStop, double* pdfDataPct);
+#endif
+};
+
+/*
+ * Per dataset mask rasterised from the MMPXY polygon.
+ */
+class CPL_DLL OziMaskBand: public GDALRasterBand {
+public:
+	OziMaskBand(OziDataset *);
+	virtual CPLErr IReadBlock(int, int, void *);
+};
+
 OziDataset::OziDataset(GDALDataset *poDS) {
 	poUnderlyingDS = poDS;
+	psMap = NULL;
 	pszProjectionRef = NULL;
+	psSRS = NULL;
 	nGCPCount = 0;
 	pasGCPList = NULL;
+	poMaskBand = NULL;
+	papszOziMetadata = NULL;
+	papszMergedMetadata = NULL;
+	psTransformer = NULL;
+	hTransformerMutex = NULL;
 
 	adfGeoTransform[0] = 0.0;
 	adfGeoTransform[1] = 1.0;
@@ -660,12 +673,188 @@ OziDataset::~OziDataset() {
 		CPLFree(pszProjectionRef);
 	}
 	if (pasGCPList) {
+		GDALDeinitGCPs(nGCPCount, pasGCPList);
 		CPLFree(pasGCPList);
 	}
-	if (poUnderlyingDS) {
-		delete poUnderlyingDS;
+	OziMapFree(psMap);
+	CSLDestroy(papszOziMetadata);
+	CSLDestroy(papszMergedMetadata);
+	OziTransformerDestroy(psTransformer);
+	if (hTransformerMutex)
+		CPLDestroyMutex(hTransformerMutex);
+
+	// proxy bands flush through to the image, drop them while it exists
+	for (int i = 0; i < nBands; i++)
+		delete papoBands[i];
+	CPLFree(papoBands);
+	papoBands = NULL;
+	nBands = 0;
+
+	if (poMaskBand) {
+		delete poMaskBand;
+	}
+	OziPoolRelease(poUnderlyingDS);
+}
+
+// -------------------------------------------------------------------- //
+//      Size and bands come from the image; the border polygon, if the  //
+//      map has one, becomes the mask and CUTLINE metadata.             //
+// -------------------------------------------------------------------- //
+void OziDataset::InitBands() {
+	nRasterXSize = poUnderlyingDS->GetRasterXSize();
+	nRasterYSize = poUnderlyingDS->GetRasterYSize();
+
+	for (int i = 1; i <= poUnderlyingDS->GetRasterCount(); i++) {
+		SetBand(i, new OziRasterBand(this, i,
+				poUnderlyingDS->GetRasterBand(i)));
+	}
+
+	if (psMap == NULL || psMap->nBorderXY < 3)
+		return;
+
+	poMaskBand = new OziMaskBand(this);
+
+	char *pszWKT = OziBorderToWKT(psMap->nBorderXY, psMap->padfBorderXY);
+	papszOziMetadata = CSLSetNameValue(papszOziMetadata, "CUTLINE", pszWKT);
+	CPLFree(pszWKT);
+
+	if (psMap->nBorderLL >= 3) {
+		pszWKT = OziBorderToWKT(psMap->nBorderLL, psMap->padfBorderLL);
+		papszOziMetadata = CSLSetNameValue(papszOziMetadata, "CUTLINE_LL",
+				pszWKT);
+		CPLFree(pszWKT);
+	}
+}
+
+char **OziDataset::GetMetadata(const char * pszDomain) {
+	if (pszDomain != NULL && *pszDomain != '\0')
+		return GDALProxyDataset::GetMetadata(pszDomain);
+
+	CSLDestroy(papszMergedMetadata);
+	papszMergedMetadata = CSLDuplicate(GDALProxyDataset::GetMetadata(pszDomain));
+
+	for (int i = 0; papszOziMetadata && papszOziMetadata[i]; i++)
+		papszMergedMetadata = CSLAddString(papszMergedMetadata,
+				papszOziMetadata[i]);
+
+	return papszMergedMetadata;
+}
+
+const char *OziDataset::GetMetadataItem(const char * pszName,
+		const char * pszDomain) {
+	if (pszDomain == NULL || *pszDomain == '\0') {
+		const char *pszValue = CSLFetchNameValue(papszOziMetadata, pszName);
+		if (pszValue != NULL)
+			return pszValue;
+	}
+
+	return GDALProxyDataset::GetMetadataItem(pszName, pszDomain);
+}
+
+OziRasterBand::OziRasterBand(OziDataset *poDS, int nBand,
+		GDALRasterBand *poUnderlyingBand) {
+	this->poDS = poDS;
+	this->nBand = nBand;
+	this->poUnderlyingBand = poUnderlyingBand;
+
+	nRasterXSize = poUnderlyingBand->GetXSize();
+	nRasterYSize = poUnderlyingBand->GetYSize();
+	eDataType = poUnderlyingBand->GetRasterDataType();
+	poUnderlyingBand->GetBlockSize(&nBlockXSize, &nBlockYSize);
+}
+
+GDALRasterBand *OziRasterBand::RefUnderlyingRasterBand() {
+	return poUnderlyingBand;
+}
+
+GDALRasterBand *OziRasterBand::GetMaskBand() {
+	OziDataset *poODS = (OziDataset *) poDS;
+
+	if (poODS->poMaskBand)
+		return poODS->poMaskBand;
+
+	return poUnderlyingBand->GetMaskBand();
+}
+
+int OziRasterBand::GetMaskFlags() {
+	OziDataset *poODS = (OziDataset *) poDS;
+
+	if (poODS->poMaskBand)
+		return GMF_PER_DATASET;
+
+	return poUnderlyingBand->GetMaskFlags();
+}
+
+#if GDAL_VERSION_NUM >= 2020000
+// -------------------------------------------------------------------- //
+//      Windows wholly outside the border are empty, so warping skips   //
+//      the map collar without reading it.                              //
+// -------------------------------------------------------------------- //
+int OziRasterBand::IGetDataCoverageStatus(int nXOff, int nYOff, int nXSize,
+		int nYSize, int nMaskFlagStop, double* pdfDataPct) {
+	OziDataset *poODS = (OziDataset *) poDS;
+
+	if (poODS->poMaskBand == NULL) {
+		if (pdfDataPct)
+			*pdfDataPct = 100.0;
+		return GDAL_DATA_COVERAGE_STATUS_DATA;
+	}
+
+	switch (OziBorderClassify(poODS->psMap->nBorderXY,
+			poODS->psMap->padfBorderXY, nXOff, nYOff, nXOff + nXSize,
+			nYOff + nYSize)) {
+	case OZI_BORDER_OUTSIDE:
+		if (pdfDataPct)
+			*pdfDataPct = 0.0;
+		return GDAL_DATA_COVERAGE_STATUS_EMPTY;
+	case OZI_BORDER_INSIDE:
+		if (pdfDataPct)
+			*pdfDataPct = 100.0;
+		return GDAL_DATA_COVERAGE_STATUS_DATA;
+	default:
+		if (pdfDataPct)
+			*pdfDataPct = -1.0;
+		return GDAL_DATA_COVERAGE_STATUS_DATA | GDAL_DATA_COVERAGE_STATUS_EMPTY;
 	}
 }
+#endif
+
+OziMaskBand::OziMaskBand(OziDataset *poDS) {
+	this->poDS = poDS;
+	this->nBand = 0;
+
+	nRasterXSize = poDS->GetRasterXSize();
+	nRasterYSize = poDS->GetRasterYSize();
+	eDataType = GDT_Byte;
+
+	nBlockXSize = 256;
+	nBlockYSize = 256;
+}
+
+CPLErr OziMaskBand::IReadBlock(int nBlockXOff, int nBlockYOff, void * pImage) {
+	OziDataset *poODS = (OziDataset *) poDS;
+	OziMapInfo *psMap = poODS->psMap;
+
+	int nXOff = nBlockXOff * nBlockXSize;
+	int nYOff = nBlockYOff * nBlockYSize;
+
+	// whole blocks on one side of the border need no scanline work
+	switch (OziBorderClassify(psMap->nBorderXY, psMap->padfBorderXY, nXOff,
+			nYOff, nXOff + nBlockXSize, nYOff + nBlockYSize)) {
+	case OZI_BORDER_OUTSIDE:
+		memset(pImage, 0, nBlockXSize * nBlockYSize);
+		break;
+	case OZI_BORDER_INSIDE:
+		memset(pImage, 255, nBlockXSize * nBlockYSize);
+		break;
+	default:
+		OziBorderRasterize(psMap->nBorderXY, psMap->padfBorderXY, nXOff,
+				nYOff, nBlockXSize, nBlockYSize, (GByte *) pImage, nBlockXSize);
+		break;
+	}
+
+	return CE_None;
+}
 
 GDALDataset* OziDataset::RefUnderlyingDataset() {
 	return poUnderlyingDS;
@@ -682,7 +871,8 @@ CPLErr OziDataset::SetProjection(const char *) {
 
 CPLErr OziDataset::GetGeoTransform(double *padfTransform) {
 	memcpy(padfTransform, adfGeoTransform, sizeof(double) * 6);
-	return CE_None;
+	// maps georeferenced by GCPs have no geotransform
+	return nGCPCount > 0 ? CE_Failure : CE_None;
 }
 CPLErr OziDataset::SetGeoTransform(double *) {
 	return CE_None;
@@ -701,6 +891,56 @@ CPLErr OziDataset::SetGCPs(int nGCPCount, const GDAL_GCP *pasGCPList,
 	return CE_None;
 }
 
+// -------------------------------------------------------------------- //
+//      The transformer is built on first use and kept for the life of  //
+//      the dataset, callers on several threads share it.               //
+// -------------------------------------------------------------------- //
+OziTransformer *OziDataset::GetTransformer() {
+	CPLMutexHolderD(&hTransformerMutex);
+
+	if (psTransformer == NULL) {
+		psTransformer = OziTransformerCreate(psSRS,
+				adfGeoTransform, nGCPCount, pasGCPList, nRasterXSize,
+				nRasterYSize);
+		if (psTransformer == NULL)
+			CPLError(CE_Failure, CPLE_AppDefined,
+					"Cannot build the pixel/lon-lat transformer of \"%s\".",
+					GetDescription());
+	}
+
+	return psTransformer;
+}
+
+static OziTransformer *OziDatasetTransformer(GDALDatasetH hDS) {
+	OziDataset *poDS = dynamic_cast<OziDataset *> ((GDALDataset *) hDS);
+
+	if (poDS == NULL) {
+		CPLError(CE_Failure, CPLE_AppDefined,
+				"Dataset was not opened by the OZI driver.");
+		return NULL;
+	}
+
+	return poDS->GetTransformer();
+}
+
+int OziDatasetToGeo(GDALDatasetH hDS, int nCount, double *padfX,
+		double *padfY, int *pabSuccess) {
+	OziTransformer *psTr = OziDatasetTransformer(hDS);
+	if (psTr == NULL)
+		return FALSE;
+
+	return OziTransformerToGeo(psTr, nCount, padfX, padfY, pabSuccess);
+}
+
+int OziDatasetToPixel(GDALDatasetH hDS, int nCount, double *padfX,
+		double *padfY, int *pabSuccess) {
+	OziTransformer *psTr = OziDatasetTransformer(hDS);
+	if (psTr == NULL)
+		return FALSE;
+
+	return OziTransformerToPixel(psTr, nCount, padfX, padfY, pabSuccess);
+}
+
 /************************************************************************/
 /*                                Identify()                            */
 /************************************************************************/
@@ -708,6 +948,10 @@ CPLErr OziDataset::SetGCPs(int nGCPCount, const GDAL_GCP *pasGCPList,
 int OziDataset::Identify(GDALOpenInfo * poOpenInfo)
 
 {
+	if (EQUALN(poOpenInfo->pszFilename, OZI_MOSAIC_PREFIX,
+			strlen(OZI_MOSAIC_PREFIX)))
+		return TRUE;
+
 	if (poOpenInfo->nHeaderBytes < 34)
 		return FALSE;
 
@@ -718,6 +962,91 @@ int OziDataset::Identify(GDALOpenInfo * poOpenInfo)
 	return TRUE;
 }
 
+/************************************************************************/
+/*                           OziOpenOption()                            */
+/*                                                                      */
+/*      Open options exist since GDAL 2.0, older versions read the      */
+/*      same settings from OZI_<name> configuration options.            */
+/************************************************************************/
+
+static const char *OziOpenOption(GDALOpenInfo * poOpenInfo,
+		const char *pszName) {
+#if GDAL_VERSION_NUM >= 2000000
+	const char *pszValue = CSLFetchNameValue(poOpenInfo->papszOpenOptions,
+			pszName);
+	if (pszValue != NULL)
+		return pszValue;
+#endif
+	return CPLGetConfigOption(CPLSPrintf("OZI_%s", pszName), NULL);
+}
+
+/************************************************************************/
+/*                          OziWarpedDataset()                          */
+/*                                                                      */
+/*      Wraps a sheet in a warped VRT in the target SRS. Only blocks    */
+/*      that are read get warped, through the approximate geotransform  */
+/*      or GCP transformer within dfMaxError pixels.                    */
+/************************************************************************/
+
+static GDALDataset *OziWarpedDataset(GDALDataset *poDS,
+		const char *pszTargetSRS, double dfMaxError) {
+	OGRSpatialReference oSRS;
+
+	if (oSRS.SetFromUserInput(pszTargetSRS) != OGRERR_NONE) {
+		CPLError(CE_Failure, CPLE_AppDefined,
+				"Open(): cannot parse TARGET_SRS \"%s\".", pszTargetSRS);
+		return NULL;
+	}
+
+	char *pszDstWKT = NULL;
+	oSRS.exportToWkt(&pszDstWKT);
+
+	const char *pszSrcWKT = poDS->GetGCPCount() > 0 ?
+			poDS->GetGCPProjection() : poDS->GetProjectionRef();
+
+	GDALDatasetH hWarped = GDALAutoCreateWarpedVRT((GDALDatasetH) poDS,
+			pszSrcWKT, pszDstWKT, GRA_Bilinear, dfMaxError, NULL);
+	CPLFree(pszDstWKT);
+
+	if (hWarped == NULL)
+		return NULL;
+
+	// the warped VRT holds its own reference and closes the sheet with it
+	poDS->Dereference();
+
+	return (GDALDataset *) hWarped;
+}
+
+/************************************************************************/
+/*                            OziOpenSheet()                            */
+/*                                                                      */
+/*      Opens a .map as a member of a mosaic. Sheets that are not       */
+/*      georeferenced by a north up geotransform in the mosaic SRS are  */
+/*      warped into it.                                                 */
+/************************************************************************/
+
+GDALDataset *OziOpenSheet(const char *pszMapFile, const char *pszTargetWKT) {
+	GDALOpenInfo oOpenInfo(pszMapFile, GA_ReadOnly);
+	GDALDataset *poDS = OziDataset::Open(&oOpenInfo);
+
+	if (poDS == NULL)
+		return NULL;
+
+	poDS->SetDescription(pszMapFile);
+
+	double adfTransform[6];
+	if (pszTargetWKT == NULL || (poDS->GetGeoTransform(adfTransform)
+			== CE_None && adfTransform[2] == 0.0 && adfTransform[4] == 0.0
+			&& EQUAL(poDS->GetProjectionRef(), pszTargetWKT)))
+		return poDS;
+
+	GDALDataset *poWarpedDS = OziWarpedDataset(poDS, pszTargetWKT, 0.125);
+	if (poWarpedDS == NULL)
+		delete poDS;
+
+	return poWarpedDS;
+}
+
 /************************************************************************/
 /*                                Open()                                */
 /************************************************************************/
@@ -727,6 +1056,8 @@ GDALDataset *OziDataset::Open(GDALOpenInfo * poOpenInfo)
 	if (!Identify(poOpenInfo)) {
 		return NULL;
 	}
+
+	OZF_TRACE_SCOPE("OziDataset::Open");
 	if (poOpenInfo->eAccess == GA_Update) {
 		CPLError(CE_Failure, CPLE_NotSupported,
 				"The Ozi driver does not support update access to existing"
@@ -734,68 +1065,79 @@ GDALDataset *OziDataset::Open(GDALOpenInfo * poOpenInfo)
 		return NULL;
 	}
 
+	if (EQUALN(poOpenInfo->pszFilename, OZI_MOSAIC_PREFIX,
+			strlen(OZI_MOSAIC_PREFIX)))
+		return OziMosaicOpen(poOpenInfo->pszFilename
+				+ strlen(OZI_MOSAIC_PREFIX));
+
 	/* -------------------------------------------------------------------- */
-	/*      Open the file and ingest.                                       */
+	/*      Read and parse the .map file in one go.                         */
 	/* -------------------------------------------------------------------- */
-	FILE *fp;
-	int nGifErr;
-
-	fp = VSIFOpenL(poOpenInfo->pszFilename, "r");
-	if (fp == NULL)
+	OziMapInfo *psMap = OziMapLoad(poOpenInfo->pszFilename);
+	if (psMap == NULL)
 		return NULL;
 
 	/* -------------------------------------------------------------------- */
-	/*      Create a corresponding GDALDataset.                             */
+	/*      Find the image next to the .map and take it from the pool.      */
 	/* -------------------------------------------------------------------- */
-
-	char **papszLines = NULL;
-	if (GDALOpenOziMapFile(poOpenInfo->pszFilename, &papszLines) != CE_None) {
-		return NULL;
-	}
-
-	char *pszImgName = NULL;
-	char **papszTok = NULL;
-	papszTok = CSLTokenizeString2(papszLines[2], "\\/", CSLT_ALLOWEMPTYTOKENS
-			| CSLT_STRIPLEADSPACES | CSLT_STRIPENDSPACES);
-	int nPNum = CSLCount(papszTok);
-	if (nPNum > 0) {
-		pszImgName = CPLStrdup(papszTok[nPNum - 1]);
-		CSLDestroy(papszTok);
-	} else {
+	char *pszImgPath = OziResolveImagePath(poOpenInfo->pszFilename,
+			psMap->pszImage);
+	if (pszImgPath == NULL) {
 		CPLError(CE_Failure, CPLE_AppDefined,
-				"Open(): cannot parse image file  \"%s\".", papszLines[2]);
-		CSLDestroy(papszTok);
-		CSLDestroy(papszLines);
+				"Open(): cannot parse image file  \"%s\".",
+				psMap->pszImage ? psMap->pszImage : "");
+		OziMapFree(psMap);
 		return NULL;
 	}
 
-	GDALDataset *poSrcDS;
-
-	poSrcDS = (GDALDataset *) GDALOpenShared(pszImgName, GA_ReadOnly);
+	GDALDataset *poSrcDS = OziPoolAcquire(pszImgPath);
 	if (!poSrcDS) {
 		CPLError(CE_Failure, CPLE_AppDefined,
-				"Open(): cannot open image file  \"%s\".", pszImgName);
-		CPLFree(pszImgName);
-		CSLDestroy(papszLines);
+				"Open(): cannot open image file  \"%s\".", pszImgPath);
+		CPLFree(pszImgPath);
+		OziMapFree(psMap);
 		return NULL;
 	}
-	CPLFree(pszImgName);
+	CPLFree(pszImgPath);
+
 	OziDataset *poDS = new OziDataset(poSrcDS);
 
 	poDS->eAccess = GA_ReadOnly;
-	if (GDALParseOziMapParams(poOpenInfo->pszFilename, papszLines,
-			poDS->adfGeoTransform, &poDS->pszProjectionRef, &poDS->nGCPCount,
+	poDS->psMap = psMap;
+	poDS->InitBands();
+	if (OziMapGeoreference(poOpenInfo->pszFilename, psMap,
+			poDS->adfGeoTransform, &poDS->psSRS, &poDS->pszProjectionRef,
+			&poDS->nGCPCount,
 			&poDS->pasGCPList) != CE_None) {
 		CPLError(CE_Failure, CPLE_AppDefined,
 				"Open(): cannot parse map params.");
 		delete poDS;
-		CSLDestroy(papszLines);
 		return NULL;
 	}
 
+	/* -------------------------------------------------------------------- */
+	/*      Reproject on the fly when a target SRS is asked for.            */
+	/* -------------------------------------------------------------------- */
+	const char *pszTargetSRS = OziOpenOption(poOpenInfo, "TARGET_SRS");
+	if (pszTargetSRS != NULL && *pszTargetSRS != '\0') {
+		const char *pszError = OziOpenOption(poOpenInfo, "ERROR_THRESHOLD");
+		GDALDataset *poWarpedDS = OziWarpedDataset(poDS, pszTargetSRS,
+				pszError ? CPLAtof(pszError) : 0.125);
+		if (poWarpedDS == NULL) {
+			delete poDS;
+			return NULL;
+		}
+		return poWarpedDS;
+	}
+
 	return poDS;
 }
 
+static void OziDriverUnload(GDALDriver *) {
+	OziPoolFlush();
+	OziSRSCacheFlush();
+}
+
 extern "C" CPL_DLL void GDALRegister_OZI() {
 
 	GDALDriver *poDriver;
@@ -807,10 +1149,24 @@ extern "C" CPL_DLL void GDALRegister_OZI() {
 		poDriver->SetMetadataItem(GDAL_DMD_LONGNAME, "OZIExplorer MAP (.map)");
 		poDriver->SetMetadataItem(GDAL_DMD_HELPTOPIC, "frmt_various.html#OZI");
 		poDriver->SetMetadataItem(GDAL_DMD_EXTENSION, "map");
+#if GDAL_VERSION_NUM >= 2000000
+		poDriver->SetMetadataItem(GDAL_DMD_OPENOPTIONLIST,
+"<OpenOptionList>"
+"  <Option name='TARGET_SRS' type='string' description='Reproject on the fly to this SRS'/>"
+"  <Option name='ERROR_THRESHOLD' type='float' description='Transformer approximation error, in pixels' default='0.125'/>"
+"</OpenOptionList>");
+#endif
 
 		poDriver->pfnOpen = OziDataset::Open;
 		poDriver->pfnIdentify = OziDataset::Identify;
+		poDriver->pfnUnloadDriver = OziDriverUnload;
 
 		GetGDALDriverManager()->RegisterDriver(poDriver);
+
+#ifdef OZF_TRACE
+		const char *pszTrace = CPLGetConfigOption("OZF_TRACE_FILE", NULL);
+		if (pszTrace != NULL && !ozf_trace_enabled)
+			ozf_trace_start(pszTrace);
+#endif
 	}
 }
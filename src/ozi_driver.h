@@ -0,0 +1,213 @@
+/*
+ * ozi_driver.h
+ *
+ *  OziExplorer .map file contents shared by the OZI driver modules.
+ */
+
+#ifndef __OZI_DRIVER_INCLUDED
+#define __OZI_DRIVER_INCLUDED
+
+#include <gdal.h>
+#include <cpl_error.h>
+
+// -------------------------------------------------------------------- //
+//      Calibration point of a .map file, geographic coordinates in    //
+//      degrees of the map datum.                                       //
+// -------------------------------------------------------------------- //
+typedef struct {
+	double dfPixel;
+	double dfLine;
+	double dfLon;
+	double dfLat;
+} OziMapPoint;
+
+// -------------------------------------------------------------------- //
+//      A parsed .map file. The file is read once into pszBuffer, line  //
+//      ends are replaced by NULs and every string member points into   //
+//      that buffer, so nothing but the point arrays is copied.         //
+// -------------------------------------------------------------------- //
+typedef struct {
+	char *pszBuffer;
+
+	const char *pszTitle;
+	const char *pszImage;       // image path as written, often a DOS path
+	const char *pszDatum;       // whole datum line
+	const char *pszProjection;  // "Map Projection,..." line
+	const char *pszProjectionSetup;
+
+	int nPoints;
+	OziMapPoint *pasPoints;
+
+	// MMPXY / MMPLL border polygon, pixel/line and lon/lat pairs
+	int nBorderXY;
+	double *padfBorderXY;
+	int nBorderLL;
+	double *padfBorderLL;
+
+	double dfMetersPerPixel;    // MM1B, 0 if absent
+	int nImageWidth;            // IWH, 0 if absent
+	int nImageHeight;
+} OziMapInfo;
+
+OziMapInfo *OziMapLoad(const char *pszFilename);
+void OziMapFree(OziMapInfo *psMap);
+
+// -------------------------------------------------------------------- //
+//      Map border (MMPXY polygon) in pixel/line coordinates.           //
+// -------------------------------------------------------------------- //
+#define OZI_BORDER_OUTSIDE 0
+#define OZI_BORDER_INSIDE 1
+#define OZI_BORDER_PARTIAL 2
+
+int OziBorderClassify(int nVertices, const double *padfXY, double dfX0,
+		double dfY0, double dfX1, double dfY1);
+void OziBorderRasterize(int nVertices, const double *padfXY, int nXOff,
+		int nYOff, int nXSize, int nYSize, GByte *pabyMask, int nLineStride);
+char *OziBorderToWKT(int nVertices, const double *padfXY);
+
+// -------------------------------------------------------------------- //
+//      Shared, bounded pool of open image datasets.                    //
+// -------------------------------------------------------------------- //
+#ifdef __cplusplus
+class GDALDataset;
+
+char *OziResolveImagePath(const char *pszMapFile, const char *pszImage);
+GDALDataset *OziPoolAcquire(const char *pszPath);
+void OziPoolRelease(GDALDataset *poDS);
+void OziPoolFlush();
+#endif
+
+// -------------------------------------------------------------------- //
+//      Shared spatial references, one per distinct datum/projection.   //
+//      The target is the SRS the sheet is georeferenced in.            //
+// -------------------------------------------------------------------- //
+#define OZI_SRS_MAP_TO_TARGET 0     // map datum lon/lat to target
+#define OZI_SRS_TARGET_TO_WGS84 1
+#define OZI_SRS_WGS84_TO_TARGET 2
+
+typedef struct OziSRS OziSRS;
+
+#ifdef __cplusplus
+class OGRSpatialReference;
+
+int CPL_STDCALL ImportFromOzi(OGRSpatialReference *pSRS, const char *pszDatum,
+		const char *pszProj, const char *pszProjParms, int* targetEPSG);
+CPLErr OziMapGeoreference(const char *pszFilename, OziMapInfo *psMap,
+		double *padfGeoTransform, const OziSRS **ppsSRS, char **ppszWKT,
+		int *pnGCPCount, GDAL_GCP **ppasGCPs);
+#endif
+
+const OziSRS *OziSRSAcquire(const char *pszDatum, const char *pszProj,
+		const char *pszProjParms);
+const char *OziSRSGetWKT(const OziSRS *psSRS);
+int OziSRSTransform(const OziSRS *psSRS, int nDirection, int nCount,
+		double *padfX, double *padfY, int *pabSuccess);
+void OziSRSCacheFlush();
+
+// -------------------------------------------------------------------- //
+//      Pixel/line <-> WGS84 lon/lat transformer, built once per        //
+//      dataset. Bulk calls follow GDALTransformerFunc: points are      //
+//      converted in place and TRUE is returned if all succeeded.       //
+// -------------------------------------------------------------------- //
+typedef struct OziTransformer OziTransformer;
+
+OziTransformer *OziTransformerCreate(const OziSRS *psSRS,
+		const double *padfGeoTransform, int nGCPCount,
+		const GDAL_GCP *pasGCPs, int nXSize, int nYSize);
+void OziTransformerDestroy(OziTransformer *psTr);
+int OziTransformerToGeo(OziTransformer *psTr, int nCount, double *padfX,
+		double *padfY, int *pabSuccess);
+int OziTransformerToPixel(OziTransformer *psTr, int nCount, double *padfX,
+		double *padfY, int *pabSuccess);
+
+// -------------------------------------------------------------------- //
+//      Packed R-tree, built once by sort-tile-recursive. Leaf nodes    //
+//      index into panItems, inner nodes into the node array, root      //
+//      last.                                                           //
+// -------------------------------------------------------------------- //
+typedef struct {
+	double dfMinX, dfMinY, dfMaxX, dfMaxY;
+} OziBox;
+
+typedef struct {
+	OziBox sBox;
+	int bLeaf;
+	int iFirst;
+	int nCount;
+} OziRTreeNode;
+
+typedef struct {
+	int nNodes;
+	OziRTreeNode *pasNodes;
+	int *panItems;
+	const OziBox *pasBoxes;
+} OziRTree;
+
+typedef int (*OziRTreeFilter)(int iItem, void *pUserData);
+
+void OziBoxUnion(OziBox *a, const OziBox *b);
+void OziRTreeBuild(OziRTree *psTree, const OziBox *pasBoxes, int nCount);
+void OziRTreeFree(OziRTree *psTree);
+int OziRTreeQuery(const OziRTree *psTree, const OziBox *psBox,
+		OziRTreeFilter pfnFilter, void *pUserData, int *panHits, int nMaxHits);
+
+// -------------------------------------------------------------------- //
+//      Mosaic of sheets, opened as OZIMOSAIC:<directory or list file>. //
+// -------------------------------------------------------------------- //
+#define OZI_MOSAIC_PREFIX "OZIMOSAIC:"
+
+#ifdef __cplusplus
+GDALDataset *OziOpenSheet(const char *pszMapFile, const char *pszTargetWKT);
+GDALDataset *OziMosaicOpen(const char *pszSource);
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// on a dataset opened by the OZI driver
+int CPL_DLL OziDatasetToGeo(GDALDatasetH hDS, int nCount, double *padfX,
+		double *padfY, int *pabSuccess);
+int CPL_DLL OziDatasetToPixel(GDALDatasetH hDS, int nCount, double *padfX,
+		double *padfY, int *pabSuccess);
+
+// -------------------------------------------------------------------- //
+//      Catalog of sheets on disk: extents in WGS84 lon/lat, SRS,       //
+//      pixel size, OZF scale sizes and file times, so coverage        //
+//      queries need no .map file. Strings point into the catalog.      //
+// -------------------------------------------------------------------- //
+typedef struct OziCatalog OziCatalog;
+
+typedef struct {
+	const char *pszMapFile;
+	const char *pszImageFile;
+	const char *pszWKT;         // SRS of the sheet
+	double dfMinLon, dfMinLat, dfMaxLon, dfMaxLat;
+	double dfPixelSize;         // metres per pixel, at the sheet centre
+	int nXSize, nYSize;
+	int nScales;                // OZF zoom levels, 0 for other images
+	const int *panScaleSizes;   // width, height per zoom level
+	GIntBig nMapMTime;
+	GIntBig nImageMTime;
+} OziCatalogSheet;
+
+int CPL_DLL OziCatalogUpdate(const char *pszCatalog, char **papszSources,
+		int nThreads);
+OziCatalog CPL_DLL *OziCatalogOpen(const char *pszCatalog);
+void CPL_DLL OziCatalogClose(OziCatalog *psCatalog);
+int CPL_DLL OziCatalogSheetCount(const OziCatalog *psCatalog);
+int CPL_DLL OziCatalogGetSheet(const OziCatalog *psCatalog, int iSheet,
+		OziCatalogSheet *psSheet);
+int CPL_DLL OziCatalogQuery(const OziCatalog *psCatalog, double dfMinLon,
+		double dfMinLat, double dfMaxLon, double dfMaxLat,
+		double dfMinPixelSize, double dfMaxPixelSize, int *panSheets,
+		int nMaxSheets);
+int CPL_DLL OziCatalogQueryPoint(const OziCatalog *psCatalog, double dfLon,
+		double dfLat, double dfMinPixelSize, double dfMaxPixelSize,
+		int *panSheets, int nMaxSheets);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,273 @@
+/*
+ * ozi_map.cpp
+ *
+ *  Single pass OziExplorer .map file parser.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <cpl_conv.h>
+#include <cpl_string.h>
+#include <cpl_vsi.h>
+
+#include "ozi_driver.h"
+
+// .map files are a few kilobytes, anything much larger is not one
+#define OZI_MAP_MAX_SIZE (16 * 1024 * 1024)
+#define OZI_MAP_MAX_FIELDS 32
+
+static const char szOziSignature[] = "OziExplorer Map Data File Version ";
+
+/************************************************************************/
+/*                             OziTrim()                                */
+/************************************************************************/
+
+static char *OziTrim(char *pszField) {
+	while (*pszField == ' ' || *pszField == '\t')
+		pszField++;
+
+	char *pszTail = pszField + strlen(pszField);
+	while (pszTail > pszField && (pszTail[-1] == ' ' || pszTail[-1] == '\t'))
+		*--pszTail = '\0';
+
+	return pszField;
+}
+
+/************************************************************************/
+/*                           OziSplitLine()                             */
+/*                                                                      */
+/*      Splits a line at commas in place and trims blanks around the    */
+/*      fields. Returns the number of fields.                           */
+/************************************************************************/
+
+static int OziSplitLine(char *pszLine, char **papszFields, int nMaxFields) {
+	int nFields = 0;
+	char *pszField = pszLine;
+
+	while (nFields < nMaxFields) {
+		char *pszEnd = strchr(pszField, ',');
+
+		if (pszEnd)
+			*pszEnd = '\0';
+
+		papszFields[nFields++] = OziTrim(pszField);
+
+		if (!pszEnd)
+			break;
+
+		pszField = pszEnd + 1;
+	}
+
+	return nFields;
+}
+
+/************************************************************************/
+/*                            OziSetPair()                              */
+/************************************************************************/
+
+static void OziSetPair(double **ppadfPairs, int *pnPairs, int nIndex,
+		double dfA, double dfB) {
+	// MMPXY/MMPLL records are numbered from 1 and normally in order
+	if (nIndex < 1 || nIndex > 1024)
+		return;
+
+	if (nIndex > *pnPairs) {
+		*ppadfPairs = (double *) CPLRealloc(*ppadfPairs,
+				sizeof(double) * 2 * nIndex);
+		for (int i = *pnPairs; i < nIndex; i++)
+			(*ppadfPairs)[i * 2] = (*ppadfPairs)[i * 2 + 1] = 0.0;
+		*pnPairs = nIndex;
+	}
+
+	(*ppadfPairs)[(nIndex - 1) * 2] = dfA;
+	(*ppadfPairs)[(nIndex - 1) * 2 + 1] = dfB;
+}
+
+/************************************************************************/
+/*                          OziParsePoint()                             */
+/*                                                                      */
+/*  Point01,xy,  123,  456,in, deg,  55, 30.0000,N,  37, 15.0000,E, ... */
+/************************************************************************/
+
+static int OziParsePoint(char **papszFields, int nFields, OziMapPoint *psPoint) {
+	if (nFields < 12 || papszFields[2][0] == '\0'
+			|| papszFields[3][0] == '\0')
+		return FALSE;
+
+	if (papszFields[6][0] == '\0' || papszFields[7][0] == '\0'
+			|| papszFields[9][0] == '\0' || papszFields[10][0] == '\0')
+		return FALSE;
+
+	psPoint->dfPixel = CPLAtof(papszFields[2]);
+	psPoint->dfLine = CPLAtof(papszFields[3]);
+
+	psPoint->dfLat = CPLAtof(papszFields[6]) + CPLAtof(papszFields[7]) / 60.0;
+	psPoint->dfLon = CPLAtof(papszFields[9]) + CPLAtof(papszFields[10]) / 60.0;
+
+	if (EQUAL(papszFields[8], "S"))
+		psPoint->dfLat = -psPoint->dfLat;
+	if (EQUAL(papszFields[11], "W"))
+		psPoint->dfLon = -psPoint->dfLon;
+
+	return TRUE;
+}
+
+/************************************************************************/
+/*                            OziMapLoad()                              */
+/************************************************************************/
+
+OziMapInfo *OziMapLoad(const char *pszFilename) {
+	FILE *fp = VSIFOpenL(pszFilename, "rb");
+
+	if (fp == NULL) {
+		CPLError(CE_Failure, CPLE_OpenFailed, "Cannot open \"%s\".",
+				pszFilename);
+		return NULL;
+	}
+
+	// -------------------------------------------------------------------- //
+	//      Read the whole file with one call.                              //
+	// -------------------------------------------------------------------- //
+	VSIFSeekL(fp, 0, SEEK_END);
+	vsi_l_offset nSize = VSIFTellL(fp);
+	VSIFSeekL(fp, 0, SEEK_SET);
+
+	if (nSize < sizeof(szOziSignature) - 1 || nSize > OZI_MAP_MAX_SIZE) {
+		VSIFCloseL(fp);
+		CPLError(CE_Failure, CPLE_AppDefined,
+				"OziMapLoad(): file \"%s\" is not in OziExplorer Map format.",
+				pszFilename);
+		return NULL;
+	}
+
+	char *pszBuffer = (char *) VSIMalloc((size_t) nSize + 1);
+
+	if (pszBuffer == NULL
+			|| VSIFReadL(pszBuffer, 1, (size_t) nSize, fp) != nSize) {
+		VSIFCloseL(fp);
+		CPLFree(pszBuffer);
+		CPLError(CE_Failure, CPLE_FileIO, "Cannot read \"%s\".", pszFilename);
+		return NULL;
+	}
+
+	VSIFCloseL(fp);
+	pszBuffer[nSize] = '\0';
+
+	if (!EQUALN(pszBuffer, szOziSignature, sizeof(szOziSignature) - 1)) {
+		CPLFree(pszBuffer);
+		CPLError(CE_Failure, CPLE_AppDefined,
+				"OziMapLoad(): file \"%s\" is not in OziExplorer Map format.",
+				pszFilename);
+		return NULL;
+	}
+
+	OziMapInfo *psMap = (OziMapInfo *) CPLCalloc(1, sizeof(OziMapInfo));
+	psMap->pszBuffer = pszBuffer;
+
+	// -------------------------------------------------------------------- //
+	//      One pass over the lines. The first five are positional, the     //
+	//      rest are recognised by their keyword.                           //
+	// -------------------------------------------------------------------- //
+	char *papszFields[OZI_MAP_MAX_FIELDS];
+	int nPointsAlloc = 0;
+	int iLine = 0;
+	char *pszLine = pszBuffer;
+
+	while (pszLine != NULL && *pszLine != '\0') {
+		char *pszNext = strpbrk(pszLine, "\r\n");
+
+		// empty lines count, the first five lines are positional
+		if (pszNext != NULL) {
+			int bCR = *pszNext == '\r';
+			*pszNext++ = '\0';
+			if (bCR && *pszNext == '\n')
+				pszNext++;
+		}
+
+		CPLDebug("OZI", "%s", pszLine);
+
+		switch (iLine) {
+		case 0:
+			break;
+		case 1:
+			psMap->pszTitle = pszLine;
+			break;
+		case 2:
+			psMap->pszImage = OziTrim(pszLine);
+			break;
+		case 3:
+			break;
+		case 4:
+			psMap->pszDatum = pszLine;
+			break;
+		default:
+			if (EQUALN(pszLine, "Point", 5)) {
+				int nFields = OziSplitLine(pszLine, papszFields,
+						OZI_MAP_MAX_FIELDS);
+
+				if (psMap->nPoints == nPointsAlloc) {
+					nPointsAlloc = nPointsAlloc ? nPointsAlloc * 2 : 32;
+					psMap->pasPoints = (OziMapPoint *) CPLRealloc(
+							psMap->pasPoints, sizeof(OziMapPoint) * nPointsAlloc);
+				}
+
+				if (OziParsePoint(papszFields, nFields,
+						psMap->pasPoints + psMap->nPoints))
+					psMap->nPoints++;
+			} else if (EQUALN(pszLine, "Map Projection", 14)) {
+				psMap->pszProjection = pszLine;
+			} else if (EQUALN(pszLine, "Projection Setup", 16)) {
+				psMap->pszProjectionSetup = pszLine;
+			} else if (EQUALN(pszLine, "MMPXY,", 6)) {
+				if (OziSplitLine(pszLine, papszFields, 4) == 4)
+					OziSetPair(&psMap->padfBorderXY, &psMap->nBorderXY,
+							atoi(papszFields[1]), CPLAtof(papszFields[2]),
+							CPLAtof(papszFields[3]));
+			} else if (EQUALN(pszLine, "MMPLL,", 6)) {
+				if (OziSplitLine(pszLine, papszFields, 4) == 4)
+					OziSetPair(&psMap->padfBorderLL, &psMap->nBorderLL,
+							atoi(papszFields[1]), CPLAtof(papszFields[2]),
+							CPLAtof(papszFields[3]));
+			} else if (EQUALN(pszLine, "MM1B,", 5)) {
+				if (OziSplitLine(pszLine, papszFields, 2) == 2)
+					psMap->dfMetersPerPixel = CPLAtof(papszFields[1]);
+			} else if (EQUALN(pszLine, "IWH,", 4)) {
+				if (OziSplitLine(pszLine, papszFields, 4) == 4) {
+					psMap->nImageWidth = atoi(papszFields[2]);
+					psMap->nImageHeight = atoi(papszFields[3]);
+				}
+			}
+			break;
+		}
+
+		iLine++;
+		pszLine = pszNext;
+	}
+
+	if (iLine < 5) {
+		CPLError(CE_Failure, CPLE_AppDefined,
+				"OziMapLoad(): file \"%s\" is not in OziExplorer Map format.",
+				pszFilename);
+		OziMapFree(psMap);
+		return NULL;
+	}
+
+	return psMap;
+}
+
+/************************************************************************/
+/*                            OziMapFree()                              */
+/************************************************************************/
+
+void OziMapFree(OziMapInfo *psMap) {
+	if (psMap == NULL)
+		return;
+
+	CPLFree(psMap->pasPoints);
+	CPLFree(psMap->padfBorderXY);
+	CPLFree(psMap->padfBorderLL);
+	CPLFree(psMap->pszBuffer);
+	CPLFree(psMap);
+}
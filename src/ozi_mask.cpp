@@ -0,0 +1,173 @@
+/*
+ * ozi_mask.cpp
+ *
+ *  Map border polygon helpers for the OZI driver: classification of
+ *  pixel rectangles, rasterisation into a mask and WKT export.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+
+#include <cpl_conv.h>
+#include <cpl_string.h>
+
+#include "ozi_driver.h"
+
+/************************************************************************/
+/*                        OziSegmentHitsRect()                          */
+/*                                                                      */
+/*      Liang-Barsky clip of one polygon edge against a rectangle.      */
+/************************************************************************/
+
+static int OziSegmentHitsRect(double dfAX, double dfAY, double dfBX,
+		double dfBY, double dfX0, double dfY0, double dfX1, double dfY1) {
+	double dfDX = dfBX - dfAX, dfDY = dfBY - dfAY;
+	double adfP[4] = { -dfDX, dfDX, -dfDY, dfDY };
+	double adfQ[4] = { dfAX - dfX0, dfX1 - dfAX, dfAY - dfY0, dfY1 - dfAY };
+	double dfT0 = 0.0, dfT1 = 1.0;
+
+	for (int i = 0; i < 4; i++) {
+		if (adfP[i] == 0.0) {
+			if (adfQ[i] < 0.0)
+				return FALSE;
+			continue;
+		}
+
+		double dfT = adfQ[i] / adfP[i];
+
+		if (adfP[i] < 0.0) {
+			if (dfT > dfT1)
+				return FALSE;
+			if (dfT > dfT0)
+				dfT0 = dfT;
+		} else {
+			if (dfT < dfT0)
+				return FALSE;
+			if (dfT < dfT1)
+				dfT1 = dfT;
+		}
+	}
+
+	return TRUE;
+}
+
+/************************************************************************/
+/*                         OziPointInBorder()                           */
+/************************************************************************/
+
+static int OziPointInBorder(int nVertices, const double *padfXY, double dfX,
+		double dfY) {
+	int bInside = FALSE;
+
+	for (int i = 0, j = nVertices - 1; i < nVertices; j = i++) {
+		double dfXi = padfXY[i * 2], dfYi = padfXY[i * 2 + 1];
+		double dfXj = padfXY[j * 2], dfYj = padfXY[j * 2 + 1];
+
+		if ((dfYi > dfY) != (dfYj > dfY) && dfX < (dfXj - dfXi) * (dfY - dfYi)
+				/ (dfYj - dfYi) + dfXi)
+			bInside = !bInside;
+	}
+
+	return bInside;
+}
+
+/************************************************************************/
+/*                         OziBorderClassify()                          */
+/*                                                                      */
+/*      Where the rectangle [X0,X1) x [Y0,Y1) lies relative to the      */
+/*      border: no edge crossing it means it is wholly on one side.     */
+/************************************************************************/
+
+int OziBorderClassify(int nVertices, const double *padfXY, double dfX0,
+		double dfY0, double dfX1, double dfY1) {
+	if (nVertices < 3)
+		return OZI_BORDER_INSIDE;
+
+	for (int i = 0, j = nVertices - 1; i < nVertices; j = i++) {
+		if (OziSegmentHitsRect(padfXY[j * 2], padfXY[j * 2 + 1], padfXY[i * 2],
+				padfXY[i * 2 + 1], dfX0, dfY0, dfX1, dfY1))
+			return OZI_BORDER_PARTIAL;
+	}
+
+	if (OziPointInBorder(nVertices, padfXY, (dfX0 + dfX1) / 2,
+			(dfY0 + dfY1) / 2))
+		return OZI_BORDER_INSIDE;
+
+	return OZI_BORDER_OUTSIDE;
+}
+
+/************************************************************************/
+/*                        OziBorderRasterize()                          */
+/*                                                                      */
+/*      Scanline even-odd fill at pixel centres, 255 inside the border  */
+/*      and 0 outside.                                                  */
+/************************************************************************/
+
+void OziBorderRasterize(int nVertices, const double *padfXY, int nXOff,
+		int nYOff, int nXSize, int nYSize, GByte *pabyMask, int nLineStride) {
+	double *padfCross = (double *) CPLMalloc(sizeof(double) * (nVertices + 1));
+
+	for (int iLine = 0; iLine < nYSize; iLine++) {
+		GByte *pabyRow = pabyMask + (size_t) iLine * nLineStride;
+		double dfY = nYOff + iLine + 0.5;
+		int nCross = 0;
+
+		memset(pabyRow, 0, nXSize);
+
+		for (int i = 0, j = nVertices - 1; i < nVertices; j = i++) {
+			double dfXi = padfXY[i * 2], dfYi = padfXY[i * 2 + 1];
+			double dfXj = padfXY[j * 2], dfYj = padfXY[j * 2 + 1];
+
+			if ((dfYi > dfY) != (dfYj > dfY))
+				padfCross[nCross++] = dfXi + (dfY - dfYi) * (dfXj - dfXi)
+						/ (dfYj - dfYi);
+		}
+
+		// few crossings per line, insertion sort is enough
+		for (int i = 1; i < nCross; i++) {
+			double dfV = padfCross[i];
+			int j = i - 1;
+			for (; j >= 0 && padfCross[j] > dfV; j--)
+				padfCross[j + 1] = padfCross[j];
+			padfCross[j + 1] = dfV;
+		}
+
+		for (int i = 0; i + 1 < nCross; i += 2) {
+			// pixels whose centre lies in [a, b)
+			int nStart = (int) ceil(padfCross[i] - 0.5) - nXOff;
+			int nEnd = (int) ceil(padfCross[i + 1] - 0.5) - nXOff;
+
+			nStart = MAX(nStart, 0);
+			nEnd = MIN(nEnd, nXSize);
+
+			if (nEnd > nStart)
+				memset(pabyRow + nStart, 255, nEnd - nStart);
+		}
+	}
+
+	CPLFree(padfCross);
+}
+
+/************************************************************************/
+/*                          OziBorderToWKT()                            */
+/************************************************************************/
+
+char *OziBorderToWKT(int nVertices, const double *padfXY) {
+	if (nVertices < 3)
+		return NULL;
+
+	CPLString osWKT("POLYGON((");
+
+	for (int i = 0; i <= nVertices; i++) {
+		int k = i % nVertices;
+		osWKT += CPLSPrintf("%s%.15g %.15g", i ? "," : "", padfXY[k * 2],
+				padfXY[k * 2 + 1]);
+	}
+
+	osWKT += "))";
+
+	return CPLStrdup(osWKT.c_str());
+}
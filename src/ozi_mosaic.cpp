@@ -0,0 +1,537 @@
+/*
+ * ozi_mosaic.cpp
+ *
+ *  One seamless dataset over many .map sheets. Sheet extents are read
+ *  from the .map files alone and kept in a packed R-tree; a sheet is
+ *  opened only when a block read touches it, and the least recently
+ *  used sheets are closed again.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+
+#include <gdal_priv.h>
+#include <ogr_spatialref.h>
+#include <cpl_conv.h>
+#include <cpl_string.h>
+
+#include "ozi_driver.h"
+
+#define OZI_MOSAIC_BLOCK 256
+#define OZI_MOSAIC_DEFAULT_OPEN 16
+
+typedef struct {
+	char *pszMapFile;
+	OziBox sExtent;             // mosaic SRS
+	GDALDataset *poDS;          // NULL until read
+	GIntBig nLastUse;
+} OziSheet;
+
+static int OziCompareInt(const void *a, const void *b) {
+	return *(const int *) a - *(const int *) b;
+}
+
+/*
+ * Mosaic dataset
+ */
+class OziMosaicBand;
+
+class CPL_DLL OziMosaicDataset: public GDALDataset {
+	friend class OziMosaicBand;
+private:
+	int nSheets;
+	OziSheet *pasSheets;
+	OziBox *pasExtents;
+	OziRTree sTree;
+	int *panHits;
+
+	char *pszProjection;
+	double adfGeoTransform[6];
+
+	int nOpen;
+	int nMaxOpen;
+	GIntBig nUseCounter;
+
+	int AddSheet(const char *pszMapFile, OGRCoordinateTransformation **ppoCT,
+			const OziSRS **ppsCTSource, double *pdfResolution);
+	GDALDataset *GetSheet(int iSheet);
+public:
+	OziMosaicDataset();
+	virtual ~OziMosaicDataset();
+
+	virtual const char *GetProjectionRef(void);
+	virtual CPLErr GetGeoTransform(double *);
+
+	static GDALDataset *Open(const char *pszSource);
+};
+
+// bands 1-3 are the sheets' colours, band 4 is where any sheet has data
+class CPL_DLL OziMosaicBand: public GDALRasterBand {
+public:
+	OziMosaicBand(OziMosaicDataset *, int);
+	virtual CPLErr IReadBlock(int, int, void *);
+	virtual GDALColorInterp GetColorInterpretation();
+};
+
+OziMosaicDataset::OziMosaicDataset() {
+	nSheets = 0;
+	pasSheets = NULL;
+	pasExtents = NULL;
+	memset(&sTree, 0, sizeof(sTree));
+	panHits = NULL;
+	pszProjection = NULL;
+	nOpen = 0;
+	nMaxOpen = MAX(1, atoi(CPLGetConfigOption("OZI_MOSAIC_OPEN",
+			CPLSPrintf("%d", OZI_MOSAIC_DEFAULT_OPEN))));
+	nUseCounter = 0;
+
+	adfGeoTransform[0] = 0.0;
+	adfGeoTransform[1] = 1.0;
+	adfGeoTransform[2] = 0.0;
+	adfGeoTransform[3] = 0.0;
+	adfGeoTransform[4] = 0.0;
+	adfGeoTransform[5] = 1.0;
+}
+
+OziMosaicDataset::~OziMosaicDataset() {
+	FlushCache();
+
+	for (int i = 0; i < nSheets; i++) {
+		if (pasSheets[i].poDS)
+			GDALClose((GDALDatasetH) pasSheets[i].poDS);
+		CPLFree(pasSheets[i].pszMapFile);
+	}
+	CPLFree(pasSheets);
+	CPLFree(pasExtents);
+	OziRTreeFree(&sTree);
+	CPLFree(panHits);
+	CPLFree(pszProjection);
+}
+
+const char *OziMosaicDataset::GetProjectionRef(void) {
+	return pszProjection ? pszProjection : "";
+}
+
+CPLErr OziMosaicDataset::GetGeoTransform(double *padfTransform) {
+	memcpy(padfTransform, adfGeoTransform, sizeof(double) * 6);
+	return CE_None;
+}
+
+/************************************************************************/
+/*                              AddSheet()                              */
+/*                                                                      */
+/*      Works out the extent of a sheet in the mosaic SRS from its      */
+/*      .map alone: the border polygon if there is one, otherwise the   */
+/*      image corners. The first sheet fixes the mosaic SRS.            */
+/************************************************************************/
+
+int OziMosaicDataset::AddSheet(const char *pszMapFile,
+		OGRCoordinateTransformation **ppoCT, const OziSRS **ppsCTSource,
+		double *pdfResolution) {
+	OziMapInfo *psMap = OziMapLoad(pszMapFile);
+	if (psMap == NULL)
+		return FALSE;
+
+	const OziSRS *psSRS = NULL;
+	char *pszWKT = NULL;
+	double adfTransform[6];
+	int nGCPCount = 0;
+	GDAL_GCP *pasGCPs = NULL;
+
+	CPLPushErrorHandler(CPLQuietErrorHandler);
+	CPLErr eErr = OziMapGeoreference(pszMapFile, psMap, adfTransform, &psSRS,
+			&pszWKT, &nGCPCount, &pasGCPs);
+	CPLPopErrorHandler();
+
+	int bOK = eErr == CE_None;
+	if (bOK && nGCPCount > 0)
+		bOK = GDALGCPsToGeoTransform(nGCPCount, pasGCPs, adfTransform, TRUE);
+	GDALDeinitGCPs(nGCPCount, pasGCPs);
+	CPLFree(pasGCPs);
+
+	// -------------------------------------------------------------------- //
+	//      Image size, from IWH or else from the image header.             //
+	// -------------------------------------------------------------------- //
+	int nXSize = psMap->nImageWidth, nYSize = psMap->nImageHeight;
+	if (bOK && (nXSize <= 0 || nYSize <= 0)) {
+		char *pszImage = OziResolveImagePath(pszMapFile, psMap->pszImage);
+		GDALDataset *poImage = pszImage ? OziPoolAcquire(pszImage) : NULL;
+		if (poImage != NULL) {
+			nXSize = poImage->GetRasterXSize();
+			nYSize = poImage->GetRasterYSize();
+			OziPoolRelease(poImage);
+		}
+		CPLFree(pszImage);
+	}
+	bOK = bOK && nXSize > 0 && nYSize > 0;
+
+	// -------------------------------------------------------------------- //
+	//      Outline in pixel/line, then in the mosaic SRS.                  //
+	// -------------------------------------------------------------------- //
+	int nVertices = 4;
+	double adfX[4] = { 0.0, (double) nXSize, (double) nXSize, 0.0 };
+	double adfY[4] = { 0.0, 0.0, (double) nYSize, (double) nYSize };
+	double *padfX = adfX, *padfY = adfY;
+
+	if (bOK && psMap->nBorderXY >= 3) {
+		nVertices = psMap->nBorderXY;
+		padfX = (double *) CPLMalloc(sizeof(double) * nVertices);
+		padfY = (double *) CPLMalloc(sizeof(double) * nVertices);
+		for (int i = 0; i < nVertices; i++) {
+			padfX[i] = psMap->padfBorderXY[i * 2];
+			padfY[i] = psMap->padfBorderXY[i * 2 + 1];
+		}
+	}
+
+	if (bOK) {
+		for (int i = 0; i < nVertices; i++) {
+			double dfPixel = padfX[i], dfLine = padfY[i];
+			padfX[i] = adfTransform[0] + dfPixel * adfTransform[1] + dfLine
+					* adfTransform[2];
+			padfY[i] = adfTransform[3] + dfPixel * adfTransform[4] + dfLine
+					* adfTransform[5];
+		}
+
+		if (pszProjection == NULL) {
+			pszProjection = CPLStrdup(pszWKT);
+		} else if (!EQUAL(pszProjection, pszWKT)) {
+			// sheets on another SRS, one transformation per run of them
+			if (*ppsCTSource != psSRS) {
+				if (*ppoCT)
+					delete *ppoCT;
+				OGRSpatialReference oSrc, oDst;
+				char *pszSrc = pszWKT, *pszDst = pszProjection;
+				oSrc.importFromWkt(&pszSrc);
+				oDst.importFromWkt(&pszDst);
+				*ppoCT = OGRCreateCoordinateTransformation(&oSrc, &oDst);
+				*ppsCTSource = psSRS;
+			}
+			bOK = *ppoCT != NULL && (*ppoCT)->Transform(nVertices, padfX, padfY);
+		}
+	}
+
+	if (bOK) {
+		OziSheet *psSheet = pasSheets + nSheets;
+		OziBox *psBox = &psSheet->sExtent;
+
+		psBox->dfMinX = psBox->dfMaxX = padfX[0];
+		psBox->dfMinY = psBox->dfMaxY = padfY[0];
+		for (int i = 1; i < nVertices; i++) {
+			psBox->dfMinX = MIN(psBox->dfMinX, padfX[i]);
+			psBox->dfMaxX = MAX(psBox->dfMaxX, padfX[i]);
+			psBox->dfMinY = MIN(psBox->dfMinY, padfY[i]);
+			psBox->dfMaxY = MAX(psBox->dfMaxY, padfY[i]);
+		}
+
+		// finest sheet sets the mosaic resolution
+		double dfRes;
+		if (EQUAL(pszProjection, pszWKT))
+			dfRes = sqrt(fabs(adfTransform[1] * adfTransform[5]
+					- adfTransform[2] * adfTransform[4]));
+		else
+			dfRes = (psBox->dfMaxX - psBox->dfMinX) / nXSize;
+		if (dfRes > 0.0 && (*pdfResolution == 0.0 || dfRes < *pdfResolution))
+			*pdfResolution = dfRes;
+
+		psSheet->pszMapFile = CPLStrdup(pszMapFile);
+		nSheets++;
+	} else {
+		CPLDebug("OZI", "Mosaic skips \"%s\", no usable georeferencing.",
+				pszMapFile);
+	}
+
+	if (padfX != adfX) {
+		CPLFree(padfX);
+		CPLFree(padfY);
+	}
+	CPLFree(pszWKT);
+	OziMapFree(psMap);
+
+	return bOK;
+}
+
+/************************************************************************/
+/*                              GetSheet()                              */
+/************************************************************************/
+
+GDALDataset *OziMosaicDataset::GetSheet(int iSheet) {
+	OziSheet *psSheet = pasSheets + iSheet;
+
+	psSheet->nLastUse = ++nUseCounter;
+
+	if (psSheet->poDS != NULL)
+		return psSheet->poDS;
+
+	// -------------------------------------------------------------------- //
+	//      Close the least recently used sheet to make room.               //
+	// -------------------------------------------------------------------- //
+	if (nOpen >= nMaxOpen) {
+		int iOldest = -1;
+		for (int i = 0; i < nSheets; i++) {
+			if (pasSheets[i].poDS != NULL && (iOldest < 0
+					|| pasSheets[i].nLastUse < pasSheets[iOldest].nLastUse))
+				iOldest = i;
+		}
+		if (iOldest >= 0) {
+			GDALClose((GDALDatasetH) pasSheets[iOldest].poDS);
+			pasSheets[iOldest].poDS = NULL;
+			nOpen--;
+		}
+	}
+
+	psSheet->poDS = OziOpenSheet(psSheet->pszMapFile, pszProjection);
+	if (psSheet->poDS != NULL)
+		nOpen++;
+
+	return psSheet->poDS;
+}
+
+/************************************************************************/
+/*                                Open()                                */
+/*                                                                      */
+/*      The source is a directory of .map files or a text file listing  */
+/*      .map paths, one per line, relative to the list file.            */
+/************************************************************************/
+
+GDALDataset *OziMosaicDataset::Open(const char *pszSource) {
+	VSIStatBufL sStat;
+	char **papszMaps = NULL;
+
+	if (VSIStatL(pszSource, &sStat) != 0) {
+		CPLError(CE_Failure, CPLE_OpenFailed,
+				"Open(): cannot find mosaic source \"%s\".", pszSource);
+		return NULL;
+	}
+
+	if (VSI_ISDIR(sStat.st_mode)) {
+		char **papszFiles = VSIReadDir(pszSource);
+		for (int i = 0; papszFiles && papszFiles[i]; i++) {
+			if (EQUAL(CPLGetExtension(papszFiles[i]), "map"))
+				papszMaps = CSLAddString(papszMaps, CPLFormFilename(pszSource,
+						papszFiles[i], NULL));
+		}
+		CSLDestroy(papszFiles);
+	} else {
+		FILE *fp = VSIFOpen(pszSource, "r");
+		if (fp == NULL) {
+			CPLError(CE_Failure, CPLE_OpenFailed,
+					"Open(): cannot read mosaic list \"%s\".", pszSource);
+			return NULL;
+		}
+		const char *pszLine;
+		CPLString osDir = CPLGetPath(pszSource);
+		while ((pszLine = CPLReadLine(fp)) != NULL) {
+			while (*pszLine == ' ' || *pszLine == '\t')
+				pszLine++;
+			if (*pszLine == '\0' || *pszLine == '#')
+				continue;
+			papszMaps = CSLAddString(papszMaps, CPLIsFilenameRelative(pszLine)
+					? CPLFormFilename(osDir, pszLine, NULL) : pszLine);
+		}
+		VSIFClose(fp);
+	}
+
+	// directory order is arbitrary, keep overlaps stable between runs
+	papszMaps = CSLSort(papszMaps);
+
+	int nMaps = CSLCount(papszMaps);
+	if (nMaps == 0) {
+		CPLError(CE_Failure, CPLE_OpenFailed,
+				"Open(): no .map files in \"%s\".", pszSource);
+		CSLDestroy(papszMaps);
+		return NULL;
+	}
+
+	// -------------------------------------------------------------------- //
+	//      Index the sheets.                                               //
+	// -------------------------------------------------------------------- //
+	OziMosaicDataset *poDS = new OziMosaicDataset();
+	poDS->pasSheets = (OziSheet *) CPLCalloc(sizeof(OziSheet), nMaps);
+
+	OGRCoordinateTransformation *poCT = NULL;
+	const OziSRS *psCTSource = NULL;
+	double dfResolution = 0.0;
+
+	for (int i = 0; i < nMaps; i++)
+		poDS->AddSheet(papszMaps[i], &poCT, &psCTSource, &dfResolution);
+
+	if (poCT)
+		delete poCT;
+	CSLDestroy(papszMaps);
+
+	if (poDS->nSheets == 0 || dfResolution <= 0.0) {
+		CPLError(CE_Failure, CPLE_AppDefined,
+				"Open(): no georeferenced sheets in \"%s\".", pszSource);
+		delete poDS;
+		return NULL;
+	}
+
+	poDS->pasExtents = (OziBox *) CPLMalloc(sizeof(OziBox) * poDS->nSheets);
+	OziBox sAll = poDS->pasSheets[0].sExtent;
+	for (int i = 0; i < poDS->nSheets; i++) {
+		poDS->pasExtents[i] = poDS->pasSheets[i].sExtent;
+		OziBoxUnion(&sAll, &poDS->pasExtents[i]);
+	}
+	OziRTreeBuild(&poDS->sTree, poDS->pasExtents, poDS->nSheets);
+	poDS->panHits = (int *) CPLMalloc(sizeof(int) * poDS->nSheets);
+
+	double dfXSize = ceil((sAll.dfMaxX - sAll.dfMinX) / dfResolution);
+	double dfYSize = ceil((sAll.dfMaxY - sAll.dfMinY) / dfResolution);
+	if (dfXSize < 1 || dfYSize < 1 || dfXSize > INT_MAX || dfYSize > INT_MAX) {
+		CPLError(CE_Failure, CPLE_AppDefined,
+				"Open(): mosaic of \"%s\" is too large.", pszSource);
+		delete poDS;
+		return NULL;
+	}
+
+	poDS->nRasterXSize = (int) dfXSize;
+	poDS->nRasterYSize = (int) dfYSize;
+	poDS->adfGeoTransform[0] = sAll.dfMinX;
+	poDS->adfGeoTransform[1] = dfResolution;
+	poDS->adfGeoTransform[3] = sAll.dfMaxY;
+	poDS->adfGeoTransform[5] = -dfResolution;
+	poDS->eAccess = GA_ReadOnly;
+
+	for (int i = 1; i <= 4; i++)
+		poDS->SetBand(i, new OziMosaicBand(poDS, i));
+
+	poDS->SetDescription(pszSource);
+
+	return poDS;
+}
+
+GDALDataset *OziMosaicOpen(const char *pszSource) {
+	return OziMosaicDataset::Open(pszSource);
+}
+
+OziMosaicBand::OziMosaicBand(OziMosaicDataset *poDS, int nBand) {
+	this->poDS = poDS;
+	this->nBand = nBand;
+
+	eDataType = GDT_Byte;
+
+	nBlockXSize = OZI_MOSAIC_BLOCK;
+	nBlockYSize = OZI_MOSAIC_BLOCK;
+}
+
+GDALColorInterp OziMosaicBand::GetColorInterpretation() {
+	switch (nBand) {
+	case 1:
+		return GCI_RedBand;
+	case 2:
+		return GCI_GreenBand;
+	case 3:
+		return GCI_BlueBand;
+	default:
+		return GCI_AlphaBand;
+	}
+}
+
+/************************************************************************/
+/*                             IReadBlock()                             */
+/*                                                                      */
+/*      Sheets the block touches are composited in catalog order, each  */
+/*      through its mask so map collars never cover a neighbour.        */
+/************************************************************************/
+
+CPLErr OziMosaicBand::IReadBlock(int nBlockXOff, int nBlockYOff, void * pImage) {
+	OziMosaicDataset *poMDS = (OziMosaicDataset *) poDS;
+	const double *padfGT = poMDS->adfGeoTransform;
+	GByte *pabyBlock = (GByte *) pImage;
+
+	memset(pabyBlock, 0, nBlockXSize * nBlockYSize);
+
+	int nXOff = nBlockXOff * nBlockXSize;
+	int nYOff = nBlockYOff * nBlockYSize;
+
+	OziBox sBlock;
+	sBlock.dfMinX = padfGT[0] + nXOff * padfGT[1];
+	sBlock.dfMaxX = sBlock.dfMinX + nBlockXSize * padfGT[1];
+	sBlock.dfMaxY = padfGT[3] + nYOff * padfGT[5];
+	sBlock.dfMinY = sBlock.dfMaxY + nBlockYSize * padfGT[5];
+
+	int nHits = OziRTreeQuery(&poMDS->sTree, &sBlock, NULL, NULL,
+			poMDS->panHits, poMDS->nSheets);
+	if (nHits == 0)
+		return CE_None;
+
+	// catalog order, the R-tree returns hits in STR order
+	qsort(poMDS->panHits, nHits, sizeof(int), OziCompareInt);
+
+	GByte *pabyData = (GByte *) CPLMalloc(nBlockXSize * nBlockYSize);
+	GByte *pabyMask = (GByte *) CPLMalloc(nBlockXSize * nBlockYSize);
+	CPLErr eErr = CE_None;
+
+	for (int h = 0; h < nHits && eErr == CE_None; h++) {
+		GDALDataset *poSheet = poMDS->GetSheet(poMDS->panHits[h]);
+		double adfSheetGT[6];
+
+		if (poSheet == NULL || poSheet->GetGeoTransform(adfSheetGT) != CE_None)
+			continue;
+
+		// -------------------------------------------------------------------- //
+		//      Block corners in sheet pixels; the sheet is north up, either    //
+		//      natively or through the warped VRT.                             //
+		// -------------------------------------------------------------------- //
+		double dfSX0 = (sBlock.dfMinX - adfSheetGT[0]) / adfSheetGT[1];
+		double dfSY0 = (sBlock.dfMaxY - adfSheetGT[3]) / adfSheetGT[5];
+		double dfScaleX = padfGT[1] / adfSheetGT[1];
+		double dfScaleY = padfGT[5] / adfSheetGT[5];
+
+		int nSheetX = poSheet->GetRasterXSize();
+		int nSheetY = poSheet->GetRasterYSize();
+
+		// destination pixels whose centres fall on the sheet
+		int nDX0 = MAX(0, (int) ceil((0.0 - dfSX0) / dfScaleX - 0.5));
+		int nDY0 = MAX(0, (int) ceil((0.0 - dfSY0) / dfScaleY - 0.5));
+		int nDX1 = MIN(nBlockXSize, (int) floor((nSheetX - dfSX0) / dfScaleX
+				- 0.5) + 1);
+		int nDY1 = MIN(nBlockYSize, (int) floor((nSheetY - dfSY0) / dfScaleY
+				- 0.5) + 1);
+		if (nDX1 <= nDX0 || nDY1 <= nDY0)
+			continue;
+
+		// source window rounded to whole pixels, as VRT sources do
+		int nSrcX = (int) floor(dfSX0 + nDX0 * dfScaleX + 0.5);
+		int nSrcY = (int) floor(dfSY0 + nDY0 * dfScaleY + 0.5);
+		int nSrcX1 = (int) floor(dfSX0 + nDX1 * dfScaleX + 0.5);
+		int nSrcY1 = (int) floor(dfSY0 + nDY1 * dfScaleY + 0.5);
+		nSrcX = MAX(0, MIN(nSrcX, nSheetX - 1));
+		nSrcY = MAX(0, MIN(nSrcY, nSheetY - 1));
+		int nSrcW = MAX(1, MIN(nSrcX1, nSheetX) - nSrcX);
+		int nSrcH = MAX(1, MIN(nSrcY1, nSheetY) - nSrcY);
+
+		int nDW = nDX1 - nDX0, nDH = nDY1 - nDY0;
+		GDALRasterBand *poSrcBand = poSheet->GetRasterBand(MIN(nBand,
+				poSheet->GetRasterCount()));
+		if (poSrcBand == NULL)
+			continue;
+
+		eErr = poSrcBand->GetMaskBand()->RasterIO(GF_Read, nSrcX, nSrcY,
+				nSrcW, nSrcH, pabyMask, nDW, nDH, GDT_Byte, 0, 0);
+		if (eErr == CE_None && nBand <= 3)
+			eErr = poSrcBand->RasterIO(GF_Read, nSrcX, nSrcY, nSrcW, nSrcH,
+					pabyData, nDW, nDH, GDT_Byte, 0, 0);
+		if (eErr != CE_None)
+			break;
+
+		for (int j = 0; j < nDH; j++) {
+			GByte *pabyDst = pabyBlock + (nDY0 + j) * nBlockXSize + nDX0;
+			for (int i = 0; i < nDW; i++) {
+				if (pabyMask[j * nDW + i] == 0)
+					continue;
+				pabyDst[i] = nBand <= 3 ? pabyData[j * nDW + i] : 255;
+			}
+		}
+	}
+
+	CPLFree(pabyData);
+	CPLFree(pabyMask);
+
+	return eErr;
+}
@@ -0,0 +1,325 @@
+/*
+ * ozi_pool.cpp
+ *
+ *  Image datasets behind .map files. Images are opened through the OZF
+ *  driver when it is loaded, and kept in a small pool so that maps sharing
+ *  one image, and repeated opens of the same map, reuse the open dataset.
+ *  Datasets are not thread safe, so like GDALOpenShared() a handle in use
+ *  is only shared within its thread. Idle handles go to any thread.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <gdal_priv.h>
+#include <cpl_conv.h>
+#include <cpl_string.h>
+#include <cpl_multiproc.h>
+
+#include "ozi_driver.h"
+
+#define OZI_POOL_DEFAULT_SIZE 16
+
+typedef struct OziPoolEntry {
+	char *pszPath;
+	GDALDataset *poDS;
+	int nRefCount;
+	long nMTime;
+	GIntBig nSize;
+	int bRetired;                   // replaced on disk, closed on last release
+	GIntBig nPID;                   // CPLGetPID() of the thread using it
+	struct OziPoolEntry *psNext;    // most recently used first
+} OziPoolEntry;
+
+static void *hPoolMutex = NULL;
+static OziPoolEntry *psPool = NULL;
+static int nPoolIdle = 0;
+
+/************************************************************************/
+/*                           OziPoolCapacity()                          */
+/*                                                                      */
+/*      Idle images kept open, OZI_POOL_SIZE, datasets in use do not    */
+/*      count against it.                                               */
+/************************************************************************/
+
+static int OziPoolCapacity() {
+	int nSize = atoi(CPLGetConfigOption("OZI_POOL_SIZE",
+			CPLSPrintf("%d", OZI_POOL_DEFAULT_SIZE)));
+	return nSize < 0 ? 0 : nSize;
+}
+
+static void OziPoolUnlink(OziPoolEntry *psEntry) {
+	OziPoolEntry **ppsLink = &psPool;
+	while (*ppsLink != psEntry)
+		ppsLink = &(*ppsLink)->psNext;
+	*ppsLink = psEntry->psNext;
+}
+
+/************************************************************************/
+/*                            OziPoolFind()                             */
+/*                                                                      */
+/*      Retired entries stay listed until their last release, but are   */
+/*      never handed out again, nor are entries in use by other         */
+/*      threads.                                                        */
+/************************************************************************/
+
+static OziPoolEntry *OziPoolFind(const char *pszPath, GIntBig nPID) {
+	OziPoolEntry *psEntry;
+	for (psEntry = psPool; psEntry != NULL; psEntry = psEntry->psNext) {
+		if (!psEntry->bRetired && strcmp(psEntry->pszPath, pszPath) == 0
+				&& (psEntry->nRefCount == 0 || psEntry->nPID == nPID))
+			break;
+	}
+	return psEntry;
+}
+
+/************************************************************************/
+/*                           OziPoolRetire()                            */
+/*                                                                      */
+/*      Takes an entry for a replaced image out of lookups. An idle     */
+/*      one is unlinked and returned to be closed outside the lock.     */
+/************************************************************************/
+
+static OziPoolEntry *OziPoolRetire(OziPoolEntry *psEntry) {
+	if (psEntry->nRefCount > 0) {
+		psEntry->bRetired = TRUE;
+		return NULL;
+	}
+
+	OziPoolUnlink(psEntry);
+	nPoolIdle--;
+	psEntry->psNext = NULL;
+	return psEntry;
+}
+
+/************************************************************************/
+/*                            OziPoolTrim()                             */
+/*                                                                      */
+/*      Unlinks the least recently used idle entries over the limit    */
+/*      and returns them, they are closed outside the lock.            */
+/************************************************************************/
+
+static OziPoolEntry *OziPoolTrim(int nLimit) {
+	OziPoolEntry *psVictims = NULL;
+
+	while (nPoolIdle > nLimit) {
+		OziPoolEntry *psEntry, *psOldest = NULL;
+		for (psEntry = psPool; psEntry != NULL; psEntry = psEntry->psNext) {
+			if (psEntry->nRefCount == 0)
+				psOldest = psEntry;
+		}
+
+		OziPoolUnlink(psOldest);
+		psOldest->psNext = psVictims;
+		psVictims = psOldest;
+		nPoolIdle--;
+	}
+
+	return psVictims;
+}
+
+static void OziPoolClose(OziPoolEntry *psList) {
+	while (psList != NULL) {
+		OziPoolEntry *psNext = psList->psNext;
+		delete psList->poDS;
+		CPLFree(psList->pszPath);
+		CPLFree(psList);
+		psList = psNext;
+	}
+}
+
+/************************************************************************/
+/*                         OziResolveImagePath()                        */
+/*                                                                      */
+/*      The image line usually holds a path on the machine that made    */
+/*      the map. Look for its file name next to the .map first, then    */
+/*      try the path as written, and last the bare name, which is what  */
+/*      the driver used to open relative to the working directory.      */
+/************************************************************************/
+
+char *OziResolveImagePath(const char *pszMapFile, const char *pszImage) {
+	if (pszImage == NULL || *pszImage == '\0')
+		return NULL;
+
+	const char *pszName = pszImage;
+	const char *pszSep = strrchr(pszImage, '\\');
+	if (strrchr(pszImage, '/') > pszSep)
+		pszSep = strrchr(pszImage, '/');
+	if (pszSep != NULL)
+		pszName = pszSep + 1;
+
+	if (*pszName == '\0')
+		return NULL;
+
+	VSIStatBufL sStat;
+	CPLString osPath = CPLFormFilename(CPLGetPath(pszMapFile), pszName, NULL);
+
+	if (VSIStatL(osPath, &sStat) == 0)
+		return CPLStrdup(osPath);
+	if (pszName != pszImage && VSIStatL(pszImage, &sStat) == 0)
+		return CPLStrdup(pszImage);
+
+	return CPLStrdup(pszName);
+}
+
+/************************************************************************/
+/*                          OziOpenImage()                              */
+/*                                                                      */
+/*      OZF images go straight to the OZF driver, so GDAL does not      */
+/*      probe every registered driver on them. Anything else, or an     */
+/*      OZF image while that driver is not loaded, goes to GDALOpen().  */
+/************************************************************************/
+
+static GDALDataset *OziOpenImage(const char *pszPath) {
+	const char *pszExt = CPLGetExtension(pszPath);
+	GDALDriver *poDriver = NULL;
+
+	if (EQUAL(pszExt, "ozf2") || EQUAL(pszExt, "ozfx3"))
+		poDriver = GetGDALDriverManager()->GetDriverByName("OZF");
+
+	if (poDriver != NULL && poDriver->pfnOpen != NULL) {
+		GDALOpenInfo oOpenInfo(pszPath, GA_ReadOnly);
+		GDALDataset *poDS = poDriver->pfnOpen(&oOpenInfo);
+		if (poDS != NULL) {
+			poDS->SetDescription(pszPath);
+			return poDS;
+		}
+	}
+
+	return (GDALDataset *) GDALOpen(pszPath, GA_ReadOnly);
+}
+
+/************************************************************************/
+/*                           OziPoolAcquire()                           */
+/************************************************************************/
+
+GDALDataset *OziPoolAcquire(const char *pszPath) {
+	VSIStatBufL sStat;
+	long nMTime = 0;
+	GIntBig nSize = 0;
+	GIntBig nPID = CPLGetPID();
+
+	if (VSIStatL(pszPath, &sStat) == 0) {
+		nMTime = (long) sStat.st_mtime;
+		nSize = (GIntBig) sStat.st_size;
+	}
+
+	OziPoolEntry *psStale = NULL;
+	{
+		CPLMutexHolderD(&hPoolMutex);
+
+		OziPoolEntry *psEntry = OziPoolFind(pszPath, nPID);
+
+		if (psEntry != NULL && (psEntry->nMTime != nMTime
+				|| psEntry->nSize != nSize)) {
+			// the image was replaced, users of the old handle keep it
+			psStale = OziPoolRetire(psEntry);
+			psEntry = NULL;
+		}
+
+		if (psEntry != NULL) {
+			if (psEntry->nRefCount++ == 0)
+				nPoolIdle--;
+			psEntry->nPID = nPID;
+			OziPoolUnlink(psEntry);
+			psEntry->psNext = psPool;
+			psPool = psEntry;
+			return psEntry->poDS;
+		}
+	}
+	OziPoolClose(psStale);
+	psStale = NULL;
+
+	// -------------------------------------------------------------------- //
+	//      Open outside the lock. If an idle handle of the image turned    //
+	//      up meanwhile it is used and the new one closed again.           //
+	// -------------------------------------------------------------------- //
+	GDALDataset *poDS = OziOpenImage(pszPath);
+	if (poDS == NULL)
+		return NULL;
+
+	OziPoolEntry *psEntry = (OziPoolEntry *) CPLCalloc(1, sizeof(OziPoolEntry));
+	psEntry->pszPath = CPLStrdup(pszPath);
+	psEntry->poDS = poDS;
+	psEntry->nRefCount = 1;
+	psEntry->nMTime = nMTime;
+	psEntry->nSize = nSize;
+	psEntry->nPID = nPID;
+
+	OziPoolEntry *psLoser = psEntry;
+	{
+		CPLMutexHolderD(&hPoolMutex);
+
+		OziPoolEntry *psOther = OziPoolFind(pszPath, nPID);
+
+		if (psOther != NULL && (psOther->nMTime != nMTime
+				|| psOther->nSize != nSize)) {
+			psStale = OziPoolRetire(psOther);
+			psOther = NULL;
+		}
+
+		if (psOther == NULL) {
+			psEntry->psNext = psPool;
+			psPool = psEntry;
+			psLoser = NULL;
+		} else {
+			if (psOther->nRefCount++ == 0)
+				nPoolIdle--;
+			psOther->nPID = nPID;
+			poDS = psOther->poDS;
+		}
+	}
+	OziPoolClose(psLoser);
+	OziPoolClose(psStale);
+
+	return poDS;
+}
+
+/************************************************************************/
+/*                           OziPoolRelease()                           */
+/************************************************************************/
+
+void OziPoolRelease(GDALDataset *poDS) {
+	if (poDS == NULL)
+		return;
+
+	OziPoolEntry *psVictims;
+	{
+		CPLMutexHolderD(&hPoolMutex);
+
+		OziPoolEntry *psEntry;
+		for (psEntry = psPool; psEntry != NULL; psEntry = psEntry->psNext) {
+			if (psEntry->poDS == poDS)
+				break;
+		}
+
+		if (psEntry == NULL || --psEntry->nRefCount > 0)
+			return;
+
+		if (psEntry->bRetired) {
+			OziPoolUnlink(psEntry);
+			psEntry->psNext = NULL;
+			psVictims = psEntry;
+		} else {
+			nPoolIdle++;
+			psVictims = OziPoolTrim(OziPoolCapacity());
+		}
+	}
+	OziPoolClose(psVictims);
+}
+
+/************************************************************************/
+/*                            OziPoolFlush()                            */
+/*                                                                      */
+/*      Closes every idle image, used when the driver is unloaded.      */
+/************************************************************************/
+
+void OziPoolFlush() {
+	OziPoolEntry *psVictims;
+	{
+		CPLMutexHolderD(&hPoolMutex);
+		psVictims = OziPoolTrim(0);
+	}
+	OziPoolClose(psVictims);
+}
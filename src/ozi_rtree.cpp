@@ -0,0 +1,173 @@
+/*
+ * ozi_rtree.cpp
+ *
+ *  Packed R-tree over sheet extents, shared by the mosaic and the
+ *  catalog. The tree is a pair of flat arrays, so the catalog can store
+ *  it as is and query it straight from the loaded file.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+#include <stdlib.h>
+
+#include <cpl_conv.h>
+
+#include "ozi_driver.h"
+
+#define OZI_RTREE_FANOUT 16
+
+static int OziBoxIntersects(const OziBox *a, const OziBox *b) {
+	return a->dfMinX < b->dfMaxX && b->dfMinX < a->dfMaxX && a->dfMinY
+			< b->dfMaxY && b->dfMinY < a->dfMaxY;
+}
+
+void OziBoxUnion(OziBox *a, const OziBox *b) {
+	a->dfMinX = MIN(a->dfMinX, b->dfMinX);
+	a->dfMinY = MIN(a->dfMinY, b->dfMinY);
+	a->dfMaxX = MAX(a->dfMaxX, b->dfMaxX);
+	a->dfMaxY = MAX(a->dfMaxY, b->dfMaxY);
+}
+
+/************************************************************************/
+/*                           OziRTreeBuild()                            */
+/************************************************************************/
+
+// doubled box centres, sorted along with the item they belong to
+typedef struct {
+	double dfX;
+	double dfY;
+	int iItem;
+} OziSortKey;
+
+static int OziCompareX(const void *a, const void *b) {
+	double da = ((const OziSortKey *) a)->dfX, db = ((const OziSortKey *) b)->dfX;
+	return da < db ? -1 : da > db ? 1 : 0;
+}
+
+static int OziCompareY(const void *a, const void *b) {
+	double da = ((const OziSortKey *) a)->dfY, db = ((const OziSortKey *) b)->dfY;
+	return da < db ? -1 : da > db ? 1 : 0;
+}
+
+// sorts panIndex (into pasBoxes) into STR order, in slices of nGroup
+static void OziSTRSort(const OziBox *pasBoxes, int *panIndex, int nCount,
+		int nGroup) {
+	int nGroups = (nCount + nGroup - 1) / nGroup;
+	int nSlice = (int) ceil(sqrt((double) nGroups)) * nGroup;
+	OziSortKey *pasKeys = (OziSortKey *) CPLMalloc(sizeof(OziSortKey)
+			* MAX(nCount, 1));
+
+	for (int i = 0; i < nCount; i++) {
+		const OziBox *psBox = pasBoxes + panIndex[i];
+		pasKeys[i].dfX = psBox->dfMinX + psBox->dfMaxX;
+		pasKeys[i].dfY = psBox->dfMinY + psBox->dfMaxY;
+		pasKeys[i].iItem = panIndex[i];
+	}
+
+	qsort(pasKeys, nCount, sizeof(OziSortKey), OziCompareX);
+	for (int i = 0; i < nCount; i += nSlice)
+		qsort(pasKeys + i, MIN(nSlice, nCount - i), sizeof(OziSortKey),
+				OziCompareY);
+
+	for (int i = 0; i < nCount; i++)
+		panIndex[i] = pasKeys[i].iItem;
+	CPLFree(pasKeys);
+}
+
+void OziRTreeBuild(OziRTree *psTree, const OziBox *pasBoxes, int nCount) {
+	psTree->panItems = (int *) CPLMalloc(sizeof(int) * MAX(nCount, 1));
+	// zeroed, the catalog writes the nodes padding and all
+	psTree->pasNodes = (OziRTreeNode *) CPLCalloc(sizeof(OziRTreeNode), 2
+			* (nCount / (OZI_RTREE_FANOUT - 1) + 1) + 1);
+	psTree->nNodes = 0;
+	psTree->pasBoxes = pasBoxes;
+
+	for (int i = 0; i < nCount; i++)
+		psTree->panItems[i] = i;
+	OziSTRSort(pasBoxes, psTree->panItems, nCount, OZI_RTREE_FANOUT);
+
+	// leaves
+	int iLevel = 0;
+	for (int i = 0; i < nCount; i += OZI_RTREE_FANOUT) {
+		OziRTreeNode *psNode = psTree->pasNodes + psTree->nNodes++;
+		psNode->bLeaf = TRUE;
+		psNode->iFirst = i;
+		psNode->nCount = MIN(OZI_RTREE_FANOUT, nCount - i);
+		psNode->sBox = pasBoxes[psTree->panItems[i]];
+		for (int k = 1; k < psNode->nCount; k++)
+			OziBoxUnion(&psNode->sBox, pasBoxes + psTree->panItems[i + k]);
+	}
+
+	// inner levels, the nodes of a level are laid out consecutively
+	int nLevelNodes = psTree->nNodes;
+	while (nLevelNodes > 1) {
+		int nFirst = psTree->nNodes;
+		for (int i = 0; i < nLevelNodes; i += OZI_RTREE_FANOUT) {
+			OziRTreeNode *psNode = psTree->pasNodes + psTree->nNodes++;
+			psNode->bLeaf = FALSE;
+			psNode->iFirst = iLevel + i;
+			psNode->nCount = MIN(OZI_RTREE_FANOUT, nLevelNodes - i);
+			psNode->sBox = psTree->pasNodes[iLevel + i].sBox;
+			for (int k = 1; k < psNode->nCount; k++)
+				OziBoxUnion(&psNode->sBox, &psTree->pasNodes[iLevel + i + k].sBox);
+		}
+		iLevel = nFirst;
+		nLevelNodes = psTree->nNodes - nFirst;
+	}
+}
+
+void OziRTreeFree(OziRTree *psTree) {
+	CPLFree(psTree->pasNodes);
+	CPLFree(psTree->panItems);
+	psTree->pasNodes = NULL;
+	psTree->panItems = NULL;
+	psTree->nNodes = 0;
+}
+
+/************************************************************************/
+/*                           OziRTreeQuery()                            */
+/*                                                                      */
+/*      Items whose box intersects psBox and that pass the filter, in   */
+/*      tree order. Returns the number of hits, of which at most        */
+/*      nMaxHits are stored.                                            */
+/************************************************************************/
+
+static void OziRTreeSearch(const OziRTree *psTree, int iNode,
+		const OziBox *psBox, OziRTreeFilter pfnFilter, void *pUserData,
+		int *panHits, int nMaxHits, int *pnHits) {
+	const OziRTreeNode *psNode = psTree->pasNodes + iNode;
+
+	if (!OziBoxIntersects(&psNode->sBox, psBox))
+		return;
+
+	for (int i = 0; i < psNode->nCount; i++) {
+		if (psNode->bLeaf) {
+			int iItem = psTree->panItems[psNode->iFirst + i];
+			if (!OziBoxIntersects(psTree->pasBoxes + iItem, psBox))
+				continue;
+			if (pfnFilter != NULL && !pfnFilter(iItem, pUserData))
+				continue;
+			if (*pnHits < nMaxHits)
+				panHits[*pnHits] = iItem;
+			(*pnHits)++;
+		} else {
+			OziRTreeSearch(psTree, psNode->iFirst + i, psBox, pfnFilter,
+					pUserData, panHits, nMaxHits, pnHits);
+		}
+	}
+}
+
+int OziRTreeQuery(const OziRTree *psTree, const OziBox *psBox,
+		OziRTreeFilter pfnFilter, void *pUserData, int *panHits, int nMaxHits) {
+	int nHits = 0;
+
+	// root last
+	if (psTree->nNodes > 0)
+		OziRTreeSearch(psTree, psTree->nNodes - 1, psBox, pfnFilter,
+				pUserData, panHits, nMaxHits, &nHits);
+
+	return nHits;
+}
@@ -0,0 +1,222 @@
+/*
+ * ozi_srs.cpp
+ *
+ *  Process-wide cache of the spatial references of .map files. A catalog
+ *  of sheets only uses a handful of datum/projection combinations, so each
+ *  one is translated, and its transformations set up, once.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <ctype.h>
+
+#include <ogr_spatialref.h>
+#include <cpl_conv.h>
+#include <cpl_string.h>
+#include <cpl_multiproc.h>
+
+#include "ozi_driver.h"
+
+struct OziSRS {
+	char *pszKey;
+	char *pszWKT;
+
+	// coordinate transformations are not reentrant, calls are serialised
+	void *hMutex;
+	OGRCoordinateTransformation *apoCT[3];
+
+	struct OziSRS *psNext;
+};
+
+static void *hSRSMutex = NULL;
+static OziSRS *psSRSCache = NULL;
+
+/************************************************************************/
+/*                             OziSRSKey()                              */
+/*                                                                      */
+/*      Datum name, projection name and the numeric projection          */
+/*      parameters, so spacing and number formatting do not matter.     */
+/************************************************************************/
+
+static char *OziSRSKey(const char *pszDatum, const char *pszProj,
+		const char *pszProjParms) {
+	char **papszDatum = CSLTokenizeString2(pszDatum, ",",
+			CSLT_ALLOWEMPTYTOKENS | CSLT_STRIPLEADSPACES | CSLT_STRIPENDSPACES);
+	char **papszProj = CSLTokenizeString2(pszProj, ",",
+			CSLT_ALLOWEMPTYTOKENS | CSLT_STRIPLEADSPACES | CSLT_STRIPENDSPACES);
+	char **papszParms = CSLTokenizeString2(pszProjParms, ",",
+			CSLT_ALLOWEMPTYTOKENS | CSLT_STRIPLEADSPACES | CSLT_STRIPENDSPACES);
+
+	CPLString osKey;
+
+	osKey += CSLCount(papszDatum) > 0 ? papszDatum[0] : "";
+	osKey += "|";
+	osKey += CSLCount(papszProj) > 1 ? papszProj[1] : "";
+	osKey += "|";
+	for (int i = 1; i < CSLCount(papszParms); i++)
+		osKey += CPLSPrintf("%.12g,", CPLAtof(papszParms[i]));
+
+	CSLDestroy(papszDatum);
+	CSLDestroy(papszProj);
+	CSLDestroy(papszParms);
+
+	char *pszKey = CPLStrdup(osKey);
+	for (char *p = pszKey; *p; p++)
+		*p = (char) toupper((unsigned char) *p);
+
+	return pszKey;
+}
+
+/************************************************************************/
+/*                            OziSRSCreate()                            */
+/************************************************************************/
+
+static OziSRS *OziSRSCreate(const char *pszDatum, const char *pszProj,
+		const char *pszProjParms) {
+	OGRSpatialReference oSRS;
+	int nTargetEPSG;
+
+	if (ImportFromOzi(&oSRS, pszDatum, pszProj, pszProjParms, &nTargetEPSG)
+			!= OGRERR_NONE)
+		return NULL;
+
+	// -------------------------------------------------------------------- //
+	//      The sheet SRS is the map projection on the EPSG datum the map   //
+	//      datum corresponds to; calibration lon/lat are in the map datum. //
+	// -------------------------------------------------------------------- //
+	OGRSpatialReference oEPSG;
+	oEPSG.importFromEPSG(nTargetEPSG);
+
+	OGRSpatialReference *poTargetSRS = oSRS.Clone();
+	poTargetSRS->CopyGeogCSFrom(&oEPSG);
+
+	OGRSpatialReference *poLatLong = oSRS.CloneGeogCS();
+	OGRSpatialReference oWGS84;
+	oWGS84.SetWellKnownGeogCS("WGS84");
+#if GDAL_VERSION_NUM >= 3000000
+	poTargetSRS->SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+	poLatLong->SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+	oWGS84.SetAxisMappingStrategy(OAMS_TRADITIONAL_GIS_ORDER);
+#endif
+
+	OziSRS *psSRS = (OziSRS *) CPLCalloc(1, sizeof(OziSRS));
+	poTargetSRS->exportToWkt(&psSRS->pszWKT);
+
+	psSRS->apoCT[OZI_SRS_MAP_TO_TARGET] = OGRCreateCoordinateTransformation(
+			poLatLong, poTargetSRS);
+	psSRS->apoCT[OZI_SRS_TARGET_TO_WGS84] = OGRCreateCoordinateTransformation(
+			poTargetSRS, &oWGS84);
+	psSRS->apoCT[OZI_SRS_WGS84_TO_TARGET] = OGRCreateCoordinateTransformation(
+			&oWGS84, poTargetSRS);
+
+	delete poLatLong;
+	delete poTargetSRS;
+
+	return psSRS;
+}
+
+static void OziSRSDestroy(OziSRS *psSRS) {
+	for (int i = 0; i < 3; i++) {
+		if (psSRS->apoCT[i])
+			delete psSRS->apoCT[i];
+	}
+	if (psSRS->hMutex)
+		CPLDestroyMutex(psSRS->hMutex);
+	CPLFree(psSRS->pszWKT);
+	CPLFree(psSRS->pszKey);
+	CPLFree(psSRS);
+}
+
+/************************************************************************/
+/*                            OziSRSAcquire()                           */
+/*                                                                      */
+/*      Entries live until OziSRSCacheFlush(), callers never free them. */
+/************************************************************************/
+
+const OziSRS *OziSRSAcquire(const char *pszDatum, const char *pszProj,
+		const char *pszProjParms) {
+	if (pszDatum == NULL || *pszDatum == '\0' || pszProj == NULL
+			|| pszProjParms == NULL)
+		return NULL;
+
+	char *pszKey = OziSRSKey(pszDatum, pszProj, pszProjParms);
+	OziSRS *psSRS;
+
+	{
+		CPLMutexHolderD(&hSRSMutex);
+		for (psSRS = psSRSCache; psSRS != NULL; psSRS = psSRS->psNext) {
+			if (strcmp(psSRS->pszKey, pszKey) == 0) {
+				CPLFree(pszKey);
+				return psSRS;
+			}
+		}
+	}
+
+	// set up outside the lock, PROJ initialisation is the slow part
+	psSRS = OziSRSCreate(pszDatum, pszProj, pszProjParms);
+	if (psSRS == NULL) {
+		CPLFree(pszKey);
+		return NULL;
+	}
+	psSRS->pszKey = pszKey;
+
+	CPLMutexHolderD(&hSRSMutex);
+
+	for (OziSRS *psOther = psSRSCache; psOther != NULL; psOther
+			= psOther->psNext) {
+		if (strcmp(psOther->pszKey, pszKey) == 0) {
+			OziSRSDestroy(psSRS);
+			return psOther;
+		}
+	}
+
+	psSRS->psNext = psSRSCache;
+	psSRSCache = psSRS;
+
+	return psSRS;
+}
+
+const char *OziSRSGetWKT(const OziSRS *psSRS) {
+	return psSRS->pszWKT;
+}
+
+/************************************************************************/
+/*                           OziSRSTransform()                          */
+/*                                                                      */
+/*      Transforms points in place. Returns FALSE if the transformation */
+/*      is not available; pabSuccess tells about single points.         */
+/************************************************************************/
+
+int OziSRSTransform(const OziSRS *psSRS, int nDirection, int nCount,
+		double *padfX, double *padfY, int *pabSuccess) {
+	OziSRS *psEntry = (OziSRS *) psSRS;
+	OGRCoordinateTransformation *poCT = psEntry->apoCT[nDirection];
+
+	if (poCT == NULL) {
+		for (int i = 0; i < nCount; i++)
+			pabSuccess[i] = FALSE;
+		return FALSE;
+	}
+
+	CPLMutexHolderD(&psEntry->hMutex);
+
+	return poCT->TransformEx(nCount, padfX, padfY, NULL, pabSuccess);
+}
+
+/************************************************************************/
+/*                          OziSRSCacheFlush()                          */
+/*                                                                      */
+/*      Only when no dataset is left, used when the driver is unloaded. */
+/************************************************************************/
+
+void OziSRSCacheFlush() {
+	CPLMutexHolderD(&hSRSMutex);
+
+	while (psSRSCache != NULL) {
+		OziSRS *psNext = psSRSCache->psNext;
+		OziSRSDestroy(psSRSCache);
+		psSRSCache = psNext;
+	}
+}
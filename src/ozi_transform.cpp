@@ -0,0 +1,335 @@
+/*
+ * ozi_transform.cpp
+ *
+ *  Cached pixel/line <-> WGS84 lon/lat transformer of an OZI sheet. The
+ *  exact chain (geotransform or TPS on the GCPs, then the shared SRS
+ *  transformation to WGS84) is sampled once onto regular grids in both
+ *  directions, bulk conversions then cost a bilinear interpolation.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <math.h>
+
+#include <gdal_alg.h>
+#include <cpl_conv.h>
+
+#include "ozi_driver.h"
+
+// grid nodes are this many pixels apart, up to OZI_GRID_MAX_NODES a side
+#define OZI_GRID_STEP 32
+#define OZI_GRID_MAX_NODES 129
+
+typedef struct {
+	double dfX0, dfY0;          // first node
+	double dfStepX, dfStepY;
+	int nCols, nRows;
+	double *padfNodes;          // output x,y pairs, HUGE_VAL where exact failed
+} OziGrid;
+
+struct OziTransformer {
+	int bAffine;
+	double adfGeoTransform[6];
+	double adfInvGeoTransform[6];
+	void *hTPS;
+
+	const OziSRS *psSRS;
+
+	OziGrid sPixelGrid;         // pixel/line -> lon/lat
+	OziGrid sGeoGrid;           // lon/lat -> pixel/line
+};
+
+/************************************************************************/
+/*                          OziExactToGeo()                             */
+/************************************************************************/
+
+static void OziExactToGeo(OziTransformer *psTr, int nCount, double *padfX,
+		double *padfY, int *pabSuccess) {
+	int i;
+
+	if (psTr->bAffine) {
+		for (i = 0; i < nCount; i++) {
+			double dfPixel = padfX[i], dfLine = padfY[i];
+			padfX[i] = psTr->adfGeoTransform[0] + dfPixel
+					* psTr->adfGeoTransform[1] + dfLine * psTr->adfGeoTransform[2];
+			padfY[i] = psTr->adfGeoTransform[3] + dfPixel
+					* psTr->adfGeoTransform[4] + dfLine * psTr->adfGeoTransform[5];
+			pabSuccess[i] = TRUE;
+		}
+	} else {
+		double *padfZ = (double *) CPLCalloc(sizeof(double), nCount);
+		GDALTPSTransform(psTr->hTPS, FALSE, nCount, padfX, padfY, padfZ,
+				pabSuccess);
+		CPLFree(padfZ);
+	}
+
+	int *pabShift = (int *) CPLMalloc(sizeof(int) * nCount);
+	OziSRSTransform(psTr->psSRS, OZI_SRS_TARGET_TO_WGS84, nCount, padfX, padfY,
+			pabShift);
+	for (i = 0; i < nCount; i++)
+		pabSuccess[i] = pabSuccess[i] && pabShift[i];
+	CPLFree(pabShift);
+}
+
+/************************************************************************/
+/*                         OziExactToPixel()                            */
+/************************************************************************/
+
+static void OziExactToPixel(OziTransformer *psTr, int nCount, double *padfX,
+		double *padfY, int *pabSuccess) {
+	int i;
+
+	OziSRSTransform(psTr->psSRS, OZI_SRS_WGS84_TO_TARGET, nCount, padfX, padfY,
+			pabSuccess);
+
+	if (psTr->bAffine) {
+		for (i = 0; i < nCount; i++) {
+			double dfGeoX = padfX[i], dfGeoY = padfY[i];
+			padfX[i] = psTr->adfInvGeoTransform[0] + dfGeoX
+					* psTr->adfInvGeoTransform[1] + dfGeoY
+					* psTr->adfInvGeoTransform[2];
+			padfY[i] = psTr->adfInvGeoTransform[3] + dfGeoX
+					* psTr->adfInvGeoTransform[4] + dfGeoY
+					* psTr->adfInvGeoTransform[5];
+		}
+	} else {
+		int *pabTPS = (int *) CPLMalloc(sizeof(int) * nCount);
+		double *padfZ = (double *) CPLCalloc(sizeof(double), nCount);
+		GDALTPSTransform(psTr->hTPS, TRUE, nCount, padfX, padfY, padfZ, pabTPS);
+		for (i = 0; i < nCount; i++)
+			pabSuccess[i] = pabSuccess[i] && pabTPS[i];
+		CPLFree(padfZ);
+		CPLFree(pabTPS);
+	}
+}
+
+/************************************************************************/
+/*                            OziGridBuild()                            */
+/*                                                                      */
+/*      Samples one direction of the exact chain on a regular grid.     */
+/************************************************************************/
+
+static void OziGridBuild(OziTransformer *psTr, OziGrid *psGrid,
+		int bToGeo) {
+	int nNodes = psGrid->nCols * psGrid->nRows;
+	double *padfX = (double *) CPLMalloc(sizeof(double) * nNodes);
+	double *padfY = (double *) CPLMalloc(sizeof(double) * nNodes);
+	int *pabSuccess = (int *) CPLMalloc(sizeof(int) * nNodes);
+
+	for (int j = 0; j < psGrid->nRows; j++) {
+		for (int i = 0; i < psGrid->nCols; i++) {
+			padfX[j * psGrid->nCols + i] = psGrid->dfX0 + i * psGrid->dfStepX;
+			padfY[j * psGrid->nCols + i] = psGrid->dfY0 + j * psGrid->dfStepY;
+		}
+	}
+
+	if (bToGeo)
+		OziExactToGeo(psTr, nNodes, padfX, padfY, pabSuccess);
+	else
+		OziExactToPixel(psTr, nNodes, padfX, padfY, pabSuccess);
+
+	psGrid->padfNodes = (double *) CPLMalloc(sizeof(double) * 2 * nNodes);
+	for (int k = 0; k < nNodes; k++) {
+		psGrid->padfNodes[k * 2] = pabSuccess[k] ? padfX[k] : HUGE_VAL;
+		psGrid->padfNodes[k * 2 + 1] = pabSuccess[k] ? padfY[k] : HUGE_VAL;
+	}
+
+	CPLFree(padfX);
+	CPLFree(padfY);
+	CPLFree(pabSuccess);
+}
+
+static void OziGridSetup(OziGrid *psGrid, double dfX0, double dfY0,
+		double dfX1, double dfY1, int nCols, int nRows) {
+	psGrid->nCols = MAX(2, MIN(nCols, OZI_GRID_MAX_NODES));
+	psGrid->nRows = MAX(2, MIN(nRows, OZI_GRID_MAX_NODES));
+	psGrid->dfX0 = dfX0;
+	psGrid->dfY0 = dfY0;
+	psGrid->dfStepX = (dfX1 - dfX0) / (psGrid->nCols - 1);
+	psGrid->dfStepY = (dfY1 - dfY0) / (psGrid->nRows - 1);
+}
+
+/************************************************************************/
+/*                          OziGridLookup()                             */
+/*                                                                      */
+/*      Bilinear interpolation between the four nodes around a point.   */
+/*      Returns FALSE outside the grid or next to a failed node.        */
+/************************************************************************/
+
+static int OziGridLookup(const OziGrid *psGrid, double *pdfX, double *pdfY) {
+	double dfFX = (*pdfX - psGrid->dfX0) / psGrid->dfStepX;
+	double dfFY = (*pdfY - psGrid->dfY0) / psGrid->dfStepY;
+
+	if (!(dfFX >= 0.0 && dfFX <= psGrid->nCols - 1 && dfFY >= 0.0 && dfFY
+			<= psGrid->nRows - 1))
+		return FALSE;
+
+	int i = MIN((int) dfFX, psGrid->nCols - 2);
+	int j = MIN((int) dfFY, psGrid->nRows - 2);
+	double dfU = dfFX - i, dfV = dfFY - j;
+
+	const double *p00 = psGrid->padfNodes + (j * psGrid->nCols + i) * 2;
+	const double *p10 = p00 + 2;
+	const double *p01 = p00 + psGrid->nCols * 2;
+	const double *p11 = p01 + 2;
+
+	if (p00[0] == HUGE_VAL || p10[0] == HUGE_VAL || p01[0] == HUGE_VAL
+			|| p11[0] == HUGE_VAL)
+		return FALSE;
+
+	*pdfX = (p00[0] * (1 - dfU) + p10[0] * dfU) * (1 - dfV) + (p01[0] * (1
+			- dfU) + p11[0] * dfU) * dfV;
+	*pdfY = (p00[1] * (1 - dfU) + p10[1] * dfU) * (1 - dfV) + (p01[1] * (1
+			- dfU) + p11[1] * dfU) * dfV;
+
+	return TRUE;
+}
+
+/************************************************************************/
+/*                          OziTransformerCreate()                      */
+/************************************************************************/
+
+OziTransformer *OziTransformerCreate(const OziSRS *psSRS,
+		const double *padfGeoTransform, int nGCPCount,
+		const GDAL_GCP *pasGCPs, int nXSize, int nYSize) {
+	if (psSRS == NULL || nXSize <= 0 || nYSize <= 0)
+		return NULL;
+
+	OziTransformer *psTr = (OziTransformer *) CPLCalloc(1,
+			sizeof(OziTransformer));
+	psTr->psSRS = psSRS;
+
+	// -------------------------------------------------------------------- //
+	//      Pixel/line to the sheet SRS.                                    //
+	// -------------------------------------------------------------------- //
+	if (nGCPCount > 0) {
+		psTr->hTPS = GDALCreateTPSTransformer(nGCPCount, pasGCPs, FALSE);
+	} else {
+		psTr->bAffine = TRUE;
+		memcpy(psTr->adfGeoTransform, padfGeoTransform, sizeof(double) * 6);
+		if (!GDALInvGeoTransform(psTr->adfGeoTransform,
+				psTr->adfInvGeoTransform))
+			psTr->bAffine = FALSE;
+	}
+
+	if (!psTr->bAffine && psTr->hTPS == NULL) {
+		CPLFree(psTr);
+		return NULL;
+	}
+
+	// -------------------------------------------------------------------- //
+	//      Forward grid over the image, inverse grid over the lon/lat      //
+	//      box the forward grid covers, at the same density.               //
+	// -------------------------------------------------------------------- //
+	OziGrid *psPixel = &psTr->sPixelGrid;
+	OziGridSetup(psPixel, 0.0, 0.0, nXSize, nYSize,
+			nXSize / OZI_GRID_STEP + 1, nYSize / OZI_GRID_STEP + 1);
+	OziGridBuild(psTr, psPixel, TRUE);
+
+	double dfMinX = HUGE_VAL, dfMinY = HUGE_VAL;
+	double dfMaxX = -HUGE_VAL, dfMaxY = -HUGE_VAL;
+	for (int k = 0; k < psPixel->nCols * psPixel->nRows; k++) {
+		double dfX = psPixel->padfNodes[k * 2];
+		double dfY = psPixel->padfNodes[k * 2 + 1];
+		if (dfX == HUGE_VAL)
+			continue;
+		dfMinX = MIN(dfMinX, dfX);
+		dfMaxX = MAX(dfMaxX, dfX);
+		dfMinY = MIN(dfMinY, dfY);
+		dfMaxY = MAX(dfMaxY, dfY);
+	}
+
+	if (dfMinX < dfMaxX && dfMinY < dfMaxY) {
+		OziGridSetup(&psTr->sGeoGrid, dfMinX, dfMinY, dfMaxX, dfMaxY,
+				psPixel->nCols, psPixel->nRows);
+		OziGridBuild(psTr, &psTr->sGeoGrid, FALSE);
+	}
+
+	return psTr;
+}
+
+/************************************************************************/
+/*                         OziTransformerDestroy()                      */
+/************************************************************************/
+
+void OziTransformerDestroy(OziTransformer *psTr) {
+	if (psTr == NULL)
+		return;
+
+	if (psTr->hTPS)
+		GDALDestroyTPSTransformer(psTr->hTPS);
+
+	CPLFree(psTr->sPixelGrid.padfNodes);
+	CPLFree(psTr->sGeoGrid.padfNodes);
+	CPLFree(psTr);
+}
+
+/************************************************************************/
+/*                          OziTransformerBulk()                        */
+/*                                                                      */
+/*      Grid lookups first; the points the grid cannot answer are       */
+/*      gathered and sent through the exact chain in one call.          */
+/************************************************************************/
+
+static int OziTransformerBulk(OziTransformer *psTr, int bToGeo, int nCount,
+		double *padfX, double *padfY, int *pabSuccess) {
+	const OziGrid *psGrid = bToGeo ? &psTr->sPixelGrid : &psTr->sGeoGrid;
+	int *panMissed = NULL;
+	int nMissed = 0, i;
+
+	for (i = 0; i < nCount; i++) {
+		if (psGrid->padfNodes != NULL && OziGridLookup(psGrid, padfX + i,
+				padfY + i)) {
+			pabSuccess[i] = TRUE;
+			continue;
+		}
+
+		if (panMissed == NULL)
+			panMissed = (int *) CPLMalloc(sizeof(int) * nCount);
+		panMissed[nMissed++] = i;
+	}
+
+	if (nMissed == 0)
+		return TRUE;
+
+	double *padfMX = (double *) CPLMalloc(sizeof(double) * nMissed);
+	double *padfMY = (double *) CPLMalloc(sizeof(double) * nMissed);
+	int *pabMS = (int *) CPLMalloc(sizeof(int) * nMissed);
+
+	for (i = 0; i < nMissed; i++) {
+		padfMX[i] = padfX[panMissed[i]];
+		padfMY[i] = padfY[panMissed[i]];
+	}
+
+	if (bToGeo)
+		OziExactToGeo(psTr, nMissed, padfMX, padfMY, pabMS);
+	else
+		OziExactToPixel(psTr, nMissed, padfMX, padfMY, pabMS);
+
+	int bAll = TRUE;
+	for (i = 0; i < nMissed; i++) {
+		padfX[panMissed[i]] = padfMX[i];
+		padfY[panMissed[i]] = padfMY[i];
+		pabSuccess[panMissed[i]] = pabMS[i];
+		bAll = bAll && pabMS[i];
+	}
+
+	CPLFree(padfMX);
+	CPLFree(padfMY);
+	CPLFree(pabMS);
+	CPLFree(panMissed);
+
+	return bAll;
+}
+
+int OziTransformerToGeo(OziTransformer *psTr, int nCount, double *padfX,
+		double *padfY, int *pabSuccess) {
+	return OziTransformerBulk(psTr, TRUE, nCount, padfX, padfY, pabSuccess);
+}
+
+int OziTransformerToPixel(OziTransformer *psTr, int nCount, double *padfX,
+		double *padfY, int *pabSuccess) {
+	return OziTransformerBulk(psTr, FALSE, nCount, padfX, padfY, pabSuccess);
+}